@@ -5,9 +5,9 @@
 #include "list.h"
 #include "sleeplock.h"
 
-#define B_BUSY  0x1     /* Buffer is lockd by some process */
 #define B_VALID 0x2     /* Buffer has been read from disk. */
 #define B_DIRTY 0x4     /* Buffer needs to be written to disk. */
+#define B_ERROR 0x8     /* The last I/O of the buffer failed. */
 
 #define DSIZE   4096
 
@@ -15,15 +15,27 @@ struct buf {
     int flags;
     uint32_t dev;
     uint32_t blockno;
-    uint8_t data[DSIZE];
+    int refcnt;             /* Users of the buffer (bucket lock). */
+    struct sleeplock lock;  /* Held by the user of the buffer. */
+    uint8_t data[DSIZE] __attribute__((aligned(64)));  /* DMA: own cache lines */
 
-    struct list_head clink; /* LRU cache list. */
+    struct list_head hlink; /* Hash chain. */
+    struct list_head clink; /* LRU list of unused buffers. */
     struct list_head dlink; /* Disk buffer list. */
+    void (*end_io)(struct buf *);   /* Completion of submit_bio(). */
+    void *private;                  /* Used by the submitter. */
 };
 
 void        binit();
-void        bwrite(struct buf *b);
+int         bcache_nbuf();
+int         bwrite(struct buf *b);
+int         bwritev(struct buf **bs, int n);
 void        brelse(struct buf *b);
+void        brelse_io(struct buf *b);
+void        bpin(struct buf *b);
+void        bunpin(struct buf *b);
+struct buf *bget(uint32_t dev, uint32_t blockno);
 struct buf *bread(uint32_t dev, uint32_t blockno);
+void        breadahead(uint32_t dev, uint32_t blockno);
 
 #endif
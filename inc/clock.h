@@ -5,7 +5,7 @@
 #include "linux/time.h"
 
 void clock_init();
-void clock_intr();
+void update_times(void);
 
 long clock_gettime(clockid_t clk_id, struct timespec *tp);
 long clock_settime(clockid_t clk_id, const struct timespec *tp);
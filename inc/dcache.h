@@ -0,0 +1,22 @@
+#ifndef INC_DCACHE_H
+#define INC_DCACHE_H
+
+#include "types.h"
+#include "vfs.h"
+
+#define NDENTRY     4096
+#define NDHASH      1024                /* Must be power of 2. */
+
+/* Results of dcache_lookup() */
+#define DC_MISS     -1                  /* Not cached */
+#define DC_NEGATIVE 0                   /* Cached as not existing */
+#define DC_POSITIVE 1                   /* Cached as existing */
+
+void     dcache_init(void);
+int      dcache_lookup(struct inode *dp, char *name, uint32_t *inum, uint16_t *type);
+void     dcache_enter(struct inode *dp, char *name, uint32_t inum, uint16_t type);
+void     dcache_purge(void);
+uint64_t dcache_newversion(void);
+void     d_invalidate(struct inode *dp);
+
+#endif
@@ -2,11 +2,23 @@
 #define INC_DEV_H
 
 #include "buf.h"
+#include "list.h"
 #include "types.h"
 
+#define DEV_MAXMERGE    32      /* Max buffers merged into one command */
+
+/* Requests held back by a process to be queued together. */
+struct blk_plug {
+    struct list_head list;
+};
+
 void dev_init();
 void dev_intr();
-void devrw(struct buf *);
+int  devrw(struct buf *);
+int  devrwv(struct buf **, int);
+void submit_bio(struct buf *);
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
 
 /* assumes size > 256 */
 static inline uint8_t blksize_bits(uint32_t size)
@@ -2,6 +2,7 @@
 #define INC_EMMC_H
 
 #include "sdhost.h"
+#include "linux/time.h"
 
 #define SD_BLOCK_SIZE        512
 
@@ -12,6 +13,12 @@ struct tscr // SD configuration register
 	int	sd_version;
 };
 
+/* A segment of a scatter-gather transfer. */
+struct emmc_sg {
+    void *buf;
+    size_t len;                         /* Multiple of SD_BLOCK_SIZE */
+};
+
 struct emmc {
     uint64_t ull_offset;
 
@@ -47,12 +54,19 @@ struct emmc {
 	uint32_t last_r3;
 
 	void *buf;
+	struct emmc_sg *sg;                 /* Used instead of buf if nsg > 0 */
+	int nsg;
 	int blocks_to_transfer;
 	size_t block_size;
 
 #ifndef USE_SDHOST
 	int card_removal;
 	uint32_t base_clock;
+
+	void (*sleep_fn)(void *);           // Wait for an interrupt if set
+	void *sleep_arg;                    // sleep_fn sleeps on this channel
+	struct hrtimer timer;               // Wakes sleep_fn at the timeout
+	int use_adma;                       // Transfer blocks by ADMA2
 #endif
 	// static const char *sd_versions[];
 	// static const uint32_t sd_commands[];
@@ -64,6 +78,8 @@ void emmc_intr(struct emmc *self);
 int emmc_init(struct emmc *self, void (*sleep_fn)(void *), void *sleep_arg);
 size_t emmc_read(struct emmc *self, void *buf, size_t cnt);
 size_t emmc_write(struct emmc *self, void *buf, size_t cnt);
+size_t emmc_readv(struct emmc *self, struct emmc_sg *sg, int nsg);
+size_t emmc_writev(struct emmc *self, struct emmc_sg *sg, int nsg);
 uint64_t emmc_seek(struct emmc *self, uint64_t off);
 
 #endif
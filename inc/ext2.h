@@ -17,6 +17,9 @@ typedef unsigned long   ext2_fsblk_t;
 #define EXT2_MAX_BGC        40
 #define EXT2_NAME_LEN       255
 #define EXT2_NINODE         1024
+
+#define EXT2_DEFAULT_RESERVE_BLOCKS 8       // Initial size of a reservation window
+#define EXT2_MAX_RESERVE_BLOCKS     1027    // Max size of a reservation window
 /**
  * EXT2_DIR_PAD defines the directory entries boundaries
  *
@@ -69,7 +72,12 @@ struct ext2_sb_info {
     int           s_first_ino;
     unsigned long s_dir_count;
     uint8_t      *s_debts;
+    int           s_hash_unsigned;      // 3 if the dirhash is unsigned
     int           flags;
+    uint32_t     *s_journal_map;        // Disk blocks of the journal
+    uint32_t      s_journal_len;        // Number of blocks in the journal
+    struct spinlock s_rsv_lock;         // Protects s_rsv_list
+    struct list_head s_rsv_list;        // Reservation windows sorted by start
 };
 
 static inline struct ext2_sb_info *
@@ -166,9 +174,23 @@ struct ext2_superblock {
     uint16_t s_reserved_word_pad;
     uint32_t s_default_mount_opts;
     uint32_t s_first_meta_bg;       // first metablock block group
-    uint32_t s_reserved[190];       // padding to the end of the block
+    uint32_t s_mkfs_time;           // when the filesystem was created
+    uint32_t s_jnl_blocks[17];      // backup of the journal inode
+    uint32_t s_blocks_count_hi;     // blocks count (64bit only)
+    uint32_t s_r_blocks_count_hi;   // reserved blocks count (64bit only)
+    uint32_t s_free_blocks_hi;      // free blocks count (64bit only)
+    uint16_t s_min_extra_isize;     // all inodes have at least # bytes
+    uint16_t s_want_extra_isize;    // new inodes should reserve # bytes
+    uint32_t s_flags;               // miscellaneous flags
+    uint32_t s_reserved[167];       // padding to the end of the block
 };
 
+/*
+ * Misc. filesystem flags (s_flags)
+ */
+#define EXT2_FLAGS_SIGNED_HASH      0x0001  // signed dirhash in use
+#define EXT2_FLAGS_UNSIGNED_HASH    0x0002  // unsigned dirhash in use
+
 #define EXT2_NDIR_BLOCKS    12
 #define EXT2_IND_BLOCK      EXT2_NDIR_BLOCKS
 #define EXT2_DIND_BLOCK     (EXT2_IND_BLOCK + 1)
@@ -232,13 +254,48 @@ struct ext2_inode {
     } osd2;                     // OS dependent 2
 };
 
+/*
+ * Reservation window: a range of blocks where a regular file allocates
+ * its blocks first.  Windows do not overlap, so that files written at
+ * the same time do not interleave their blocks.  In memory only.
+ */
+struct ext2_reserve_window {
+    struct list_head link;              // s_rsv_list
+    ext2_fsblk_t rsv_start;             // First block, 0 if no window
+    ext2_fsblk_t rsv_end;               // Last block
+    uint32_t     rsv_goal_size;         // Size of the next window
+    uint32_t     rsv_alloc_hit;         // Blocks allocated in this window
+};
+
+/*
+ * Block-map cache: recently mapped runs of blocks contiguous on the
+ * disk, so that mapping a file costs a lookup per run instead of
+ * reading its indirect blocks or extent tree per block.  In memory only.
+ */
+#define EXT2_NMAPCACHE  8
+
+struct ext2_map_extent {
+    uint32_t lblk;                      // First logical block
+    uint32_t pblk;                      // Its disk block
+    uint32_t len;                       // Number of blocks, 0 if unused
+};
+
 struct ext2_inode_info {
     struct ext2_inode i_ei;
     uint32_t flags;
+    struct ext2_reserve_window i_rsv;   // Protected by s_rsv_lock
+    struct ext2_map_extent i_map[EXT2_NMAPCACHE];   // Protected by the inode lock
+    uint32_t i_map_next;                // Next i_map to replace
 };
 
 #define EXT2_ROOTINO  2  /* Root inode */
 
+/*
+ * Inode flags (i_flags)
+ */
+#define EXT2_INDEX_FL       0x00001000  // hash-indexed directory
+#define EXT4_EXTENTS_FL     0x00080000  // mapped by an extent tree
+
 /*
  * Structure of a directory entry
  */
@@ -263,6 +320,130 @@ struct ext2_dir_entry_2 {
     char     name[];    // file name, up to EXT2_NAME_LEN
 };
 
+/*
+ * Hash-indexed directories (htree), compatible with ext3 dir_index.
+ *
+ * Block 0 holds "." and "..", whose rec_len covers the rest of the
+ * block, followed by dx_root_info and the root of the index.  The
+ * other index blocks are dx_nodes which look like an empty entry.
+ * Leaves are ordinary directory blocks.  The first dx_entry of an
+ * index block holds the count and the limit in place of the hash.
+ */
+#define DX_HASH_LEGACY              0
+#define DX_HASH_HALF_MD4            1
+#define DX_HASH_TEA                 2
+#define DX_HASH_LEGACY_UNSIGNED     3
+#define DX_HASH_HALF_MD4_UNSIGNED   4
+#define DX_HASH_TEA_UNSIGNED        5
+
+#define EXT2_HTREE_EOF              0x7fffffff
+#define EXT2_HTREE_LEVEL            2       // root + one level of nodes
+
+struct fake_dirent {
+    uint32_t inode;
+    uint16_t rec_len;
+    uint8_t  name_len;
+    uint8_t  file_type;
+};
+
+struct dx_countlimit {
+    uint16_t limit;
+    uint16_t count;
+};
+
+struct dx_entry {
+    uint32_t hash;
+    uint32_t block;
+};
+
+struct dx_root {
+    struct fake_dirent dot;
+    char dot_name[4];
+    struct fake_dirent dotdot;
+    char dotdot_name[4];
+    struct dx_root_info {
+        uint32_t reserved_zero;
+        uint8_t  hash_version;
+        uint8_t  info_length;       // 8
+        uint8_t  indirect_levels;
+        uint8_t  unused_flags;
+    } info;
+    struct dx_entry entries[];
+};
+
+struct dx_node {
+    struct fake_dirent fake;
+    struct dx_entry entries[];
+};
+
+struct dx_hash_info {
+    uint32_t  hash;
+    uint32_t  minor_hash;
+    int       hash_version;
+    uint32_t *seed;
+};
+
+/*
+ * Extent trees of ext4 (read only).
+ *
+ * i_block of an inode with EXT4_EXTENTS_FL holds the header and up to
+ * four entries of the root.  Entries of the nodes with eh_depth > 0 are
+ * ext4_extent_idxs pointing to the blocks of the next level, and those
+ * of the leaves are ext4_extents, both sorted by the logical block.
+ */
+#define EXT4_EXT_MAGIC          0xf30a
+#define EXT4_MAX_EXTENT_DEPTH   5
+#define EXT_INIT_MAX_LEN        (1U << 15)  // longer ee_len is uninitialized
+
+struct ext4_extent_header {
+    uint16_t eh_magic;
+    uint16_t eh_entries;        // number of valid entries
+    uint16_t eh_max;            // capacity of store in entries
+    uint16_t eh_depth;          // 0 in the leaves
+    uint32_t eh_generation;
+};
+
+struct ext4_extent {
+    uint32_t ee_block;          // first logical block extent covers
+    uint16_t ee_len;            // number of blocks covered by extent
+    uint16_t ee_start_hi;       // high 16 bits of physical block
+    uint32_t ee_start_lo;       // low 32 bits of physical block
+};
+
+struct ext4_extent_idx {
+    uint32_t ei_block;          // index covers logical blocks from 'block'
+    uint32_t ei_leaf_lo;        // pointer to the physical block of the next level
+    uint16_t ei_leaf_hi;        // high 16 bits of physical block
+    uint16_t ei_unused;
+};
+
+#define EXT_FIRST_EXTENT(eh)    ((struct ext4_extent *)((eh) + 1))
+#define EXT_FIRST_INDEX(eh)     ((struct ext4_extent_idx *)((eh) + 1))
+
+static inline uint64_t
+ext4_ext_pblock(struct ext4_extent *ex)
+{
+    return (uint64_t)ex->ee_start_hi << 32 | ex->ee_start_lo;
+}
+
+static inline uint64_t
+ext4_idx_pblock(struct ext4_extent_idx *ix)
+{
+    return (uint64_t)ix->ei_leaf_hi << 32 | ix->ei_leaf_lo;
+}
+
+static inline int
+ext4_ext_is_uninit(struct ext4_extent *ex)
+{
+    return ex->ee_len > EXT_INIT_MAX_LEN;
+}
+
+static inline uint32_t
+ext4_ext_get_actual_len(struct ext4_extent *ex)
+{
+    return ex->ee_len <= EXT_INIT_MAX_LEN ? ex->ee_len : ex->ee_len - EXT_INIT_MAX_LEN;
+}
+
 /**
  * Structure of  blocks group descriptor
  */
@@ -308,11 +489,14 @@ struct ext2_group_desc {
 // FIrst non-reserved inode for old ext2 filesystems
 #define EXT2_GOOD_OLD_FIRST_INO     11
 
+#define EXT2_HAS_COMPAT_FEATURE(sb,mask)        \
+    ( EXT2_SB(sb)->s_es->s_feature_compat & mask )
 #define EXT2_HAS_INCOMPAT_FEATURE(sb,mask)      \
     ( EXT2_SB(sb)->s_es->s_feature_incompat & mask )
 #define EXT2_HAS_RO_COMPAT_FEATURE(sb,mask)     \
     ( EXT2_SB(sb)->s_es->s_feature_ro_compat & mask )
 
+#define EXT2_FEATURE_COMPAT_DIR_INDEX       0x0020
 #define EXT2_FEATURE_INCOMPAT_META_BG       0x0010
 #define EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
 
@@ -354,15 +538,20 @@ void          ext2_iupdate(struct inode *ip);
 void          ext2_itrunc(struct inode *ip);
 void          ext2_cleanup(struct inode *ip);
 uint32_t      ext2_bmap(struct inode *ip, uint32_t bn);
+uint32_t      ext2_bmap_noalloc(struct inode *ip, uint32_t bn);
 void          ext2_ilock(struct inode *ip);
 void          ext2_iunlock(struct inode *ip);
 void          ext2_stati(struct inode *ip, struct stat *st);
 ssize_t       ext2_readi(struct inode *ip, char *dst, size_t off, size_t n);
 ssize_t       ext2_writei(struct inode *ip, char *src, size_t off, size_t n);
+int           ext2_writepages(struct inode *ip, off_t off, char **pages, int n);
+int           ext2_prepare_write(struct inode *ip, off_t off, size_t n);
 int           ext2_dirlink(struct inode *dp, char *name, uint32_t inum, uint16_t type);
 int           ext2_unlink(struct inode *dp, uint32_t off);
 int           ext2_isdirempty(struct inode *dp);
 
+int           ext2_dirhash(const char *name, int len, struct dx_hash_info *hinfo);
+
 int           init_ext2fs(void);
 int           ext2_fill_inode(struct inode *ip);
 #endif
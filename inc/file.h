@@ -16,6 +16,18 @@
 #define FILE_READABLE(flags) ((((flags) & O_ACCMODE) == O_RDWR) || (((flags) & O_ACCMODE) == O_RDONLY));
 #define FILE_WRITABLE(flags) ((((flags) & O_ACCMODE) == O_RDWR) || (((flags) & O_ACCMODE) == O_WRONLY));
 
+#define RA_MIN      4           /* Blocks in the first readahead window */
+#define RA_MAX      32          /* Max blocks in a readahead window */
+#define RA_RANGE    256         /* Max blocks read ahead for a range */
+
+/* Readahead state of an open file */
+struct file_ra_state {
+    uint32_t start;             /* First block of the last window */
+    uint32_t size;              /* Blocks in it: 0 if not reading sequentially */
+    off_t prev_end;             /* End of the previous read */
+    int advice;                 /* POSIX_FADV_* */
+};
+
 struct file {
     enum { FD_NONE, FD_PIPE, FD_INODE } type;
     int ref;
@@ -25,6 +37,7 @@ struct file {
     int flags;
     char readable;
     char writable;
+    struct file_ra_state ra;
 };
 
 /*
@@ -39,6 +52,7 @@ struct devsw {
 
 extern struct devsw devsw[];
 
+void            fileinit();
 struct file *   filealloc();
 struct file *   filedup(struct file *f);
 long            fileopen(char *path, int flags, mode_t mode);
@@ -55,6 +69,8 @@ long            filerename(char *path1, char *path2);
 long            filechmod(char *path, mode_t mode);
 long            filechown(struct file *f, char *path, uid_t owner, gid_t group);
 long            filepread64(struct file *f, void *buf, size_t count, off_t offset);
+long            fileadvise(struct file *f, off_t offset, off_t len, int advice);
+void            inode_readahead(struct inode *ip, off_t off, size_t len);
 
 long            fsync(struct file *f, int type);
 long            fdalloc(struct file *f, int from);
@@ -0,0 +1,12 @@
+#ifndef INC_FUTEX_H
+#define INC_FUTEX_H
+
+#include "types.h"
+#include "linux/time.h"
+
+void futex_init();
+long futex(uint32_t *uaddr, int op, uint32_t val, struct timespec *timeout,
+           uint32_t *uaddr2, uint32_t val3);
+long futex_wake(uint32_t *uaddr, int nr);
+
+#endif
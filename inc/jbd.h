@@ -0,0 +1,85 @@
+#ifndef INC_JBD_H
+#define INC_JBD_H
+
+#include "types.h"
+
+/*
+ * On-disk format of the ext3 journal (JBD).
+ * All fields are big-endian.
+ */
+
+#define JBD_MAGIC               0xc03b3998U
+
+/* Block types */
+#define JBD_DESCRIPTOR_BLOCK    1
+#define JBD_COMMIT_BLOCK        2
+#define JBD_SUPERBLOCK_V1       3
+#define JBD_SUPERBLOCK_V2       4
+#define JBD_REVOKE_BLOCK        5
+
+/* Tag flags */
+#define JBD_FLAG_ESCAPE         1       /* on-disk block is escaped */
+#define JBD_FLAG_SAME_UUID      2       /* block has same uuid as previous */
+#define JBD_FLAG_DELETED        4       /* block deleted by this transaction */
+#define JBD_FLAG_LAST_TAG       8       /* last tag in this descriptor block */
+
+/* Features */
+#define JBD_FEATURE_COMPAT_CHECKSUM     0x00000001
+#define JBD_FEATURE_INCOMPAT_REVOKE     0x00000001
+
+#define EXT3_FEATURE_COMPAT_HAS_JOURNAL     0x0004
+#define EXT3_FEATURE_INCOMPAT_RECOVER       0x0004
+
+typedef struct journal_header_s {
+    uint32_t h_magic;
+    uint32_t h_blocktype;
+    uint32_t h_sequence;
+} journal_header_t;
+
+/* Tag of a block in a descriptor block.  The first tag is followed by a uuid. */
+typedef struct journal_block_tag_s {
+    uint32_t t_blocknr;         /* The on-disk block number */
+    uint32_t t_flags;           /* See above */
+} journal_block_tag_t;
+
+/* Header of a revoke block.  Block numbers of r_count bytes follow. */
+typedef struct journal_revoke_header_s {
+    journal_header_t r_header;
+    uint32_t r_count;           /* Count of bytes used in the block */
+} journal_revoke_header_t;
+
+/* The journal superblock.  All fields are in big-endian byte order. */
+typedef struct journal_superblock_s {
+    journal_header_t s_header;
+
+    /* Static information describing the journal */
+    uint32_t s_blocksize;       /* journal device blocksize */
+    uint32_t s_maxlen;          /* total blocks in journal file */
+    uint32_t s_first;           /* first block of log information */
+
+    /* Dynamic information describing the current state of the log */
+    uint32_t s_sequence;        /* first commit ID expected in log */
+    uint32_t s_start;           /* blocknr of start of log, 0 if clean */
+
+    uint32_t s_errno;
+
+    /* Remaining fields are only valid in a version-2 superblock */
+    uint32_t s_feature_compat;
+    uint32_t s_feature_incompat;
+    uint32_t s_feature_ro_compat;
+    uint8_t  s_uuid[16];        /* 128-bit uuid for journal */
+    uint32_t s_nr_users;        /* Nr of filesystems sharing log */
+    uint32_t s_dynsuper;
+    uint32_t s_max_transaction;
+    uint32_t s_max_trans_data;
+    uint32_t s_padding[44];
+    uint8_t  s_users[16*48];
+} journal_superblock_t;
+
+static inline uint32_t
+be32(uint32_t x)
+{
+    return __builtin_bswap32(x);
+}
+
+#endif
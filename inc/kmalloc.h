@@ -3,7 +3,15 @@
 
 #include "types.h"
 
+struct kmem_cache;
+
+void kmalloc_init();
 void kmfree(void *ap);
 void *kmalloc(size_t nbytes);
 
+struct kmem_cache *kmem_cache_create(const char *name, size_t size);
+void *kmem_cache_alloc(struct kmem_cache *c);
+void kmem_cache_free(struct kmem_cache *c, void *obj);
+void kmem_cache_dump();
+
 #endif
@@ -58,6 +58,9 @@
 
 #define F_GETOWNER_UIDS 17
 
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+
 #define FD_CLOEXEC 1
 
 #define AT_FDCWD (-100)
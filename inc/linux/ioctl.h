@@ -77,4 +77,8 @@
 #define TIOCGICOUNT	0x545D
 #define FIOQSIZE	0x5460
 
+/* Regular files (linux/fs.h) */
+#define FIBMAP		0x0001	/* bmap access */
+#define FIGETBSZ	0x0002	/* get the block size used for bmap */
+
 #endif
@@ -60,4 +60,11 @@ struct rusage {
 
 #define RLIM_NLIMITS RLIMIT_NLIMITS
 
+#define PRIO_MIN        (-20)
+#define PRIO_MAX        20
+
+#define PRIO_PROCESS    0
+#define PRIO_PGRP       1
+#define PRIO_USER       2
+
 #endif
@@ -5,6 +5,7 @@
 #include "list.h"
 
 #define HZ 100
+#define NSEC_PER_SEC    1000000000UL
 //#define INITIAL_JIFFIES ((uint64_t)-300 * HZ)                // itimerが動かず
 //#define INITIAL_JIFFIES ((uint64_t)(uint32_t)(-300 * HZ))    // clock割り込みしない
 #define INITIAL_JIFFIES 0UL
@@ -31,6 +32,19 @@ struct timer_list {
     void (*function)(uint64_t);
 };
 
+struct hrtimer_base;
+
+/* High resolution timer: expires is in ns of ktime_get(). */
+struct hrtimer {
+    struct list_head list;
+    uint64_t expires;
+    int (*function)(struct hrtimer *);
+    struct hrtimer_base *base;          /* cpu this timer was armed on */
+};
+
+#define HRTIMER_NORESTART   0
+#define HRTIMER_RESTART     1
+
 extern uint64_t jiffies;
 extern struct timespec xtime;
 
@@ -74,6 +88,22 @@ static inline int timer_pending (const struct timer_list * timer)
 	return timer->list.next != NULL;
 }
 
+static inline void hrtimer_init(struct hrtimer *t, int (*fn)(struct hrtimer *))
+{
+    t->list.next = t->list.prev = NULL;
+    t->function = fn;
+    t->base = NULL;
+}
+
+static inline int hrtimer_pending(const struct hrtimer *t)
+{
+    return t->list.next != NULL;
+}
+
+uint64_t ktime_get(void);
+void hrtimer_start(struct hrtimer *t, uint64_t expires);
+int hrtimer_cancel(struct hrtimer *t);
+
 #define time_after(a,b)     ((int64_t)(b) - (int64_t)(a) < 0)
 #define time_before(a,b)    time_after(b,a)
 
@@ -83,7 +113,7 @@ static inline int timer_pending (const struct timer_list * timer)
 void init_timervecs(void);
 void run_timer_list(void);
 long getitimer(int, struct itimerval *);
-void it_real_fn(uint64_t);
+int it_real_fn(struct hrtimer *);
 long setitimer(int, struct itimerval *, struct itimerval *);
 
 #endif
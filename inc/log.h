@@ -1,13 +1,19 @@
 #ifndef INC_LOG_H
 #define INC_LOG_H
 
+#include "types.h"
+
 struct buf;
 
 #define NLOG    3
 
 void initlog(int dev);
+int  initlog_jbd(int dev, uint32_t *map, uint32_t maxlen);
+int  log_enabled(int dev);
+void log_close(int dev);
 void log_write(struct buf *);
 void begin_op(void);
 void end_op(void);
+void log_force(int dev);
 
 #endif
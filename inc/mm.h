@@ -6,8 +6,12 @@
 void mm_init(void);
 void *kalloc(void);
 void kfree(void *va);
+void *alloc_pages(int order);
+void free_pages(void *va, int order);
+int get_order(size_t size);
+int page_order(void *va);
 void inc_kmem_ref(uint64_t pa);
-void dec_kmem_ref(uint64_t pa);
+int dec_kmem_ref(uint64_t pa);
 int get_kmem_ref(uint64_t pa);
 uint64_t  get_totalram(void);
 uint64_t  get_freeram(void);
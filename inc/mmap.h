@@ -7,16 +7,17 @@
 
 #define NOT_PAGEALIGN(a)  ((uint64_t)(a) & (PGSIZE-1))
 
+void mmap_init();
 long mmap(void *, size_t, int, int, struct file*, off_t);
 long munmap(void *, size_t);
 void *mremap(void *, size_t, size_t, int, void *);
 long msync(void *, size_t, int);
 
 uint64_t get_perm(int, int);
-void free_mmap_list(struct proc *);
+void free_mmap_list(struct mm_struct *);
 long mmap_load_pages(void *, size_t, int, int, struct file*, off_t);
 void print_mmap_list(struct proc *, const char *);
-long copy_mmap_list(struct proc *, struct proc *);
+long copy_mmap_list(struct mm_struct *, struct mm_struct *);
 long copy_mmap_list2(struct proc *, struct proc *);
 long copy_mmap_pages(void *, size_t, uint64_t);
 void print_vmas(struct proc *);
@@ -61,6 +61,7 @@
 #define PTE_NG          (1 << 11)
 #define PTE_PXN         (1UL<<53)   /* EL1以上での実行不可 */
 #define PTE_UXN         (1UL<<54)   /* EL0での実行不可 */
+#define PTE_COW         (1UL<<55)   /* ソフトウェア使用: Copy on Write */
 
 /* 1GB/2MB block for kernel, and 4KB page for user. */
 #define PTE_KDATA       (PTE_KERN | PTE_NORMAL | PTE_BLOCK)
@@ -2,22 +2,46 @@
 #define INC_PAGECACHE_H
 
 #include "file.h"
+#include "list.h"
 #include "sleeplock.h"
 #include "types.h"
 
 #define NPAGECACHE 10240
+#define NPAGEHASH  1024                 /* Must be power of 2. */
+#define WB_MAXPAGES (MAXOPBLOCKS - 10)  /* Pages written back in one transaction */
+
+/* flags: protected by pagecache.lock */
+#define PG_LRU          0x1             /* On the active or inactive list */
+#define PG_ACTIVE       0x2             /* On the active list */
+#define PG_REFERENCED   0x4             /* Accessed since last scanned */
+#define PG_DIRTY        0x8             /* Newer than the disk: not evictable */
 
 struct cached_page {
     char *page;
     uint32_t dev;
     uint32_t inum;
-    int ref_count;
+    int ref_count;                      /* Users of the page (bucket lock) */
+    int hashed;                         /* On the hash chain (bucket lock) */
+    int valid;                          /* page has been read (lock) */
+    int flags;                          /* PG_* */
     off_t offset;
+    struct inode *ip;                   /* Owner of ilist */
+    struct list_head hash;              /* Hash chain */
+    struct list_head lru;               /* active, inactive or free list */
+    struct list_head ilist;             /* Pages of the same inode */
     struct sleeplock lock;
 };
 
 void pagecache_init(void);
+void pagecache_drop(struct inode *);
+void pagecache_invalidate(struct inode *, off_t, off_t);
 void update_page(off_t, uint32_t, uint32_t, char *, size_t);
 long copy_page(struct inode *, off_t, char *, size_t, off_t);
 long copy_pages(struct inode *, char *, size_t, off_t);
+long pagecache_write(struct inode *, char *, off_t, size_t);
+int  pagecache_read(struct inode *, char *, off_t, size_t);
+long pagecache_writeback(struct inode *);
+long pagecache_error(struct inode *);
+void pagecache_sync(int);
+void balance_dirty_pages(void);
 #endif
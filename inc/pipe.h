@@ -6,22 +6,36 @@
 #include "types.h"
 #include "spinlock.h"
 
-#define PIPESIZE 512
+#define PIPE_DEF_BUFFERS    16                  // 64 KiB
+#define PIPE_MAX_SIZE       (1024 * 1024)       // Limit of F_SETPIPE_SZ
+#define PIPE_BUF            4096                // Writes up to this are atomic
 
 #define PIPE2_FLAGS (O_CLOEXEC | O_DIRECT | O_NONBLOCK)
 
+/*
+ * The data is held in a ring of nbufs pages, which are allocated
+ * when written first.  Byte n of the stream is at n % PGSIZE in page
+ * (n / PGSIZE) % nbufs; nbufs is a power of 2 so that this holds
+ * across the wraparound of nread and nwrite.
+ */
 struct pipe {
   struct spinlock lock;
-  char      data[PIPESIZE];
+  char    **bufs;       // ring of pages
+  uint32_t  nbufs;      // number of pages in the ring
+  uint32_t  size;       // nbufs * PGSIZE
   uint32_t  nread;      // number of bytes read
   uint32_t  nwrite;     // number of bytes written
   int       readopen;   // read fd is still open
   int       writeopen;  // write fd is still open
+  int       nrwait;     // number of readers sleeping
+  int       nwwait;     // number of writers sleeping
 };
 
+void pipeinit();
 int pipealloc(struct file **f0, struct file **f1, int flags);
 void pipeclose(struct pipe *p, int writable);
 ssize_t pipewrite(struct pipe *p, char *addr, ssize_t n);
 ssize_t piperead(struct pipe *p, char *addr, ssize_t n);
+long pipe_setsize(struct pipe *p, long size);
 
 #endif
@@ -45,8 +45,12 @@ struct signal {
     struct sigaction actions[NSIG];
 };
 
-/* Per-process state */
-struct proc {
+/*
+ * Address space.  Shared by the threads created with CLONE_VM
+ * and freed when the last of them drops it.
+ */
+struct mm_struct {
+    int ref;                    /* Number of users (atomic) */
     /*
      * Memory layout
      *
@@ -70,10 +74,44 @@ struct proc {
     size_t stksz;
 
     void *pgdir;                /* User space page table. */
+    int nregions;               /* Number of regions mapped by the process */
+    struct mmap_region *regions; /* head pointer of the mmap region list */
+    struct spinlock lock;       /* Serializes copy on write faults of threads */
+};
+
+/* Open files.  Shared by CLONE_FILES. */
+struct files_struct {
+    int ref;                    /* Number of users (atomic) */
+    struct spinlock lock;       /* Protects allocation of ofile */
+    int fdflag;                 // file descriptor flags: 1 bit/file
+    struct file *ofile[NOFILE]; // Open files
+};
+
+/* Filesystem context.  Shared by CLONE_FS. */
+struct fs_struct {
+    int ref;                    /* Number of users (atomic) */
+    struct inode *cwd;          // Current directory
+};
+
+/* Thread group.  Shared by CLONE_THREAD. */
+struct thread_group {
+    int ref;                    /* Number of users (atomic) */
+    int nr_threads;             /* Threads not exited yet (ptable.lock) */
+    int exiting;                /* exit_group() was called (ptable.lock) */
+    int exit_code;              /* Its exit code for all the threads */
+};
+
+/* Per-process state */
+struct proc {
+    struct mm_struct *mm;       /* Address space */
+    struct files_struct *files; /* Open files */
+    struct fs_struct *fs;       /* Current directory */
+    struct thread_group *group; /* Thread group */
     void *kstack;               /* Bottom of kernel stack for this process. */
     enum procstate state;       /* Process state. */
 
-    pid_t pid;                  /* Process ID. */
+    pid_t pid;                  /* Process ID (thread ID). */
+    pid_t tgid;                 /* Thread group ID: pid of the first thread */
     pid_t pgid;                 // プロセスグループID
     pid_t sid;                  // セッションID
     struct proc *parent;        /* Parent process */
@@ -87,29 +125,35 @@ struct proc {
     kernel_cap_t   cap_effective, cap_inheritable, cap_permitted;   // capabilities
     mode_t umask;               // umask
 
-    uint64_t stime, utime;      // ticks for system and user
-    uint64_t it_real_value, it_prof_value, it_virt_value;   /* timer interval value: REAL, PROF, VIRTUAL */
-    uint64_t it_real_incr, it_prof_incr, it_virt_incr;      /* timer increment: REAL, PROF, VIRTUAL */
-    struct timer_list real_timer;                           /* Real time timer */
+    uint64_t utime;             // time (ns) in user mode
+    uint64_t it_real_value, it_prof_value, it_virt_value;   /* timer interval value: REAL (ns), PROF, VIRTUAL */
+    uint64_t it_real_incr, it_prof_incr, it_virt_incr;      /* timer increment: REAL (ns), PROF, VIRTUAL */
+    struct hrtimer real_timer;                              /* Real time timer */
 
     struct trapframe *tf;       /* Trap frame for current syscall. */
     struct context *context;    /* swtch() here to run process. */
     struct list_head link;      /* linked list of running process. */
+    int cpu;                    /* CPU whose run queue this process belongs to. */
+    uint64_t cpus_allowed;      /* CPUs this process may run on (bit i: cpu i). */
+    int nice;                   /* Nice value (-20..19). */
+    uint64_t vruntime;          /* Run time (ns) weighted by nice. */
+    uint64_t exec_start;        /* Time (ns) vruntime was last updated. */
     void *chan;                 /* If non-zero, sleeping on chan */
     int killed;                 // If non-zero, have been killed
     int xstate;                 // waitで待っていてる親に返すexit status
-    int fdflag;                 // file descriptor flags: 1 bit/file
-    struct file *ofile[NOFILE]; // Open files
-    struct inode *cwd;          // Current directory
     char name[16];              // Process name (debugging)
-
-    int nregions;               /* Number of regions mapped by the process */
-    struct mmap_region *regions; /* head pointer of the mmap region list */
-    struct spinlock *regions_lock; /* mmap regions lock */
+    void (*kfn)(void *);        /* Function of a kernel thread */
+    void *karg;                 /* Its argument */
+    struct blk_plug *plug;      /* Block requests held back (dev.c) */
+    int logops;                 /* Logs joined by begin_op() (log.c) */
 
     struct signal signal;       // Signal
     struct trapframe *oldtf;    // To save the old trapframe
     int paused;                 //
+
+    int vfork;                  /* CLONE_VFORK: 親がexecve/exitを待っている */
+    int detached;               /* CLONE_THREAD: waitされずexit時に回収される */
+    int *clear_child_tid;       /* exit時に0を書き込んでfutexで起こすアドレス */
 };
 
 /* Per-CPU state */
@@ -118,7 +162,12 @@ struct cpu {
     struct proc *proc;          /* The process running on this cpu or null. */
     struct proc *idle;          /* The idle process. */
     volatile int started;       /* Has the CPU started? */
-    struct spinlock lock;
+    struct spinlock lock;       /* Protects runq and is held across swtch(). */
+    struct list_head runq;      /* Per-CPU run queue. */
+    int nrunnable;              /* Number of processes on runq. */
+    uint64_t nsteal;            /* Processes this CPU stole from other CPUs. */
+    uint64_t nmigrate;          /* Processes which migrated onto this CPU. */
+    uint64_t min_vruntime;      /* Monotonic floor of vruntime on runq. */
 };
 
 extern struct cpu cpu[NCPU];
@@ -141,10 +190,19 @@ void scheduler();
 void sleep(void *chan, struct spinlock *lk);
 void wakeup(void *chan);
 void yield();
+int  sched_tick();
 void exit(int);
 int  wait4(pid_t pid, int *status, int options, struct rusage *ru);
 int  fork();
+int  clone(uint64_t flags, void *stack, int *ptid, uint64_t tls, int *ctid);
+void vfork_release(struct proc *p);
+void exit_group(int);
+void zap_other_threads(struct proc *p);
+void de_thread(struct proc *p);
+struct mm_struct *mm_alloc();
+void mm_put(struct mm_struct *mm);
 void procdump();
+struct proc *kthread_create(void (*fn)(void *), void *arg, char *name);
 
 long kill(pid_t pid, int sig);
 long sigsuspend(sigset_t *mask);
@@ -162,6 +220,10 @@ void flush_signal_handlers(struct proc *p);
 long ppoll(struct pollfd *fds, nfds_t nfds);
 long setpgid(pid_t, pid_t);
 pid_t getpgid(pid_t);
+long setpriority(int which, int who, int niceval);
+long getpriority(int which, int who);
+long sched_setaffinity(pid_t pid, uint64_t mask);
+long sched_getaffinity(pid_t pid, uint64_t *mask);
 uint16_t get_procs();
 
 // sigret_syscall.S
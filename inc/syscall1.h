@@ -17,6 +17,7 @@ long argu64(int n, uint64_t * ip);
 long argptr(int, char **, size_t);
 long fetchstr(uint64_t, char **);
 long sys_clock_gettime();
+long sys_sched_setaffinity();
 long sys_sched_getaffinity();
 long sys_prlimit64();
 long sys_sysinfo();
@@ -47,6 +48,9 @@ long sys_tkill();
 mode_t sys_umask();
 long sys_getpgid();
 long sys_setpgid();
+long sys_setpriority();
+long sys_getpriority();
+long sys_futex();
 long sys_setregid();
 long sys_setgid();
 long sys_setreuid();
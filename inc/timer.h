@@ -1,7 +1,11 @@
 #ifndef INC_TIMER_H
 #define INC_TIMER_H
 
+#include "linux/time.h"
+
 void timer_init();
 void timer_intr();
+void timer_set_tick(int on);
+long hrtimer_nanosleep(struct timespec *req, struct timespec *rem);
 
 #endif
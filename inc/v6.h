@@ -11,7 +11,7 @@
 #include "linux/time.h"
 
 // Belows are used by both
-#define LOGSIZE         (MAXOPBLOCKS*3)     // Max data blocks in on-disk log
+#define LOGSIZE         (MAXOPBLOCKS*8)     // Max data blocks in a log transaction
 #define BSIZE           4096                // Block size
 
 /* Disk layout:
@@ -93,6 +93,7 @@ void            v6_iupdate(struct inode *ip);
 void            v6_itrunc(struct inode *ip);
 void            v6_cleanup(struct inode *ip);
 uint32_t        v6_bmap(struct inode *ip, uint32_t bn);
+uint32_t        v6_bmap_noalloc(struct inode *ip, uint32_t bn);
 void            v6_ilock(struct inode *ip);
 ssize_t         v6_readi(struct inode *ip, char *dst, size_t off, size_t n);
 ssize_t         v6_writei(struct inode *ip, char *src, size_t off, size_t n);
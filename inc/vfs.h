@@ -25,11 +25,12 @@
 #define ROOTDEV         V6MINOR             // Root device #
 
 #define MAXOPBLOCKS     42                  // Max # of blocks any FS op writes
-#define NBUF            (MAXOPBLOCKS*3)     // Size of disk block cache
+#define NBUF            (MAXOPBLOCKS*3)     // Minimum size of disk block cache
 #define MAXVFSSIZE      4                   // maximum number of vfs fils systems
 #define ROOTFSTYPE      "v6"                //
 #define MAXBSIZE        4096                // maximum BSIZE
 #define NINODE          1024                // Maximum # of active i-nodes
+#define NIHASH          256                 // Inode hash buckets (power of 2)
 #define ROOTINO         1                   // Root i-number
 
 // mkfs only
@@ -84,12 +85,16 @@ struct inode_operations {
     void (*iupdate)(struct inode *ip);
     void (*itrunc)(struct inode *ip);
     void (*cleanup)(struct inode *ip);
+    void (*release)(struct inode *ip);      // The last reference is dropped (optional)
     uint32_t (*bmap)(struct inode *ip, uint32_t bn);
+    uint32_t (*bmap_noalloc)(struct inode *ip, uint32_t bn);   // 0 if not allocated
     void (*ilock)(struct inode *ip);
     void (*iunlock)(struct inode *ip);
     void (*stati)(struct inode *ip, struct stat *st);
     ssize_t (*readi)(struct inode *ip, char *dst, size_t off, size_t n);
     ssize_t (*writei)(struct inode *ip, char *src, size_t off, size_t n);
+    int (*writepages)(struct inode *ip, off_t off, char **pages, int n);  // Write back dirty pages: # written
+    int (*prepare_write)(struct inode *ip, off_t off, size_t n);        // Check a write before dirtying pages (optional)
     int (*dirlink)(struct inode *dp, char *name, uint32_t inum, uint16_t type);
     int (*unlink)(struct inode *dp, uint32_t off);
     int (*isdirempty)(struct inode *dp);
@@ -100,7 +105,7 @@ struct inode_operations {
 struct inode {
     uint32_t dev;                       // Minor Divice number
     uint32_t inum;                      // Inode number
-    int ref;                            // Reference count
+    int ref;                            // Reference count (atomic)
     struct sleeplock lock;              // sleep lock
     int valid;                          // inode has been read from disk?
     struct filesystem_type *fs_t;       // THe filesystem type this inode is stored in
@@ -118,14 +123,29 @@ struct inode {
     struct timespec atime;              // Last access time
     struct timespec mtime;              // Last modify time
     struct timespec ctime;              // Last create time
+    struct list_head i_pages;           // Cached pages (pagecache.lock)
+    int i_ndirty;                       // Dirty cached pages (pagecache.lock)
+    int i_wb_error;                     // Error of the last writeback (pagecache.lock)
+    uint64_t i_dversion;                // Version of cached dentries (T_DIR only)
+    struct list_head i_hash;            // Hash chain (bucket lock)
+    int i_hashed;                       // On a hash chain (bucket lock)
+    struct list_head i_lru;             // LRU of unreferenced inodes (icache.lock)
+    int i_onlru;                        // On the LRU list (icache.lock)
 };
 
 #define INODE_FREE  0
 #define INODE_USED  1
 
-struct icache {
+struct inode_bucket {
     struct spinlock lock;
+    struct list_head chain;
+};
+
+struct icache {
+    struct spinlock lock;                   // Protects lru
+    struct list_head lru;                   // Unreferenced inodes, LRU at the back
     struct inode inode[NINODE];
+    struct inode_bucket hash[NIHASH];
 };
 extern struct icache icache;
 
@@ -157,12 +177,13 @@ struct vfs_operations {
     void            (*bzero)(uint32_t dev, int bno);
     void            (*bfree)(uint32_t dev, uint32_t b);
     void            (*brelse)(struct buf *b);
-    void            (*bwrite)(struct buf *b);
+    int             (*bwrite)(struct buf *b);
     struct buf *    (*bread)(uint32_t dev, uint32_t blockno);
     int             (*namecmp)(const char *s, const char *t);
     int             (*direntlookup)(struct inode *dp, int inum, struct dirent *dep, size_t *ofp);
     uint16_t        (*getrootino)(void);
     long            (*getdents)(struct file *f, char *data, size_t size);
+    struct inode *  (*iget)(uint32_t dev, uint32_t inum, uint16_t type);
 };
 
 /*
@@ -217,6 +238,7 @@ struct filesystem_type *getfs(const char *fs_name);
 struct inode *iget(uint32_t dev, uint32_t inum, uint16_t type, int (*fill_super)(struct inode *));
 struct inode *idup(struct inode *ip);
 void          iinit(int dev);
+void          ievict(uint32_t dev);
 void          iput(struct inode *ip);
 void          iunlockput(struct inode * ip);
 struct inode *namei(char *path);
@@ -227,6 +249,7 @@ struct inode *create(char *path, uint16_t type, uint16_t major, uint16_t minor,
 void generic_iunlock(struct inode *ip);
 void generic_stati(struct inode *ip, struct stat *st);
 ssize_t  generic_readi(struct inode *ip, char *dst, size_t off, size_t n);
+void     generic_readahead(struct inode *ip, uint32_t bn, uint32_t n);
 int  generic_dirlink(struct inode *dp, char *name, uint32_t inum, uint16_t type);
 int  generic_permission(struct inode *ip, int mask);
 
@@ -1,6 +1,6 @@
 /* Buffer cache.
  *
- * The buffer cache is a linked list of buf structures holding
+ * The buffer cache is a hash table of buf structures holding
  * cached copies of disk block contents.  Caching disk blocks
  * in memory reduces the number of disk reads and also provides
  * a synchronization point for disk blocks used by multiple processes.
@@ -17,6 +17,18 @@
  * * B_VALID: the buffer data has been read from the disk.
  * * B_DIRTY: the buffer data has been modified
  *     and needs to be written to disk.
+ * * B_ERROR: the last read or write of the buffer failed.
+ *
+ * Buffers are hashed by (dev, blockno) into NBHASH buckets.
+ * A bucket lock protects its chain and the refcnt of the buffers
+ * on it, so that lookups of different blocks do not contend.
+ * Buffers with refcnt == 0 are kept on an LRU list protected by
+ * bcache.lock, and the one used least recently is recycled on a miss.
+ * Only one process at a time recycles a buffer (bcache.evict), so it
+ * may hold two bucket locks without deadlock.
+ * b->lock (a sleeplock) serializes the users of a buffer.
+ *
+ * Lock order: bcache.evict -> bucket lock -> bcache.lock.
  */
 
 #include "spinlock.h"
@@ -25,110 +37,329 @@
 #include "console.h"
 #include "vfs.h"
 #include "dev.h"
+#include "linux/errno.h"
+#include "mm.h"
+#include "mmu.h"
+
+#define NBHASH          512             /* Must be power of 2. */
+#define NBUF_MAX        8192
+#define BUF_CHUNK_ORDER 8               /* Buffers are allocated 1MB at a time */
+
+struct bucket {
+    struct spinlock lock;
+    struct list_head chain;
+};
 
 struct {
     struct spinlock lock;
-    struct buf buf[NBUF];
+    struct spinlock evict;
+    int nbuf;
 
-    // Linked list of all buffers, through prev/next.
-    // head.next is most recently used.
+    // Buffers with refcnt == 0, through clink.
+    // head.next is least recently used.
     struct list_head head;
+    struct bucket hash[NBHASH];
 } bcache;
 
+static struct bucket *
+bhash(uint32_t dev, uint32_t blockno)
+{
+    uint32_t h = blockno ^ (dev << 20);
+    h ^= h >> 9;
+    return &bcache.hash[h & (NBHASH - 1)];
+}
+
+/*
+ * Size the cache to 1/64 of RAM, at least NBUF buffers.
+ */
 void
 binit()
 {
     struct buf *b;
+    uint64_t n;
+    int per = (PGSIZE << BUF_CHUNK_ORDER) / sizeof(struct buf);
 
     initlock(&bcache.lock, "bcache");
-
-    // Create linked list of buffers
+    initlock(&bcache.evict, "bcache.evict");
     list_init(&bcache.head);
-    for (b = bcache.buf; b < bcache.buf + NBUF; b++) {
-        list_push_back(&bcache.head, &b->clink);
+    for (int i = 0; i < NBHASH; i++) {
+        initlock(&bcache.hash[i].lock, "bcache.bucket");
+        list_init(&bcache.hash[i].chain);
+    }
+
+    n = get_totalram() / 64 / sizeof(struct buf);
+    n = MIN(MAX(n, (uint64_t)NBUF), (uint64_t)NBUF_MAX);
+    while (bcache.nbuf < n) {
+        if ((b = alloc_pages(BUF_CHUNK_ORDER)) == 0) {
+            if (bcache.nbuf >= NBUF)
+                break;
+            panic("binit: no memory");
+        }
+        for (int i = 0; i < per && bcache.nbuf < n; i++, b++, bcache.nbuf++) {
+            b->flags = 0;
+            b->refcnt = 0;
+            b->dev = b->blockno = (uint32_t)-1;
+            initsleeplock(&b->lock, "buffer");
+            list_init(&b->hlink);
+            list_push_back(&bcache.head, &b->clink);
+        }
+    }
+    info("bcache: %d buffers", bcache.nbuf);
+}
+
+/* Number of buffers in the cache. */
+int
+bcache_nbuf()
+{
+    return bcache.nbuf;
+}
+
+/* hb->lock must be held. */
+static struct buf *
+bfind(struct bucket *hb, uint32_t dev, uint32_t blockno)
+{
+    struct buf *b;
+
+    LIST_FOREACH_ENTRY(b, &hb->chain, hlink) {
+        if (b->dev == dev && b->blockno == blockno)
+            return b;
+    }
+    return 0;
+}
+
+/* Take a reference to b.  Its bucket lock must be held. */
+static void
+bhold(struct buf *b)
+{
+    if (b->refcnt++ == 0) {
+        acquire(&bcache.lock);
+        list_drop(&b->clink);
+        release(&bcache.lock);
     }
 }
 
 /*
- * Look through buffer cache for block on device dev.
- * If not found, allocate a buffer.
- * In either case, return locked buffer.
+ * Take the least recently used buffer which is not in use
+ * off its bucket and the LRU list.  hb->lock and bcache.evict
+ * must be held.
  */
 static struct buf *
-bget(uint32_t dev, uint32_t blockno)
+brecycle(struct bucket *hb)
 {
     struct buf *b;
+    struct bucket *vb;
 
     acquire(&bcache.lock);
-    // Is the block already cached?
-loop:
+restart:
+    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+    // because log.c has modified it but not yet committed it.
     LIST_FOREACH_ENTRY(b, &bcache.head, clink) {
-        if (b->dev == dev && b->blockno == blockno) {
-            if (!(b->flags & B_BUSY)) {
-                b->flags |= B_BUSY;
-                release(&bcache.lock);
-                return b;
+        if (b->flags & B_DIRTY)
+            continue;
+        vb = bhash(b->dev, b->blockno);
+        if (vb != hb) {
+            // Only evicters take a second bucket lock.
+            release(&bcache.lock);
+            acquire(&vb->lock);
+            acquire(&bcache.lock);
+            if (b->refcnt != 0 || (b->flags & B_DIRTY)) {
+                release(&vb->lock);
+                // The LRU list has changed: scan it again.
+                goto restart;
             }
-            sleep(b, &bcache.lock);
-            goto loop;
         }
+        list_drop(&b->clink);
+        list_drop(&b->hlink);
+        release(&bcache.lock);
+        if (vb != hb)
+            release(&vb->lock);
+        return b;
+    }
+    release(&bcache.lock);
+    return 0;
+}
+
+/*
+ * Look through buffer cache for block on device dev.
+ * If not found, allocate a buffer.
+ * In either case, return locked buffer.
+ */
+struct buf *
+bget(uint32_t dev, uint32_t blockno)
+{
+    struct bucket *hb = bhash(dev, blockno);
+    struct buf *b;
+
+    // Is the block already cached?
+    acquire(&hb->lock);
+    if ((b = bfind(hb, dev, blockno)) != 0) {
+        bhold(b);
+        release(&hb->lock);
+        acquiresleep(&b->lock);
+        return b;
     }
+    release(&hb->lock);
 
     trace("not cached: bno %d", blockno);
 
     // Not cached; recycle an unused buffer.
-    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-    // because log.c has modified it but not yet committed it.
-    LIST_FOREACH_ENTRY_REVERSE(b, &bcache.head, clink) {
-        if ((b->flags & B_BUSY) == 0 /* b->refcnt == 0 */ && (b->flags & B_DIRTY) == 0) {
-            b->dev = dev;
-            b->blockno = blockno;
-            b->flags = B_BUSY;
-            release(&bcache.lock);
-            return b;
-        }
+    acquire(&bcache.evict);
+    acquire(&hb->lock);
+    if ((b = bfind(hb, dev, blockno)) != 0) {
+        bhold(b);
+    } else {
+        if ((b = brecycle(hb)) == 0)
+            panic("bget: no buffers");
+        b->dev = dev;
+        b->blockno = blockno;
+        b->flags = 0;
+        b->refcnt = 1;
+        list_push_back(&hb->chain, &b->hlink);
     }
-    panic("bget: no buffers");
-    return 0;
+    release(&hb->lock);
+    release(&bcache.evict);
+    acquiresleep(&b->lock);
+    return b;
 }
 
-/* Return a locked buf with the contents of the indicated block. */
+/*
+ * Return a locked buf with the contents of the indicated block.
+ * If the read fails, B_ERROR is set and B_VALID is not, so that
+ * the next bread() tries again.
+ */
 struct buf *
 bread(uint32_t dev, uint32_t blockno)
 {
     struct buf *b = bget(dev, blockno);
-    if ((b->flags & B_VALID) == 0) {
-        devrw(b);
-    }
+    if ((b->flags & B_VALID) == 0 && devrw(b) < 0)
+        warn("bread: I/O error: dev %d, blockno 0x%x", dev, blockno);
     return b;
 }
 
-/* Write b's contents to disk. Must be locked. */
-void
+/* Write b's contents to disk. Must be locked.  Returns 0 or -EIO. */
+int
 bwrite(struct buf *b)
 {
-    if ((b->flags & B_BUSY) == 0) {
+    if (!holdingsleep(&b->lock)) {
         panic("bwrite: not locked dev: %d, blockno: 0x%x, flags=%d\n",
             b->dev, b->blockno, b->flags);
     }
     b->flags |= B_DIRTY;
-    devrw(b);
+    return devrw(b) < 0 ? -EIO : 0;
+}
+
+/*
+ * Write the contents of n buffers to disk.  All must be locked.
+ * Adjacent blocks are written with one command.
+ * Returns 0 or -EIO if any of them failed.
+ */
+int
+bwritev(struct buf **bs, int n)
+{
+    for (int i = 0; i < n; i++) {
+        if (!holdingsleep(&bs[i]->lock))
+            panic("bwritev: not locked dev: %d, blockno: 0x%x\n",
+                bs[i]->dev, bs[i]->blockno);
+        bs[i]->flags |= B_DIRTY;
+    }
+    return devrwv(bs, n) < 0 ? -EIO : 0;
+}
+
+/*
+ * Keep b in the cache after it is released, until bunpin().
+ * Used for blocks referred to all the time, such as super blocks.
+ */
+void
+bpin(struct buf *b)
+{
+    struct bucket *hb = bhash(b->dev, b->blockno);
+
+    acquire(&hb->lock);
+    bhold(b);
+    release(&hb->lock);
+}
+
+/* Drop a reference to b taken by bget(). */
+static void
+bput(struct buf *b)
+{
+    struct bucket *hb = bhash(b->dev, b->blockno);
+
+    acquire(&hb->lock);
+    if (--b->refcnt == 0) {
+        acquire(&bcache.lock);
+        list_push_back(&bcache.head, &b->clink);
+        release(&bcache.lock);
+    }
+    release(&hb->lock);
 }
 
 /*
  * Release a locked buffer.
- * Move to the head of the MRU list.
+ * Move to the tail of the LRU list when unused.
  */
 void
 brelse(struct buf *b)
 {
-    if ((b->flags & B_BUSY) == 0)
+    if (!holdingsleep(&b->lock))
         panic("brelse");
 
-    acquire(&bcache.lock);
-    list_drop(&b->clink);
-    list_push_back(&bcache.head, &b->clink);
-    b->flags &= ~B_BUSY;
-    wakeup(b);
-    release(&bcache.lock);
+    releasesleep(&b->lock);
+    bput(b);
+}
+
+/* Undo bpin(). */
+void
+bunpin(struct buf *b)
+{
+    bput(b);
+}
+
+/*
+ * Release a buffer locked by another process, typically from
+ * b->end_io() which is called by the I/O worker.
+ */
+void
+brelse_io(struct buf *b)
+{
+    releasesleep(&b->lock);
+    bput(b);
+}
+
+/*
+ * Completion of breadahead(): called by the I/O worker.
+ * A failed block is left invalid for bread() to read again.
+ */
+static void
+breadahead_end(struct buf *b)
+{
+    b->end_io = 0;
+    brelse_io(b);
+}
+
+/*
+ * Start reading a block into the cache without waiting.  The buffer
+ * stays locked until the read completes, so that bread() of the
+ * block waits for it instead of reading it again.
+ */
+void
+breadahead(uint32_t dev, uint32_t blockno)
+{
+    struct bucket *hb = bhash(dev, blockno);
+    struct buf *b;
+
+    // Nothing to do if the block is cached or being read.
+    acquire(&hb->lock);
+    b = bfind(hb, dev, blockno);
+    release(&hb->lock);
+    if (b)
+        return;
+
+    b = bget(dev, blockno);
+    if (b->flags & B_VALID) {
+        brelse(b);
+        return;
+    }
+    b->end_io = breadahead_end;
+    submit_bio(b);
 }
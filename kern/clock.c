@@ -7,24 +7,14 @@
 #include "console.h"
 #include "rtc.h"
 #include "proc.h"
+#include "spinlock.h"
 
-/* Local timer */
-#define TIMER_ROUTE             (LOCAL_BASE + 0x24)
-#define TIMER_IRQ2CORE(i)       (i)
-
+/*
+ * Local timer: not used.  jiffies and the wall time are derived from
+ * the generic timer (ktime_get()), so that no cpu takes a periodic
+ * interrupt only to count ticks.
+ */
 #define TIMER_CTRL              (LOCAL_BASE + 0x34)
-#define TIMER_INTENA            (1 << 29)
-#define TIMER_ENABLE            (1 << 28)
-
-#if RASPI <= 3
-#define TIMER_RELOAD_SEC        (38400000 / HZ)      /* 2 * 19.2 MHz = 1 sec, /HZ = 10 ms*/
-#elif RASPI == 4
-#define TIMER_RELOAD_SEC        (108000000)     /* 2 * 54 MHz */
-#endif
-
-#define TIMER_CLR               (LOCAL_BASE + 0x38)
-#define TIMER_CLR_INT           (1 << 31)
-#define TIMER_RELOAD            (1 << 30)
 
 #define TICK_USEC (10000UL)
 #define TICK_NSEC (10000000UL)
@@ -36,69 +26,40 @@ uint64_t tick_nsec = TICK_NSEC;        /* ACTHZ period (nsec) */
 uint64_t jiffies = INITIAL_JIFFIES;
 /* The current time (wall_time) */
 struct timespec xtime  __attribute__ ((aligned (16)));
-/* jiffies at the most recent update of wall time */
-unsigned long wall_jiffies = INITIAL_JIFFIES;
+/* The wall time (ns) when ktime_get() was 0 */
+static uint64_t wall_base;
+static struct spinlock xtime_lock;
 
 void
 clock_init()
 {
-    put32(TIMER_CTRL, TIMER_INTENA | TIMER_ENABLE | TIMER_RELOAD_SEC);
-    put32(TIMER_ROUTE, TIMER_IRQ2CORE(0));
-    put32(TIMER_CLR, TIMER_RELOAD | TIMER_CLR_INT);
-#ifdef USE_GIC
-    irq_enable(IRQ_LOCAL_TIMER);
-    irq_register(IRQ_LOCAL_TIMER, clock_intr);
-#endif
-    if (rtc_gettime(&xtime) < 0) {
-        xtime.tv_nsec = 0L;
-        xtime.tv_sec = 1655644975L;      // 2022/06/21/01:31 UTC
-    }
-}
+    struct timespec ts;
 
-static void
-clock_reset()
-{
-    put32(TIMER_CLR, TIMER_CLR_INT);
-}
-
-// 現在痔の更新
-static void update_wall_time(uint64_t ticks)
-{
-    do {
-        ticks--;
-        xtime.tv_nsec += TICK_NSEC;         // 1 tick = 10ms = 10 * 10^6
-        if (xtime.tv_nsec >= 1000000000) {  // nsec部分が1秒を超えたら
-            xtime.tv_nsec -= 1000000000;    // nsecから1秒引いて
-            xtime.tv_sec++;                 // secに1秒足す
-        }
-    } while (ticks);
-}
-
-// 現在時の調整
-static inline void update_times(void)
-{
-    uint64_t ticks;
-
-    ticks = jiffies - wall_jiffies;
-    if (ticks) {
-        wall_jiffies += ticks;
-        update_wall_time(ticks);
+    initlock(&xtime_lock, "xtime");
+    put32(TIMER_CTRL, 0);
+    if (rtc_gettime(&ts) < 0) {
+        ts.tv_nsec = 0L;
+        ts.tv_sec = 1655644975L;      // 2022/06/21/01:31 UTC
     }
+    wall_base = ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec - ktime_get();
+    update_times();
 }
 
 /*
- * Real time clock (local timer) interrupt. It gets impluse from crystal clock,
- * thus independent of the variant cpu clock.
+ * Bring jiffies and xtime up to date.  Called when they are read and
+ * by the timer interrupt: there is no periodic tick to advance them.
  */
 void
-clock_intr()
+update_times(void)
 {
-    ++jiffies;
-    thisproc()->stime = jiffies * 1000000000 / HZ;
-    trace("c: %d", jiffies);
-    update_times();
-    run_timer_list();
-    clock_reset();
+    uint64_t now = ktime_get(), wall;
+
+    acquire(&xtime_lock);
+    jiffies = INITIAL_JIFFIES + now / TICK_NSEC;
+    wall = wall_base + now;
+    xtime.tv_sec = wall / NSEC_PER_SEC;
+    xtime.tv_nsec = wall % NSEC_PER_SEC;
+    release(&xtime_lock);
 }
 
 long
@@ -110,11 +71,17 @@ clock_gettime(clockid_t clk_id, struct timespec *tp)
         default:
             return -EINVAL;
         case CLOCK_REALTIME:
+            update_times();
             tp->tv_nsec = xtime.tv_nsec;
             tp->tv_sec = xtime.tv_sec;
             break;
+        case CLOCK_MONOTONIC:
+            ptime = ktime_get();
+            tp->tv_nsec = ptime % 1000000000;
+            tp->tv_sec  = ptime / 1000000000;
+            break;
         case CLOCK_PROCESS_CPUTIME_ID:
-            ptime = thisproc()->stime + thisproc()->utime;
+            ptime = thisproc()->utime;
             tp->tv_nsec = ptime % 1000000000;
             tp->tv_sec  = ptime / 1000000000;
             break;
@@ -130,8 +97,10 @@ long clock_settime(clockid_t clk_id, const struct timespec *tp)
             return -EINVAL;
         case CLOCK_REALTIME:
             if (capable(CAP_SYS_TIME)) {
-                xtime.tv_nsec = tp->tv_nsec;
-                xtime.tv_sec = tp->tv_sec;
+                acquire(&xtime_lock);
+                wall_base = tp->tv_sec * NSEC_PER_SEC + tp->tv_nsec - ktime_get();
+                release(&xtime_lock);
+                update_times();
             } else {
                 return -EPERM;
             }
@@ -142,5 +111,6 @@ long clock_settime(clockid_t clk_id, const struct timespec *tp)
 
 long get_uptime(void)
 {
+    update_times();
     return xtime.tv_sec;
 }
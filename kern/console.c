@@ -7,6 +7,7 @@
 #include "file.h"
 #include "vfs.h"
 #include "mm.h"
+#include "kmalloc.h"
 #include "linux/termios.h"
 
 #define CONSOLE 1
@@ -160,6 +161,7 @@ console_intr1(int (*getc)())
 
     if (prof) {
         mm_dump();
+        kmem_cache_dump();
         procdump();
     }
 }
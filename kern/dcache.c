@@ -0,0 +1,200 @@
+#include "dcache.h"
+#include "console.h"
+#include "list.h"
+#include "spinlock.h"
+#include "string.h"
+#include "types.h"
+#include "vfs.h"
+
+/*
+ * Directory entry cache.
+ *
+ * Results of dirlookup() are cached by (dev, directory inum, name),
+ * including names which were not found (negative entries), so that
+ * resolving a hot path name reads no directory blocks.  The hash
+ * buckets have their own locks as the page cache ones do.
+ *
+ * An entry records the version of its directory, dp->i_dversion, when
+ * it was cached.  A directory gets a new version when it is modified
+ * and when its in-memory inode is filled, and the entries with older
+ * versions are ignored: no entry has to be looked for on unlink or
+ * rename.  Mounts purge the whole cache.
+ *
+ * Entries are recycled in the clock order: hits only set the referenced
+ * flag, so that they take no global lock.  dcache.lock serializes
+ * recycling.  Lock order: dcache.lock -> bucket lock.
+ */
+
+struct dentry {
+    struct list_head hash;              /* Hash chain (bucket lock) */
+    int hashed;                         /* On a hash chain (bucket lock) */
+    int referenced;                     /* Hit since the clock hand passed */
+    uint32_t dev;
+    uint32_t dir;                       /* inum of the directory */
+    uint64_t version;                   /* i_dversion of the directory */
+    uint32_t inum;                      /* 0 for a negative entry */
+    uint16_t type;
+    char name[DIRSIZ];
+};
+
+struct dentry_bucket {
+    struct spinlock lock;
+    struct list_head chain;
+};
+
+static struct {
+    struct spinlock lock;
+    int hand;                           /* Clock hand */
+    uint64_t version;                   /* Last directory version */
+    struct dentry dentry[NDENTRY];
+    struct dentry_bucket hash[NDHASH];
+} dcache;
+
+void
+dcache_init()
+{
+    initlock(&dcache.lock, "dcache");
+    for (int i = 0; i < NDHASH; i++) {
+        initlock(&dcache.hash[i].lock, "dcache bucket");
+        list_init(&dcache.hash[i].chain);
+    }
+    cprintf("dcache_init ok\n");
+}
+
+static struct dentry_bucket *
+d_hash(uint32_t dev, uint32_t dir, char *name)
+{
+    uint32_t h = (dev << 24) ^ dir;
+
+    for (int i = 0; i < DIRSIZ && name[i]; i++)
+        h = h * 31 + (uint8_t)name[i];
+    h ^= h >> 16;
+    return &dcache.hash[h & (NDHASH - 1)];
+}
+
+/* hb->lock must be held. */
+static struct dentry *
+d_find(struct dentry_bucket *hb, uint32_t dev, uint32_t dir, char *name)
+{
+    struct dentry *d;
+
+    LIST_FOREACH_ENTRY(d, &hb->chain, hash) {
+        if (d->dev == dev && d->dir == dir && strncmp(d->name, name, DIRSIZ) == 0)
+            return d;
+    }
+    return 0;
+}
+
+/* Return a new directory version. */
+uint64_t
+dcache_newversion()
+{
+    return __atomic_add_fetch(&dcache.version, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Forget the cached entries of directory dp: called when an entry
+ * of dp is added, removed or changed.  dp must be locked.
+ */
+void
+d_invalidate(struct inode *dp)
+{
+    dp->i_dversion = dcache_newversion();
+}
+
+/*
+ * Look up name in directory dp, which must be locked.  Returns
+ * DC_POSITIVE setting *inum and *type, DC_NEGATIVE, or DC_MISS.
+ */
+int
+dcache_lookup(struct inode *dp, char *name, uint32_t *inum, uint16_t *type)
+{
+    struct dentry_bucket *hb = d_hash(dp->dev, dp->inum, name);
+    struct dentry *d;
+    int ret = DC_MISS;
+
+    acquire(&hb->lock);
+    if ((d = d_find(hb, dp->dev, dp->inum, name)) != 0) {
+        if (d->version != dp->i_dversion) {
+            // Stale: recycle it first.
+            list_drop(&d->hash);
+            d->hashed = 0;
+        } else {
+            d->referenced = 1;
+            *inum = d->inum;
+            *type = d->type;
+            ret = d->inum ? DC_POSITIVE : DC_NEGATIVE;
+        }
+    }
+    release(&hb->lock);
+    return ret;
+}
+
+/*
+ * Cache the result of looking up name in directory dp, which must
+ * be locked: inum 0 means that name does not exist.
+ */
+void
+dcache_enter(struct inode *dp, char *name, uint32_t inum, uint16_t type)
+{
+    struct dentry_bucket *hb = d_hash(dp->dev, dp->inum, name), *ob;
+    struct dentry *d;
+
+    acquire(&dcache.lock);
+    // Take an entry off the chains in the clock order.
+    for (;;) {
+        d = &dcache.dentry[dcache.hand];
+        dcache.hand = (dcache.hand + 1) % NDENTRY;
+        if (!d->hashed)
+            break;
+        ob = d_hash(d->dev, d->dir, d->name);
+        acquire(&ob->lock);
+        if (d->hashed && d->referenced) {
+            d->referenced = 0;
+            release(&ob->lock);
+            continue;
+        }
+        if (d->hashed) {
+            list_drop(&d->hash);
+            d->hashed = 0;
+        }
+        release(&ob->lock);
+        break;
+    }
+
+    acquire(&hb->lock);
+    if (d_find(hb, dp->dev, dp->inum, name) == 0) {
+        d->dev = dp->dev;
+        d->dir = dp->inum;
+        d->version = dp->i_dversion;
+        d->inum = inum;
+        d->type = type;
+        d->referenced = 0;
+        strncpy(d->name, name, DIRSIZ);
+        list_push_front(&hb->chain, &d->hash);
+        d->hashed = 1;
+    }
+    release(&hb->lock);
+    release(&dcache.lock);
+}
+
+/* Forget all entries: called when a file system is mounted or unmounted. */
+void
+dcache_purge()
+{
+    struct dentry *d;
+
+    acquire(&dcache.lock);
+    for (d = dcache.dentry; d < &dcache.dentry[NDENTRY]; d++) {
+        if (!d->hashed)
+            continue;
+        struct dentry_bucket *hb = d_hash(d->dev, d->dir, d->name);
+        acquire(&hb->lock);
+        if (d->hashed) {
+            list_drop(&d->hash);
+            d->hashed = 0;
+        }
+        release(&hb->lock);
+    }
+    release(&dcache.lock);
+}
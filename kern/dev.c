@@ -13,6 +13,7 @@
 #include "v6.h"
 
 static void dev_test();
+static void dev_worker(void *);
 
 static struct emmc card;
 static struct list_head devque;
@@ -22,6 +23,9 @@ static struct spinlock cardlock;
 static uint32_t first_bno = 0;
 static uint32_t nblocks = 1;
 
+// 最後に発行したランの次のセクタ（C-LOOKはここから続ける）
+static uint32_t next_sector;
+
 // SDカードのMaster Boot Record
 struct mbr mbr;
 // 使用中のデバイス数
@@ -46,10 +50,14 @@ dev_init()
     list_init(&devque);
     initlock(&cardlock, "dev");
 
+#ifdef USE_SDHOST
 #if RASPI == 3
     irq_enable(IRQ_SDIO);
     irq_register(IRQ_SDIO, dev_intr);
-#elif RASPI == 4
+#endif
+#else
+    irq_enable(IRQ_ARASANSDIO);
+    irq_register(IRQ_ARASANSDIO, dev_intr);
 #endif
 
     acquire(&cardlock);
@@ -57,6 +65,8 @@ dev_init()
     release(&cardlock);
     assert(ret == 0);
 
+    assert(kthread_create(dev_worker, 0, "kblockd"));
+
     struct buf b;
     b.blockno = (uint32_t)-1;
     b.flags = 0;
@@ -84,61 +94,236 @@ dev_intr()
     release(&cardlock);
 }
 
+/* Sector number of b on the card. */
+static uint32_t
+dev_sector(struct buf *b)
+{
+    if (b->blockno == (uint32_t)-1)
+        return 0;
+    first_bno = sb[b->dev].lba;
+    nblocks = sb[b->dev].nsecs;
+    assert(b->blockno < nblocks);
+    return b->blockno * 8 + first_bno;
+}
+
 /*
- * Start all request.
- * Caller must hold sdlock.
+ * Add b to the request queue keeping it sorted by sector
+ * (elevator, see dev_next()), so that adjacent requests can be merged.
+ * Caller must hold cardlock.
  */
-void
+static void
+dev_enqueue(struct buf *b)
+{
+    struct buf *p;
+    uint32_t sec = dev_sector(b);
+
+    LIST_FOREACH_ENTRY_REVERSE(p, &devque, dlink) {
+        if (dev_sector(p) <= sec)
+            break;
+    }
+    list_insert(&b->dlink, &p->dlink, p->dlink.next);
+}
+
+/*
+ * The request to dispatch next by C-LOOK: the first one at or after
+ * next_sector, or the lowest one when the sweep reaches the end, so
+ * that requests for high sectors are not starved by new low ones.
+ * Caller must hold cardlock.
+ */
+static struct buf *
+dev_next(void)
+{
+    struct buf *b;
+
+    LIST_FOREACH_ENTRY(b, &devque, dlink) {
+        if (dev_sector(b) >= next_sector)
+            return b;
+    }
+    return container_of(list_front(&devque), struct buf, dlink);
+}
+
+/*
+ * Start all request in one-way elevator (C-LOOK) order.
+ * Requests for consecutive sectors in the same direction are
+ * merged into one multiple block command.  Requests may be added
+ * while the card is transferring.
+ * Caller must hold cardlock.
+ */
+static void
 dev_start(void)
 {
-    uint32_t bno;
+    struct emmc_sg sg[DEV_MAXMERGE];
+    struct buf *run[DEV_MAXMERGE];
 
     while (!list_empty(&devque)) {
-        struct buf *b =
-            container_of(list_front(&devque), struct buf, dlink);
-        if (b->blockno == (uint32_t)-1) {
-            bno = 0;
-        } else {
-            first_bno = sb[b->dev].lba;
-            nblocks = sb[b->dev].nsecs;
-            assert(b->blockno < nblocks);
-            bno = b->blockno * 8 + first_bno;
-        }
-        emmc_seek(&card, bno * SD_BLOCK_SIZE);
-        if (b->flags & B_DIRTY) {
-            assert(emmc_write(&card, b->data, BSIZE) == BSIZE);
-        } else {
-            assert(emmc_read(&card, b->data, BSIZE) == BSIZE);
-        }
+        struct buf *b = dev_next();
+        struct list_head *next;
+        int write = b->flags & B_DIRTY;
+        uint32_t sec = dev_sector(b);
+        size_t r;
+        int n = 0;
 
-        b->flags |= B_VALID;
-        b->flags &= ~B_DIRTY;
+        // Collect the run of requests following b.
+        do {
+            run[n] = b;
+            sg[n].buf = b->data;
+            sg[n].len = BSIZE;
+            n++;
+            next = b->dlink.next;
+            list_drop(&b->dlink);
+            if (next == &devque)
+                break;
+            b = container_of(next, struct buf, dlink);
+        } while (n < DEV_MAXMERGE && (b->flags & B_DIRTY) == write
+              && dev_sector(b) == sec + n * (BSIZE / SD_BLOCK_SIZE));
+        next_sector = sec + n * (BSIZE / SD_BLOCK_SIZE);
 
-        list_pop_front(&devque);
+        emmc_seek(&card, (uint64_t)sec * SD_BLOCK_SIZE);
+        if (write)
+            r = emmc_writev(&card, sg, n);
+        else
+            r = emmc_readv(&card, sg, n);
 
+        // 失敗したランはB_ERRORを付けて完了させる（読み込みはB_VALIDにならない）
+        if (r != (size_t)n * BSIZE)
+            warn("%s error: sector %d, %d blocks", write ? "write" : "read", sec, n);
+        for (int i = 0; i < n; i++) {
+            if (r == (size_t)n * BSIZE)
+                run[i]->flags |= B_VALID;
+            else
+                run[i]->flags |= B_ERROR;
+            run[i]->flags &= ~B_DIRTY;
+        }
         disb();
-        wakeup(b);
+
+        // Complete them: the callbacks may submit new requests.
+        release(&cardlock);
+        for (int i = 0; i < n; i++) {
+            if (run[i]->end_io)
+                run[i]->end_io(run[i]);
+            else
+                wakeup(run[i]);
+        }
+        acquire(&cardlock);
     }
 }
 
+/* I/O worker of the card: serve devque until the system stops. */
+static void
+dev_worker(void *arg)
+{
+    acquire(&cardlock);
+    for (;;) {
+        while (list_empty(&devque))
+            sleep(&devque, &cardlock);
+        dev_start();
+    }
+}
+
+/*
+ * Queue a request to read b, or to write it if B_DIRTY is set, and
+ * return without waiting.  When it is done, the worker calls
+ * b->end_io(b) if set, or wakes up the processes sleeping on b.
+ * B_ERROR is set if the request failed.
+ * Requests are held back while the process is plugged.
+ */
 void
-devrw(struct buf *b)
+submit_bio(struct buf *b)
 {
+    struct blk_plug *plug = thisproc()->plug;
+
+    b->flags &= ~B_ERROR;
+
+    if (plug) {
+        list_push_back(&plug->list, &b->dlink);
+        return;
+    }
     acquire(&cardlock);
+    dev_enqueue(b);
+    wakeup(&devque);
+    release(&cardlock);
+}
 
-    /* Append to request queue. */
-    list_push_back(&devque, &b->dlink);
+/*
+ * Hold back the requests of this process until blk_finish_plug(),
+ * so that they are sorted and merged together.
+ */
+void
+blk_start_plug(struct blk_plug *plug)
+{
+    struct proc *p = thisproc();
 
-    /* Start disk if necessary. */
-    if (list_front(&devque) == &b->dlink) {
-        dev_start();
+    list_init(&plug->list);
+    if (p->plug == 0)
+        p->plug = plug;
+}
+
+/* Queue the requests held back by the plug of this process. */
+static void
+blk_flush_plug(struct proc *p)
+{
+    struct blk_plug *plug = p->plug;
+
+    if (plug == 0 || list_empty(&plug->list))
+        return;
+    acquire(&cardlock);
+    while (!list_empty(&plug->list)) {
+        struct buf *b = container_of(list_front(&plug->list), struct buf, dlink);
+        list_pop_front(&plug->list);
+        dev_enqueue(b);
     }
+    wakeup(&devque);
+    release(&cardlock);
+}
 
-    /* Wait for request to finish. */
-    while ((b->flags & (B_VALID | B_DIRTY)) != B_VALID)
-        dev_sleep(b);
+void
+blk_finish_plug(struct blk_plug *plug)
+{
+    struct proc *p = thisproc();
+
+    if (p->plug != plug)
+        return;
+    blk_flush_plug(p);
+    p->plug = 0;
+}
+
+/*
+ * Read or write n buffers and wait for them.  Their requests are
+ * queued together so that adjacent blocks are transferred with
+ * one command.  Returns 0 or -1 if any of them failed (B_ERROR).
+ */
+int
+devrwv(struct buf **bs, int n)
+{
+    struct blk_plug plug;
+    int error = 0;
+
+    blk_start_plug(&plug);
+    for (int i = 0; i < n; i++) {
+        bs[i]->end_io = 0;
+        submit_bio(bs[i]);
+    }
+    blk_finish_plug(&plug);
+    // Requests of an outer plug must be on the queue before sleeping.
+    blk_flush_plug(thisproc());
 
+    /* Wait for requests to finish. */
+    acquire(&cardlock);
+    for (int i = 0; i < n; i++) {
+        while (!(bs[i]->flags & B_ERROR)
+            && (bs[i]->flags & (B_VALID | B_DIRTY)) != B_VALID)
+            dev_sleep(bs[i]);
+        if (bs[i]->flags & B_ERROR)
+            error = -1;
+    }
     release(&cardlock);
+    return error;
+}
+
+int
+devrw(struct buf *b)
+{
+    return devrwv(&b, 1);
 }
 
 /* Test SD card read/write speed. */
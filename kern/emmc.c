@@ -40,6 +40,7 @@
 #include "emmc.h"
 #include "string.h"
 #include "console.h"
+#include "proc.h"
 
 /* External Mass Media Controller. */
 #define ARM_EMMC_BASE   (MMIO_BASE + 0x300000)
@@ -112,6 +113,7 @@
 #define EMMC_CAPABILITIES_0	(EMMC_BASE + 0x40)
 #define EMMC_CAPABILITIES_1	(EMMC_BASE + 0x44)
 #define EMMC_FORCE_IRPT		(EMMC_BASE + 0x50)
+#define EMMC_ADMA_ADDR		(EMMC_BASE + 0x58)
 #define EMMC_BOOT_TIMEOUT	(EMMC_BASE + 0x70)
 #define EMMC_DBG_SEL		(EMMC_BASE + 0x74)
 #define EMMC_EXRDFIFO_CFG	(EMMC_BASE + 0x80)
@@ -184,6 +186,24 @@
 #define SD_CARD_REMOVAL         (1 << 7)
 #define SD_CARD_INTERRUPT       (1 << 8)
 
+#define SD_CAP0_ADMA2           (1 << 19)
+#define SD_CONTROL0_DMA_MASK    (3 << 3)
+#define SD_CONTROL0_ADMA2       (2 << 3)        // 32-bit ADMA2
+
+// ADMA2 descriptor: attributes, length and 32-bit address
+#define ADMA2_VALID             (1 << 0)
+#define ADMA2_END               (1 << 1)
+#define ADMA2_TRAN              (2 << 4)
+#define ADMA2_MAXLEN            0x8000
+#define ADMA2_MAXDESC           64
+
+// Address of ARM memory seen from the DMA of the controller
+#if RASPI <= 3
+#define EMMC_BUS_ADDR(pa)       ((uint32_t)(pa) | 0xC0000000)
+#else
+#define EMMC_BUS_ADDR(pa)       ((uint32_t)(pa))
+#endif
+
 #endif
 
 #define SD_RESP_NONE        SD_CMD_RSPNS_TYPE_NONE
@@ -453,7 +473,8 @@ const uint32_t sd_acommands[] = {
 static int emmc_ensure_data_mode(struct emmc *self);
 static int emmc_do_data_command(struct emmc *self, int is_write,
                                 uint8_t * buf, size_t buf_size,
-                                uint32_t block_no);
+                                uint32_t block_no,
+                                struct emmc_sg *sg, int nsg);
 static size_t emmc_do_read(struct emmc *self, uint8_t * buf,
                            size_t buf_size, uint32_t block_no);
 static size_t emmc_do_write(struct emmc *self, uint8_t * buf,
@@ -461,6 +482,9 @@ static size_t emmc_do_write(struct emmc *self, uint8_t * buf,
 
 static int emmc_card_init(struct emmc *self);
 static int emmc_card_reset(struct emmc *self);
+#ifndef USE_SDHOST
+static int emmc_timeout_fn(struct hrtimer *t);
+#endif
 
 static int emmc_issue_command(struct emmc *self, uint32_t cmd,
                               uint32_t arg, int timeout);
@@ -481,6 +505,9 @@ emmc_intr(struct emmc *self)
 {
 #ifdef USE_SDHOST
     sdhost_intr(&self->host);
+#else
+    // emmc_wait_intr() checks the status: just stop signalling
+    put32(EMMC_IRPT_EN, 0);
 #endif
 }
 
@@ -497,6 +524,10 @@ emmc_init(struct emmc *self, void (*sleep_fn)(void *), void *sleep_arg)
 {
 #ifndef USE_SDHOST
 
+    // Sleep only after the card is initialized
+    self->sleep_fn = 0;
+    self->use_adma = 0;
+
 #if RASPI == 3
     // TODO: Initialize gpio on pi3
 #elif RASPI == 4
@@ -519,6 +550,16 @@ emmc_init(struct emmc *self, void (*sleep_fn)(void *), void *sleep_arg)
     if (emmc_card_init(self) != 0) {
         return -1;
     }
+
+#ifndef USE_SDHOST
+    self->sleep_fn = sleep_fn;
+    self->sleep_arg = sleep_arg;
+    hrtimer_init(&self->timer, emmc_timeout_fn);
+    if (get32(EMMC_CAPABILITIES_0) & SD_CAP0_ADMA2) {
+        self->use_adma = 1;
+        info("using ADMA2");
+    }
+#endif
     return 0;
 }
 
@@ -550,6 +591,61 @@ emmc_write(struct emmc *self, void *buf, size_t cnt)
     return cnt;
 }
 
+/*
+ * Transfer the segments of sg from/to the consecutive blocks
+ * at the current offset with one multiple block command.
+ */
+static size_t
+emmc_rwv(struct emmc *self, int is_write, struct emmc_sg *sg, int nsg)
+{
+    size_t cnt = 0;
+
+    if (self->ull_offset % SD_BLOCK_SIZE != 0) {
+        return -1;
+    }
+    uint32_t nblock = self->ull_offset / SD_BLOCK_SIZE;
+
+#ifdef USE_SDHOST
+    // sdhost takes a contiguous buffer: one command per segment.
+    for (int i = 0; i < nsg; i++) {
+        size_t r = is_write
+            ? emmc_do_write(self, sg[i].buf, sg[i].len, nblock)
+            : emmc_do_read(self, sg[i].buf, sg[i].len, nblock);
+        if (r != sg[i].len) {
+            return -1;
+        }
+        nblock += sg[i].len / SD_BLOCK_SIZE;
+        cnt += sg[i].len;
+    }
+#else
+    for (int i = 0; i < nsg; i++) {
+        cnt += sg[i].len;
+    }
+    if (emmc_ensure_data_mode(self) != 0) {
+        return -1;
+    }
+    trace("%s %d segments at block %u", is_write ? "writing" : "reading",
+          nsg, nblock);
+    if (emmc_do_data_command(self, is_write, sg[0].buf, cnt, nblock,
+                             sg, nsg) < 0) {
+        return -1;
+    }
+#endif
+    return cnt;
+}
+
+size_t
+emmc_readv(struct emmc *self, struct emmc_sg *sg, int nsg)
+{
+    return emmc_rwv(self, 0, sg, nsg);
+}
+
+size_t
+emmc_writev(struct emmc *self, struct emmc_sg *sg, int nsg)
+{
+    return emmc_rwv(self, 1, sg, nsg);
+}
+
 uint64_t
 emmc_seek(struct emmc *self, uint64_t off)
 {
@@ -593,6 +689,103 @@ emmc_timeout_wait(uint64_t reg, uint32_t mask, int value, uint64_t us)
     return -1;
 }
 
+/* The timeout of emmc_wait_intr(): wake it up to see the deadline. */
+static int
+emmc_timeout_fn(struct hrtimer *t)
+{
+    struct emmc *self = container_of(t, struct emmc, timer);
+
+    wakeup(self->sleep_arg);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Wait at most us microseconds until one of mask is set in the
+ * INTERRUPT register.  Returns 0 or -1 on timeout.  Once the driver
+ * can sleep, the interrupt is signalled to the ARM and the cpu is
+ * given to other processes while waiting; emmc_intr() turns the
+ * signal off again.  A timer on this cpu wakes the sleeper at the
+ * deadline; it cannot fire before sleep_fn() sleeps, since the caller
+ * holds the card lock with interrupts off.
+ */
+static int
+emmc_wait_intr(struct emmc *self, uint32_t mask, uint64_t us)
+{
+    uint64_t deadline;
+    int r = 0;
+
+    if (self->sleep_fn == 0) {
+        return emmc_timeout_wait(EMMC_INTERRUPT, mask, 1, us);
+    }
+    deadline = ktime_get() + us * 1000;
+    hrtimer_start(&self->timer, deadline);
+    while ((get32(EMMC_INTERRUPT) & mask) == 0) {
+        if (ktime_get() >= deadline) {
+            warn("timeout waiting for interrupt 0x%x", mask);
+            r = -1;
+            break;
+        }
+        // The error summary (bit 15) is signalled by the error bits.
+        put32(EMMC_IRPT_EN, (mask & 0x7fff) | (mask & 0x8000 ? 0xffff0000 : 0));
+        self->sleep_fn(self->sleep_arg);
+    }
+    put32(EMMC_IRPT_EN, 0);
+    hrtimer_cancel(&self->timer);
+    return r;
+}
+
+/* Clean and invalidate the data cache lines of [p, p + n). */
+static void
+emmc_dcache_flush(void *p, size_t n)
+{
+    uint64_t a = ROUNDDOWN((uint64_t) p, 64);
+
+    disb();
+    for (; a < (uint64_t) p + n; a += 64) {
+        asm volatile("dc civac, %[x]" : : [x]"r"(a));
+    }
+    disb();
+}
+
+static uint64_t adma_desc[ADMA2_MAXDESC] __attribute__((aligned(64)));
+
+/*
+ * Build the ADMA2 descriptor table for the segments of the current
+ * transfer and point the controller to it.  The segments must be
+ * cache line aligned, so that flushing them does not lose data of
+ * their neighbours.
+ */
+static int
+emmc_adma_setup(struct emmc *self)
+{
+    int n = 0;
+
+    for (int i = 0; i < self->nsg; i++) {
+        char *p = self->sg[i].buf;
+        size_t len = self->sg[i].len;
+
+        emmc_dcache_flush(p, len);
+        while (len > 0) {
+            size_t l = len < ADMA2_MAXLEN ? len : ADMA2_MAXLEN;
+            if (n == ADMA2_MAXDESC) {
+                return -1;
+            }
+            adma_desc[n++] = ADMA2_VALID | ADMA2_TRAN | ((uint64_t) l << 16)
+                | ((uint64_t) EMMC_BUS_ADDR(V2P(p)) << 32);
+            p += l;
+            len -= l;
+        }
+    }
+    adma_desc[n - 1] |= ADMA2_END;
+    emmc_dcache_flush(adma_desc, n * sizeof(adma_desc[0]));
+
+    uint32_t control0 = get32(EMMC_CONTROL0);
+    control0 = (control0 & ~SD_CONTROL0_DMA_MASK) | SD_CONTROL0_ADMA2;
+    put32(EMMC_CONTROL0, control0);
+    put32(EMMC_ADMA_ADDR, EMMC_BUS_ADDR(V2P(adma_desc)));
+    return 0;
+}
+
 /* Get the current base clock rate in Hz. */
 static uint32_t
 emmc_get_base_clock()
@@ -799,6 +992,16 @@ emmc_issue_command_int(struct emmc *self, uint32_t cmd_reg,
         self->block_size | (self->blocks_to_transfer << 16);
     put32(EMMC_BLKSIZECNT, blksizecnt);
 
+    // Block transfers (scatter-gather) go by ADMA2 if available
+    int dma = self->use_adma && (cmd_reg & SD_CMD_ISDATA) && self->nsg > 0;
+    if (dma) {
+        if (emmc_adma_setup(self) < 0) {
+            warn("too many segments for ADMA2: %d", self->nsg);
+            return;
+        }
+        cmd_reg |= SD_CMD_DMA;
+    }
+
     // Set argument 1 reg
     put32(EMMC_ARG1, argument);
 
@@ -841,7 +1044,7 @@ emmc_issue_command_int(struct emmc *self, uint32_t cmd_reg,
     }
 
     // If with data, wait for the appropriate interrupt
-    if (cmd_reg & SD_CMD_ISDATA) {
+    if ((cmd_reg & SD_CMD_ISDATA) && !dma) {
         uint32_t wr_irpt;
         int is_write = 0;
         if (cmd_reg & SD_CMD_DAT_DIR_CH) {
@@ -857,10 +1060,23 @@ emmc_issue_command_int(struct emmc *self, uint32_t cmd_reg,
 
         assert(((uint64_t) self->buf & 3) == 0);
         uint32_t *pData = (uint32_t *) self->buf;
+        // Scatter-gather: the segment being transferred and bytes left in it
+        int seg = 0;
+        size_t seglen = self->nsg > 0 ? self->sg[0].len : 0;
 
         for (int nBlock = 0; nBlock < self->blocks_to_transfer; nBlock++) {
-            emmc_timeout_wait(EMMC_INTERRUPT, wr_irpt | 0x8000, 1,
-                              timeout);
+            if (self->nsg > 0) {
+                if (seglen == 0) {
+                    seg++;
+                    assert(seg < self->nsg);
+                    pData = (uint32_t *) self->sg[seg].buf;
+                    seglen = self->sg[seg].len;
+                    assert(((uint64_t) pData & 3) == 0);
+                }
+                seglen -= self->block_size;
+            }
+
+            emmc_wait_intr(self, wr_irpt | 0x8000, timeout);
             irpts = get32(EMMC_INTERRUPT);
             put32(EMMC_INTERRUPT, 0xffff0000 | wr_irpt);
 
@@ -900,9 +1116,15 @@ emmc_issue_command_int(struct emmc *self, uint32_t cmd_reg,
         } else
 #endif
         {
-            emmc_timeout_wait(EMMC_INTERRUPT, 0x8002, 1, timeout);
+            emmc_wait_intr(self, 0x8002, timeout);
             irpts = get32(EMMC_INTERRUPT);
             put32(EMMC_INTERRUPT, 0xffff0002);
+            if (dma) {
+                // Drop the lines fetched while the controller was writing
+                for (int i = 0; i < self->nsg; i++) {
+                    emmc_dcache_flush(self->sg[i].buf, self->sg[i].len);
+                }
+            }
 
             // Handle the case where both data timeout and transfer complete
             //  are set - transfer complete overrides data timeout: HCSS 2.2.17
@@ -1218,7 +1440,8 @@ emmc_ensure_data_mode(struct emmc *self)
 
 static int
 emmc_do_data_command(struct emmc *self, int is_write, uint8_t * buf,
-                     size_t buf_size, uint32_t block_no)
+                     size_t buf_size, uint32_t block_no,
+                     struct emmc_sg *sg, int nsg)
 {
 
     // PLSS table 4.20 - SDSC cards use byte addresses rather than block addresses
@@ -1242,6 +1465,8 @@ emmc_do_data_command(struct emmc *self, int is_write, uint8_t * buf,
         return -1;
     }
     self->buf = buf;
+    self->sg = sg;
+    self->nsg = nsg;
 
     // Decide on the command to use
     int command;
@@ -1276,6 +1501,8 @@ emmc_do_data_command(struct emmc *self, int is_write, uint8_t * buf,
         }
     }
 
+    self->sg = 0;
+    self->nsg = 0;
     if (retry_count == max_retries) {
         self->card_rca = 0;
         return -1;
@@ -1295,7 +1522,7 @@ emmc_do_read(struct emmc *self, uint8_t * buf, size_t buf_size,
 
     trace("reading from block %u", block_no);
 
-    if (emmc_do_data_command(self, 0, buf, buf_size, block_no) < 0) {
+    if (emmc_do_data_command(self, 0, buf, buf_size, block_no, 0, 0) < 0) {
         return -1;
     }
 
@@ -1313,7 +1540,7 @@ emmc_do_write(struct emmc *self, uint8_t * buf, size_t buf_size,
     }
     trace("writing to block %u", block_no);
 
-    if (emmc_do_data_command(self, 1, buf, buf_size, block_no) < 0) {
+    if (emmc_do_data_command(self, 1, buf, buf_size, block_no, 0, 0) < 0) {
         return -1;
     }
 
@@ -1452,6 +1679,8 @@ emmc_card_reset(struct emmc *self)
     self->last_r3 = 0;
 
     self->buf = 0;
+    self->sg = 0;
+    self->nsg = 0;
     self->blocks_to_transfer = 0;
     self->block_size = 0;
 #ifndef USE_SDHOST
@@ -125,10 +125,10 @@ static void flush_old_exec(void)
     flush_signal_handlers(p);
     // (2) close_on_execのfileのclose
     for (int i = 0; i < NOFILE; i++) {
-        if (p->ofile[i] && bit_test(p->fdflag, i)) {
-            fileclose(p->ofile[i]);
-            p->ofile[i] = 0;
-            bit_remove(p->fdflag, i);
+        if (p->files->ofile[i] && bit_test(p->files->fdflag, i)) {
+            fileclose(p->files->ofile[i]);
+            p->files->ofile[i] = 0;
+            bit_remove(p->files->fdflag, i);
         }
     }
     // (3) capability 再設定
@@ -266,7 +266,7 @@ execve(const char *path, char *const argv[], char *const envp[])
     Elf64_Ehdr elf;                         // ELFヘッダ
     Elf64_Phdr *phdr;                       // プログラムヘッダ作業用
     Elf64_Phdr *phdata;                     // 全プログラムヘッダ読み込み用
-    struct file *f;
+    struct file *f = 0;
 
     if (thisproc()->pid == 11) {
         debug("argv[0]: %s, envp[0]: %s, envp[1]: %s", argv[0], envp[0], envp[1]);
@@ -277,16 +277,21 @@ execve(const char *path, char *const argv[], char *const envp[])
 
     // Save previous page table.
     struct proc *curproc = thisproc();
-    void *oldpgdir = curproc->pgdir, *pgdir = vm_init();
+    struct mm_struct *oldmm = curproc->mm, *mm = mm_alloc();
+    void *oldpgdir = oldmm->pgdir, *pgdir;
 
-    if (pgdir == 0) {
+    if (mm == 0) {
         warn("vm init failed");
         goto bad;
     }
+    pgdir = mm->pgdir;
 
     f = get_file(path);
-    if (IS_ERR(f))
-        return (long)f;
+    if (IS_ERR(f)) {
+        error = (long)f;
+        f = 0;
+        goto bad;
+    }
 
     debug("path='%s', proc: uid=%d, gid=%d, ip: inum=%d, mode=0x%x, uid=%d, gid=%d", s, curproc->uid, curproc->gid, f->ip->inum, f->ip->mode, f->ip->uid, f->ip->gid);
 
@@ -324,7 +329,7 @@ execve(const char *path, char *const argv[], char *const envp[])
     if ((error = copy_page(f->ip, 0, (char *)phdata, size, elf.e_phoff)) < 0)
         goto free_phdata;
 
-    curproc->pgdir = pgdir;     // Required since readi(sdrw) involves context switch(switch page table).
+    curproc->mm = mm;           // Required since readi(sdrw) involves context switch(switch page table).
 
     // Set-uid, Set-gidの処理
     if (f->ip->mode & S_ISUID && curproc->uid != 0)
@@ -338,6 +343,13 @@ execve(const char *path, char *const argv[], char *const envp[])
 
     flush_old_exec();
 
+    // ロードするセグメントを先読みしておく
+    phdr = phdata;
+    for (int i = 0; i < elf.e_phnum; i++, phdr++) {
+        if (phdr->p_type == PT_LOAD && phdr->p_filesz > 0)
+            inode_readahead(f->ip, phdr->p_offset, phdr->p_filesz);
+    }
+
     // Load program into memory.
     size_t sz = 0, base = 0, stksz = 0;
     int first = 1;
@@ -424,7 +436,7 @@ execve(const char *path, char *const argv[], char *const envp[])
         len = strlen(ELF_PLATFORM) + 1;
         sp -= len;
         platform = (uint64_t)sp;
-        if (copyout(pgdir, sp, ELF_PLATFORM, len) < 0) {
+        if (copyout(mm, sp, ELF_PLATFORM, len) < 0) {
             goto free_interp;
         }
     }
@@ -437,7 +449,7 @@ execve(const char *path, char *const argv[], char *const envp[])
             }
             trace("argv[%d] = '%s', len: %d", argc, argv[argc], len);
             sp -= len + 1;
-            if (copyout(pgdir, sp, argv[argc], len + 1) < 0)    // include '\0';
+            if (copyout(mm, sp, argv[argc], len + 1) < 0)    // include '\0';
                 goto free_interp;
         }
     }
@@ -450,7 +462,7 @@ execve(const char *path, char *const argv[], char *const envp[])
             }
             trace("envp[%d] = '%s', len: %d", envc, envp[envc], len);
             sp -= len + 1;
-            if (copyout(pgdir, sp, envp[envc], len + 1) < 0)    // include '\0';
+            if (copyout(mm, sp, envp[envc], len + 1) < 0)    // include '\0';
                 goto free_interp;
         }
     }
@@ -486,7 +498,7 @@ execve(const char *path, char *const argv[], char *const envp[])
     void *newsp =
         (void *)ROUNDDOWN((size_t)sp - auxv_size -
                           (envc + argc + 4) * 8, 16);
-    if (copyout(pgdir, newsp, 0, (size_t)sp - (size_t)newsp) < 0)
+    if (copyout(mm, newsp, 0, (size_t)sp - (size_t)newsp) < 0)
         goto free_interp;
 
     uvm_switch(pgdir);
@@ -552,11 +564,11 @@ execve(const char *path, char *const argv[], char *const envp[])
     assert((uint64_t) sp > USERTOP - stksz);
 
     // Commit to the user image.
-    curproc->pgdir = pgdir;
+    curproc->mm = mm;
 
-    curproc->base = base;
-    curproc->sz = sz;
-    curproc->stksz = stksz;
+    curproc->mm->base = base;
+    curproc->mm->sz = sz;
+    curproc->mm->stksz = stksz;
 
     // memset(curproc->tf, 0, sizeof(*curproc->tf));
 
@@ -578,12 +590,17 @@ execve(const char *path, char *const argv[], char *const envp[])
             last = cur + 1;
     safestrcpy(curproc->name, last, sizeof(curproc->name));
 
-    uvm_switch(curproc->pgdir);
-    vm_free(oldpgdir);
+    uvm_switch(curproc->mm->pgdir);
+    // 他のスレッドは終了させ、リーダーでなければその pid を引き継ぐ。
+    // 元のアドレス空間は共有しているプロセス（vforkの親など）が
+    // いなければ解放される
+    de_thread(curproc);
+    mm_put(oldmm);
+    vfork_release(curproc);
     if (thisproc()->pid ==11) debug("run [%d] %s", curproc->pid, curproc->name);
     if (has_interp && interp)
         kmfree((void *)interp);
-    //if (thisproc()->pid ==11) vm_stat(thisproc()->pgdir);
+    //if (thisproc()->pid ==11) vm_stat(thisproc()->mm->pgdir);
     return 0;
 
 free_interp:
@@ -593,11 +610,12 @@ free_phdata:
     if (phdata)
         kmfree((void *)phdata);
 bad:
-    if (pgdir)
-        vm_free(pgdir);
+    thisproc()->mm = oldmm;
+    uvm_switch(oldpgdir);
+    if (mm)
+        mm_put(mm);
     if (f)
         fileclose(f);
-    thisproc()->pgdir = oldpgdir;
     warn("bad");
     return error;
 }
@@ -12,6 +12,10 @@
 #include "vfsmount.h"
 #include "rtc.h"
 #include "string.h"
+#include "log.h"
+#include "jbd.h"
+#include "pagecache.h"
+#include "linux/errno.h"
 #include "linux/stat.h"
 #include "linux/find_bits.h"
 #include "linux/ilog2.h"
@@ -34,6 +38,14 @@ static struct buf *read_block_bitmap(struct superblock *sb,
 static void group_adjust_blocks(struct superblock *sb, int group_no,
                 struct ext2_group_desc *desc, struct buf *bh, int count);
 
+static int ext2_bwrite(struct buf *b);
+
+static void ext2_discard_reservation(struct inode *ip);
+
+static struct inode *ext2_iget(uint32_t dev, uint32_t inum, uint16_t type);
+
+static void ext2_map_cache_clear(struct ext2_inode_info *ei);
+
 typedef struct {
     uint32_t    *p;
     uint32_t    key;
@@ -66,12 +78,13 @@ struct vfs_operations ext2_ops ={
     .bzero      = &ext2_bzero,
     .bfree      = &ext2_bfree,
     .brelse     = &brelse,
-    .bwrite     = &bwrite,
+    .bwrite     = &ext2_bwrite,
     .bread      = &bread,
     .namecmp    = &ext2_namecmp,
     .direntlookup = &ext2_direntlookup,
     .getrootino = &ext2_getrootino,
-    .getdents   = &ext2_getdents
+    .getdents   = &ext2_getdents,
+    .iget       = &ext2_iget
 };
 
 struct inode_operations ext2_iops = {
@@ -79,12 +92,16 @@ struct inode_operations ext2_iops = {
     .iupdate        = &ext2_iupdate,
     .itrunc         = &ext2_itrunc,
     .cleanup        = &ext2_cleanup,
+    .release        = &ext2_discard_reservation,
     .bmap           = &ext2_bmap,
+    .bmap_noalloc   = &ext2_bmap_noalloc,
     .ilock          = &ext2_ilock,
     .iunlock        = &generic_iunlock,
     .stati          = &generic_stati,
     .readi          = &generic_readi,
     .writei         = &ext2_writei,
+    .writepages     = &ext2_writepages,
+    .prepare_write  = &ext2_prepare_write,
     .dirlink        = &ext2_dirlink,
     .unlink         = &ext2_unlink,
     .isdirempty     = &ext2_isdirempty,
@@ -150,6 +167,71 @@ ext2fs_init(void)
     return 0;
 }
 
+/*
+ * Write b through the journal if the file system has one: the update
+ * is committed with the others of the transaction.  Otherwise write
+ * it synchronously.  Returns 0 or -EIO.
+ */
+static int
+ext2_bwrite(struct buf *b)
+{
+    if (log_enabled(b->dev)) {
+        log_write(b);
+        return 0;
+    }
+    return bwrite(b);
+}
+
+/*
+ * Use the ext3 journal of the file system if it has one.  The blocks
+ * of the journal inode are mapped once and kept in sbi.
+ */
+static void
+ext2_load_journal(uint32_t dev)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(&sb[dev]);
+    struct ext2_superblock *es = sbi->s_es;
+    struct inode *jip;
+    uint32_t *map, n, i;
+
+    if (!(es->s_feature_compat & EXT3_FEATURE_COMPAT_HAS_JOURNAL) ||
+        es->s_journal_inum == 0 || dev >= NLOG)
+        return;
+
+    if (sbi->s_journal_map == 0) {
+        jip = ext2_iget(dev, es->s_journal_inum, T_FILE);
+        n = ((struct ext2_inode_info *)jip->i_private)->i_ei.i_size / sb[dev].blocksize;
+        if (n == 0 || (map = kmalloc(sizeof(uint32_t) * n)) == 0) {
+            iput(jip);
+            warn("dev %d: no journal", dev);
+            return;
+        }
+        for (i = 0; i < n; i++) {
+            if ((map[i] = ext2_bmap_noalloc(jip, i)) == 0)
+                break;
+        }
+        iput(jip);
+        if (i < n) {
+            kmfree(map);
+            warn("dev %d: journal has a hole", dev);
+            return;
+        }
+        sbi->s_journal_map = map;
+        sbi->s_journal_len = n;
+    }
+
+    if (initlog_jbd(dev, sbi->s_journal_map, sbi->s_journal_len) < 0)
+        return;
+
+    // Other systems must replay the journal before using the file system.
+    acquiresleep(&sbi->s_sbh->lock);
+    if (!(es->s_feature_incompat & EXT3_FEATURE_INCOMPAT_RECOVER)) {
+        es->s_feature_incompat |= EXT3_FEATURE_INCOMPAT_RECOVER;
+        bwrite(sbi->s_sbh);
+    }
+    releasesleep(&sbi->s_sbh->lock);
+}
+
 int
 ext2_mount(struct inode *devi, struct inode *ip)
 {
@@ -157,6 +239,7 @@ ext2_mount(struct inode *devi, struct inode *ip)
 
     // Read the superblock
     ext2_ops.readsb(devi->minor, &sb[devi->minor]);
+    ext2_load_journal(devi->minor);
 
     // Read the root device
     struct inode *devrtip = ext2_ops.getroot(devi->major, devi->minor);
@@ -315,6 +398,8 @@ ext2_readsb(uint32_t dev, struct superblock *sb)
 
     sbi = (struct ext2_sb_info *)kmalloc(sizeof(struct ext2_sb_info));
     if (sbi == NULL) panic("memory exhaust\n");
+    initlock(&sbi->s_rsv_lock, "ext2 rsv");
+    list_init(&sbi->s_rsv_list);
 
     // These sets are needed becuase of bread
     sb->major = SDMAJOR;
@@ -380,6 +465,20 @@ ext2_readsb(uint32_t dev, struct superblock *sb)
     sbi->s_addr_per_block_bits = ilog2(EXT2_ADDR_PER_BLOCK(sb));    // 10
     sbi->s_desc_per_block_bits = ilog2(EXT2_DESC_PER_BLOCK(sb));    //  7
 
+    // htreeのハッシュ: どちらのフラグもなければこのCPUのcharに合わせる
+    if (es->s_flags & EXT2_FLAGS_UNSIGNED_HASH)
+        sbi->s_hash_unsigned = 3;
+    else if (es->s_flags & EXT2_FLAGS_SIGNED_HASH)
+        sbi->s_hash_unsigned = 0;
+    else {
+#ifdef __CHAR_UNSIGNED__
+        es->s_flags |= EXT2_FLAGS_UNSIGNED_HASH;
+        sbi->s_hash_unsigned = 3;
+#else
+        es->s_flags |= EXT2_FLAGS_SIGNED_HASH;
+#endif
+    }
+
     if (sbi->s_blocks_per_group > sb->blocksize * 8) {
         panic("error: #blocks per group too big\n");
     }
@@ -404,8 +503,14 @@ ext2_readsb(uint32_t dev, struct superblock *sb)
         if (!sbi->s_group_desc[i]) {
             panic("error on read ext2 group descriptor\n");
         }
+        // Keep it cached but unlocked: the writers lock it.
+        bpin(sbi->s_group_desc[i]);
+        ext2_ops.brelse(sbi->s_group_desc[i]);
     }
     sbi->s_gdb_count = db_count;
+    sbi->s_sbh = bp;
+    bpin(bp);
+    ext2_ops.brelse(bp);
 /*
     info("sb: major=%d, minor=%d, blksize=%d, lba=0x%x, nescs: 0x%x, bits=%d, flags=%d", sb->major, sb->minor, sb->blocksize, sb->lba, sb->nsecs, sb->s_blocksize_bits, sb->flags);
     info("sbi: s_inodes_per_block=%lld", sbi->s_inodes_per_block);
@@ -516,9 +621,10 @@ got:
         panic("ext2_ialloc: invalid inode number allocated\n");
     }
 
+    acquiresleep(&bh2->lock);
     gdp->bg_free_inodes_count -= 1;
-
     ext2_ops.bwrite(bh2);
+    releasesleep(&bh2->lock);
 
     raw_inode = ext2_get_inode(&sb[dev], ino, &ibh);
 
@@ -563,42 +669,6 @@ ext2_bfree(uint32_t dev, uint32_t b)
     panic("ext2 bfree op not defined");
 }
 
-struct inode *
-ext2_dirlookup(struct inode *dp, char *name, size_t *poff)
-{
-    uint32_t off, inum, currblk;
-    struct ext2_dir_entry_2 *de;
-    struct buf *bh;
-    int namelen = strlen(name);
-
-    for (off = 0; off < dp->size; ) {
-        currblk = off / sb[dp->dev].blocksize;
-
-        bh = ext2_ops.bread(dp->dev, ext2_iops.bmap(dp, currblk));
-
-        de = (struct ext2_dir_entry_2 *)(bh->data + (off % sb[dp->dev].blocksize));
-
-        if (de->inode == 0 || de->name_len != namelen) {
-            off += de->rec_len;
-            ext2_ops.brelse(bh);
-            continue;
-        }
-
-        if (strncmp(name, de->name, de->name_len) == 0) {
-            // entry matches path element
-            if (poff)
-                *poff = off;
-            inum = de->inode;
-            ext2_ops.brelse(bh);
-            return ext2_iget(dp->dev, inum, de->file_type);
-        }
-        off += de->rec_len;
-        ext2_ops.brelse(bh);
-    }
-
-    return 0;
-}
-
 void
 ext2_iupdate(struct inode *ip)
 {
@@ -611,6 +681,7 @@ ext2_iupdate(struct inode *ip)
 
     raw_inode->i_mode = ei->i_ei.i_mode;
     raw_inode->i_blocks = ei->i_ei.i_blocks;
+    raw_inode->i_flags = ei->i_ei.i_flags;
     raw_inode->i_links_count = ip->nlink;
     memmove(raw_inode->i_block, ei->i_ei.i_block, sizeof(ei->i_ei.i_block));
     raw_inode->i_size = ip->size;
@@ -775,6 +846,41 @@ ext2_free_branches(struct inode *inode, uint32_t *p, uint32_t *q, int depth)
     }
 }
 
+/*
+ * Free the blocks of the extent tree node eh at level and its
+ * subtrees: the extents of the leaves and the index blocks.
+ */
+static void
+ext4_ext_free(struct inode *ip, struct ext4_extent_header *eh, int level)
+{
+    struct ext4_extent_idx *ix;
+    struct ext4_extent *ex;
+    struct buf *bh;
+    uint32_t leaf;
+
+    if (eh->eh_magic != EXT4_EXT_MAGIC || eh->eh_entries > eh->eh_max
+     || level > EXT4_MAX_EXTENT_DEPTH) {
+        warn("bad extent tree: inum=%d", ip->inum);
+        return;
+    }
+    if (eh->eh_depth == 0) {
+        ex = EXT_FIRST_EXTENT(eh);
+        for (int i = 0; i < eh->eh_entries; i++, ex++) {
+            if (ext4_ext_get_actual_len(ex))
+                ext2_free_blocks(ip, ext4_ext_pblock(ex), ext4_ext_get_actual_len(ex));
+        }
+        return;
+    }
+    ix = EXT_FIRST_INDEX(eh);
+    for (int i = 0; i < eh->eh_entries; i++, ix++) {
+        leaf = ext4_idx_pblock(ix);
+        bh = ext2_ops.bread(ip->dev, leaf);
+        ext4_ext_free(ip, (struct ext4_extent_header *)bh->data, level + 1);
+        ext2_ops.brelse(bh);
+        ext2_free_blocks(ip, leaf, 1);
+    }
+}
+
 static void
 ext2_release_inode(struct superblock *sb, int group, int dir)
 {
@@ -787,10 +893,12 @@ ext2_release_inode(struct superblock *sb, int group, int dir)
         return;
     }
 
+    acquiresleep(&bh->lock);
     desc->bg_free_inodes_count += 1;
     if (dir)
         desc->bg_used_dirs_count -= 1;
     ext2_ops.bwrite(bh);
+    releasesleep(&bh->lock);
 }
 
 /*
@@ -869,6 +977,17 @@ ext2_itrunc(struct inode *ip)
     if (n == 0)
         return;
 
+    ext2_discard_reservation(ip);
+    ext2_map_cache_clear(ei);
+
+    if (ei->i_ei.i_flags & EXT4_EXTENTS_FL) {
+        // Leaves an empty block-mapped inode
+        ext4_ext_free(ip, (struct ext4_extent_header *)i_data, 0);
+        memset(i_data, 0, sizeof(ei->i_ei.i_block));
+        ei->i_ei.i_flags &= ~EXT4_EXTENTS_FL;
+        goto out;
+    }
+
     // lock block here
 
     if (n == 1) {
@@ -900,6 +1019,7 @@ ext2_itrunc(struct inode *ip)
             ;
     }
 
+out:
     // unlock the inode here
     ext2_free_inode(ip);
 
@@ -909,6 +1029,7 @@ ext2_itrunc(struct inode *ip)
 void
 ext2_cleanup(struct inode *ip)
 {
+    ext2_discard_reservation(ip);
     memset(ip->i_private, 0, sizeof(struct ext2_inode_info));
     kmfree(ip->i_private);
 }
@@ -984,38 +1105,36 @@ ext2_block_to_path(struct inode *inode,
     return n;
 }
 
+/**
+ * ext2_splice_branch - splice the allocated branch onto inode.
+ * @inode: owner
+ * @where: location of missing link
+ * @num:   number of indirect blocks we are adding
+ * @blks:  number of direct blocks we are adding
+ *
+ * This function fills the missing link and writes the parent indirect
+ * block, if any.  The caller writes the inode for links in ->i_block.
+ */
 static void
-ext2_update_branch(struct inode *inode, uint32_t bn, Indirect *chain)
+ext2_splice_branch(struct inode *inode, Indirect *where, int num, int blks)
 {
-    int ptrs = EXT2_ADDR_PER_BLOCK(&sb[inode->dev]);
-    int ptrs_bits = EXT2_ADDR_PER_BLOCK_BITS(&sb[inode->dev]);
-    const long direct_blocks = EXT2_NDIR_BLOCKS,
-            indirect_blocks = ptrs,
-            double_blocks = (1 << (ptrs_bits * 2));
-    struct ext2_inode_info *ei;
-
-    ei = inode->i_private;
+    int i;
 
-    // Update inode block
-    if (bn < 0) {
-        panic("block_to_path invalid block num");
-    } else if (bn < direct_blocks) {
-        if (ei->i_ei.i_block[bn] == 0)
-            ei->i_ei.i_block[bn] = chain[0].key;
-    } else if ((bn -= direct_blocks) < indirect_blocks) {
-        if (ei->i_ei.i_block[EXT2_IND_BLOCK] == 0)
-            ei->i_ei.i_block[EXT2_IND_BLOCK] = chain[0].key;
-    } else if ((bn -= indirect_blocks) < double_blocks) {
-        if (ei->i_ei.i_block[EXT2_DIND_BLOCK] == 0)
-            ei->i_ei.i_block[EXT2_DIND_BLOCK] = chain[0].key;
-    } else if (((bn -= double_blocks) >> (ptrs_bits * 2)) < ptrs) {
-        if (ei->i_ei.i_block[EXT2_TIND_BLOCK] == 0)
-            ei->i_ei.i_block[EXT2_TIND_BLOCK] = chain[0].key;
-    } else {
-        panic("This block is out of bounds from this ext2 fs");
-    }
+    *where->p = where->key;
 
-    return;
+    /*
+     * Update the host indirect block or inode to point to the
+     * other direct blocks just allocated
+     */
+    if (num == 0 && blks > 1) {
+        uint32_t current_block = where->key + 1;
+        for (i = 1; i < blks; i++)
+            *(where->p + i) = current_block++;
+    }
+
+    /* had we spliced it onto indirect block? */
+    if (where->bh)
+        ext2_ops.bwrite(where->bh);
 }
 
 /**
@@ -1276,7 +1395,7 @@ find_next_usable_block(int start, struct buf *bh, int maxblocks)
  * @bitmap_bh:  bufferhead holds the block bitmap
  * @grp_goal:  given target block within the group
  * @count:  target number of blocks to allocate
- * @my_rsv:  reservation window
+ * @my_rsv:  reservation window, or NULL
  *
  * Attempt to allocate blocks within a give range. Set the range of allocation
  * first, then find the first free bit(s) from the bitmap (within the range),
@@ -1294,16 +1413,30 @@ find_next_usable_block(int start, struct buf *bh, int maxblocks)
 static int
 ext2_try_to_allocate(struct superblock *sb, int group,
     struct buf *bitmap_bh, ext2_grpblk_t grp_goal,
-    unsigned long *count)
+    unsigned long *count, struct ext2_reserve_window *my_rsv)
 {
+    ext2_fsblk_t group_first_block;
     ext2_grpblk_t start, end;
     unsigned long num = 0;
 
-    if (grp_goal > 0)
-        start = grp_goal;
-    else
-        start = 0;
-    end = EXT2_BLOCKS_PER_GROUP(sb);
+    /* we do allocation within the reservation window if we have a window */
+    if (my_rsv) {
+        group_first_block = ext2_group_first_block_no(sb, group);
+        start = my_rsv->rsv_start - group_first_block;
+        end = my_rsv->rsv_end - group_first_block + 1;
+        if (end > EXT2_BLOCKS_PER_GROUP(sb))
+            end = EXT2_BLOCKS_PER_GROUP(sb);
+        if (grp_goal >= start && grp_goal < end)
+            start = grp_goal;
+        else
+            grp_goal = -1;
+    } else {
+        if (grp_goal > 0)
+            start = grp_goal;
+        else
+            start = 0;
+        end = EXT2_BLOCKS_PER_GROUP(sb);
+    }
 
 repeat:
     if (grp_goal < 0) {
@@ -1346,6 +1479,211 @@ fail_access:
     return -1;
 }
 
+static inline int
+rsv_is_empty(struct ext2_reserve_window *rsv)
+{
+    return rsv->rsv_end == 0;
+}
+
+/* Take rsv off the list.  s_rsv_lock must be held. */
+static void
+rsv_window_remove(struct ext2_reserve_window *rsv)
+{
+    if (!rsv_is_empty(rsv)) {
+        list_drop(&rsv->link);
+        rsv->rsv_start = rsv->rsv_end = 0;
+        rsv->rsv_alloc_hit = 0;
+    }
+}
+
+/*
+ * Is the goal block (group relative) in the window,
+ * and the window in the group?
+ */
+static int
+goal_in_my_reservation(struct ext2_reserve_window *rsv, ext2_grpblk_t grp_goal,
+                       int group, struct superblock *sb)
+{
+    ext2_fsblk_t group_first_block, group_last_block;
+
+    group_first_block = ext2_group_first_block_no(sb, group);
+    group_last_block = group_first_block + EXT2_BLOCKS_PER_GROUP(sb) - 1;
+
+    if (rsv_is_empty(rsv) || rsv->rsv_start > group_last_block
+     || rsv->rsv_end < group_first_block)
+        return 0;
+    if (grp_goal >= 0 && (grp_goal + group_first_block < rsv->rsv_start
+     || grp_goal + group_first_block > rsv->rsv_end))
+        return 0;
+    return 1;
+}
+
+/**
+ * find_next_reservable_window()
+ * @sbi:  ext2 superblock info holding the window list
+ * @my_rsv:  the window to be placed, not on the list
+ * @goal:  the block (filesystem wide) to search from
+ * @last_block:  the last block of the group
+ *
+ * Find the first range of my_rsv->rsv_goal_size blocks from goal which
+ * no other window overlaps, and insert my_rsv there.  The range may
+ * be cut by the end of the group.  Returns -1 if there is none.
+ * s_rsv_lock must be held.
+ */
+static int
+find_next_reservable_window(struct ext2_sb_info *sbi,
+    struct ext2_reserve_window *my_rsv, ext2_fsblk_t goal,
+    ext2_fsblk_t last_block)
+{
+    struct ext2_reserve_window *rsv;
+    struct list_head *next = &sbi->s_rsv_list;
+    ext2_fsblk_t cur = goal;
+    unsigned long size = my_rsv->rsv_goal_size;
+
+    LIST_FOREACH_ENTRY(rsv, &sbi->s_rsv_list, link) {
+        if (rsv->rsv_end < cur)
+            continue;
+        if (cur + size - 1 < rsv->rsv_start) {
+            next = &rsv->link;
+            break;
+        }
+        cur = rsv->rsv_end + 1;
+    }
+    if (cur > last_block)
+        return -1;
+
+    my_rsv->rsv_start = cur;
+    my_rsv->rsv_end = MIN(cur + size - 1, last_block);
+    my_rsv->rsv_alloc_hit = 0;
+    list_push_back(next, &my_rsv->link);
+    return 0;
+}
+
+/**
+ * alloc_new_reservation()
+ * @my_rsv:  the window of the inode
+ * @grp_goal:  the goal block (group relative), or -1
+ * @sb:  superblock
+ * @group:  the group to reserve in
+ * @bitmap_bh:  the block bitmap of the group
+ *
+ * Move the window to the first free range from the goal in the group.
+ * The window grows twice as large when more than half of it was used,
+ * as sequential writers do.  Returns -1 if no window can be made in
+ * this group.
+ */
+static int
+alloc_new_reservation(struct ext2_reserve_window *my_rsv,
+    ext2_grpblk_t grp_goal, struct superblock *sb,
+    int group, struct buf *bitmap_bh)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(sb);
+    ext2_fsblk_t group_first_block, group_end_block, start_block;
+    ext2_grpblk_t first_free_block;
+
+    group_first_block = ext2_group_first_block_no(sb, group);
+    group_end_block = group_first_block + EXT2_BLOCKS_PER_GROUP(sb) - 1;
+
+    if (grp_goal < 0)
+        start_block = group_first_block;
+    else
+        start_block = grp_goal + group_first_block;
+
+    acquire(&sbi->s_rsv_lock);
+    if (!rsv_is_empty(my_rsv) &&
+        my_rsv->rsv_alloc_hit > (my_rsv->rsv_end - my_rsv->rsv_start + 1) / 2) {
+        my_rsv->rsv_goal_size *= 2;
+        if (my_rsv->rsv_goal_size > EXT2_MAX_RESERVE_BLOCKS)
+            my_rsv->rsv_goal_size = EXT2_MAX_RESERVE_BLOCKS;
+    }
+    for (;;) {
+        rsv_window_remove(my_rsv);
+        if (find_next_reservable_window(sbi, my_rsv, start_block,
+                                        group_end_block) < 0) {
+            release(&sbi->s_rsv_lock);
+            return -1;
+        }
+        /*
+         * The window must start with a free block.  Otherwise search
+         * again from the first free block after it: blocks allocated
+         * without windows are only found in the bitmap.
+         */
+        first_free_block = bitmap_search_next_usable_block(
+            my_rsv->rsv_start - group_first_block, bitmap_bh,
+            group_end_block - group_first_block + 1);
+        if (first_free_block < 0) {
+            rsv_window_remove(my_rsv);
+            release(&sbi->s_rsv_lock);
+            return -1;
+        }
+        start_block = first_free_block + group_first_block;
+        if (start_block == my_rsv->rsv_start)
+            break;
+    }
+    release(&sbi->s_rsv_lock);
+    return 0;
+}
+
+/*
+ * Allocate blocks in the group, in the reservation window of the
+ * inode if it has one: the window is moved when the goal is not in
+ * it or it is used up.  Falls back to the allocation without window
+ * when no window can be made in the group.
+ */
+static ext2_grpblk_t
+ext2_try_to_allocate_with_rsv(struct superblock *sb, int group,
+    struct buf *bitmap_bh, ext2_grpblk_t grp_goal,
+    struct ext2_reserve_window *my_rsv, unsigned long *count)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(sb);
+    unsigned long num = *count;
+    ext2_grpblk_t ret;
+
+    if (my_rsv == 0)
+        return ext2_try_to_allocate(sb, group, bitmap_bh, grp_goal, count, 0);
+
+    if (my_rsv->rsv_goal_size < *count)
+        my_rsv->rsv_goal_size = MIN(*count, EXT2_MAX_RESERVE_BLOCKS);
+
+    for (;;) {
+        if (!goal_in_my_reservation(my_rsv, grp_goal, group, sb)) {
+            if (alloc_new_reservation(my_rsv, grp_goal, sb, group, bitmap_bh) < 0)
+                return ext2_try_to_allocate(sb, group, bitmap_bh, grp_goal, count, 0);
+            if (!goal_in_my_reservation(my_rsv, grp_goal, group, sb))
+                grp_goal = -1;
+        }
+        ret = ext2_try_to_allocate(sb, group, bitmap_bh, grp_goal, &num, my_rsv);
+        if (ret >= 0) {
+            acquire(&sbi->s_rsv_lock);
+            my_rsv->rsv_alloc_hit += num;
+            release(&sbi->s_rsv_lock);
+            *count = num;
+            return ret;
+        }
+        /* The rest of the window was taken: search after it */
+        grp_goal = my_rsv->rsv_end + 1 - ext2_group_first_block_no(sb, group);
+        if (grp_goal >= EXT2_BLOCKS_PER_GROUP(sb))
+            return ext2_try_to_allocate(sb, group, bitmap_bh, -1, count, 0);
+        num = *count;
+    }
+}
+
+/*
+ * Discard the reservation window of ip: when its inode cache entry
+ * is released after the last close and the write back of its data,
+ * and when it is freed.
+ */
+static void
+ext2_discard_reservation(struct inode *ip)
+{
+    struct ext2_inode_info *ei = ip->i_private;
+    struct ext2_sb_info *sbi = EXT2_SB(&sb[ip->dev]);
+
+    acquire(&sbi->s_rsv_lock);
+    rsv_window_remove(&ei->i_rsv);
+    release(&sbi->s_rsv_lock);
+}
+
 static void
 group_adjust_blocks(struct superblock *sb, int group_no,
                     struct ext2_group_desc *desc, struct buf *bh,
@@ -1355,11 +1693,11 @@ group_adjust_blocks(struct superblock *sb, int group_no,
         /* struct ext2_sb_info *sbi = EXT2_SB(sb); */
         unsigned free_blocks;
 
-        /* spin_lock(sb_bgl_lock(sbi, group_no)); */
+        acquiresleep(&bh->lock);
         free_blocks = desc->bg_free_blocks_count;
         desc->bg_free_blocks_count = free_blocks + count;
-        /* spin_unlock(sb_bgl_lock(sbi, group_no)); */
         ext2_ops.bwrite(bh);
+        releasesleep(&bh->lock);
     }
 }
 
@@ -1395,6 +1733,8 @@ ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
     struct ext2_sb_info *sbi;
     unsigned long ngroups;
     unsigned long num = *count;
+    struct ext2_reserve_window *my_rsv = 0;
+    struct ext2_inode_info *ei = inode->i_private;
 
     *errp = -1;
     superb = &sb[inode->dev];
@@ -1402,6 +1742,16 @@ ext2_new_blocks(struct inode *inode, ext2_fsblk_t goal,
     sbi = EXT2_SB(superb);
     es = sbi->s_es;
 
+    /*
+    * Allocate the blocks of regular files in their reservation
+    * windows; directories are small and written rarely.
+    */
+    if (inode->type == T_FILE) {
+        my_rsv = &ei->i_rsv;
+        if (my_rsv->rsv_goal_size == 0)
+            my_rsv->rsv_goal_size = EXT2_DEFAULT_RESERVE_BLOCKS;
+    }
+
     /* if (!ext2_has_free_blocks(sbi)) { */
     /*   *errp = -ENOSPC; */
     /*   goto out; */
@@ -1429,8 +1779,8 @@ retry_alloc:
         bitmap_bh = read_block_bitmap(superb, group_no);
         if (!bitmap_bh)
             goto io_error;
-        grp_alloc_blk = ext2_try_to_allocate(superb, group_no,
-                                            bitmap_bh, grp_target_blk, &num);
+        grp_alloc_blk = ext2_try_to_allocate_with_rsv(superb, group_no,
+                                            bitmap_bh, grp_target_blk, my_rsv, &num);
         if (grp_alloc_blk >= 0)
             goto allocated;
     }
@@ -1464,12 +1814,13 @@ retry_alloc:
         /*
         * try to allocate block(s) from this group, without a goal(-1).
         */
-        grp_alloc_blk = ext2_try_to_allocate(superb, group_no,
-                                            bitmap_bh, -1, &num);
+        grp_alloc_blk = ext2_try_to_allocate_with_rsv(superb, group_no,
+                                            bitmap_bh, -1, my_rsv, &num);
         if (grp_alloc_blk >= 0)
             goto allocated;
     }
 
+    *errp = -ENOSPC;
     goto out;
 
 allocated:
@@ -1498,12 +1849,12 @@ allocated:
     /* if (num < *count) { */
     /*   dquot_free_block_nodirty(inode, *count-num); */
     /*   mark_inode_dirty(inode); */
-    /*   *count = num; */
     /* } */
+    *count = num;
     return ret_block;
 
 io_error:
-    *errp = -2;
+    *errp = -EIO;
 out:
     /*
     * Undo the block allocation
@@ -1512,7 +1863,8 @@ out:
     /*   dquot_free_block_nodirty(inode, *count); */
     /*   mark_inode_dirty(inode); */
     /* } */
-    ext2_ops.brelse(bitmap_bh);
+    if (bitmap_bh)
+        ext2_ops.brelse(bitmap_bh);
     return 0;
 }
 
@@ -1573,7 +1925,9 @@ ext2_alloc_blocks(struct inode *inode,
     *err = 0;
     return ret;
 failed_out:
-    panic("ext2 error on ext2_alloc_blocks");
+    /* Free the indirect blocks allocated so far */
+    for (int i = 0; i < index; i++)
+        ext2_free_blocks(inode, new_blocks[i], 1);
     return ret;
 }
 
@@ -1659,22 +2013,147 @@ failed:
     return err;
 }
 
-uint32_t
-ext2_bmap(struct inode *ip, uint32_t bn)
+/*
+ * Look up block bn of ip in its block-map cache.  Returns the number
+ * of blocks mapped contiguously from bn, setting the disk block of bn
+ * in *bno, or 0 if not cached.
+ */
+static uint32_t
+ext2_map_cache_lookup(struct ext2_inode_info *ei, uint32_t bn, uint32_t *bno)
+{
+    struct ext2_map_extent *m;
+
+    for (int i = 0; i < EXT2_NMAPCACHE; i++) {
+        m = &ei->i_map[i];
+        if (bn - m->lblk < m->len) {
+            *bno = m->pblk + (bn - m->lblk);
+            return m->len - (bn - m->lblk);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Remember that len blocks from lblk are mapped to the disk blocks
+ * from pblk.  A run continuing a cached one extends it, so that
+ * a file written sequentially stays in one entry.
+ */
+static void
+ext2_map_cache_insert(struct ext2_inode_info *ei, uint32_t lblk, uint32_t pblk,
+                      uint32_t len)
+{
+    struct ext2_map_extent *m;
+
+    if (len == 0)
+        return;
+    for (int i = 0; i < EXT2_NMAPCACHE; i++) {
+        m = &ei->i_map[i];
+        if (m->len && lblk - m->lblk <= m->len && pblk - m->pblk == lblk - m->lblk) {
+            m->len = MAX(m->len, lblk - m->lblk + len);
+            return;
+        }
+    }
+    m = &ei->i_map[ei->i_map_next++ % EXT2_NMAPCACHE];
+    m->lblk = lblk;
+    m->pblk = pblk;
+    m->len = len;
+}
+
+/* Forget the mappings: when the blocks are freed or i_block is reread. */
+static void
+ext2_map_cache_clear(struct ext2_inode_info *ei)
+{
+    memset(ei->i_map, 0, sizeof(ei->i_map));
+    ei->i_map_next = 0;
+}
+
+/*
+ * Map block bn of the extent-mapped inode ip through its extent tree,
+ * caching the extent found.  Returns the number of blocks mapped
+ * contiguously from bn, setting the disk block of bn in *bno, or 0 if
+ * bn is in a hole or an uninitialized extent, which read as zeros.
+ */
+static uint32_t
+ext4_ext_map(struct inode *ip, uint32_t bn, uint32_t *bno)
+{
+    struct ext2_inode_info *ei = ip->i_private;
+    struct ext4_extent_header *eh = (struct ext4_extent_header *)ei->i_ei.i_block;
+    struct ext4_extent_idx *ix;
+    struct ext4_extent *ex;
+    struct buf *bh = 0;
+    uint64_t leaf;
+    uint32_t len, n = 0;
+    int i;
+
+    for (int level = 0; ; level++) {
+        if (eh->eh_magic != EXT4_EXT_MAGIC || eh->eh_entries > eh->eh_max
+         || level > EXT4_MAX_EXTENT_DEPTH) {
+            warn("bad extent tree: inum=%d", ip->inum);
+            break;
+        }
+        if (eh->eh_entries == 0)
+            break;
+        if (eh->eh_depth == 0) {
+            ex = EXT_FIRST_EXTENT(eh);
+            for (i = 0; i < eh->eh_entries && ex->ee_block <= bn; i++, ex++) {
+                len = ext4_ext_get_actual_len(ex);
+                if (bn - ex->ee_block >= len)
+                    continue;
+                if (!ext4_ext_is_uninit(ex)) {
+                    ext2_map_cache_insert(ei, ex->ee_block, ext4_ext_pblock(ex), len);
+                    *bno = ext4_ext_pblock(ex) + (bn - ex->ee_block);
+                    n = len - (bn - ex->ee_block);
+                }
+                break;
+            }
+            break;
+        }
+        // The last index whose first block is at or before bn
+        ix = EXT_FIRST_INDEX(eh);
+        for (i = 1; i < eh->eh_entries && ix[1].ei_block <= bn; i++)
+            ix++;
+        if (ix->ei_block > bn)
+            break;
+        leaf = ext4_idx_pblock(ix);
+        if (bh)
+            ext2_ops.brelse(bh);
+        bh = ext2_ops.bread(ip->dev, leaf);
+        eh = (struct ext4_extent_header *)bh->data;
+    }
+    if (bh)
+        ext2_ops.brelse(bh);
+    return n;
+}
+
+/*
+ * Map up to maxblocks blocks of ip from block bn, allocating the
+ * unallocated ones if create is set.  Sets the disk block of bn in
+ * *bno and returns the number of blocks mapped, which are contiguous
+ * on the disk, or sets 0 and returns 0 if bn is not allocated, or
+ * an error if the allocation failed.  Blocks are not allocated in
+ * extent-mapped inodes.
+ */
+static int
+ext2_get_blocks(struct inode *ip, uint32_t bn, int maxblocks, uint32_t *bno,
+                int create)
 {
-    /* struct buf *bp; */
+    struct ext2_inode_info *ei = ip->i_private;
     int depth;
     Indirect chain[4];
     Indirect *partial;
     int offsets[4];
     int indirect_blks;
-    uint32_t blkn;
     int blocks_to_boundary;
     ext2_fsblk_t goal;
     int count;
-    unsigned long maxblocks;
     int err;
 
+    *bno = 0;
+    if ((count = ext2_map_cache_lookup(ei, bn, bno)) > 0)
+        return MIN(count, maxblocks);
+    if (ei->i_ei.i_flags & EXT4_EXTENTS_FL)
+        return MIN(ext4_ext_map(ip, bn, bno), (uint32_t)maxblocks);
+
     depth = ext2_block_to_path(ip, bn, offsets, &blocks_to_boundary);
 
     if (depth == 0)
@@ -1683,10 +2162,26 @@ ext2_bmap(struct inode *ip, uint32_t bn)
     partial = ext2_get_branch(ip, depth, offsets, chain);
 
     if (!partial) {
+        /*
+         * Count the following blocks which are mapped contiguously
+         * in this (indirect) block and cache them all.
+         */
+        count = 1;
+        while (count <= blocks_to_boundary
+          && *(chain[depth-1].p + count) == chain[depth-1].key + count)
+            count++;
+        ext2_map_cache_insert(ei, bn, chain[depth-1].key, count);
+        count = MIN(count, maxblocks);
         goto got_it;
     }
 
-    maxblocks = sb[ip->dev].blocksize >> EXT2_BLOCK_SIZE_BITS(&sb[ip->dev]);
+    if (!create) {
+        while (partial > chain) {
+            ext2_ops.brelse(partial->bh);
+            partial--;
+        }
+        return 0;
+    }
 
     // The requested block is not allocated yet
     goal = ext2_find_goal(ip, bn, partial);
@@ -1704,12 +2199,20 @@ ext2_bmap(struct inode *ip, uint32_t bn)
     err = ext2_alloc_branch(ip, indirect_blks, &count, goal,
         offsets + (partial - chain), partial);
 
-    if (err < 0)
-        panic("error on ext2_alloc_branch");
+    // No space: the writeback reports it
+    if (err < 0) {
+        while (partial > chain) {
+            ext2_ops.brelse(partial->bh);
+            partial--;
+        }
+        return err;
+    }
+
+    ext2_splice_branch(ip, partial, indirect_blks, count);
+    ext2_map_cache_insert(ei, bn, chain[depth-1].key, count);
 
 got_it:
-    blkn = chain[depth-1].key;
-    ext2_update_branch(ip, bn, chain);
+    *bno = chain[depth-1].key;
 
     /* Clean up and exit */
     partial = chain + depth - 1;  /* the whole chain */
@@ -1719,17 +2222,44 @@ got_it:
         partial--;
     }
 
-    return blkn;
+    return count;
 }
 
-void
-ext2_ilock(struct inode *ip)
+/*
+ * Return the disk block number of block bn of ip, allocating it if
+ * needed, or 0 if it is a hole which cannot be filled or there is
+ * no space.
+ */
+uint32_t
+ext2_bmap(struct inode *ip, uint32_t bn)
 {
-    struct buf *bp;
-    struct ext2_inode *raw_inode;
-    struct ext2_inode_info *ei;
+    uint32_t blkn;
 
-    ei = (struct ext2_inode_info *)ip->i_private;
+    ext2_get_blocks(ip, bn, 1, &blkn, 1);
+    return blkn;
+}
+
+/*
+ * Return the disk block number of block bn of ip,
+ * or 0 if it is not allocated.  Used by readahead.
+ */
+uint32_t
+ext2_bmap_noalloc(struct inode *ip, uint32_t bn)
+{
+    uint32_t blkn;
+
+    ext2_get_blocks(ip, bn, 1, &blkn, 0);
+    return blkn;
+}
+
+void
+ext2_ilock(struct inode *ip)
+{
+    struct buf *bp;
+    struct ext2_inode *raw_inode;
+    struct ext2_inode_info *ei;
+
+    ei = (struct ext2_inode_info *)ip->i_private;
 
     if (ip == 0 || ip->ref < 1)
         panic("ext2_ilock\n");
@@ -1750,6 +2280,7 @@ ext2_ilock(struct inode *ip)
         ip->nlink = raw_inode->i_links_count;
         ip->size = raw_inode->i_size;
         memmove(&ei->i_ei, raw_inode, sizeof(ei->i_ei));
+        ext2_map_cache_clear(ei);
         ip->atime.tv_sec = (time_t)raw_inode->i_atime;
         ip->ctime.tv_sec = (time_t)raw_inode->i_ctime;
         ip->mtime.tv_sec = (time_t)raw_inode->i_mtime;
@@ -1769,6 +2300,7 @@ ssize_t
 ext2_writei(struct inode *ip, char *src, size_t off, size_t n)
 {
     size_t tot, m;
+    uint32_t bno;
     struct buf *bp;
 
     if (ip->type == T_DEV) {
@@ -1783,21 +2315,104 @@ ext2_writei(struct inode *ip, char *src, size_t off, size_t n)
     // TODO: Verify the max file size
 
     for (tot = 0; tot < n; tot += m, off += m, src += m) {
-        bp = ext2_ops.bread(ip->dev, ext2_iops.bmap(ip, off / sb[ip->dev].blocksize));
+        // A hole of an extent-mapped inode cannot be filled
+        if ((bno = ext2_iops.bmap(ip, off / sb[ip->dev].blocksize)) == 0)
+            break;
+        bp = ext2_ops.bread(ip->dev, bno);
         m = min(n - tot, sb[ip->dev].blocksize - off % sb[ip->dev].blocksize);
         memmove(bp->data + off % sb[ip->dev].blocksize, src, m);
         ext2_ops.bwrite(bp);
         ext2_ops.brelse(bp);
     }
 
-    if(n > 0 && off > ip->size){
+    if(tot > 0 && off > ip->size){
         ip->size = off;
         ext2_iops.iupdate(ip);
     }
 
+    return (tot == 0 && n > 0) ? -1 : tot;
+}
+
+/*
+ * Write back n dirty cached pages of ip from off: called by the
+ * flusher and fsync() in a transaction.  Blocks not allocated yet
+ * (delayed allocation) are allocated here as contiguously as
+ * possible, and each contiguous run is written with one command.
+ * At most WB_MAXPAGES blocks fit in the transaction, so with blocks
+ * smaller than a page only the first pages are written.  Returns
+ * the number of pages written or an error.
+ */
+int
+ext2_writepages(struct inode *ip, off_t off, char **pages, int n)
+{
+    struct buf *bs[WB_MAXPAGES];
+    uint32_t blksize = sb[ip->dev].blocksize;
+    uint32_t ppb = PGSIZE / blksize;
+    uint32_t bn = off / blksize, bno;
+    off_t end;
+    int nblocks, count, error = 0;
+
+    n = MIN(n, MAX(1, WB_MAXPAGES / (int)ppb));
+    end = MIN(off + (off_t)n * PGSIZE, (off_t)ip->size);
+    if (end <= off)
+        return n;
+    nblocks = (end - off + blksize - 1) / blksize;
+
+    for (int i = 0; i < nblocks; i += count) {
+        count = ext2_get_blocks(ip, bn + i, MIN(nblocks - i, WB_MAXPAGES), &bno, 1);
+        if (count < 0)
+            return count;
+        if (count == 0)
+            return -EROFS;      // A hole of an extent-mapped inode
+        for (int j = 0; j < count; j++) {
+            int k = i + j;
+            bs[j] = bget(ip->dev, bno + j);
+            memmove(bs[j]->data, pages[k / ppb] + (k % ppb) * blksize, blksize);
+            bs[j]->flags |= B_VALID;
+        }
+        if (log_enabled(ip->dev)) {
+            for (int j = 0; j < count; j++)
+                ext2_ops.bwrite(bs[j]);
+        } else {
+            error = bwritev(bs, count);
+        }
+        for (int j = 0; j < count; j++)
+            ext2_ops.brelse(bs[j]);
+        if (error < 0)
+            return error;
+    }
+
+    /* New blocks and the size */
+    ext2_iops.iupdate(ip);
     return n;
 }
 
+/*
+ * Check a write of n bytes at off of ip before the pages are dirtied:
+ * writeback cannot fill a hole of an extent-mapped inode, so every
+ * block of the pages the write touches must already be allocated.
+ * Returns 0 or -EROFS.
+ */
+int
+ext2_prepare_write(struct inode *ip, off_t off, size_t n)
+{
+    struct ext2_inode_info *ei = ip->i_private;
+    uint32_t blksize = sb[ip->dev].blocksize;
+    off_t start, end;
+
+    if (!(ei->i_ei.i_flags & EXT4_EXTENTS_FL) || n == 0)
+        return 0;
+
+    // ページ単位で書き戻されるのでページ全体（ファイル内）を調べる
+    start = ROUNDDOWN(off, PGSIZE);
+    end = MIN(ROUNDUP(off + (off_t)n, PGSIZE), MAX(off + (off_t)n, (off_t)ip->size));
+    for (uint32_t bn = start / blksize; (off_t)bn * blksize < end; bn++) {
+        if (ext2_bmap_noalloc(ip, bn) == 0)
+            return -EROFS;
+    }
+    return 0;
+}
+
 /*
  * Return the offset into page `page_nr' of the last valid
  * byte in that page, plus one.
@@ -1813,92 +2428,805 @@ ext2_last_byte(struct inode *inode, unsigned long page_nr)
 }
 
 
-int
-ext2_dirlink(struct inode *dp, char *name, uint32_t inum, uint16_t type)
+/*
+ * Indexed directories (htree)
+ *
+ * A directory with EXT2_INDEX_FL is a B-tree of name hashes whose
+ * leaves are ordinary directory blocks (see inc/ext2.h), so that a
+ * lookup or an insert reads a few blocks instead of the whole
+ * directory.  It follows fs/ext3/namei.c of Linux: the tree has at
+ * most two levels, a single block directory is indexed when it gets
+ * full, and a broken index makes the directory linear again.
+ * Removing an entry of a leaf is done by ext2_unlink() as before.
+ */
+
+#define ERR_BAD_DX_DIR  (-75000)
+
+struct dx_frame {
+    struct buf *bh;
+    struct dx_entry *entries;
+    struct dx_entry *at;
+};
+
+struct dx_map_entry {
+    uint32_t hash;
+    uint16_t offs;
+    uint16_t size;
+};
+
+static inline uint32_t
+dx_get_block(struct dx_entry *entry)
 {
-    int namelen = strlen(name);
+    return entry->block & 0x00ffffff;
+}
+
+static inline void
+dx_set_block(struct dx_entry *entry, uint32_t value)
+{
+    entry->block = value;
+}
+
+static inline uint32_t
+dx_get_hash(struct dx_entry *entry)
+{
+    return entry->hash;
+}
+
+static inline void
+dx_set_hash(struct dx_entry *entry, uint32_t value)
+{
+    entry->hash = value;
+}
+
+static inline unsigned
+dx_get_count(struct dx_entry *entries)
+{
+    return ((struct dx_countlimit *)entries)->count;
+}
+
+static inline unsigned
+dx_get_limit(struct dx_entry *entries)
+{
+    return ((struct dx_countlimit *)entries)->limit;
+}
+
+static inline void
+dx_set_count(struct dx_entry *entries, unsigned value)
+{
+    ((struct dx_countlimit *)entries)->count = value;
+}
+
+static inline void
+dx_set_limit(struct dx_entry *entries, unsigned value)
+{
+    ((struct dx_countlimit *)entries)->limit = value;
+}
+
+static inline unsigned
+dx_root_limit(struct inode *dp, unsigned infosize)
+{
+    unsigned entry_space = sb[dp->dev].blocksize - EXT2_DIR_REC_LEN(1) -
+                           EXT2_DIR_REC_LEN(2) - infosize;
+    return entry_space / sizeof(struct dx_entry);
+}
+
+static inline unsigned
+dx_node_limit(struct inode *dp)
+{
+    unsigned entry_space = sb[dp->dev].blocksize - EXT2_DIR_REC_LEN(0);
+    return entry_space / sizeof(struct dx_entry);
+}
+
+static inline struct ext2_dir_entry_2 *
+ext2_next_entry(struct ext2_dir_entry_2 *de)
+{
+    return (struct ext2_dir_entry_2 *)((char *)de + de->rec_len);
+}
+
+static int
+ext2_is_dx(struct inode *dp)
+{
+    struct ext2_inode_info *ei = dp->i_private;
+
+    return EXT2_HAS_COMPAT_FEATURE(&sb[dp->dev], EXT2_FEATURE_COMPAT_DIR_INDEX)
+        && (ei->i_ei.i_flags & EXT2_INDEX_FL);
+}
+
+/* Read block block of dp, or return 0 if it has no disk block. */
+static struct buf *
+dir_bread(struct inode *dp, uint32_t block)
+{
+    uint32_t bno;
+
+    if ((bno = ext2_iops.bmap(dp, block)) == 0)
+        return 0;
+    return ext2_ops.bread(dp->dev, bno);
+}
+
+/*
+ * Add a block to the end of dp and set *bhp to it holding an empty
+ * entry.  Returns 0, -EROFS if dp is extent-mapped (a new block
+ * cannot be mapped) or -ENOSPC.
+ */
+static int
+dir_append(struct inode *dp, uint32_t *block, struct buf **bhp)
+{
+    uint32_t blocksize = sb[dp->dev].blocksize;
+    struct ext2_inode_info *ei = dp->i_private;
+    struct ext2_dir_entry_2 *de;
     struct buf *bh;
-    unsigned chunk_size = sb[dp->dev].blocksize;
-    unsigned reclen = EXT2_DIR_REC_LEN(namelen);
-    unsigned short rec_len, name_len;
-    char *dir_end;
+
+    if (ei->i_ei.i_flags & EXT4_EXTENTS_FL)
+        return -EROFS;
+    *block = dp->size / blocksize;
+    if ((bh = dir_bread(dp, *block)) == 0)
+        return -ENOSPC;
+    memset(bh->data, 0, blocksize);
+    de = (struct ext2_dir_entry_2 *)bh->data;
+    de->rec_len = blocksize;
+    dp->size += blocksize;
+    ext2_iops.iupdate(dp);
+    *bhp = bh;
+    return 0;
+}
+
+/* Look for name in the first size bytes of directory block bh. */
+static struct ext2_dir_entry_2 *
+search_dirblock(struct buf *bh, uint32_t size, const char *name, int namelen)
+{
+    struct ext2_dir_entry_2 *de = (struct ext2_dir_entry_2 *)bh->data;
+    char *top = (char *)bh->data + size;
+
+    while ((char *)de + EXT2_DIR_REC_LEN(0) <= top) {
+        if (de->rec_len < EXT2_DIR_REC_LEN(0))
+            break;      // broken block
+        if (de->inode && de->name_len == namelen
+         && strncmp(name, de->name, namelen) == 0)
+            return de;
+        de = ext2_next_entry(de);
+    }
+    return 0;
+}
+
+/*
+ * Add an entry to directory block bh, writing and releasing bh.
+ * Returns -ENOSPC, keeping bh, if the block has no room.
+ */
+static int
+add_dirent_to_buf(struct inode *dp, struct buf *bh, const char *name, int namelen,
+                  uint32_t inum, uint8_t file_type)
+{
+    uint32_t blocksize = sb[dp->dev].blocksize;
+    unsigned reclen = EXT2_DIR_REC_LEN(namelen), nlen;
+    char *top = (char *)bh->data + blocksize - reclen;
+    struct ext2_dir_entry_2 *de = (struct ext2_dir_entry_2 *)bh->data, *de1;
+
+    while ((char *)de <= top) {
+        if (de->rec_len == 0)
+            return -EIO;
+        nlen = de->inode ? EXT2_DIR_REC_LEN(de->name_len) : 0;
+        if (de->rec_len >= nlen + reclen)
+            break;
+        de = ext2_next_entry(de);
+    }
+    if ((char *)de > top)
+        return -ENOSPC;
+
+    if (de->inode) {
+        nlen = EXT2_DIR_REC_LEN(de->name_len);
+        de1 = (struct ext2_dir_entry_2 *)((char *)de + nlen);
+        de1->rec_len = de->rec_len - nlen;
+        de->rec_len = nlen;
+        de = de1;
+    }
+    de->inode = inum;
+    de->name_len = namelen;
+    de->file_type = file_type;
+    memmove(de->name, name, namelen);
+
+    ext2_ops.bwrite(bh);
+    ext2_ops.brelse(bh);
+    return 0;
+}
+
+static void
+dx_hash_init(struct inode *dp, int hash_version, struct dx_hash_info *hinfo)
+{
+    struct ext2_sb_info *sbi = EXT2_SB(&sb[dp->dev]);
+
+    hinfo->hash_version = hash_version;
+    if (hash_version <= DX_HASH_TEA)
+        hinfo->hash_version += sbi->s_hash_unsigned;
+    hinfo->seed = sbi->s_es->s_hash_seed;
+}
+
+/*
+ * Read block block of dp named by the index, or return 0 if it is
+ * beyond the end of dp, i.e. the index is broken.
+ */
+static struct buf *
+dx_bread(struct inode *dp, uint32_t block)
+{
+    if (block >= dp->size / sb[dp->dev].blocksize) {
+        warn("dx block out of range: inum=%d, block=%d", dp->inum, block);
+        return 0;
+    }
+    return dir_bread(dp, block);
+}
+
+static void
+dx_release(struct dx_frame *frames, struct dx_frame *frame)
+{
+    for (; frame >= frames; frame--)
+        ext2_ops.brelse(frame->bh);
+}
+
+/*
+ * Walk down the index of dp to the leaf which may hold name, filling
+ * frames with the index blocks on the way and hinfo with the hash of
+ * name.  Returns the frame of the lowest level, or 0 if the index is
+ * broken.
+ */
+static struct dx_frame *
+dx_probe(struct inode *dp, const char *name, int namelen,
+         struct dx_hash_info *hinfo, struct dx_frame *frames)
+{
+    unsigned count, indirect;
+    struct dx_entry *at, *entries, *p, *q, *m;
+    struct dx_root *root;
+    struct dx_frame *frame = frames;
+    struct buf *bh;
+
+    if ((bh = dir_bread(dp, 0)) == 0)
+        return 0;
+    root = (struct dx_root *)bh->data;
+    if (root->info.hash_version != DX_HASH_TEA
+     && root->info.hash_version != DX_HASH_HALF_MD4
+     && root->info.hash_version != DX_HASH_LEGACY) {
+        warn("unrecognised inode hash code %d", root->info.hash_version);
+        goto fail;
+    }
+    if (root->info.unused_flags & 1) {
+        warn("unimplemented inode hash flags: %#06x", root->info.unused_flags);
+        goto fail;
+    }
+    if ((indirect = root->info.indirect_levels) >= EXT2_HTREE_LEVEL) {
+        warn("unimplemented inode hash depth: %#06x", root->info.indirect_levels);
+        goto fail;
+    }
+
+    dx_hash_init(dp, root->info.hash_version, hinfo);
+    ext2_dirhash(name, namelen, hinfo);
+
+    entries = (struct dx_entry *)((char *)&root->info + root->info.info_length);
+    if (dx_get_limit(entries) != dx_root_limit(dp, root->info.info_length)) {
+        warn("dx entry: limit != root limit");
+        goto fail;
+    }
+
+    for (;;) {
+        count = dx_get_count(entries);
+        if (count == 0 || count > dx_get_limit(entries)) {
+            warn("dx entry: no count or count > limit");
+            goto fail;
+        }
+
+        p = entries + 1;
+        q = entries + count - 1;
+        while (p <= q) {
+            m = p + (q - p) / 2;
+            if (dx_get_hash(m) > hinfo->hash)
+                q = m - 1;
+            else
+                p = m + 1;
+        }
+        at = p - 1;
+
+        frame->bh = bh;
+        frame->entries = entries;
+        frame->at = at;
+        if (indirect-- == 0)
+            return frame;
+
+        frame++;
+        if ((bh = dx_bread(dp, dx_get_block(at))) == 0)
+            goto fail;
+        entries = ((struct dx_node *)bh->data)->entries;
+        if (dx_get_limit(entries) != dx_node_limit(dp)) {
+            warn("dx entry: limit != node limit");
+            goto fail;
+        }
+    }
+
+fail:
+    if (bh)
+        ext2_ops.brelse(bh);
+    while (frame > frames) {
+        frame--;
+        ext2_ops.brelse(frame->bh);
+    }
+    return 0;
+}
+
+/*
+ * Advance frame to the next leaf if it may still hold names of hash,
+ * i.e. the hash continues into it.  Returns 1 if advanced, 0 if not,
+ * or ERR_BAD_DX_DIR.
+ */
+static int
+dx_next_block(struct inode *dp, uint32_t hash, struct dx_frame *frame,
+              struct dx_frame *frames)
+{
+    struct dx_frame *p = frame;
+    struct buf *bh;
+    int num_frames = 0;
+
+    for (;;) {
+        if (++(p->at) < p->entries + dx_get_count(p->entries))
+            break;
+        if (p == frames)
+            return 0;
+        num_frames++;
+        p--;
+    }
+
+    // 衝突ビットのない次のブロックに同じハッシュはない
+    if ((dx_get_hash(p->at) & ~1) != hash)
+        return 0;
+
+    while (num_frames--) {
+        if ((bh = dx_bread(dp, dx_get_block(p->at))) == 0)
+            return ERR_BAD_DX_DIR;
+        p++;
+        ext2_ops.brelse(p->bh);
+        p->bh = bh;
+        p->at = p->entries = ((struct dx_node *)bh->data)->entries;
+    }
+    return 1;
+}
+
+/*
+ * Look up name through the index of dp.  Returns 1 setting the leaf
+ * block and the entry, 0 if not found, or ERR_BAD_DX_DIR.
+ */
+static int
+dx_find_entry(struct inode *dp, const char *name, int namelen, struct buf **bhp,
+              struct ext2_dir_entry_2 **dep, uint32_t *blockp)
+{
+    struct dx_frame frames[EXT2_HTREE_LEVEL], *frame;
+    struct dx_hash_info hinfo;
     struct ext2_dir_entry_2 *de;
-    int n;
-    int numblocks = (dp->size + chunk_size - 1) / chunk_size;
-    char *kaddr;
-    trace("dp=%d, name=%s, inum=%d, type=%d", dp->inum, name, inum, type);
+    struct buf *bh;
+    uint32_t block;
+    int r;
+
+    if ((frame = dx_probe(dp, name, namelen, &hinfo, frames)) == 0)
+        return ERR_BAD_DX_DIR;
+    do {
+        block = dx_get_block(frame->at);
+        if ((bh = dx_bread(dp, block)) == 0) {
+            r = ERR_BAD_DX_DIR;
+            break;
+        }
+        if ((de = search_dirblock(bh, sb[dp->dev].blocksize, name, namelen)) != 0) {
+            *bhp = bh;
+            *dep = de;
+            *blockp = block;
+            r = 1;
+            break;
+        }
+        ext2_ops.brelse(bh);
+    } while ((r = dx_next_block(dp, hinfo.hash, frame, frames)) == 1);
 
-    // すでに同名のファイルが存在する場合はエラー
-    if (ext2_iops.dirlookup(dp, name, 0) != 0) {
-        return -1;
+    dx_release(frames, frame);
+    return r;
+}
+
+/* Copy the entries of map to dst, packed, filling the block. */
+static void
+dx_fill_block(char *dst, char *src, struct dx_map_entry *map, int count,
+              uint32_t blocksize)
+{
+    struct ext2_dir_entry_2 *de = (struct ext2_dir_entry_2 *)dst;
+    char *p = dst;
+
+    memset(dst, 0, blocksize);
+    if (count == 0) {
+        de->rec_len = blocksize;
+        return;
     }
-    for (n = 0; n <= numblocks; n++) {
-        bh = ext2_ops.bread(dp->dev, ext2_iops.bmap(dp, n));
-        debug("[%d] bread bh blockno=0x%x", n, bh->blockno);
-        kaddr = (char *) bh->data;
-        de = (struct ext2_dir_entry_2 *) kaddr;
-        dir_end = kaddr + ext2_last_byte(dp, n);
-        kaddr += chunk_size - reclen;
+    for (int i = 0; i < count; i++) {
+        de = (struct ext2_dir_entry_2 *)p;
+        memmove(p, src + map[i].offs, map[i].size);
+        de->rec_len = map[i].size;
+        p += map[i].size;
+    }
+    de->rec_len += dst + blocksize - p;
+}
 
-        while ((char *)de <= kaddr) {
-            if ((char *)de == dir_end) {
-                /* We hit i_size */
-                name_len = 0;
-                rec_len = chunk_size;
-                de->rec_len = chunk_size;
-                de->inode = 0;
-                goto got_it;
-            }
+/* Insert (hash, block) after frame->at. */
+static void
+dx_insert_block(struct dx_frame *frame, uint32_t hash, uint32_t block)
+{
+    struct dx_entry *entries = frame->entries;
+    struct dx_entry *old = frame->at, *new = old + 1;
+    int count = dx_get_count(entries);
+
+    memmove(new + 1, new, (char *)(entries + count) - (char *)new);
+    dx_set_hash(new, hash);
+    dx_set_block(new, block);
+    dx_set_count(entries, count + 1);
+}
 
-            if (de->rec_len == 0) {
-                return -1;
+/*
+ * Split the full leaf *bhp of frame->at into two by hash, moving
+ * about half of the entries to a new block.  Sets *bhp to the half
+ * where the name of hinfo goes; the other half is written.
+ */
+static int
+do_split(struct inode *dp, struct buf **bhp, struct dx_frame *frame,
+         struct dx_hash_info *hinfo)
+{
+    uint32_t blocksize = sb[dp->dev].blocksize;
+    struct buf *bh = *bhp, *bh2;
+    struct ext2_dir_entry_2 *de;
+    struct dx_map_entry *map, tmp;
+    struct dx_hash_info h;
+    uint32_t newblock, hash2;
+    int count = 0, split, move, size, continued, i, j, r;
+    char *data;
+
+    map = kmalloc(blocksize / EXT2_DIR_REC_LEN(1) * sizeof(struct dx_map_entry));
+    data = kmalloc(blocksize);
+    if (map == NULL || data == NULL) {
+        if (map) kmfree(map);
+        if (data) kmfree(data);
+        return -ENOMEM;
+    }
+
+    // 生きているエントリのハッシュの表を作り、ハッシュ順に並べる
+    memmove(data, bh->data, blocksize);
+    h = *hinfo;
+    for (de = (struct ext2_dir_entry_2 *)data;
+         (char *)de < data + blocksize && de->rec_len; de = ext2_next_entry(de)) {
+        if (de->inode == 0)
+            continue;
+        ext2_dirhash(de->name, de->name_len, &h);
+        map[count].hash = h.hash;
+        map[count].offs = (char *)de - data;
+        map[count].size = EXT2_DIR_REC_LEN(de->name_len);
+        count++;
+    }
+    for (i = 1; i < count; i++) {
+        tmp = map[i];
+        for (j = i; j > 0 && map[j - 1].hash > tmp.hash; j--)
+            map[j] = map[j - 1];
+        map[j] = tmp;
+    }
+
+    // 大きさで半分に分ける
+    size = move = 0;
+    for (i = count - 1; i >= 0; i--) {
+        // is more than half of this entry in 2nd half of the block?
+        if (size + map[i].size / 2 > blocksize / 2)
+            break;
+        size += map[i].size;
+        move++;
+    }
+    split = count - move;
+    if (split == 0)
+        split = 1;
+    if (split == count) {
+        // 1エントリ以下: 分けられない
+        kmfree(map);
+        kmfree(data);
+        return -ENOSPC;
+    }
+    hash2 = map[split].hash;
+    continued = (hash2 == map[split - 1].hash);
+
+    if ((r = dir_append(dp, &newblock, &bh2)) < 0) {
+        kmfree(map);
+        kmfree(data);
+        return r;
+    }
+    dx_fill_block((char *)bh->data, data, map, split, blocksize);
+    dx_fill_block((char *)bh2->data, data, map + split, count - split, blocksize);
+    kmfree(map);
+    kmfree(data);
+
+    // どちらのブロックに新しいエントリを入れるか
+    if (hinfo->hash >= hash2) {
+        *bhp = bh2;
+        bh2 = bh;
+    }
+    dx_insert_block(frame, hash2 + continued, newblock);
+    ext2_ops.bwrite(bh2);
+    ext2_ops.brelse(bh2);
+    ext2_ops.bwrite(frame->bh);
+    return 0;
+}
+
+/*
+ * Add an entry through the index of dp, splitting the leaf and the
+ * index blocks as needed.  Returns 0, an error or ERR_BAD_DX_DIR.
+ */
+static int
+dx_add_entry(struct inode *dp, const char *name, int namelen, uint32_t inum,
+             uint8_t file_type)
+{
+    struct dx_frame frames[EXT2_HTREE_LEVEL], *frame;
+    struct dx_entry *entries, *at, *entries2;
+    struct dx_hash_info hinfo;
+    struct dx_node *node2;
+    struct buf *bh, *bh2, *tmp;
+    uint32_t newblock, hash2;
+    unsigned icount, icount1;
+    int levels, r;
+
+    if ((frame = dx_probe(dp, name, namelen, &hinfo, frames)) == 0)
+        return ERR_BAD_DX_DIR;
+    entries = frame->entries;
+    at = frame->at;
+
+    if ((bh = dx_bread(dp, dx_get_block(at))) == 0) {
+        r = ERR_BAD_DX_DIR;
+        goto out;
+    }
+    if ((r = add_dirent_to_buf(dp, bh, name, namelen, inum, file_type)) != -ENOSPC) {
+        if (r < 0)
+            ext2_ops.brelse(bh);
+        goto out;
+    }
+
+    // Block full, should compress but for now just split
+    if (dx_get_count(entries) == dx_get_limit(entries)) {
+        // 索引ブロックも一杯なので分割する
+        icount = dx_get_count(entries);
+        levels = frame - frames;
+        if (levels && dx_get_count(frames->entries) == dx_get_limit(frames->entries)) {
+            warn("directory index full: inum=%d", dp->inum);
+            ext2_ops.brelse(bh);
+            r = -ENOSPC;
+            goto out;
+        }
+        if ((r = dir_append(dp, &newblock, &bh2)) < 0) {
+            ext2_ops.brelse(bh);
+            goto out;
+        }
+        node2 = (struct dx_node *)bh2->data;
+        entries2 = node2->entries;
+        memset(&node2->fake, 0, sizeof(struct fake_dirent));
+        node2->fake.rec_len = sb[dp->dev].blocksize;
+        if (levels) {
+            icount1 = icount / 2;
+            hash2 = dx_get_hash(entries + icount1);
+            memmove(entries2, entries + icount1, (icount - icount1) * sizeof(struct dx_entry));
+            dx_set_count(entries, icount1);
+            dx_set_count(entries2, icount - icount1);
+            dx_set_limit(entries2, dx_node_limit(dp));
+
+            // Which index block gets the new entry?
+            if (at - entries >= icount1) {
+                frame->at = at = at - entries - icount1 + entries2;
+                frame->entries = entries = entries2;
+                tmp = frame->bh;
+                frame->bh = bh2;
+                bh2 = tmp;
             }
+            dx_insert_block(frames, hash2, newblock);
+            ext2_ops.bwrite(bh2);
+            ext2_ops.brelse(bh2);
+        } else {
+            // 根の索引を新しいノードに移して1段深くする
+            memmove(entries2, entries, icount * sizeof(struct dx_entry));
+            dx_set_limit(entries2, dx_node_limit(dp));
+
+            dx_set_count(entries, 1);
+            dx_set_block(entries, newblock);
+            ((struct dx_root *)frames[0].bh->data)->info.indirect_levels = 1;
+
+            frame = frames + 1;
+            frame->at = at = at - entries + entries2;
+            frame->entries = entries = entries2;
+            frame->bh = bh2;
+        }
+        // 新しいノードを先に書いてから親を書く。索引の分割はそれだけで
+        // 完結しているので、この後 do_split が失敗しても壊れない
+        ext2_ops.bwrite(frame->bh);
+        ext2_ops.bwrite(frames[0].bh);
+    }
+
+    if ((r = do_split(dp, &bh, frame, &hinfo)) == 0)
+        r = add_dirent_to_buf(dp, bh, name, namelen, inum, file_type);
+    if (r < 0)
+        ext2_ops.brelse(bh);
+
+out:
+    dx_release(frames, frame);
+    return r;
+}
+
+/*
+ * Index the single block directory dp, whose block 0 bh is full, and
+ * add the entry.  Block 0 becomes the root, and its entries but "."
+ * and ".." move to a new leaf, which is split for the new entry.
+ * Returns ERR_BAD_DX_DIR, keeping bh, if block 0 does not start with
+ * "." and "..".
+ */
+static int
+make_indexed_dir(struct inode *dp, struct buf *bh, const char *name, int namelen,
+                 uint32_t inum, uint8_t file_type)
+{
+    uint32_t blocksize = sb[dp->dev].blocksize;
+    struct ext2_inode_info *ei = dp->i_private;
+    struct dx_root *root = (struct dx_root *)bh->data;
+    struct ext2_dir_entry_2 *de, *de2;
+    struct dx_frame frames[EXT2_HTREE_LEVEL], *frame;
+    struct dx_hash_info hinfo;
+    struct dx_entry *entries;
+    struct buf *bh2;
+    uint32_t block, len;
+    char *data1, *top;
+    int r, version;
+
+    if (root->dot.name_len != 1 || root->dot_name[0] != '.'
+     || root->dot.rec_len != EXT2_DIR_REC_LEN(1)
+     || root->dotdot.name_len != 2 || root->dotdot_name[0] != '.'
+     || root->dotdot_name[1] != '.' || root->dotdot.rec_len < EXT2_DIR_REC_LEN(2)) {
+        warn("invalid dot entries: inum=%d", dp->inum);
+        return ERR_BAD_DX_DIR;
+    }
+
+    // ".." より後ろのエントリを新しいブロックに移す
+    de = (struct ext2_dir_entry_2 *)((char *)&root->dotdot + root->dotdot.rec_len);
+    len = (char *)root + blocksize - (char *)de;
+    if ((r = dir_append(dp, &block, &bh2)) < 0) {
+        ext2_ops.brelse(bh);
+        return r;
+    }
+    data1 = (char *)bh2->data;
+    memmove(data1, de, len);
+    de = (struct ext2_dir_entry_2 *)data1;
+    top = data1 + len;
+    while ((char *)(de2 = ext2_next_entry(de)) < top && de2->rec_len)
+        de = de2;
+    de->rec_len = data1 + blocksize - (char *)de;
+
+    // Initialize the root; the dot dirents already exist
+    root->dotdot.rec_len = blocksize - EXT2_DIR_REC_LEN(1);
+    memset(&root->info, 0, sizeof(root->info));
+    root->info.info_length = sizeof(root->info);
+    version = EXT2_SB(&sb[dp->dev])->s_es->s_def_hash_version;
+    root->info.hash_version = version <= DX_HASH_TEA ? version : DX_HASH_HALF_MD4;
+    entries = root->entries;
+    dx_set_block(entries, block);
+    dx_set_count(entries, 1);
+    dx_set_limit(entries, dx_root_limit(dp, sizeof(root->info)));
+
+    ei->i_ei.i_flags |= EXT2_INDEX_FL;
+    ext2_iops.iupdate(dp);
+
+    // Initialize as for dx_probe
+    dx_hash_init(dp, root->info.hash_version, &hinfo);
+    ext2_dirhash(name, namelen, &hinfo);
+    frame = frames;
+    frame->entries = entries;
+    frame->at = entries;
+    frame->bh = bh;
+
+    if ((r = do_split(dp, &bh2, frame, &hinfo)) == 0)
+        r = add_dirent_to_buf(dp, bh2, name, namelen, inum, file_type);
+    if (r < 0) {
+        // 移したエントリは失えない
+        ext2_ops.bwrite(bh2);
+        ext2_ops.brelse(bh2);
+    }
+    ext2_ops.bwrite(bh);
+    ext2_ops.brelse(bh);
+    return r;
+}
 
-            name_len = EXT2_DIR_REC_LEN(de->name_len);
-            rec_len = de->rec_len;
-            if (!de->inode && rec_len >= reclen)
-                goto got_it;
-            if (rec_len >= name_len + reclen)
-                goto got_it;
-            de = (struct ext2_dir_entry_2 *) ((char *) de + rec_len);
+struct inode *
+ext2_dirlookup(struct inode *dp, char *name, size_t *poff)
+{
+    uint32_t blocksize = sb[dp->dev].blocksize, block, inum;
+    struct ext2_dir_entry_2 *de = 0;
+    struct buf *bh;
+    int namelen = strlen(name);
+    uint8_t file_type;
+
+    // "." と ".." は索引にない
+    if (ext2_is_dx(dp) && !(name[0] == '.'
+     && (namelen == 1 || (namelen == 2 && name[1] == '.')))) {
+        switch (dx_find_entry(dp, name, namelen, &bh, &de, &block)) {
+        case 1:
+            goto found;
+        case 0:
+            return 0;
         }
-        debug("brease");
+        warn("falling back to linear search: inum=%d", dp->inum);
+    }
+
+    for (block = 0; block * blocksize < dp->size; block++) {
+        if ((bh = dir_bread(dp, block)) == 0)
+            continue;
+        if ((de = search_dirblock(bh, ext2_last_byte(dp, block), name, namelen)) != 0)
+            goto found;
         ext2_ops.brelse(bh);
     }
+    return 0;
 
-    return -1;
+found:
+    // entry matches path element
+    if (poff)
+        *poff = block * blocksize + ((char *)de - (char *)bh->data);
+    inum = de->inode;
+    file_type = de->file_type;
+    ext2_ops.brelse(bh);
+    return ext2_iget(dp->dev, inum, file_type);
+}
 
-got_it:
-    if (de->inode) {
-        struct ext2_dir_entry_2 *de1 = (struct ext2_dir_entry_2 *) ((char *) de + name_len);
-        de1->rec_len = rec_len - name_len;
-        de->rec_len = name_len;
-        de = de1;
+int
+ext2_dirlink(struct inode *dp, char *name, uint32_t inum, uint16_t type)
+{
+    uint32_t blocksize = sb[dp->dev].blocksize, block, nblocks;
+    struct ext2_inode_info *ei = dp->i_private;
+    int namelen = strlen(name), dx_fallback = 0, r;
+    struct inode *ip;
+    uint8_t file_type;
+    struct buf *bh;
+    trace("dp=%d, name=%s, inum=%d, type=%d", dp->inum, name, inum, type);
+
+    // すでに同名のファイルが存在する場合はエラー
+    if ((ip = ext2_iops.dirlookup(dp, name, 0)) != 0) {
+        iput(ip);
+        return -EEXIST;
     }
-    de->name_len = namelen;
-    strncpy(de->name, name, namelen);
-    de->inode = inum;
 
     // Translate the xv6 to inode type type
     if (type == T_DIR) {
-        de->file_type = EXT2_FT_DIR;
+        file_type = EXT2_FT_DIR;
     } else if (type == T_FILE) {
-        de->file_type = EXT2_FT_REG_FILE;
+        file_type = EXT2_FT_REG_FILE;
     } else {
         // We did not treat char and block devices with difference.
         panic("ext2: invalid type %d\n", type);
     }
 
-    debug("bwrite bh: blockno=0x%x", bh->blockno);
-    ext2_ops.bwrite(bh);
-    ext2_ops.brelse(bh);
-
-    if ((n + 1) * chunk_size > dp->size) {
-        dp->size += rec_len;
+    if (ext2_is_dx(dp)) {
+        if ((r = dx_add_entry(dp, name, namelen, inum, file_type)) != ERR_BAD_DX_DIR)
+            return r;
+        // 索引が壊れているので線形のディレクトリに戻す
+        ei->i_ei.i_flags &= ~EXT2_INDEX_FL;
+        dx_fallback = 1;
         ext2_iops.iupdate(dp);
     }
 
-    return 0;
+    nblocks = dp->size / blocksize;
+    for (block = 0; block < nblocks; block++) {
+        if ((bh = dir_bread(dp, block)) == 0)
+            continue;
+        if ((r = add_dirent_to_buf(dp, bh, name, namelen, inum, file_type)) != -ENOSPC) {
+            if (r < 0)
+                ext2_ops.brelse(bh);
+            return r;
+        }
+        // 1ブロックのディレクトリが一杯になったら索引を付ける
+        if (nblocks == 1 && !dx_fallback
+         && EXT2_HAS_COMPAT_FEATURE(&sb[dp->dev], EXT2_FEATURE_COMPAT_DIR_INDEX)) {
+            if ((r = make_indexed_dir(dp, bh, name, namelen, inum, file_type)) != ERR_BAD_DX_DIR)
+                return r;
+        }
+        ext2_ops.brelse(bh);
+    }
+
+    // 空きがなければブロックを足す（エクステントのディレクトリでは -EROFS）
+    if ((r = dir_append(dp, &block, &bh)) < 0)
+        return r;
+    if ((r = add_dirent_to_buf(dp, bh, name, namelen, inum, file_type)) < 0)
+        ext2_ops.brelse(bh);
+    return r;
 }
 
 int
@@ -2094,7 +3422,8 @@ long
 ext2_getdents(struct file *f, char *data, uint64_t size)
 {
     ssize_t r, n;
-    int ext2_reclen, de64_reclen, off = 0;
+    int ext2_reclen, de64_reclen, off = 0, rec_len;
+    off_t start;
     char *buf, rec[264];
     struct ext2_dir_entry_2 *de;
     struct dirent64 *de64;
@@ -2103,6 +3432,7 @@ ext2_getdents(struct file *f, char *data, uint64_t size)
 
     while (1) {
         r = (buf - data);
+        start = f->off;
         n = fileread(f, (char *)rec, 8);
         if (n == 0) {
             //cprintf("ext2_getdents: read 0\n");
@@ -2114,12 +3444,22 @@ ext2_getdents(struct file *f, char *data, uint64_t size)
         }
 
         de = (struct ext2_dir_entry_2 *)rec;
-        if (de->inode == 0) continue;
+        rec_len = de->rec_len;
+        if (rec_len < EXT2_DIR_REC_LEN(0)) {
+            warn("ext2_getdents: invalid rec_len %d", rec_len);
+            return r ? r : -1;
+        }
+        // 空きエントリとhtreeの索引ブロックは飛ばす
+        if (de->inode == 0) {
+            f->off = start + rec_len;
+            continue;
+        }
 
         de64_reclen = (size_t)(&((struct dirent64*)0)->d_name) + de->name_len;
         de64_reclen = ALIGN(de64_reclen, 3);
         if ((r + de64_reclen) > size) {
             //cprintf("ext2_getdents: break; r: %d, reclen: %d, size: %d\n", r, de64_reclen, size);
+            f->off = start;     // 次の呼び出しで返す
             break;
         }
 
@@ -2137,6 +3477,8 @@ ext2_getdents(struct file *f, char *data, uint64_t size)
         memmove(de64->d_name, rec, n);
         //print_dirent64((struct dirent64 *)buf);
         buf += de64_reclen;
+        // 名前の後ろの空き (削除の跡やhtreeのルート) を飛ばす
+        f->off = start + rec_len;
         off = f->off;
     }
 
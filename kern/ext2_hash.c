@@ -0,0 +1,246 @@
+/*
+ * Directory name hashes of htree directories.
+ *
+ * These must give the same values as fs/ext3/hash.c of Linux, which
+ * this file is based on, so that the directories can be shared.
+ */
+#include "ext2.h"
+#include "string.h"
+#include "types.h"
+
+#define DELTA 0x9E3779B9
+
+static inline uint32_t
+rol32(uint32_t word, unsigned int shift)
+{
+    return (word << shift) | (word >> (32 - shift));
+}
+
+static void
+TEA_transform(uint32_t buf[4], uint32_t const in[])
+{
+    uint32_t sum = 0;
+    uint32_t b0 = buf[0], b1 = buf[1];
+    uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+    int n = 16;
+
+    do {
+        sum += DELTA;
+        b0 += ((b1 << 4)+a) ^ (b1+sum) ^ ((b1 >> 5)+b);
+        b1 += ((b0 << 4)+c) ^ (b0+sum) ^ ((b0 >> 5)+d);
+    } while (--n);
+
+    buf[0] += b0;
+    buf[1] += b1;
+}
+
+/* F, G and H are basic MD4 functions: selection, majority, parity */
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+/*
+ * The generic round function.  The application is so specific that
+ * we don't bother protecting all the arguments with parens, as is generally
+ * good macro practice, in favor of extra legibility.
+ * Rotation is separate from addition to prevent recomputation
+ */
+#define ROUND(f, a, b, c, d, x, s)  \
+    (a += f(b, c, d) + x, a = rol32(a, s))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+/*
+ * Basic cut-down MD4 transform.  Returns only 32 bits of result.
+ */
+static void
+half_md4_transform(uint32_t buf[4], uint32_t const in[8])
+{
+    uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+    /* Round 1 */
+    ROUND(F, a, b, c, d, in[0] + K1,  3);
+    ROUND(F, d, a, b, c, in[1] + K1,  7);
+    ROUND(F, c, d, a, b, in[2] + K1, 11);
+    ROUND(F, b, c, d, a, in[3] + K1, 19);
+    ROUND(F, a, b, c, d, in[4] + K1,  3);
+    ROUND(F, d, a, b, c, in[5] + K1,  7);
+    ROUND(F, c, d, a, b, in[6] + K1, 11);
+    ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+    /* Round 2 */
+    ROUND(G, a, b, c, d, in[1] + K2,  3);
+    ROUND(G, d, a, b, c, in[3] + K2,  5);
+    ROUND(G, c, d, a, b, in[5] + K2,  9);
+    ROUND(G, b, c, d, a, in[7] + K2, 13);
+    ROUND(G, a, b, c, d, in[0] + K2,  3);
+    ROUND(G, d, a, b, c, in[2] + K2,  5);
+    ROUND(G, c, d, a, b, in[4] + K2,  9);
+    ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+    /* Round 3 */
+    ROUND(H, a, b, c, d, in[3] + K3,  3);
+    ROUND(H, d, a, b, c, in[7] + K3,  9);
+    ROUND(H, c, d, a, b, in[2] + K3, 11);
+    ROUND(H, b, c, d, a, in[6] + K3, 15);
+    ROUND(H, a, b, c, d, in[1] + K3,  3);
+    ROUND(H, d, a, b, c, in[5] + K3,  9);
+    ROUND(H, c, d, a, b, in[0] + K3, 11);
+    ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+    buf[0] += a;
+    buf[1] += b;
+    buf[2] += c;
+    buf[3] += d;
+}
+
+#undef ROUND
+#undef F
+#undef G
+#undef H
+#undef K1
+#undef K2
+#undef K3
+
+/* The old legacy hash */
+static uint32_t
+dx_hack_hash(const char *name, int len, int unsigned_flag)
+{
+    uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+    const unsigned char *ucp = (const unsigned char *)name;
+    const signed char *scp = (const signed char *)name;
+    int c;
+
+    while (len--) {
+        if (unsigned_flag)
+            c = (int)*ucp++;
+        else
+            c = (int)*scp++;
+        hash = hash1 + (hash0 ^ (c * 7152373));
+
+        if (hash & 0x80000000)
+            hash -= 0x7fffffff;
+        hash1 = hash0;
+        hash0 = hash;
+    }
+    return hash0 << 1;
+}
+
+static void
+str2hashbuf(const char *msg, int len, uint32_t *buf, int num, int unsigned_flag)
+{
+    uint32_t pad, val;
+    int i, c;
+    const unsigned char *ucp = (const unsigned char *)msg;
+    const signed char *scp = (const signed char *)msg;
+
+    pad = (uint32_t)len | ((uint32_t)len << 8);
+    pad |= pad << 16;
+
+    val = pad;
+    if (len > num*4)
+        len = num * 4;
+    for (i = 0; i < len; i++) {
+        if (unsigned_flag)
+            c = (int)ucp[i];
+        else
+            c = (int)scp[i];
+
+        val = c + (val << 8);
+        if ((i % 4) == 3) {
+            *buf++ = val;
+            val = pad;
+            num--;
+        }
+    }
+    if (--num >= 0)
+        *buf++ = val;
+    while (--num >= 0)
+        *buf++ = pad;
+}
+
+/*
+ * Returns the hash of a filename.  If len is 0 and name is NULL, then
+ * this function can be used to test whether or not a hash version is
+ * supported.
+ *
+ * The seed is an 4 longword (32 bits) "secret" which can be used to
+ * uniquify a hash.  If the seed is all zero's, then some default seed
+ * may be used.
+ *
+ * Sets hinfo->hash and hinfo->minor_hash, and returns 0, or -1 if
+ * hinfo->hash_version is not supported.
+ */
+int
+ext2_dirhash(const char *name, int len, struct dx_hash_info *hinfo)
+{
+    uint32_t hash;
+    uint32_t minor_hash = 0;
+    const char *p;
+    int i;
+    uint32_t in[8], buf[4];
+    int unsigned_flag = 0;
+
+    /* Initialize the default seed for the hash checksum functions */
+    buf[0] = 0x67452301;
+    buf[1] = 0xefcdab89;
+    buf[2] = 0x98badcfe;
+    buf[3] = 0x10325476;
+
+    /* Check to see if the seed is all zero's */
+    if (hinfo->seed) {
+        for (i = 0; i < 4; i++) {
+            if (hinfo->seed[i]) {
+                memmove(buf, hinfo->seed, sizeof(buf));
+                break;
+            }
+        }
+    }
+
+    switch (hinfo->hash_version) {
+    case DX_HASH_LEGACY_UNSIGNED:
+        unsigned_flag++;
+        /* fall through */
+    case DX_HASH_LEGACY:
+        hash = dx_hack_hash(name, len, unsigned_flag);
+        break;
+    case DX_HASH_HALF_MD4_UNSIGNED:
+        unsigned_flag++;
+        /* fall through */
+    case DX_HASH_HALF_MD4:
+        p = name;
+        while (len > 0) {
+            str2hashbuf(p, len, in, 8, unsigned_flag);
+            half_md4_transform(buf, in);
+            len -= 32;
+            p += 32;
+        }
+        minor_hash = buf[2];
+        hash = buf[1];
+        break;
+    case DX_HASH_TEA_UNSIGNED:
+        unsigned_flag++;
+        /* fall through */
+    case DX_HASH_TEA:
+        p = name;
+        while (len > 0) {
+            str2hashbuf(p, len, in, 4, unsigned_flag);
+            TEA_transform(buf, in);
+            len -= 16;
+            p += 16;
+        }
+        hash = buf[0];
+        minor_hash = buf[1];
+        break;
+    default:
+        hinfo->hash = 0;
+        return -1;
+    }
+    hash = hash & ~1;
+    if (hash == (EXT2_HTREE_EOF << 1))
+        hash = (EXT2_HTREE_EOF - 1) << 1;
+    hinfo->hash = hash;
+    hinfo->minor_hash = minor_hash;
+    return 0;
+}
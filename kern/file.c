@@ -8,6 +8,7 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "console.h"
+#include "dcache.h"
 #include "log.h"
 #include "pipe.h"
 #include "clock.h"
@@ -16,18 +17,22 @@
 #include "vfsmount.h"
 #include "linux/stat.h"
 #include "linux/capability.h"
+#include "kmalloc.h"
 
 struct devsw devsw[NMAJOR];
 struct {
     struct spinlock lock;
-    struct file file[NFILE];
+    int nfile;                  /* Allocated file structures */
 } ftable;
 
-/* Optional since BSS is zero-initialized. */
+static struct kmem_cache *file_cachep;
+
 void
 fileinit()
 {
     initlock(&ftable.lock, "file");
+    file_cachep = kmem_cache_create("file", sizeof(struct file));
+    assert(file_cachep);
 }
 
 /* Allocate a file structure. */
@@ -37,15 +42,22 @@ filealloc()
     struct file *f;
 
     acquire(&ftable.lock);
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        if (f->ref == 0) {
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
+    if (ftable.nfile >= NFILE) {
+        release(&ftable.lock);
+        return 0;
     }
+    ftable.nfile++;
     release(&ftable.lock);
-    return 0;
+
+    if ((f = kmem_cache_alloc(file_cachep)) == 0) {
+        acquire(&ftable.lock);
+        ftable.nfile--;
+        release(&ftable.lock);
+        return 0;
+    }
+    memset(f, 0, sizeof(*f));
+    f->ref = 1;
+    return f;
 }
 
 /* Increment ref count for file f. */
@@ -78,10 +90,10 @@ fileopen(char *path, int flags, mode_t mode)
             warn("O_CREAT && O_EXCL and  %s exists", path);
             return -EEXIST;
         } else if (!ip) {
-            if ((ip = create(path, T_FILE, 0, 0, mode | S_IFREG)) == 0) {
+            if ((long)(ip = create(path, T_FILE, 0, 0, mode | S_IFREG)) < 0) {
                 end_op();
                 warn("cant create %s", path);
-                return -EDQUOT;
+                return (long)ip;
             }
         } else {
             ip->iops->ilock(ip);
@@ -137,7 +149,7 @@ loop:
     f->readable = readable;
     f->writable = writable;
     if (flags & O_CLOEXEC)
-        bit_add(thisproc()->fdflag, fd);
+        bit_add(thisproc()->files->fdflag, fd);
     debug("proc[%d], path: %s, fd: %d, flags: %d, mode: 0x%x", thisproc()->pid, path, fd, f->flags, f->ip->mode);
     return fd;
 
@@ -163,7 +175,9 @@ fileclose(struct file *f)
     ff = *f;
     f->ref = 0;
     f->type = FD_NONE;
+    ftable.nfile--;
     release(&ftable.lock);
+    kmem_cache_free(file_cachep, f);
 
     if (ff.type == FD_PIPE) {
         pipeclose(ff.pipe, ff.writable);
@@ -195,6 +209,115 @@ filestat(struct file *f, struct stat *st)
     return -EFAULT;
 }
 
+/*
+ * Readahead for a read of [off, off + n) of f.  While f is read
+ * sequentially, a window of the following blocks is read without
+ * waiting.  When the reader enters the window, the next one is
+ * started, twice as large up to RA_MAX blocks.
+ * Caller must hold f->ip->lock.
+ */
+static void
+file_readahead(struct file *f, off_t off, size_t n)
+{
+    struct file_ra_state *ra = &f->ra;
+    size_t blksize = sb[f->ip->dev].blocksize;
+    uint32_t last = (off + n - 1) / blksize;
+    uint32_t max = ra->advice == POSIX_FADV_SEQUENTIAL ? RA_MAX * 2 : RA_MAX;
+
+    if (n == 0 || f->ip->type != T_FILE || ra->advice == POSIX_FADV_RANDOM)
+        return;
+    if (off != ra->prev_end && ra->advice != POSIX_FADV_SEQUENTIAL) {
+        ra->size = 0;
+        return;
+    }
+
+    if (ra->size == 0 || last >= ra->start + ra->size) {
+        ra->start = last + 1;
+        ra->size = RA_MIN;
+    } else if (last >= ra->start) {
+        ra->start += ra->size;
+        ra->size = MIN(ra->size * 2, max);
+    } else {
+        return;
+    }
+    generic_readahead(f->ip, ra->start, ra->size);
+}
+
+/*
+ * Start reading [off, off + len) of ip, up to RA_RANGE blocks,
+ * without waiting.  ip must not be locked.
+ */
+void
+inode_readahead(struct inode *ip, off_t off, size_t len)
+{
+    size_t blksize = sb[ip->dev].blocksize;
+    uint32_t bn = off / blksize;
+    uint32_t n = (off + len + blksize - 1) / blksize - bn;
+
+    ip->iops->ilock(ip);
+    generic_readahead(ip, bn, MIN(n, (uint32_t)RA_RANGE));
+    ip->iops->iunlock(ip);
+}
+
+/* posix_fadvise(2) */
+long
+fileadvise(struct file *f, off_t offset, off_t len, int advice)
+{
+    if (f->type == FD_PIPE)
+        return -ESPIPE;
+    if (f->type != FD_INODE)
+        return -EBADF;
+    if (offset < 0 || len < 0)
+        return -EINVAL;
+
+    switch (advice) {
+    case POSIX_FADV_NORMAL:
+    case POSIX_FADV_RANDOM:
+    case POSIX_FADV_SEQUENTIAL:
+        f->ra.advice = advice;
+        f->ra.size = 0;
+        break;
+    case POSIX_FADV_WILLNEED:
+        if (f->ip->type == T_FILE) {
+            if (len == 0 || offset + len > f->ip->size)
+                len = offset < f->ip->size ? f->ip->size - offset : 0;
+            if (len > 0)
+                inode_readahead(f->ip, offset, len);
+        }
+        break;
+    case POSIX_FADV_DONTNEED:
+        pagecache_invalidate(f->ip, offset - offset % PGSIZE,
+            len == 0 ? (off_t)1 << 62 : offset + len);
+        break;
+    case POSIX_FADV_NOREUSE:
+        break;
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/*
+ * Wait until the updates of f are on the disk.  type is 0 for
+ * fsync and 1 for fdatasync, which are the same here: the log
+ * commits data and metadata together.  Dirty cached pages are
+ * written back first; a failure of their writeback, also of one
+ * done earlier by the flusher, is returned.
+ */
+long
+fsync(struct file *f, int type)
+{
+    long error;
+
+    if (f->type != FD_INODE)
+        return -EINVAL;
+    // 書き戻しの失敗はフラッシャが行ったものも報告する
+    pagecache_writeback(f->ip);
+    error = pagecache_error(f->ip);
+    log_force(f->ip->dev);
+    return error;
+}
+
 /* Read from file f. */
 ssize_t
 fileread(struct file *f, char *addr, ssize_t n)
@@ -207,8 +330,10 @@ fileread(struct file *f, char *addr, ssize_t n)
     if (f->type == FD_INODE) {
         begin_op();
         f->ip->iops->ilock(f->ip);
+        file_readahead(f, f->off, n);
         if ((r = f->ip->iops->readi(f->ip, addr, f->off, n)) > 0)
             f->off += r;
+        f->ra.prev_end = f->off;
         clock_gettime(CLOCK_REALTIME, &f->ip->atime);
         f->ip->iops->iunlock(f->ip);
         end_op();
@@ -245,6 +370,33 @@ filewrite(struct file *f, char *addr, ssize_t n)
     if (f->writable == 0) return -EBADF;
     if (f->type == FD_PIPE)
         return pipewrite(f->pipe, addr, n);
+    if (f->type == FD_INODE && f->ip->iops->writepages && f->ip->type == T_FILE) {
+        /*
+         * 遅延割り当て: データはページキャッシュに書き込むだけで、
+         * ブロックの割り当てとディスクへの書き出しはライトバック時に
+         * まとめて行う。ダーティページが多すぎる場合は
+         * トランザクションの外で減るのを待つ。
+         */
+        ssize_t max = WB_MAXPAGES * PGSIZE;
+        ssize_t i = 0;
+        while (i < n) {
+            ssize_t n1 = MIN(max, n - i);
+            balance_dirty_pages();
+            begin_op();
+            f->ip->iops->ilock(f->ip);
+            if ((r = pagecache_write(f->ip, addr + i, f->off, n1)) > 0)
+                f->off += r;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            f->ip->mtime = f->ip->atime = ts;
+            f->ip->iops->iunlock(f->ip);
+            end_op();
+
+            if (r < 0) break;
+            i += r;
+            if (r != n1) break;
+        }
+        return i == n ? n : (i == 0 && r < 0 ? r : -1);
+    }
     if (f->type == FD_INODE) {
         /*
          * 最大ログトランザクションサイズを超えないように、
@@ -355,6 +507,7 @@ filelink(char *old, char *new)
         iunlockput(dp);
         goto bad;
     }
+    d_invalidate(dp);
 
     iunlockput(dp);
     iput(ip);
@@ -407,6 +560,7 @@ filesymlink(char *old, char *new)
         end_op();
         return error;
     }
+    d_invalidate(dp);
 
     dp->iops->iupdate(dp);
     iunlockput(dp);
@@ -513,6 +667,9 @@ fileunlink(char *path, int flags)
         goto badip;
         //panic("unlink: unlink");
     }
+    d_invalidate(dp);
+    if (ip->type == T_DIR)
+        d_invalidate(ip);
 
     if (ip->type == T_DIR) {
         dp->nlink--;
@@ -542,14 +699,17 @@ baddp:
 long
 fdalloc(struct file *f, int from)
 {
-    struct proc *p = thisproc();
+    struct files_struct *files = thisproc()->files;
 
+    acquire(&files->lock);
     for (int fd = from; fd < NOFILE; fd++) {
-        if (p->ofile[fd] == 0) {
-            p->ofile[fd] = f;
+        if (files->ofile[fd] == 0) {
+            files->ofile[fd] = f;
+            release(&files->lock);
             return fd;
         }
     }
+    release(&files->lock);
     return -EBADF;
 }
 
@@ -769,6 +929,7 @@ rename(struct inode *dp, char *name1, char *name2)
         warn("writei");
         return -ENOSPC;
     }
+    d_invalidate(dp);
     dp->iops->iupdate(dp);
     clock_gettime(CLOCK_REALTIME, &ip->ctime);
     ip->iops->iupdate(ip);
@@ -797,6 +958,7 @@ reinode(struct inode *dp, struct inode *old_ip, struct inode *new_ip)
         warn("writei");
         return -ENOSPC;
     }
+    d_invalidate(dp);
     dp->iops->iupdate(dp);
     clock_gettime(CLOCK_REALTIME, &ts);
     old_ip->ctime = new_ip->ctime = ts;
@@ -856,6 +1018,7 @@ filerename(char *path1, char *path2)
                 warn("dirlink failed 2");
                 goto bad;
             }
+            d_invalidate(dp2);
             end_op();
             return fileunlink(path1, ip1->type == T_DIR ? AT_REMOVEDIR : 0);
         } else {
@@ -941,6 +1104,8 @@ mount(char *source, char *target, char *fstype, uint64_t flags, void *data)
     // 8: マウントポイントのファイルタイプを変更
     ip->type = T_MOUNT;
     //ip->iops->iupdate(ip);    // これを活かすとconsoleでcntl-Dが効かなくなる
+    // マウントポイントを越えるdentryを捨てる
+    dcache_purge();
     devi->iops->iunlock(devi);
     ip->iops->iunlock(ip);
     end_op();
@@ -959,6 +1124,10 @@ umount(char *target, int flags)
     struct inode *ip, *devi;
     struct vfs *vfs;
     long error;
+    int dev = -1;
+
+    // 遅延書き込み中のデータを書き出す
+    pagecache_sync(-1);
 
     begin_op();
     if ((devi = namei(target)) == 0) {
@@ -992,8 +1161,10 @@ umount(char *target, int flags)
         goto bad1;
     }
 
-    devi->ref--;
+    __atomic_sub_fetch(&devi->ref, 1, __ATOMIC_RELEASE);
     ip->type = T_DIR;
+    dev = devi->dev;
+    dcache_purge();
 
     error = 0;
 
@@ -1002,5 +1173,11 @@ bad1:
 bad2:
     iunlockput(devi);
     end_op();
+    if (error == 0) {
+        // キャッシュに残っているこのデバイスのinodeを捨てる
+        ievict(dev);
+        // トランザクションの外でログを書き出して閉じる
+        log_close(dev);
+    }
     return error;
 }
@@ -0,0 +1,341 @@
+#include "types.h"
+#include "futex.h"
+#include "linux/errno.h"
+#include "linux/futex.h"
+#include "linux/time.h"
+#include "console.h"
+#include "list.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "syscall1.h"
+#include "vm.h"
+
+/*
+ * Fast user-space mutexes.
+ *
+ * A waiter is queued on a futex_q on its kernel stack in one of the
+ * buckets of futex_queues, hashed by the physical address of the futex
+ * word, so that the threads of a process and the processes sharing the
+ * page (MAP_SHARED) meet at the same key.  Each bucket has its own lock
+ * and FUTEX_WAKE wakes up exactly the waiters it dequeues, one wakeup
+ * per waiter.
+ *
+ * Lock order: bucket lock -> mm->lock, bucket lock -> ptable.lock.
+ * Two bucket locks are taken in the order of their address.
+ */
+
+#define FUTEX_HASHBITS  6
+#define FUTEX_HASHSIZE  (1 << FUTEX_HASHBITS)
+
+struct futex_bucket {
+    struct spinlock lock;
+    struct list_head chain;
+};
+
+struct futex_q {
+    struct list_head link;              /* Chain of the bucket */
+    uint64_t key;                       /* Physical address of the futex */
+    struct futex_bucket *bucket;        /* Changed by FUTEX_REQUEUE */
+    struct hrtimer timer;               /* Timeout */
+    int woken, timedout;
+};
+
+static struct futex_bucket futex_queues[FUTEX_HASHSIZE];
+
+void
+futex_init()
+{
+    for (int i = 0; i < FUTEX_HASHSIZE; i++) {
+        initlock(&futex_queues[i].lock, "futex");
+        list_init(&futex_queues[i].chain);
+    }
+}
+
+static struct futex_bucket *
+hash_futex(uint64_t key)
+{
+    return &futex_queues[((key >> 2) ^ (key >> (2 + FUTEX_HASHBITS))) & (FUTEX_HASHSIZE - 1)];
+}
+
+/*
+ * Get the physical address of the futex word at uaddr.
+ * The page is faulted in and copied if it is copy on write,
+ * so that the key does not change while waiting.
+ */
+static long
+get_futex_key(uint32_t *uaddr, uint64_t *key)
+{
+    struct mm_struct *mm = thisproc()->mm;
+    uint64_t *pte;
+    long error = 0;
+
+    if ((uint64_t)uaddr & (sizeof(uint32_t) - 1))
+        return -EINVAL;
+    if (!in_user(uaddr, sizeof(uint32_t)))
+        return -EFAULT;
+    /* 遅延読み込みのページはここで読み込ませる */
+    (void)*(volatile uint32_t *)uaddr;
+
+    acquire(&mm->lock);
+    pte = pgdir_walk(mm->pgdir, uaddr, 0);
+    if (pte == 0 || !(*pte & PTE_VALID)) {
+        error = -EFAULT;
+        goto out;
+    }
+    if ((*pte & PTE_COW) && (error = uvm_cow(pte)) < 0)
+        goto out;
+    *key = PTE_ADDR(*pte) | ((uint64_t)uaddr & (PGSIZE - 1));
+out:
+    release(&mm->lock);
+    return error;
+}
+
+/*
+ * Read the futex word at uaddr whose key is key without faulting:
+ * the bucket lock is held.  The page is looked up again under
+ * mm->lock and read through the kernel mapping.  Returns -EFAULT if
+ * uaddr is no longer mapped and -EAGAIN if it was remapped elsewhere.
+ */
+static long
+get_futex_value(uint32_t *uaddr, uint64_t key, uint32_t *val)
+{
+    struct mm_struct *mm = thisproc()->mm;
+    uint64_t *pte;
+    long error = 0;
+
+    acquire(&mm->lock);
+    pte = pgdir_walk(mm->pgdir, uaddr, 0);
+    if (pte == 0 || !(*pte & PTE_VALID))
+        error = -EFAULT;
+    else if ((PTE_ADDR(*pte) | ((uint64_t)uaddr & (PGSIZE - 1))) != key)
+        error = -EAGAIN;
+    else
+        *val = *(volatile uint32_t *)P2V(key);
+    release(&mm->lock);
+    return error;
+}
+
+/* Dequeue q and wake up its waiter.  q->bucket->lock must be held. */
+static void
+wake_futex(struct futex_q *q)
+{
+    list_drop(&q->link);
+    q->woken = 1;
+    wakeup(q);
+}
+
+/* Lock the bucket q is on, following FUTEX_REQUEUE. */
+static struct futex_bucket *
+lock_queue(struct futex_q *q)
+{
+    struct futex_bucket *hb = q->bucket;
+
+    acquire(&hb->lock);
+    while (hb != q->bucket) {
+        release(&hb->lock);
+        hb = q->bucket;
+        acquire(&hb->lock);
+    }
+    return hb;
+}
+
+static int
+futex_timeout(struct hrtimer *t)
+{
+    struct futex_q *q = container_of(t, struct futex_q, timer);
+    struct futex_bucket *hb = lock_queue(q);
+
+    q->timedout = 1;
+    wakeup(q);
+    release(&hb->lock);
+    return HRTIMER_NORESTART;
+}
+
+static int
+signal_pending(struct proc *p)
+{
+    return p->killed || (p->signal.pending & ~p->signal.mask) != 0;
+}
+
+/*
+ * FUTEX_WAIT: sleep while *uaddr == val until woken up by FUTEX_WAKE,
+ * the relative timeout expires or a signal arrives.
+ */
+static long
+futex_wait(uint32_t *uaddr, uint32_t val, struct timespec *timeout)
+{
+    struct proc *p = thisproc();
+    struct futex_bucket *hb;
+    struct futex_q q;
+    uint32_t cur;
+    long error = 0;
+
+    if ((error = get_futex_key(uaddr, &q.key)) < 0)
+        return error;
+
+    q.woken = q.timedout = 0;
+    hrtimer_init(&q.timer, futex_timeout);
+    hb = q.bucket = hash_futex(q.key);
+    acquire(&hb->lock);
+    /* The waker changes the value before taking hb->lock: no lost wakeup. */
+    if ((error = get_futex_value(uaddr, q.key, &cur)) < 0 || cur != val) {
+        release(&hb->lock);
+        return error < 0 ? error : -EAGAIN;
+    }
+    list_push_back(&hb->chain, &q.link);
+    if (timeout)
+        hrtimer_start(&q.timer, ktime_get() + timeout->tv_sec * NSEC_PER_SEC + timeout->tv_nsec);
+
+    while (!q.woken) {
+        if (q.timedout) {
+            error = -ETIMEDOUT;
+            break;
+        }
+        if (signal_pending(p)) {
+            error = -EINTR;
+            break;
+        }
+        sleep(&q, &hb->lock);
+        /* Moved to another bucket by FUTEX_REQUEUE. */
+        if (hb != q.bucket) {
+            release(&hb->lock);
+            hb = lock_queue(&q);
+        }
+    }
+    if (!q.woken)
+        list_drop(&q.link);
+    release(&hb->lock);
+
+    /* q is on our stack: wait for the callback before returning. */
+    if (timeout)
+        hrtimer_cancel(&q.timer);
+    return q.woken ? 0 : error;
+}
+
+/* FUTEX_WAKE: wake up at most nr waiters on uaddr. */
+static long
+futex_wake1(uint32_t *uaddr, int nr)
+{
+    struct futex_bucket *hb;
+    struct futex_q *q, *nq;
+    uint64_t key;
+    long error;
+    int n = 0;
+
+    if ((error = get_futex_key(uaddr, &key)) < 0)
+        return error;
+
+    hb = hash_futex(key);
+    acquire(&hb->lock);
+    LIST_FOREACH_ENTRY_SAFE(q, nq, &hb->chain, link) {
+        if (n >= nr)
+            break;
+        if (q->key == key) {
+            wake_futex(q);
+            n++;
+        }
+    }
+    release(&hb->lock);
+    return n;
+}
+
+long
+futex_wake(uint32_t *uaddr, int nr)
+{
+    return futex_wake1(uaddr, nr);
+}
+
+static void
+double_lock(struct futex_bucket *hb1, struct futex_bucket *hb2)
+{
+    if (hb1 > hb2) {
+        struct futex_bucket *tmp = hb1;
+        hb1 = hb2;
+        hb2 = tmp;
+    }
+    acquire(&hb1->lock);
+    if (hb1 != hb2)
+        acquire(&hb2->lock);
+}
+
+static void
+double_unlock(struct futex_bucket *hb1, struct futex_bucket *hb2)
+{
+    release(&hb1->lock);
+    if (hb1 != hb2)
+        release(&hb2->lock);
+}
+
+/*
+ * FUTEX_REQUEUE, FUTEX_CMP_REQUEUE: wake up at most nr_wake waiters on
+ * uaddr1 and move at most nr_requeue of the rest to uaddr2 without
+ * waking them, so that a condition variable broadcast does not wake
+ * every waiter only to have them contend for the mutex.
+ */
+static long
+futex_requeue(uint32_t *uaddr1, uint32_t *uaddr2, int nr_wake,
+              int nr_requeue, uint32_t *cmpval)
+{
+    struct futex_bucket *hb1, *hb2;
+    struct futex_q *q, *nq;
+    uint64_t key1, key2;
+    uint32_t cur;
+    long error;
+    int n = 0;
+
+    if ((error = get_futex_key(uaddr1, &key1)) < 0
+     || (error = get_futex_key(uaddr2, &key2)) < 0)
+        return error;
+
+    hb1 = hash_futex(key1);
+    hb2 = hash_futex(key2);
+    double_lock(hb1, hb2);
+    if (cmpval
+     && ((error = get_futex_value(uaddr1, key1, &cur)) < 0 || cur != *cmpval)) {
+        double_unlock(hb1, hb2);
+        return error < 0 ? error : -EAGAIN;
+    }
+    LIST_FOREACH_ENTRY_SAFE(q, nq, &hb1->chain, link) {
+        if (q->key != key1)
+            continue;
+        if (n < nr_wake) {
+            wake_futex(q);
+        } else if (n < nr_wake + nr_requeue) {
+            q->key = key2;
+            if (hb1 != hb2) {
+                list_drop(&q->link);
+                list_push_back(&hb2->chain, &q->link);
+                q->bucket = hb2;
+            }
+        } else {
+            break;
+        }
+        n++;
+    }
+    double_unlock(hb1, hb2);
+    return n;
+}
+
+long
+futex(uint32_t *uaddr, int op, uint32_t val, struct timespec *timeout,
+      uint32_t *uaddr2, uint32_t val3)
+{
+    /* timeout is the number of waiters to requeue for FUTEX_*REQUEUE. */
+    int val2 = (int)(uint64_t)timeout;
+
+    switch (op & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+        return futex_wait(uaddr, val, timeout);
+    case FUTEX_WAKE:
+        return futex_wake1(uaddr, val);
+    case FUTEX_REQUEUE:
+        return futex_requeue(uaddr, uaddr2, val, val2, 0);
+    case FUTEX_CMP_REQUEUE:
+        return futex_requeue(uaddr, uaddr2, val, val2, &val3);
+    default:
+        trace("futex op %d not supported", op);
+        return -ENOSYS;
+    }
+}
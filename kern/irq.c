@@ -240,15 +240,11 @@ irq_handler()
     int nack = 0;
 #ifndef USE_GIC
     int src = get32(IRQ_SRC_CORE(cpuid()));
-    assert(!(src & ~(IRQ_SRC_CNTPNSIRQ | IRQ_SRC_GPU | IRQ_SRC_TIMER)));
+    assert(!(src & ~(IRQ_SRC_CNTPNSIRQ | IRQ_SRC_GPU)));
     if (src & IRQ_SRC_CNTPNSIRQ) {
         timer_intr();
         nack++;
     }
-    if (src & IRQ_SRC_TIMER) {
-        clock_intr();
-        nack++;
-    }
 #if RASPI == 4
     uint64_t irq =
         get32(IRQ0_PENDING0) | (((uint64_t) get32(IRQ0_PENDING1)) << 32);
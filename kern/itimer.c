@@ -42,6 +42,25 @@ jiffiestotv(uint64_t jiffies, struct timeval *value)
     value->tv_sec  = jiffies / HZ;
 }
 
+/* ITIMER_REALはhrtimerを使うのでnsで扱う */
+static uint64_t
+tvtons(struct timeval *value)
+{
+    uint64_t sec =  (uint64_t) value->tv_sec;
+    uint64_t usec = (uint64_t) value->tv_usec;
+
+    if (sec > (ULLONG_MAX / 1000000000UL) - 1)
+        return ULLONG_MAX / 2;
+    return sec * 1000000000UL + usec * 1000;
+}
+
+static void
+nstotv(uint64_t ns, struct timeval *value)
+{
+    value->tv_usec = (ns % 1000000000UL) / 1000;
+    value->tv_sec  = ns / 1000000000UL;
+}
+
 long
 getitimer(int which, struct itimerval *value)
 {
@@ -55,12 +74,14 @@ getitimer(int which, struct itimerval *value)
         /*
          * FIXME! This needs to be atomic, in case the kernel timer happens!
          */
-        if (timer_pending(&p->real_timer)) {
-            val = p->real_timer.expires - jiffies;
+        if (hrtimer_pending(&p->real_timer)) {
+            val = p->real_timer.expires - ktime_get();
             if ((int64_t) val <= 0)
-                val = 1;
+                val = 1000;
         }
-        break;
+        nstotv(val, &value->it_value);
+        nstotv(interval, &value->it_interval);
+        return 0;
     case ITIMER_VIRTUAL:
     /*
         val = p->it_virt_value;
@@ -83,20 +104,23 @@ getitimer(int which, struct itimerval *value)
     return 0;
 }
 
-void
-it_real_fn(uint64_t __data)
+int
+it_real_fn(struct hrtimer *t)
 {
-    struct proc *p = (struct proc *) __data;
-    uint64_t interval;
+    struct proc *p = container_of(t, struct proc, real_timer);
+    uint64_t interval, now;
 
     kill(p->pid, SIGALRM);
     interval = p->it_real_incr;
     if (interval) {
-        if (interval > (uint64_t) LLONG_MAX)
-            interval = LLONG_MAX;
-        p->real_timer.expires = jiffies + interval;
-        add_timer(&p->real_timer);
+        /* 遅れた分は詰めずに次の周期に合わせる */
+        now = ktime_get();
+        do {
+            t->expires += interval;
+        } while (t->expires <= now);
+        return HRTIMER_RESTART;
     }
+    return HRTIMER_NORESTART;
 }
 
 long
@@ -106,22 +130,23 @@ setitimer(int which, struct itimerval *value, struct itimerval *ovalue)
     long k;
     struct proc *p = thisproc();
 
-    i = tvtojiffies(&value->it_interval);
-    j = tvtojiffies(&value->it_value);
+    if (which == ITIMER_REAL) {
+        i = tvtons(&value->it_interval);
+        j = tvtons(&value->it_value);
+    } else {
+        i = tvtojiffies(&value->it_interval);
+        j = tvtojiffies(&value->it_value);
+    }
     if (ovalue && (k = getitimer(which, ovalue)) < 0)
         return k;
     switch (which) {
         case ITIMER_REAL:
-            del_timer_sync(&p->real_timer);
+            hrtimer_cancel(&p->real_timer);
             p->it_real_value = j;
             p->it_real_incr = i;
             if (!j)
                 break;
-            if (j > (uint64_t) LONG_MAX)
-                j = LONG_MAX;
-            i = j + jiffies;
-            p->real_timer.expires = i;
-            add_timer(&p->real_timer);
+            hrtimer_start(&p->real_timer, ktime_get() + j);
             break;
         case ITIMER_VIRTUAL:
             if (j)
@@ -3,98 +3,333 @@
 #include "kmalloc.h"
 #include "mmu.h"
 #include "string.h"
+#include "spinlock.h"
+#include "console.h"
+#include "proc.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.    Section 8.7.
+/*
+ * Slab allocator.
+ *
+ * Each cache hands out objects of one size.  Objects are carved out of
+ * slabs, one page each, with a struct slab header at the start of the
+ * page, so the slab (and cache) of an object is found by rounding its
+ * address down to the page.  Each slab is on one of the partial, full
+ * or free lists of its cache, protected by the cache lock.
+ *
+ * In front of the slabs every cpu has an array of free objects (a
+ * magazine) that is used without locking: the kernel is not preemptive
+ * and interrupts are masked in kernel mode, so nothing else can run on
+ * this cpu between reading cpuid() and touching its array.  Objects
+ * move between the array and the slabs BATCHCOUNT at a time.
+ *
+ * kmalloc() uses power of 2 size caches up to KMALLOC_MAX bytes and
+ * blocks of pages from the buddy allocator beyond that, which kmfree()
+ * tells apart by the page alignment of the pointer (a slab object never
+ * starts a page).
+ */
 
-typedef __uint128_t Align;
+#define SLAB_MAGIC      0x51ab51abU
+#define SLAB_ALIGN      16
+#define KMALLOC_MIN     16
+#define KMALLOC_MAX     1024
+#define NKMALLOC        7               /* 16, 32, ..., 1024 */
+#define NCACHE          32
+#define AC_LIMIT        32              /* Objects in a per-cpu array */
+#define BATCHCOUNT      16              /* Objects moved at a time */
+#define CACHE_NAMELEN   16
 
-union header {
-    struct {
-        union header *ptr;
-        uint64_t size;
-    } s;
-    Align x;
+struct slab {
+    struct list_head link;              /* partial, full or free list */
+    struct kmem_cache *cache;
+    void *freelist;                     /* Free objects in this slab */
+    int inuse;                          /* Objects handed out */
+    uint32_t magic;
 };
 
-typedef union header Header;
+#define SLAB_HDRSIZE    ROUNDUP(sizeof(struct slab), SLAB_ALIGN)
 
-static Header base;
-static Header *freep = NULL;
+struct array_cache {
+    int avail;
+    void *entry[AC_LIMIT];
+};
 
-void
-kmfree(void *ap)
+struct kmem_cache {
+    char name[CACHE_NAMELEN];
+    size_t objsize;                     /* Requested object size */
+    size_t size;                        /* Aligned object size */
+    int num;                            /* Objects per slab */
+    struct spinlock lock;
+    struct list_head partial, full, free;
+    int nslabs;                         /* Pages owned by this cache */
+    int nfree;                          /* Slabs on the free list */
+    int inuse;                          /* Objects out of the slabs */
+    struct array_cache cpu[NCPU];
+};
+
+static struct {
+    struct spinlock lock;
+    int ncache;
+    struct kmem_cache cache[NCACHE];
+} cache_chain;
+
+static struct kmem_cache *kmalloc_caches[NKMALLOC];
+
+static struct slab *
+obj_to_slab(void *obj)
 {
-    Header *bp, *p;
+    return (struct slab *)ROUNDDOWN((uint64_t)obj, PGSIZE);
+}
 
-    bp = (Header*)ap - 1;
-    for (p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-        if (p >= p->s.ptr && (bp > p || bp < p->s.ptr))
+static void
+slab_move(struct slab *s, struct list_head *list)
+{
+    list_drop(&s->link);
+    list_push_back(list, &s->link);
+}
+
+/*
+ * Add a new slab to the free list of c.
+ * c->lock must be held.
+ */
+static struct slab *
+cache_grow(struct kmem_cache *c)
+{
+    struct slab *s;
+    char *obj;
+
+    if ((s = kalloc()) == 0)
+        return 0;
+    s->cache = c;
+    s->magic = SLAB_MAGIC;
+    s->inuse = 0;
+    s->freelist = 0;
+    obj = (char *)s + SLAB_HDRSIZE;
+    for (int i = 0; i < c->num; i++, obj += c->size) {
+        *(void **)obj = s->freelist;
+        s->freelist = obj;
+    }
+    list_push_back(&c->free, &s->link);
+    c->nslabs++;
+    c->nfree++;
+    return s;
+}
+
+/* Fill the array of this cpu with up to BATCHCOUNT objects from the slabs. */
+static int
+cache_refill(struct kmem_cache *c, struct array_cache *ac)
+{
+    struct slab *s;
+
+    acquire(&c->lock);
+    while (ac->avail < BATCHCOUNT) {
+        if (!list_empty(&c->partial)) {
+            s = container_of(list_front(&c->partial), struct slab, link);
+        } else if (!list_empty(&c->free) || cache_grow(c)) {
+            s = container_of(list_front(&c->free), struct slab, link);
+            slab_move(s, &c->partial);
+            c->nfree--;
+        } else {
             break;
-    if (bp + bp->s.size == p->s.ptr){
-        bp->s.size += p->s.ptr->s.size;
-        bp->s.ptr = p->s.ptr->s.ptr;
-    } else
-        bp->s.ptr = p->s.ptr;
-    if (p + p->s.size == bp){
-        p->s.size += bp->s.size;
-        p->s.ptr = bp->s.ptr;
-    } else
-        p->s.ptr = bp;
-    freep = p;
+        }
+        while (s->freelist && ac->avail < BATCHCOUNT) {
+            ac->entry[ac->avail++] = s->freelist;
+            s->freelist = *(void **)s->freelist;
+            s->inuse++;
+            c->inuse++;
+        }
+        if (s->freelist == 0)
+            slab_move(s, &c->full);
+    }
+    release(&c->lock);
+    return ac->avail;
+}
+
+/*
+ * Return obj to its slab.  One empty slab is kept for reuse,
+ * further ones are given back to the page allocator.
+ * c->lock must be held.
+ */
+static void
+slab_put(struct kmem_cache *c, void *obj)
+{
+    struct slab *s = obj_to_slab(obj);
+    int wasfull = (s->freelist == 0);
+
+    *(void **)obj = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    c->inuse--;
+    if (s->inuse == 0) {
+        if (c->nfree > 0) {
+            list_drop(&s->link);
+            c->nslabs--;
+            s->magic = 0;
+            kfree(s);
+        } else {
+            slab_move(s, &c->free);
+            c->nfree++;
+        }
+    } else if (wasfull) {
+        slab_move(s, &c->partial);
+    }
 }
 
-//use kalloc instead of growproc to allocate memory
-//to kernel data structures.
-//kalloc always returns PGSIZE memory on success
-//size parameter of the Header takes Header sized chunks
-static Header*
-morecore()
+/* Give the oldest BATCHCOUNT objects of the array back to the slabs. */
+static void
+cache_flush(struct kmem_cache *c, struct array_cache *ac)
 {
-    char *p;
-    Header *hp;
-
-    p = kalloc();
-    if (p == 0)
-        return NULL;
-    memset(p, 0, PGSIZE);
-    hp = (Header*)p;
-    hp->s.size = PGSIZE / sizeof(Header);
-    kmfree((void*)(hp + 1));
-    return freep;
+    int n = MIN(ac->avail, BATCHCOUNT);
+
+    acquire(&c->lock);
+    for (int i = 0; i < n; i++)
+        slab_put(c, ac->entry[i]);
+    release(&c->lock);
+    ac->avail -= n;
+    memmove(ac->entry, ac->entry + n, sizeof(void *) * ac->avail);
 }
 
-void*
+/*
+ * Create a cache of objects of size bytes.
+ * size must be at most KMALLOC_MAX.  Returns 0 if failed.
+ */
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size)
+{
+    struct kmem_cache *c;
+
+    if (size == 0 || size > KMALLOC_MAX)
+        return 0;
+
+    acquire(&cache_chain.lock);
+    if (cache_chain.ncache == NCACHE) {
+        release(&cache_chain.lock);
+        warn("no more kmem_cache for %s", name);
+        return 0;
+    }
+    c = &cache_chain.cache[cache_chain.ncache++];
+    release(&cache_chain.lock);
+
+    memset(c, 0, sizeof(*c));
+    safestrcpy(c->name, (char *)name, sizeof(c->name));
+    c->objsize = size;
+    c->size = ROUNDUP(MAX(size, sizeof(void *)), SLAB_ALIGN);
+    c->num = (PGSIZE - SLAB_HDRSIZE) / c->size;
+    initlock(&c->lock, c->name);
+    list_init(&c->partial);
+    list_init(&c->full);
+    list_init(&c->free);
+    return c;
+}
+
+/* Allocate an object from c.  Returns 0 if out of memory. */
+void *
+kmem_cache_alloc(struct kmem_cache *c)
+{
+    struct array_cache *ac = &c->cpu[cpuid()];
+
+    if (ac->avail == 0 && cache_refill(c, ac) == 0)
+        return 0;
+    return ac->entry[--ac->avail];
+}
+
+/* Free obj which was allocated from c. */
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+    struct array_cache *ac = &c->cpu[cpuid()];
+
+    if (obj_to_slab(obj)->magic != SLAB_MAGIC || obj_to_slab(obj)->cache != c)
+        panic("kmem_cache_free: %s: bad object 0x%p", c->name, obj);
+    if (ac->avail == AC_LIMIT)
+        cache_flush(c, ac);
+    ac->entry[ac->avail++] = obj;
+}
+
+void
+kmalloc_init()
+{
+    char name[CACHE_NAMELEN] = "kmalloc-";
+    size_t size = KMALLOC_MIN;
+
+    initlock(&cache_chain.lock, "cache_chain");
+    for (int i = 0; i < NKMALLOC; i++, size <<= 1) {
+        char *p = name + sizeof("kmalloc-") - 1;
+        /* size is 16 .. 1024 */
+        if (size >= 1000) *p++ = '0' + size / 1000;
+        if (size >= 100)  *p++ = '0' + size / 100 % 10;
+        *p++ = '0' + size / 10 % 10;
+        *p++ = '0' + size % 10;
+        *p = 0;
+        kmalloc_caches[i] = kmem_cache_create(name, size);
+        assert(kmalloc_caches[i]);
+    }
+}
+
+/* Index of the smallest kmalloc cache which can hold nbytes. */
+static int
+kmalloc_index(size_t nbytes)
+{
+    if (nbytes <= KMALLOC_MIN)
+        return 0;
+    return (64 - __builtin_clzl(nbytes - 1)) - 4;
+}
+
+/*
+ * Allocate nbytes of zeroed memory.
+ * Returns NULL if failed.
+ */
+void *
 kmalloc(size_t nbytes)
 {
-    Header *p, *prevp;
-    uint64_t nunits;
-
-    //panic if we try to allocate more than PGSIZE bytes
-    //4088 + 8 bytes (Header )
-    if (nbytes > PGSIZE)
-        panic("kmalloc: Cannot allocate the requested size of memory ( > PGSIZE )\n");
-    nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-
-    if((prevp = freep) == 0){
-        base.s.ptr = freep = prevp = &base;
-        base.s.size = 0;
+    void *p;
+
+    if (nbytes > KMALLOC_MAX)
+        p = alloc_pages(get_order(nbytes));
+    else
+        p = kmem_cache_alloc(kmalloc_caches[kmalloc_index(nbytes)]);
+    if (p)
+        memset(p, 0, nbytes);
+    return p;
+}
+
+void
+kmfree(void *ap)
+{
+    struct slab *s;
+
+    if (ap == NULL)
+        return;
+    if (((uint64_t)ap & (PGSIZE - 1)) == 0) {
+        free_pages(ap, page_order(ap));
+        return;
     }
+    s = obj_to_slab(ap);
+    if (s->magic != SLAB_MAGIC)
+        panic("kmfree: bad pointer 0x%p", ap);
+    kmem_cache_free(s->cache, ap);
+}
 
-    for (p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-        if (p->s.size >= nunits){
-            if (p->s.size == nunits)
-                prevp->s.ptr = p->s.ptr;
-            else {
-                p->s.size -= nunits;
-                p += p->s.size;
-                p->s.size = nunits;
-            }
-            freep = prevp;
-            return (void*)(p + 1);
-        }
-        if (p == freep)
-            if ((p = morecore()) == 0)
-                return NULL;
+/*
+ * Print usage of each cache.  active: objects in use,
+ * cached: free objects in the per-cpu arrays, total: objects
+ * in all slabs, frag: pages not used by active objects.
+ */
+void
+kmem_cache_dump()
+{
+    struct kmem_cache *c;
+
+    cprintf("cache           size  active  cached   total  slabs  frag\n");
+    for (int i = 0; i < cache_chain.ncache; i++) {
+        c = &cache_chain.cache[i];
+        int cached = 0;
+        for (int j = 0; j < NCPU; j++)
+            cached += c->cpu[j].avail;
+        int active = c->inuse - cached;
+        int total = c->nslabs * c->num;
+        uint64_t bytes = (uint64_t)c->nslabs * PGSIZE;
+        int frag = bytes ? 100 - (int)((uint64_t)active * c->objsize * 100 / bytes) : 0;
+        cprintf("%-14s %5d %7d %7d %7d %6d %4d%%\n", c->name, (int)c->objsize,
+                active, cached, total, c->nslabs, frag);
     }
 }
@@ -5,8 +5,14 @@
 #include "sleeplock.h"
 #include "vfs.h"
 #include "v6.h"
+#include "ext2.h"
 #include "buf.h"
+#include "dev.h"
 #include "string.h"
+#include "proc.h"
+#include "kmalloc.h"
+#include "jbd.h"
+#include "linux/time.h"
 
 /* FSシステムコールの並行処理を可能にするシンプルなロギング
  * ログトランザクションは複数のFSシステムコールの更新を含んでいる。
@@ -18,46 +24,171 @@
  * システムコールはその開始と終了を begin_op()/end_op()を呼び出して
  * マークする必要がある。通常、begin_op()は進行中のFSシステムコールの
  * カウントを増加させて戻るだけである。しかし、ログが枯渇しそうになると
- * 最後の未処理のend_op()がコミットするまでスリープする。
+ * コミットまたはチェックポイントが終わるまでスリープする。
  *
- * ログはディスクブロックを含む物理的なREDOログである。ディスク上の
- * ログ形式は次のとおりである。
+ * ログはディスクブロックを含む物理的なREDOログであり、ログ領域を
+ * 循環して使用する。ディスク上のログ形式は次のとおりである。
  *
- *   - ヘッダブロックブロック（A, B, C, ...のブロック番号を含む）
- *   - ブロックA
- *   - ブロックB
- *   - ブロックC
- *   ...
+ *   - ログスーパーブロック（最古の未チェックポイントトランザクションの
+ *     位置とtid）
+ *   - 循環領域: トランザクションごとに
+ *       - ディスクリプタブロック（tid, A, B, C, ...のブロック番号）
+ *       - ブロックA, ブロックB, ブロックC, ...
+ *       - コミットブロック（tid）
  *
- * ログの追記は同期的に行われる。
+ * コミットはデバイスごとのコミットスレッド(kjournald)が行う（グループ
+ * コミット）。end_op()はI/Oを行わずに戻り、複数のシステムコールの更新は
+ * 次のいずれかの契機でまとめて1回でコミットされる。
+ *
+ *   - 最初のブロックがログに記録されてからLOG_COMMIT_INTERVALが経過した
+ *   - ログに記録されたブロックがトランザクションの上限の半分を超えた
+ *   - begin_op()がログの空きを待っている
+ *   - fsync()がトランザクションの永続化を待っている
+ *
+ * コミットが要求されるとcommittingをセットして新しいシステムコールの
+ * 開始を止め、実行中のシステムコールがすべて終了した時点でコミットする。
+ * トランザクションはtidで識別され、commit_tidはディスクにコミット
+ * された最後のtidである。
+ *
+ * コミットしたブロックはすぐには本来の位置に書き込まない（チェック
+ * ポイント）。バッファキャッシュにB_DIRTYでピンしておき、ログ領域の
+ * 半分が埋まるなどしたらコミットスレッドがまとめて書き出して、ログの
+ * 末尾(tail)を進める。何度も更新されるブロック（ビットマップや
+ * inodeブロック）はチェックポイントごとに1回書き込むだけで済む。
+ * チェックポイントはシステムコールと並行して行う。実行中の
+ * トランザクションで更新されたブロックはコミットされるまで書き出さない。
+ *
+ * ext2はext3互換のジャーナル（ジャーナルinodeのブロック、JBD形式）を
+ * 同じ仕組みで使う（initlog_jbd()）。ディスクリプタ、コミット、
+ * スーパーブロックの形式が異なるだけである。メタデータとデータの
+ * 両方をジャーナルに書く（data=journal）のでrevokeは書かないが、
+ * リカバリではLinuxが書いたrevokeを扱う。
  */
 
-/* ヘッダブロックの内容であり、ディスク上のヘッダブロックとコミット前の
- * ログブロック番号をメモリ上で追跡するために使用される、
- */
+#define LOG_SUPER_MAGIC     0x4c4f4753      // "LOGS"
+#define LOG_DESC_MAGIC      0x4c4f4744      // "LOGD"
+#define LOG_COMMIT_MAGIC    0x4c4f4743      // "LOGC"
+
+/* ログ領域の先頭ブロック */
+struct log_super {
+    uint32_t magic;
+    uint32_t start;             // 最古のトランザクションの循環領域内の位置
+    uint64_t sequence;          // そのtid
+};
+
+/* トランザクションの先頭ブロック */
+struct log_desc {
+    uint32_t magic;
+    uint32_t n;                 // ブロック数
+    uint64_t tid;
+    uint32_t block[LOGSIZE];    // ブロック番号
+};
+
+/* トランザクションの末尾ブロック。これが書かれたらコミット済み */
+struct log_commit {
+    uint32_t magic;
+    uint32_t n;
+    uint64_t tid;
+};
+
+/* 実行中のトランザクションのログブロック番号をメモリ上で追跡する */
 struct logheader {
     int n;
     int block[LOGSIZE];
 };
 
+/* コミット済みでチェックポイントされていないブロック */
+struct cpent {
+    uint32_t blockno;
+    uint32_t done;              // チェックポイントで書き出した
+    uint64_t pos;               // 最新のコピーを含むトランザクションの位置
+    uint64_t tid;               // そのtid
+};
+
 struct log {
     struct spinlock lock;
-    int start;
+    int start;                  // v6: ログ領域の先頭ブロック
     int size;
+    int jbd;                    // ext3形式のジャーナル
+    uint32_t *map;              // jbd: ジャーナルのブロックのディスク上の番号
+    uint8_t uuid[16];           // jbd: ジャーナルのuuid
+    uint32_t first;             // 循環領域の先頭のログ内のブロック番号
+    uint32_t nblocks;           // 循環領域のブロック数
+    struct proc *thread;        // コミットスレッド
     int outstanding;            // 実行中のFSシステムコール数
-    int committing;             // commit()実行中。待て。
+    int committing;             // コミット要求中またはcommit()実行中。待て。
     int dev;
     int flag;                   // LOGENABLED/
+    uint64_t tid;               // 実行中のトランザクションのID
+    uint64_t commit_tid;        // コミット済みの最後のトランザクションのID
+    int timer_armed;            // timerがセットされている
+    struct hrtimer timer;       // LOG_COMMIT_INTERVAL後にコミットを要求する
+    int maxtrans;               // トランザクションの最大ブロック数
+    int pinmax;                 // ピンしてよいバッファ数
+    uint64_t head;              // 次のトランザクションを書く位置（循環前の通し番号）
+    uint64_t tail;              // 最古の未チェックポイントトランザクションの位置
+    int need_cp;                // チェックポイントが要求されている
+    int cp_io;                  // チェックポイントの書き込み中のブロック数
+    int cp_error;               // チェックポイントの書き込みが失敗した
+    int ncp;
+    struct cpent *cp;           // コミット済みでチェックポイントされていないブロック
     struct logheader lh;
 };
 struct log log[NLOG];
 
 #define LOGENABLED  1
 
+#define LOG_COMMIT_INTERVAL     (NSEC_PER_SEC / 2)  // 最初の更新からコミットまでの最大時間
+
 extern struct superblock sb[NMINOR];
 
-static void recover_from_log();
-static void commit(int dev);
+static void recover_from_log(struct log *lg);
+static void jbd_recover(struct log *lg);
+static void log_commit_thread(void *arg);
+
+/* 循環領域の位置posにあるブロックのブロック番号 */
+static uint32_t
+logblock(struct log *lg, uint64_t pos)
+{
+    uint32_t i = lg->first + pos % lg->nblocks;
+    return lg->map ? lg->map[i] : lg->start + i;
+}
+
+/* ログのスーパーブロックのブロック番号 */
+static uint32_t
+logsuper(struct log *lg)
+{
+    return lg->map ? lg->map[0] : lg->start;
+}
+
+/*
+ * 形式に依らない初期化。ログを再実行してコミットスレッドを起動する。
+ * 再マウントではコミットスレッドはそのまま使う
+ */
+static void
+log_setup(struct log *lg)
+{
+    // 1トランザクションが循環領域に収まり、コミット済みのブロックと
+    // 合わせてバッファキャッシュをピンし尽くさないようにする
+    lg->maxtrans = MIN(LOGSIZE, lg->nblocks - 2);
+    lg->pinmax = bcache_nbuf() - MAXOPBLOCKS;
+    if (lg->maxtrans < MAXOPBLOCKS || lg->pinmax < MAXOPBLOCKS)
+        panic("initlog: too small log");
+    kmfree(lg->cp);
+    if ((lg->cp = kmalloc(sizeof(struct cpent) * lg->nblocks)) == 0)
+        panic("initlog: no memory");
+    lg->ncp = 0;
+    lg->outstanding = 0;
+    lg->committing = 0;
+    lg->need_cp = 0;
+    if (lg->jbd)
+        jbd_recover(lg);
+    else
+        recover_from_log(lg);
+    lg->flag = LOGENABLED;
+    if (lg->thread == 0)
+        assert(lg->thread = kthread_create(log_commit_thread, lg, "kjournald"));
+}
 
 // log機能はV6固有だが、begin_op()する段階ではどのFSを使うか
 // わからないのでログを区別できない。速度的には無駄になるが
@@ -65,79 +196,624 @@ static void commit(int dev);
 void
 initlog(int dev)
 {
-    // ログヘッダはディスクのログ領域の先頭ブロックにある
-    // だから、1ブロック未満でなければならない
-    if (sizeof(struct logheader) >= sb[dev].blocksize)
-        panic("initlog: too big logheader");
-    initlock(&log[dev].lock, "log");
+    // ディスクリプタはログ領域の1ブロックに収まらなければならない
+    if (sizeof(struct log_desc) > sb[dev].blocksize)
+        panic("initlog: too big log descriptor");
+    struct log *lg = &log[dev];
+    // 再マウント: ログはそのまま使う
+    if (lg->flag & LOGENABLED)
+        return;
+    if (lg->thread == 0)
+        initlock(&lg->lock, "log");
     struct v6_superblock *v6sb = sb[dev].fs_info;
-    log[dev].start = v6sb->logstart;
-    log[dev].size = v6sb->nlog;
-    log[dev].dev = dev;
-    log[dev].flag = LOGENABLED;
-    recover_from_log();
-    info("init log ok");
+    lg->start = v6sb->logstart;
+    lg->size = v6sb->nlog;
+    lg->dev = dev;
+    lg->jbd = 0;
+    lg->map = 0;
+    lg->first = 1;
+    lg->nblocks = lg->size - 1;
+    log_setup(lg);
+    info("init log ok: %d blocks", lg->size);
 }
 
-/* コミット済みブロックをディスクから本来のblockにコピー */
+/*
+ * ext3形式のジャーナルを使う。map[i]はジャーナルのi番目のブロックの
+ * ディスク上のブロック番号で、maxlenブロックある。mapはログが使い続ける。
+ * 扱えないジャーナルであれば-1を返す。
+ */
+int
+initlog_jbd(int dev, uint32_t *map, uint32_t maxlen)
+{
+    if (dev >= NLOG)
+        return -1;
+
+    struct log *lg = &log[dev];
+    if (lg->flag & LOGENABLED)
+        return 0;
+
+    struct buf *buf = bread(dev, map[0]);
+    journal_superblock_t *jsb = (journal_superblock_t *)buf->data;
+    uint32_t type = be32(jsb->s_header.h_blocktype);
+    int ok = (be32(jsb->s_header.h_magic) == JBD_MAGIC &&
+              (type == JBD_SUPERBLOCK_V1 || type == JBD_SUPERBLOCK_V2) &&
+              be32(jsb->s_blocksize) == BSIZE &&
+              be32(jsb->s_maxlen) <= maxlen && be32(jsb->s_first) > 0 &&
+              be32(jsb->s_first) < be32(jsb->s_maxlen));
+    // チェックサムや64ビットブロック番号などには対応していない
+    if (ok && type == JBD_SUPERBLOCK_V2 &&
+        (be32(jsb->s_feature_compat) != 0 ||
+         (be32(jsb->s_feature_incompat) & ~JBD_FEATURE_INCOMPAT_REVOKE) != 0))
+        ok = 0;
+    if (ok) {
+        lg->first = be32(jsb->s_first);
+        lg->nblocks = be32(jsb->s_maxlen) - lg->first;
+        if (type == JBD_SUPERBLOCK_V2)
+            memmove(lg->uuid, jsb->s_uuid, sizeof(lg->uuid));
+        else
+            memset(lg->uuid, 0, sizeof(lg->uuid));
+    }
+    brelse(buf);
+    if (!ok) {
+        warn("dev %d: unsupported journal", dev);
+        return -1;
+    }
+
+    if (lg->thread == 0)
+        initlock(&lg->lock, "log");
+    lg->start = 0;
+    lg->size = lg->first + lg->nblocks;
+    lg->dev = dev;
+    lg->jbd = 1;
+    lg->map = map;
+    log_setup(lg);
+    info("dev %d: ext3 journal %d blocks", dev, lg->size);
+    return 0;
+}
+
+/* devのログが使われているか */
+int
+log_enabled(int dev)
+{
+    return dev < NLOG && (log[dev].flag & LOGENABLED);
+}
+
+/*
+ * ログの位置posから記録されたn個のブロックを本来のblockにコピー。
+ * flagsがあればJBDのエスケープを戻す
+ */
 static void
-install_trans(int dev)
+install_trans(struct log *lg, uint64_t pos, uint32_t *blocks, uint32_t *flags, int n)
 {
-    if (dev >= NLOG || !(log[dev].flag & LOGENABLED)) return;
+    struct buf *dbufs[DEV_MAXMERGE];
+    int m = 0;
 
-    for (int tail = 0; tail < log[dev].lh.n; tail++) {
-        struct buf *lbuf = bread(log[dev].dev, log[dev].start + tail + 1);    // read log block（先頭はheaderなので+1)
-        struct buf *dbuf = bread(log[dev].dev, log[dev].lh.block[tail]);      // read dst
+    for (int i = 0; i < n; i++) {
+        struct buf *lbuf = bread(lg->dev, logblock(lg, pos + i));  // read log block
+        struct buf *dbuf = bread(lg->dev, blocks[i]);               // read dst
         memmove(dbuf->data, lbuf->data, BSIZE);                     // copy block to dst
-        bwrite(dbuf);                                               // write dst to disk
+        if (flags && (flags[i] & JBD_FLAG_ESCAPE))
+            *(uint32_t *)dbuf->data = be32(JBD_MAGIC);
         brelse(lbuf);
-        brelse(dbuf);
+        dbufs[m++] = dbuf;
+        // 隣接ブロックをまとめて書き出す
+        if (m == DEV_MAXMERGE || i == n - 1) {
+            bwritev(dbufs, m);                                      // write dst to disk
+            for (int j = 0; j < m; j++)
+                brelse(dbufs[j]);
+            m = 0;
+        }
     }
 }
 
-/* ログヘッダをディスクからメモリに読み込む */
+/*
+ * ログスーパーブロックを書き込む。posにあるtidのトランザクションより
+ * 前のログは不要になる。posがheadであればログは空である
+ */
 static void
-read_head(int dev)
+write_super(struct log *lg, uint64_t pos, uint64_t tid)
 {
-    if (dev >= NLOG || !(log[dev].flag & LOGENABLED)) return;
+    struct buf *buf;
 
-    struct buf *buf = bread(log[dev].dev, log[dev].start);  // log headerを読み込み
-    struct logheader *lh = (struct logheader *)(buf->data);
-    log[dev].lh.n = lh->n;
-    for (int i = 0; i < log[dev].lh.n; i++) {
-        log[dev].lh.block[i] = lh->block[i];
+    if (lg->jbd) {
+        buf = bread(lg->dev, logsuper(lg));
+        journal_superblock_t *jsb = (journal_superblock_t *)(buf->data);
+        jsb->s_sequence = be32((uint32_t)tid);
+        jsb->s_start = pos == lg->head ? 0 : be32(lg->first + pos % lg->nblocks);
+    } else {
+        buf = bget(lg->dev, logsuper(lg));
+        struct log_super *ls = (struct log_super *)(buf->data);
+        memset(buf->data, 0, BSIZE);
+        ls->magic = LOG_SUPER_MAGIC;
+        ls->start = pos % lg->nblocks;
+        ls->sequence = tid;
     }
+    bwrite(buf);
     brelse(buf);
 }
 
 /*
- * メモリ上のログヘッダをディスクに書き込む。
- * これが本当の意味でのカレントトランザクションの
- * コミッションポイント
+ * 位置posにあるtidのトランザクションを読む。コミット済みであれば
+ * ブロック番号をlg->lhに入れて1を返す。
+ */
+static int
+read_trans(struct log *lg, uint64_t pos, uint64_t tid)
+{
+    struct buf *buf = bread(lg->dev, logblock(lg, pos));
+    struct log_desc *ld = (struct log_desc *)(buf->data);
+    int ok = (ld->magic == LOG_DESC_MAGIC && ld->tid == tid &&
+              ld->n > 0 && ld->n <= lg->maxtrans);
+    if (ok) {
+        lg->lh.n = ld->n;
+        for (int i = 0; i < lg->lh.n; i++)
+            lg->lh.block[i] = ld->block[i];
+    }
+    brelse(buf);
+    if (!ok)
+        return 0;
+
+    buf = bread(lg->dev, logblock(lg, pos + 1 + lg->lh.n));
+    struct log_commit *lc = (struct log_commit *)(buf->data);
+    ok = (lc->magic == LOG_COMMIT_MAGIC && lc->tid == tid && lc->n == lg->lh.n);
+    brelse(buf);
+    return ok;
+}
+
+/*
+ * ログスーパーブロックが指すトランザクションからコミット済みの
+ * ものを順に再実行して、ログを空にする
  */
 static void
-write_head(int dev)
+recover_from_log(struct log *lg)
 {
-    if (dev >= NLOG || !(log[dev].flag & LOGENABLED)) return;
+    struct buf *buf = bread(lg->dev, logsuper(lg));
+    struct log_super ls = *(struct log_super *)(buf->data);
+    // 旧形式のログヘッダ（ブロック数とブロック番号の配列）
+    uint32_t n = *(uint32_t *)(buf->data);
+    uint32_t *blocks = (uint32_t *)(buf->data) + 1;
+    uint64_t pos = 0, tid = 1;
+
+    if (ls.magic != LOG_SUPER_MAGIC) {
+        if (n > 0 && n < lg->size && n < BSIZE / sizeof(uint32_t)) {
+            info("recover %d blocks from old log", n);
+            install_trans(lg, 0, blocks, 0, n);
+        }
+        brelse(buf);
+    } else {
+        brelse(buf);
+        pos = ls.start;
+        tid = ls.sequence;
+        while (read_trans(lg, pos, tid)) {
+            install_trans(lg, pos + 1, (uint32_t *)lg->lh.block, 0, lg->lh.n);
+            pos += lg->lh.n + 2;
+            tid++;
+        }
+    }
+    lg->lh.n = 0;
+    lg->head = lg->tail = pos;
+    lg->tid = tid;
+    lg->commit_tid = tid - 1;
+    write_super(lg, pos, tid);          // clear the log
+}
+
+#define JBD_MAXTAGS     (BSIZE / sizeof(journal_block_tag_t))
+#define JBD_MAXREVOKE   4096
+
+struct jbd_revoke {
+    uint32_t blockno;
+    uint32_t tid;                       // revokeしたトランザクション
+};
+
+/*
+ * ディスクリプタブロックdataのタグを読み、ブロック番号をblocksに、
+ * フラグをflagsに入れる。タグ数を返す
+ */
+static int
+jbd_tags(char *data, uint32_t *blocks, uint32_t *flags)
+{
+    int off = sizeof(journal_header_t), n = 0;
+
+    while (off + sizeof(journal_block_tag_t) <= BSIZE) {
+        journal_block_tag_t *tag = (journal_block_tag_t *)(data + off);
+        blocks[n] = be32(tag->t_blocknr);
+        flags[n] = be32(tag->t_flags);
+        off += sizeof(journal_block_tag_t);
+        if (!(flags[n] & JBD_FLAG_SAME_UUID))
+            off += 16;
+        if (flags[n++] & JBD_FLAG_LAST_TAG)
+            break;
+    }
+    return n;
+}
+
+/*
+ * ext3形式のジャーナルを再実行する。1パス目でコミット済みの
+ * トランザクションの終わりを探してrevokeを集め、2パス目で
+ * revokeされていないブロックを本来の位置にコピーする
+ */
+static void
+jbd_recover(struct log *lg)
+{
+    struct buf *buf = bread(lg->dev, logsuper(lg));
+    journal_superblock_t *jsb = (journal_superblock_t *)(buf->data);
+    uint32_t start = be32(jsb->s_start);
+    uint32_t seq = be32(jsb->s_sequence), tid, end_tid = seq;
+    uint64_t pos0 = start ? start - lg->first : 0, pos, end = pos0;
+    int nrv = 0, n, done;
+    brelse(buf);
+
+    uint32_t *blocks = kmalloc(sizeof(uint32_t) * JBD_MAXTAGS * 2);
+    uint32_t *flags = blocks + JBD_MAXTAGS;
+    struct jbd_revoke *rv = kmalloc(sizeof(struct jbd_revoke) * JBD_MAXREVOKE);
+    if (blocks == 0 || rv == 0)
+        panic("jbd_recover: no memory");
+
+    // 1パス目: コミットブロックのある最後のトランザクションまでを対象とする
+    for (pos = pos0, tid = seq, done = !start; !done; ) {
+        buf = bread(lg->dev, logblock(lg, pos));
+        journal_header_t *h = (journal_header_t *)(buf->data);
+        if (be32(h->h_magic) != JBD_MAGIC || be32(h->h_sequence) != tid) {
+            brelse(buf);
+            break;
+        }
+        switch (be32(h->h_blocktype)) {
+        case JBD_DESCRIPTOR_BLOCK:
+            pos += 1 + jbd_tags((char *)buf->data, blocks, flags);
+            break;
+        case JBD_COMMIT_BLOCK:
+            pos++;
+            end = pos;
+            end_tid = ++tid;
+            break;
+        case JBD_REVOKE_BLOCK: {
+            journal_revoke_header_t *r = (journal_revoke_header_t *)h;
+            uint32_t count = MIN(be32(r->r_count), BSIZE);
+            uint32_t *p = (uint32_t *)(r + 1);
+            for (uint32_t off = sizeof(*r); off + 4 <= count; off += 4, p++) {
+                if (nrv == JBD_MAXREVOKE)
+                    panic("jbd_recover: too many revoke records");
+                rv[nrv].blockno = be32(*p);
+                rv[nrv++].tid = tid;
+            }
+            pos++;
+            break;
+        }
+        default:
+            done = 1;
+            break;
+        }
+        brelse(buf);
+    }
+
+    // 2パス目: 同じか後のトランザクションでrevokeされたブロックは飛ばす
+    for (pos = pos0, tid = seq; tid != end_tid; ) {
+        buf = bread(lg->dev, logblock(lg, pos));
+        journal_header_t *h = (journal_header_t *)(buf->data);
+        uint32_t type = be32(h->h_blocktype);
+        n = type == JBD_DESCRIPTOR_BLOCK ? jbd_tags((char *)buf->data, blocks, flags) : 0;
+        brelse(buf);
+        if (type == JBD_COMMIT_BLOCK)
+            tid++;
+        for (int i = 0; i < n; i++) {
+            int revoked = 0;
+            for (int j = 0; j < nrv && !revoked; j++)
+                revoked = (rv[j].blockno == blocks[i] && (int32_t)(rv[j].tid - tid) >= 0);
+            if (!revoked)
+                install_trans(lg, pos + 1 + i, &blocks[i], &flags[i], 1);
+        }
+        pos += 1 + n;
+    }
+    if (end_tid != seq)
+        info("jbd: recovered %d transactions", end_tid - seq);
+
+    kmfree(blocks);
+    kmfree(rv);
+    lg->lh.n = 0;
+    lg->head = lg->tail = end;
+    lg->tid = end_tid;
+    lg->commit_tid = end_tid - 1;
+    write_super(lg, end, end_tid);      // clear the log
+}
+
+/*
+ * コミットスレッドにコミットを要求する。
+ * 呼び出し元はlg->lockを保持していなければならない。
+ */
+static void
+request_commit(struct log *lg)
+{
+    lg->committing = 1;
+    if (lg->outstanding == 0)
+        wakeup(&lg->committing);
+}
+
+/* LOG_COMMIT_INTERVALが経過した。割り込みコンテキストで呼ばれる */
+static int
+log_timer_fn(struct hrtimer *t)
+{
+    struct log *lg = container_of(t, struct log, timer);
+
+    acquire(&lg->lock);
+    lg->timer_armed = 0;
+    if (lg->lh.n > 0)
+        request_commit(lg);
+    release(&lg->lock);
+    return HRTIMER_NORESTART;
+}
+
+/* blocknoが実行中のトランザクションに含まれているか。lg->lockを保持すること */
+static int
+in_trans(struct log *lg, uint32_t blockno)
+{
+    for (int i = 0; i < lg->lh.n; i++) {
+        if (lg->lh.block[i] == blockno)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * 変更されたブロックをキャッシュからログの位置posへコピーする。
+ * ディスクリプタはエスケープしたブロックのフラグが決まってから
+ * 最後のブロックと一緒に書き出す
+ */
+static void
+write_log(struct log *lg, uint64_t pos, uint64_t tid)
+{
+    struct buf *tos[DEV_MAXMERGE + 1];
+    int n = 0;
+    int off = sizeof(journal_header_t);
 
-    struct buf *buf = bread(log[dev].dev, log[dev].start);
-    struct logheader *hb = (struct logheader *)(buf->data);
-    hb->n = log[dev].lh.n;
-    for (int i = 0; i < log[dev].lh.n; i++) {
-        hb->block[i] = log[dev].lh.block[i];
+    struct buf *d = bget(lg->dev, logblock(lg, pos));       // descriptor
+    memset(d->data, 0, BSIZE);
+    if (lg->jbd) {
+        journal_header_t *h = (journal_header_t *)(d->data);
+        h->h_magic = be32(JBD_MAGIC);
+        h->h_blocktype = be32(JBD_DESCRIPTOR_BLOCK);
+        h->h_sequence = be32((uint32_t)tid);
+    } else {
+        struct log_desc *ld = (struct log_desc *)(d->data);
+        ld->magic = LOG_DESC_MAGIC;
+        ld->n = lg->lh.n;
+        ld->tid = tid;
+        for (int i = 0; i < lg->lh.n; i++)
+            ld->block[i] = lg->lh.block[i];
+    }
+
+    for (int tail = 0; tail < lg->lh.n; tail++) {
+        struct buf *to = bget(lg->dev, logblock(lg, pos + 1 + tail));  // log block
+        struct buf *from = bread(lg->dev, lg->lh.block[tail]);          // cache block
+        memmove(to->data, from->data, BSIZE);
+        brelse(from);
+        if (lg->jbd) {
+            // マジックで始まるブロックはエスケープする
+            journal_block_tag_t *tag = (journal_block_tag_t *)(d->data + off);
+            uint32_t flags = tail > 0 ? JBD_FLAG_SAME_UUID : 0;
+            if (*(uint32_t *)to->data == be32(JBD_MAGIC)) {
+                *(uint32_t *)to->data = 0;
+                flags |= JBD_FLAG_ESCAPE;
+            }
+            if (tail == lg->lh.n - 1)
+                flags |= JBD_FLAG_LAST_TAG;
+            tag->t_blocknr = be32(lg->lh.block[tail]);
+            tag->t_flags = be32(flags);
+            off += sizeof(*tag);
+            if (tail == 0) {
+                memmove(d->data + off, lg->uuid, sizeof(lg->uuid));
+                off += sizeof(lg->uuid);
+            }
+        }
+        tos[n++] = to;
+        if (tail == lg->lh.n - 1)
+            tos[n++] = d;
+        // ログブロックは（折り返しを除いて）連続しているので1コマンドで書き出せる
+        if (n >= DEV_MAXMERGE || tail == lg->lh.n - 1) {
+            bwritev(tos, n);                                    // write the log
+            for (int i = 0; i < n; i++)
+                brelse(tos[i]);
+            n = 0;
+        }
+    }
+}
+
+/* コミットブロックを書き込む。これが本当の意味でのコミットポイント */
+static void
+write_commit(struct log *lg, uint64_t pos, uint64_t tid)
+{
+    struct buf *buf = bget(lg->dev, logblock(lg, pos));
+
+    memset(buf->data, 0, BSIZE);
+    if (lg->jbd) {
+        journal_header_t *h = (journal_header_t *)(buf->data);
+        h->h_magic = be32(JBD_MAGIC);
+        h->h_blocktype = be32(JBD_COMMIT_BLOCK);
+        h->h_sequence = be32((uint32_t)tid);
+    } else {
+        struct log_commit *lc = (struct log_commit *)(buf->data);
+        lc->magic = LOG_COMMIT_MAGIC;
+        lc->n = lg->lh.n;
+        lc->tid = tid;
     }
     bwrite(buf);
     brelse(buf);
 }
 
+/*
+ * コミット済みのブロックをチェックポイントリストに加える。
+ * 前のトランザクションのコピーはこれで不要になる（吸収）。
+ * lg->lockを保持すること
+ */
 static void
-recover_from_log()
+cp_add(struct log *lg, uint32_t blockno, uint64_t pos, uint64_t tid)
 {
-    for (int i = 0; i < NLOG; i++) {
-        read_head(i);
-        install_trans(i);            // if committed, copy from log to disk
-        log[i].lh.n = 0;
-        write_head(i);               // clear the log
+    int i;
+
+    for (i = 0; i < lg->ncp; i++) {
+        if (lg->cp[i].blockno == blockno)
+            break;
+    }
+    if (i == lg->ncp)
+        lg->ncp++;
+    lg->cp[i].blockno = blockno;
+    lg->cp[i].done = 0;
+    lg->cp[i].pos = pos;
+    lg->cp[i].tid = tid;
+}
+
+/*
+ * 実行中のトランザクションをコミットする。実行中のシステムコールは
+ * ないので、lg->lhはコミットスレッドしか変更しない。
+ * 更新されたブロックは本来の位置には書かず、ピンしたままにする。
+ */
+static void
+commit(struct log *lg, uint64_t tid)
+{
+    uint64_t pos = lg->head;
+    int n = lg->lh.n;
+
+    if (n == 0)
+        return;
+    write_log(lg, pos, tid);            // Write descriptor and modified blocks to log
+    write_commit(lg, pos + 1 + n, tid); // Write commit block -- the real commit
+
+    acquire(&lg->lock);
+    for (int i = 0; i < n; i++)
+        cp_add(lg, lg->lh.block[i], pos, tid);
+    lg->head = pos + n + 2;
+    lg->lh.n = 0;
+    release(&lg->lock);
+}
+
+/* チェックポイントの書き込みの完了。I/Oワーカーから呼ばれる */
+static void
+checkpoint_end(struct buf *b)
+{
+    struct log *lg = b->private;
+
+    b->end_io = 0;
+    b->private = 0;
+    // 失敗したら次のチェックポイントで書き直すまでピンしておく
+    if (b->flags & B_ERROR)
+        b->flags |= B_DIRTY;
+    brelse_io(b);                       // B_DIRTYはクリアされピンが外れる
+    acquire(&lg->lock);
+    if (b->flags & B_ERROR)
+        lg->cp_error = 1;
+    if (--lg->cp_io == 0)
+        wakeup(&lg->cp_io);
+    release(&lg->lock);
+}
+
+/*
+ * コミット済みのブロックを本来の位置に書き出してログの末尾を進める。
+ * 実行中のトランザクションで更新されたブロックはコミットされていない
+ * 内容を含むので書き出さず、そのブロックを含むトランザクションを
+ * 次回まで残す。バッファを1つずつロックして非同期に書き出すので、
+ * 他のバッファを待っているシステムコールとデッドロックしない。
+ */
+static void
+checkpoint(struct log *lg)
+{
+    uint64_t tail, tid;
+    int i, n;
+
+    acquire(&lg->lock);
+    lg->need_cp = 0;
+    release(&lg->lock);
+
+    // lg->cpとlg->ncpを変更するのはコミットスレッドだけ
+    for (i = 0; i < lg->ncp; i++) {
+        struct buf *b = bread(lg->dev, lg->cp[i].blockno);
+        acquire(&lg->lock);
+        int busy = in_trans(lg, b->blockno);
+        if (!busy)
+            lg->cp_io++;
+        release(&lg->lock);
+        if (busy) {
+            brelse(b);
+            continue;
+        }
+        lg->cp[i].done = 1;
+        b->private = lg;
+        b->end_io = checkpoint_end;
+        b->flags |= B_DIRTY;
+        submit_bio(b);
+    }
+
+    acquire(&lg->lock);
+    while (lg->cp_io > 0)
+        sleep(&lg->cp_io, &lg->lock);
+    // 書けなかったブロックがあればログを残して次回やり直す
+    if (lg->cp_error) {
+        warn("checkpoint: I/O error: dev %d", lg->dev);
+        lg->cp_error = 0;
+        for (i = 0; i < lg->ncp; i++)
+            lg->cp[i].done = 0;
+    }
+    // 書き出したブロックを除き、残ったものの最古のトランザクションを新しい末尾にする
+    tail = lg->head;
+    tid = lg->tid;
+    for (i = n = 0; i < lg->ncp; i++) {
+        if (lg->cp[i].done)
+            continue;
+        if (lg->cp[i].pos < tail) {
+            tail = lg->cp[i].pos;
+            tid = lg->cp[i].tid;
+        }
+        lg->cp[n++] = lg->cp[i];
+    }
+    lg->ncp = n;
+    release(&lg->lock);
+
+    if (tail == lg->tail)
+        return;
+    write_super(lg, tail, tid);
+    acquire(&lg->lock);
+    lg->tail = tail;
+    wakeup(lg);                         // begin_op()がログの空きを待っている
+    release(&lg->lock);
+}
+
+/* チェックポイントするべきか。lg->lockを保持すること */
+static int
+need_checkpoint(struct log *lg)
+{
+    return lg->need_cp || lg->head - lg->tail > lg->nblocks / 2 ||
+           lg->ncp > lg->pinmax / 2;
+}
+
+/*
+ * コミットスレッド。要求されたら実行中のシステムコールがなくなるのを
+ * 待ってコミットし、commit_tidを進めて待っているプロセスを起こす。
+ * 必要ならその後でチェックポイントする。
+ */
+static void
+log_commit_thread(void *arg)
+{
+    struct log *lg = arg;
+    uint64_t tid;
+
+    acquire(&lg->lock);
+    for (;;) {
+        while (!lg->committing || lg->outstanding > 0)
+            sleep(&lg->committing, &lg->lock);
+        tid = lg->tid;
+        release(&lg->lock);
+
+        // commit()はロックせずに実行する。なぜなら、
+        // ロックも持ってsleepすることが許されないから。
+        commit(lg, tid);
+
+        acquire(&lg->lock);
+        lg->commit_tid = tid;
+        lg->tid++;
+        lg->committing = 0;
+        wakeup(lg);
+        if (need_checkpoint(lg)) {
+            release(&lg->lock);
+            checkpoint(lg);
+            acquire(&lg->lock);
+        }
     }
 }
 
@@ -148,17 +824,27 @@ begin_op()
     for (int i = 0; i < NLOG; i++) {
         if (!log[i].flag & LOGENABLED) continue;
 
-        acquire(&log[i].lock);
+        struct log *lg = &log[i];
+        acquire(&lg->lock);
         while (1) {
-            if (log[i].committing) {
-                sleep(&log[i], &log[i].lock);
-            } else if (log[i].lh.n + (log[i].outstanding + 1) * MAXOPBLOCKS >
-                    LOGSIZE) {
-                // ログが枯渇する恐れがあるのでコミットされるのを待機する
-                sleep(&log[i], &log[i].lock);
+            int reserve = lg->lh.n + (lg->outstanding + 1) * MAXOPBLOCKS;
+            if (lg->committing) {
+                sleep(lg, &lg->lock);
+            } else if (reserve > lg->maxtrans) {
+                // トランザクションが溢れる恐れがあるのでコミットを要求して待機する
+                request_commit(lg);
+                sleep(lg, &lg->lock);
+            } else if (lg->head - lg->tail + reserve + 2 > lg->nblocks ||
+                       lg->ncp + reserve > lg->pinmax) {
+                // ログかバッファキャッシュが枯渇する恐れがあるので
+                // チェックポイントを要求して待機する
+                lg->need_cp = 1;
+                request_commit(lg);
+                sleep(lg, &lg->lock);
             } else {
-                log[i].outstanding += 1;
-                release(&log[i].lock);
+                lg->outstanding += 1;
+                thisproc()->logops |= 1 << i;
+                release(&lg->lock);
                 break;
             }
         }
@@ -167,79 +853,90 @@ begin_op()
 }
 
 /*
- * FSシステムコールの終了時に呼ばれる。
- * これが実行中の最後のシステムコールの場合はコミットする
+ * FSシステムコールの終了時に呼ばれる。I/Oは行わない。
+ * これが実行中の最後のシステムコールで、コミットが要求されているか
+ * ログが十分にたまっている場合はコミットスレッドを起こす。
+ * begin_op()の後でマウントされたログは対象としない
  */
 void
 end_op()
 {
-    for (int i = 0; i < NLOG; i++) {
-        if (!log[i].flag & LOGENABLED) continue;
+    struct proc *p = thisproc();
 
-        int do_commit = 0;
+    for (int i = 0; i < NLOG; i++) {
+        if (!(p->logops & (1 << i))) continue;
 
         acquire(&log[i].lock);
         log[i].outstanding -= 1;
-        if (log[i].committing)
-            panic("log committing");
-        if (log[i].outstanding == 0) {
-            do_commit = 1;
-            log[i].committing = 1;
-        } else {
-            // begin_op()がログスペースが空くのを待っている可能性がある。
-            // また、log[i].outstandingを減ずることで予約スペースが減じた可能性がある
-            wakeup(&log[i]);
-        }
+        if (log[i].outstanding == 0 &&
+            (log[i].committing || log[i].lh.n >= log[i].maxtrans / 2))
+            request_commit(&log[i]);
+        // begin_op()がログスペースが空くのを待っている可能性がある。
+        // また、log[i].outstandingを減ずることで予約スペースが減じた可能性がある
+        wakeup(&log[i]);
         release(&log[i].lock);
-
-        if (do_commit) {
-            // commit()はロックせずに実行する。なぜなら、
-            // ロックも持ってsleepすることが許されないから。
-            commit(i);
-            acquire(&log[i].lock);
-            log[i].committing = 0;
-            wakeup(&log[i]);
-            release(&log[i].lock);
-        }
     }
+    p->logops = 0;
 
 }
 
-/* 変更されたブロックをキャッシュからログへコピーする */
-static void
-write_log(int dev)
+/*
+ * devで終了したシステムコールの更新がディスクにコミットされるまで待つ。
+ * fsync()から呼ばれる。
+ */
+void
+log_force(int dev)
 {
     if (dev >= NLOG || !(log[dev].flag & LOGENABLED)) return;
 
-    for (int tail = 0; tail < log[dev].lh.n; tail++) {
-        struct buf *to = bread(log[dev].dev, log[dev].start + tail + 1);  // log block
-        struct buf *from = bread(log[dev].dev, log[dev].lh.block[tail]);  // cache block
-        memmove(to->data, from->data, BSIZE);
-        bwrite(to);                                             // write the log
-        brelse(from);
-        brelse(to);
+    struct log *lg = &log[dev];
+
+    acquire(&lg->lock);
+    // 実行中のトランザクションが空でコミット中でもなければ待つ必要はない
+    if (lg->lh.n > 0 || lg->committing) {
+        uint64_t tid = lg->tid;
+        request_commit(lg);
+        while (lg->commit_tid < tid)
+            sleep(lg, &lg->lock);
     }
+    release(&lg->lock);
 }
 
-static void
-commit(int dev)
+/*
+ * devのログを閉じる。コミットしてすべてチェックポイントし、ログを
+ * 空にする。ext3形式のジャーナルであれば、リカバリが不要になったので
+ * スーパーブロックのRECOVERを落とす。アンマウント後にトランザクションの
+ * 外から呼ばれる
+ */
+void
+log_close(int dev)
 {
-    if (dev >= NLOG || !(log[dev].flag & LOGENABLED)) return;
+    if (!log_enabled(dev)) return;
+
+    struct log *lg = &log[dev];
 
-    if (log[dev].lh.n > 0) {
-        write_log(dev);            // Write modified blocks from cache to log
-        write_head(dev);           // Write header to disk -- the real commit
-        install_trans(dev);        // Now install writes to home locations
-        disb();
-        log[dev].lh.n = 0;
-        disb();
-        write_head(dev);           // Erase the transaction from the log
+    acquire(&lg->lock);
+    while (lg->lh.n > 0 || lg->committing || lg->head != lg->tail) {
+        lg->need_cp = 1;
+        request_commit(lg);
+        sleep(lg, &lg->lock);
+    }
+    lg->flag = 0;
+    release(&lg->lock);
+
+    if (lg->jbd) {
+        struct ext2_sb_info *sbi = EXT2_SB(&sb[dev]);
+        acquiresleep(&sbi->s_sbh->lock);
+        sbi->s_es->s_feature_incompat &= ~EXT3_FEATURE_INCOMPAT_RECOVER;
+        bwrite(sbi->s_sbh);
+        releasesleep(&sbi->s_sbh->lock);
     }
 }
 
 /* 呼び出し元はバッファを処理してb->dataを変更した。
  * キャッシュ内のブロック番号とピンをB_DIRTYを付けて記録する。
- * commit()/write_log()がディスクへの書き込みを行う。
+ * commit()/write_log()がログへの書き込みを、checkpoint()が本来の
+ * 位置への書き込みを行う。
  *
  * log_write()がbwrite()を置き換える; 典型的な使用法は次の通り:
  *   bp = bread(...)
@@ -254,7 +951,7 @@ log_write(struct buf *b)
 
     int i;
 
-    if (log[b->dev].lh.n >= LOGSIZE || log[b->dev].lh.n >= log[b->dev].size - 1)
+    if (log[b->dev].lh.n >= log[b->dev].maxtrans)
         panic("too big a transaction");
     if (log[b->dev].outstanding < 1)
         panic("log_write outside of trans: dev: %d, blockno: %d, outstanding: %d\n",
@@ -269,5 +966,11 @@ log_write(struct buf *b)
     if (i == log[b->dev].lh.n)                          // なかった場合は新たに追加
         log[b->dev].lh.n++;
     b->flags |= B_DIRTY;                        // prevent eviction
+    // トランザクションの最初の更新からLOG_COMMIT_INTERVAL後にはコミットする
+    if (!log[b->dev].timer_armed) {
+        log[b->dev].timer_armed = 1;
+        hrtimer_init(&log[b->dev].timer, log_timer_fn);
+        hrtimer_start(&log[b->dev].timer, ktime_get() + LOG_COMMIT_INTERVAL);
+    }
     release(&log[b->dev].lock);
 }
@@ -15,10 +15,16 @@
 #include "irq.h"
 #include "ds3231.h"
 #include "i2c.h"
+#include "dcache.h"
 #include "pagecache.h"
 #include "random.h"
 #include "vfs.h"
 #include "vfsmount.h"
+#include "kmalloc.h"
+#include "file.h"
+#include "mmap.h"
+#include "pipe.h"
+#include "futex.h"
 
 /*
  * Keep it in data segment by explicitly initializing by zero,
@@ -39,6 +45,7 @@ main()
         i2c_init(DS3231_I2C_DIV);
         irq_init();
         mm_init();
+        kmalloc_init();
         console_init();
         clock_init();
         rand_init();
@@ -49,6 +56,11 @@ main()
         fs_init();
         install_rootfs();
         pagecache_init();
+        dcache_init();
+        fileinit();
+        mmap_init();
+        pipeinit();
+        futex_init();
         proc_init();
         user_init();
 
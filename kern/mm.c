@@ -7,6 +7,8 @@
 #include "spinlock.h"
 #include "console.h"
 #include "mbox.h"
+#include "list.h"
+#include "proc.h"
 
 #ifdef DEBUG
 
@@ -26,84 +28,188 @@ extern char end[];
 #define PHYSTOP 0x3b400000
 #define NFRAMES (PHYSTOP / PGSIZE)
 
+/*
+ * Buddy allocator.
+ *
+ * Free memory is kept in blocks of 2^order pages (order < MAX_ORDER),
+ * each aligned to its size, on free_area[order].  A block is split in
+ * halves to serve a smaller request and merged with its buddy (the
+ * other half of the block of the next order) when both are free.
+ *
+ * Single pages are served from per-cpu lists of hot pages, which are
+ * refilled from and drained to the buddy lists PCP_BATCH pages at a
+ * time, so the common kalloc()/kfree() path takes no lock.  The lists
+ * are per cpu and the kernel is not preemptive with interrupts masked
+ * in kernel mode, so nothing else touches them while we do.
+ *
+ * Reference counts of pages are updated with atomic operations.
+ */
+#define MAX_ORDER   11                  /* Largest block: 1024 pages (4MB) */
+#define PCP_HIGH    64                  /* Max pages on a per-cpu list */
+#define PCP_BATCH   16                  /* Pages moved at a time */
+
+#define PFN(va)     (V2P(va) >> PGSHIFT)
+#define PFN2VA(pfn) P2V((uint64_t)(pfn) << PGSHIFT)
+
 struct run {
-    struct run *next;
+    struct list_head link;
+};
+
+struct page {
+    int ref;                            /* Reference count (atomic) */
+    int8_t order;                       /* Order of the block this page heads, -1 if none */
+    uint8_t free;                       /* Head of a block in free_area */
 };
 
+static struct page pages[NFRAMES];
+
 struct _kmem {
     struct spinlock lock;
-    struct run *freelist;
-    uint64_t fpages;
+    struct list_head free_area[MAX_ORDER];
+    uint64_t nfree[MAX_ORDER];          /* Blocks in each free_area */
+    uint64_t fpages;                    /* Pages in free_area */
+    uint64_t min_pfn, max_pfn;          /* Range of managed pages */
 } kmem;
 
-struct _kmem_reftable {
-    int ref[NFRAMES];
-    struct spinlock lock;
-} kmem_reftable;
+struct per_cpu_pages {
+    int count;
+    struct list_head list;              /* Hot pages at front */
+};
+
+static struct per_cpu_pages pcp[NCPU];
 
 static uint64_t totalram = 0;
 
+static void
+set_kmem_ref(uint64_t pa, int count)
+{
+    __atomic_store_n(&pages[pa >> PGSHIFT].ref, count, __ATOMIC_RELAXED);
+}
+
+/*
+ * Put the block of 2^order pages at pfn to free_area,
+ * merging it with its buddies.  kmem.lock must be held.
+ */
+static void
+free_block(uint64_t pfn, int order)
+{
+    struct run *r;
+
+    kmem.fpages += 1UL << order;
+    while (order < MAX_ORDER - 1) {
+        uint64_t buddy = pfn ^ (1UL << order);
+        if (buddy < kmem.min_pfn || buddy + (1UL << order) > kmem.max_pfn
+         || !pages[buddy].free || pages[buddy].order != order)
+            break;
+        r = (struct run *)PFN2VA(buddy);
+        list_drop(&r->link);
+        pages[buddy].free = 0;
+        pages[buddy].order = -1;
+        kmem.nfree[order]--;
+        pfn &= ~(1UL << order);
+        order++;
+    }
+    r = (struct run *)PFN2VA(pfn);
+    pages[pfn].free = 1;
+    pages[pfn].order = order;
+    list_push_front(&kmem.free_area[order], &r->link);
+    kmem.nfree[order]++;
+}
+
+/*
+ * Take a block of 2^order pages from free_area, splitting
+ * a larger block if needed.  kmem.lock must be held.
+ */
+static struct run *
+alloc_block(int order)
+{
+    struct run *r;
+    uint64_t pfn;
+    int o;
+
+    for (o = order; o < MAX_ORDER; o++)
+        if (!list_empty(&kmem.free_area[o]))
+            break;
+    if (o == MAX_ORDER)
+        return 0;
+
+    r = container_of(list_front(&kmem.free_area[o]), struct run, link);
+    list_drop(&r->link);
+    kmem.nfree[o]--;
+    pfn = PFN(r);
+    pages[pfn].free = 0;
+    while (o > order) {
+        o--;
+        uint64_t buddy = pfn + (1UL << o);
+        pages[buddy].free = 1;
+        pages[buddy].order = o;
+        list_push_front(&kmem.free_area[o], &((struct run *)PFN2VA(buddy))->link);
+        kmem.nfree[o]++;
+    }
+    pages[pfn].order = order;
+    kmem.fpages -= 1UL << order;
+    return r;
+}
+
 static void
 free_range(void *start, void *end)
 {
     int cnt = 0;
 
+    acquire(&kmem.lock);
     for (void *p = start; p + PGSIZE <= end; p += PGSIZE, cnt++) {
-        kfree(p);
+        free_block(PFN(p), 0);
         totalram += PGSIZE;
     }
+    release(&kmem.lock);
     info("0x%p ~ 0x%p, %d pages", start, end, cnt);
 }
 
 void
 mm_init(void)
 {
-    initlock(&kmem_reftable.lock, "kmem_ref");
     initlock(&kmem.lock, "kmem");
 
-    acquire(&kmem_reftable.lock);
     for (int i = 0; i < NFRAMES; i++) {
-        kmem_reftable.ref[i] = 0;
+        pages[i].ref = 0;
+        pages[i].order = -1;
+        pages[i].free = 0;
+    }
+    for (int i = 0; i < MAX_ORDER; i++) {
+        list_init(&kmem.free_area[i]);
+        kmem.nfree[i] = 0;
+    }
+    for (int i = 0; i < NCPU; i++) {
+        list_init(&pcp[i].list);
+        pcp[i].count = 0;
     }
-    release(&kmem_reftable.lock);
 
     kmem.fpages = 0;
     // HACK Raspberry pi 4b.
     //size_t phystop = MIN(0x3F000000, mbox_get_arm_memory());
-    free_range(ROUNDUP((void *)end, PGSIZE), P2V(PHYSTOP));
+    void *start = ROUNDUP((void *)end, PGSIZE);
+    kmem.min_pfn = PFN(start);
+    kmem.max_pfn = PHYSTOP >> PGSHIFT;
+    free_range(start, P2V(PHYSTOP));
 }
 
 void
 inc_kmem_ref(uint64_t pa)
 {
-    acquire(&kmem_reftable.lock);
-    kmem_reftable.ref[pa >> PGSHIFT]++;
-    release(&kmem_reftable.lock);
+    __atomic_add_fetch(&pages[pa >> PGSHIFT].ref, 1, __ATOMIC_RELAXED);
 }
 
-void
+/* Decrement the reference count of pa and return the new count. */
+int
 dec_kmem_ref(uint64_t pa)
 {
-    acquire(&kmem_reftable.lock);
-    kmem_reftable.ref[pa >> PGSHIFT]--;
-    release(&kmem_reftable.lock);
+    return __atomic_sub_fetch(&pages[pa >> PGSHIFT].ref, 1, __ATOMIC_ACQ_REL);
 }
 
 int
 get_kmem_ref(uint64_t pa)
 {
-    acquire(&kmem_reftable.lock);
-    int ref = kmem_reftable.ref[pa >> PGSHIFT];
-    release(&kmem_reftable.lock);
-    return ref;
-}
-
-static void
-set_kmem_ref(uint64_t pa, int count)
-{
-    acquire(&kmem_reftable.lock);
-    kmem_reftable.ref[pa >> PGSHIFT] = count;
-    release(&kmem_reftable.lock);
+    return __atomic_load_n(&pages[pa >> PGSHIFT].ref, __ATOMIC_RELAXED);
 }
 
 uint64_t
@@ -115,30 +221,54 @@ get_totalram(void)
 uint64_t
 get_freeram(void)
 {
-    acquire(&kmem.lock);
     uint64_t fpages = kmem.fpages;
-    release(&kmem.lock);
+    for (int i = 0; i < NCPU; i++)
+        fpages += pcp[i].count;
     return fpages * PGSIZE;
 }
 
+/* The smallest order whose block can hold size bytes. */
+int
+get_order(size_t size)
+{
+    int order = 0;
+
+    while ((PGSIZE << order) < size)
+        order++;
+    return order;
+}
+
+/* Order of the block starting at va which was allocated by alloc_pages(). */
+int
+page_order(void *va)
+{
+    return pages[PFN(va)].order;
+}
+
 /*
  * Allocate a page of physical memory.
  * Returns 0 if failed else a pointer.
- * Corrupt the page by filling non-zero value in it for debugging.
  */
 void *
 kalloc(void)
 {
+    struct per_cpu_pages *pc = &pcp[cpuid()];
     struct run *r;
 
-    acquire(&kmem.lock);
-    r = kmem.freelist;
-    if (r) {
-        kmem.freelist = r->next;
-        kmem.fpages--;
-        set_kmem_ref((uint64_t)V2P((uint64_t)r), 1);
+    if (pc->count == 0) {
+        acquire(&kmem.lock);
+        while (pc->count < PCP_BATCH && (r = alloc_block(0))) {
+            list_push_back(&pc->list, &r->link);
+            pc->count++;
+        }
+        release(&kmem.lock);
+        if (pc->count == 0)
+            return 0;
     }
-    release(&kmem.lock);
+    r = container_of(list_front(&pc->list), struct run, link);
+    list_pop_front(&pc->list);
+    pc->count--;
+    set_kmem_ref((uint64_t)V2P((uint64_t)r), 1);
     return r;
 }
 
@@ -146,16 +276,65 @@ kalloc(void)
 void
 kfree(void *va)
 {
+    struct per_cpu_pages *pc = &pcp[cpuid()];
     struct run *r;
+
     if ((uint64_t)va % PGSIZE || va < (void *)end || V2P(va) >= PHYSTOP)
         panic("kfree: va=0x%p", va);
 
-    acquire(&kmem.lock);
+    set_kmem_ref((uint64_t)V2P((uint64_t)va), 0);
     r = (struct run *)va;
-    r->next = kmem.freelist;
-    kmem.freelist = r;
-    kmem.fpages++;
+    list_push_front(&pc->list, &r->link);
+    if (++pc->count > PCP_HIGH) {
+        /* Give the coldest pages back to the buddy lists. */
+        acquire(&kmem.lock);
+        for (int i = 0; i < PCP_BATCH; i++) {
+            r = container_of(list_back(&pc->list), struct run, link);
+            list_pop_back(&pc->list);
+            free_block(PFN(r), 0);
+        }
+        release(&kmem.lock);
+        pc->count -= PCP_BATCH;
+    }
+}
+
+/*
+ * Allocate 2^order physically contiguous pages.
+ * Returns 0 if failed else a pointer to the first page.
+ */
+void *
+alloc_pages(int order)
+{
+    struct run *r;
+
+    if (order == 0)
+        return kalloc();
+    if (order < 0 || order >= MAX_ORDER)
+        return 0;
+
+    acquire(&kmem.lock);
+    r = alloc_block(order);
+    release(&kmem.lock);
+    if (r)
+        set_kmem_ref((uint64_t)V2P((uint64_t)r), 1);
+    return r;
+}
+
+/* Free 2^order pages allocated by alloc_pages(). */
+void
+free_pages(void *va, int order)
+{
+    if (order == 0) {
+        kfree(va);
+        return;
+    }
+    if ((uint64_t)va % (PGSIZE << order) || va < (void *)end
+     || V2P(va) + (PGSIZE << order) > PHYSTOP)
+        panic("free_pages: va=0x%p, order=%d", va, order);
+
     set_kmem_ref((uint64_t)V2P((uint64_t)va), 0);
+    acquire(&kmem.lock);
+    free_block(PFN(va), order);
     release(&kmem.lock);
 }
 
@@ -163,7 +342,14 @@ kfree(void *va)
 void
 mm_dump()
 {
-    cprintf("\nTotal Memory: %lld MB, Free Memmory: %lld MB\n\n", get_totalram() / MB, get_freeram() / MB);
+    cprintf("\nTotal Memory: %lld MB, Free Memmory: %lld MB\n", get_totalram() / MB, get_freeram() / MB);
+    cprintf("free blocks:");
+    for (int i = 0; i < MAX_ORDER; i++)
+        cprintf(" %lld", kmem.nfree[i]);
+    cprintf("\nper-cpu pages:");
+    for (int i = 0; i < NCPU; i++)
+        cprintf(" %d", pcp[i].count);
+    cprintf("\n\n");
 #ifdef DEBUG
     int cnt = 0;
     for (int i = 0; i < MAX_PAGES; i++) {
@@ -17,6 +17,15 @@
 #include "types.h"
 #include "vm.h"
 
+static struct kmem_cache *region_cachep;
+
+void
+mmap_init()
+{
+    region_cachep = kmem_cache_create("mmap_region", sizeof(struct mmap_region));
+    assert(region_cachep);
+}
+
 /* utils */
 
 /*
@@ -24,22 +33,22 @@
  * つなぐ。munmap()が呼ばれた時に呼び出される
  */
 static void
-delete_mmap_node(struct proc *p, struct mmap_region *node)
+delete_mmap_node(struct mm_struct *mm, struct mmap_region *node)
 {
-    if (p->regions == 0) return;
+    if (mm->regions == 0) return;
 
     //cprintf("delete_mmap_node[%d]: addr=0x%p\n", p->pid, node->addr);
 
     //print_mmap_list(p, "delete node before");
 
     struct mmap_region *region, *prev;
-    if (node->addr == p->regions->addr) {
-        if (p->regions->next != 0)
-            p->regions = p->regions->next;
+    if (node->addr == mm->regions->addr) {
+        if (mm->regions->next != 0)
+            mm->regions = mm->regions->next;
         else
-            p->regions = 0;
+            mm->regions = 0;
     } else {
-        region = prev = p->regions;
+        region = prev = mm->regions;
         while (region) {
             if (node->addr == region->addr) {
                 if (region->next != 0)
@@ -54,33 +63,30 @@ delete_mmap_node(struct proc *p, struct mmap_region *node)
     }
     // FIXME: paをshareしているmmapがすべて削除されたことを判断する方法
     //int free = (node->flags & MAP_SHARED) ? 0 : 1;
-    uvm_unmap(p->pgdir, (uint64_t)node->addr, (((uint64_t)node->length + PGSIZE - 1) / PGSIZE));
-    kmfree(node);
+    uvm_unmap(mm->pgdir, (uint64_t)node->addr, (((uint64_t)node->length + PGSIZE - 1) / PGSIZE));
+    kmem_cache_free(region_cachep, node);
     node = 0;
     //print_mmap_list(p, "delete node after");
 }
 
 /*
  * struct mmap_regionリンクリスト全体をクリアする。
- * ユーザ空間にあるメモリページをすべて開放しなければ
- * ならない時にexecから呼び出される
+ * アドレス空間が解放される時にmm_putから呼び出される
  */
 void
-free_mmap_list(struct proc *p)
+free_mmap_list(struct mm_struct *mm)
 {
-    struct mmap_region* region = p->regions;
+    struct mmap_region* region = mm->regions;
     struct mmap_region* temp;
 
     while (region) {
-        temp = region;
-        //if (!(region->flags & MAP_SHARED)) {
-            if (region->f) {
-                fileclose(region->f);
-            }
-            delete_mmap_node(p, region);
-            p->nregions -= 1;
-        //}
-        region = temp->next;
+        temp = region->next;
+        if (region->f) {
+            fileclose(region->f);
+        }
+        delete_mmap_node(mm, region);
+        mm->nregions -= 1;
+        region = temp;
     }
 }
 
@@ -142,7 +148,7 @@ scale_mmap_region(struct mmap_region *region, uint64_t size)
         uint64_t dpages = (region->length - dstart + PGSIZE - 1) / PGSIZE;
         //int free = (region->flags & MAP_SHARED) ? 0 : 1;
         if ((uint64_t)region->addr + size <= dstart && dpages > 0) {
-            uvm_unmap(thisproc()->pgdir, dstart, dpages);
+            uvm_unmap(thisproc()->mm->pgdir, dstart, dpages);
         }
     }
     region->length = size;
@@ -159,9 +165,9 @@ is_usable(void *addr, size_t length)
 {
     struct proc *p = thisproc();
 
-    if (p->nregions == 0) return 1;
+    if (p->mm->nregions == 0) return 1;
 
-    struct mmap_region *cursor = p->regions;
+    struct mmap_region *cursor = p->mm->regions;
     while (cursor) {
         // 1: 右端が最左のregionより小さい
         if (addr + length <= cursor->addr)
@@ -213,7 +219,7 @@ map_file_page(void *addr, size_t length, uint64_t perm, struct file *f, off_t of
     }
     // ページをユーザプロセスにマッピング
     //cprintf("- map_region: addr=0x%p, mem=0x%p\n", (void *)addr, mem);
-    if ((error = uvm_map(p->pgdir, (void *)addr, PGSIZE, V2P(mem))) < 0) {
+    if ((error = uvm_map(p->mm->pgdir, (void *)addr, PGSIZE, V2P(mem))) < 0) {
         //cprintf("map_pagecache_page: map_region failed\n");
         kfree(mem);
         return error;
@@ -230,11 +236,14 @@ map_file_pages(void *addr, size_t length, uint64_t perm, struct file *f, off_t o
     long error;
     size_t mapsize, size = length;
     //cprintf("map_file_pages: addr=%p, length=0x%llx, perm=0x%llx, f=%d\n", addr, length, perm, f->ip->inum);
+    // 領域全体のブロックを先読みしておく
+    if (offset < f->ip->size)
+        inode_readahead(f->ip, offset, MIN(length, (size_t)(f->ip->size - offset)));
     for (uint64_t cur = 0; cur < length; cur += PGSIZE) {
         mapsize = PGSIZE > size ? size : PGSIZE;
         if ((error = map_file_page(addr + cur, mapsize, perm, f, offset + cur)) < 0) {
             if (cur != 0)
-                uvm_unmap(thisproc()->pgdir, (uint64_t)addr, cur/PGSIZE);
+                uvm_unmap(thisproc()->mm->pgdir, (uint64_t)addr, cur/PGSIZE);
             return error;
         }
         size -= mapsize;
@@ -255,8 +264,8 @@ map_anon_page(void *addr, uint64_t perm)
     }
     memset(page, 0, PGSIZE);
     //cprintf("map_anon_page: map addr=0x%llx, page=0x%p\n", addr, V2P(page));
-    //if (map_region(p->pgdir, addr, PGSIZE, V2P(page), perm) < 0) {
-    if (uvm_map(p->pgdir, addr, PGSIZE, V2P(page)) < 0) {
+    //if (map_region(p->mm->pgdir, addr, PGSIZE, V2P(page), perm) < 0) {
+    if (uvm_map(p->mm->pgdir, addr, PGSIZE, V2P(page)) < 0) {
         kfree(page);
         return -EINVAL;
     }
@@ -272,7 +281,7 @@ map_anon_pages(void *addr, size_t length, uint64_t perm)
     for (uint64_t cur = 0; cur < length; cur += PGSIZE) {
         if ((ret = map_anon_page(addr + cur, perm)) < 0) {
             if (cur != 0)
-                uvm_unmap(thisproc()->pgdir, (uint64_t)addr, cur/PGSIZE);
+                uvm_unmap(thisproc()->mm->pgdir, (uint64_t)addr, cur/PGSIZE);
             return ret;
         }
 
@@ -324,7 +333,7 @@ mmap(void *addr, size_t length, int prot, int flags, struct file *f, off_t offse
             if (prot == PROT_NONE) {
                 int mapped = 0;
                 for (int i = 0; i < length / PGSIZE; i++) {
-                    uint64_t *pte = pgdir_walk(p->pgdir, (void *)((uint64_t)addr + i * PGSIZE), 0);
+                    uint64_t *pte = pgdir_walk(p->mm->pgdir, (void *)((uint64_t)addr + i * PGSIZE), 0);
                     // すでにマッピング済み。
                     if (*pte & PTE_VALID) {
                         mapped++;
@@ -359,12 +368,12 @@ mmap(void *addr, size_t length, int prot, int flags, struct file *f, off_t offse
     // 1.2. アドレスが指定されていない場合
     } else {
         // 1.2.1 最初のアドレス候補
-        if (p->regions)
-            addr = p->regions->addr;
+        if (p->mm->regions)
+            addr = p->mm->regions->addr;
         else
             addr = (void *)MMAPBASE;
 select_addr:
-        struct mmap_region *node = p->regions;
+        struct mmap_region *node = p->mm->regions;
         while (node) {
             trace("- addr=0x%p, node->addr=0x%p, node->next->addr=0x%p", addr, node->addr, node->next ? node->next->addr : NULL);
             // 1.2.31 作成マッピングが現在のノードアドレスより小さい場合はこの候補を使用する
@@ -405,7 +414,7 @@ select_addr:
     // 2. 新規mmap_regionを作成する
 
     // 2.1 mmap_regionのためのメモリを割り当てる
-    struct mmap_region *region = (struct mmap_region*)kmalloc(sizeof(struct mmap_region));
+    struct mmap_region *region = (struct mmap_region*)kmem_cache_alloc(region_cachep);
     if (region == NULL)
         return -ENOMEM;
     // 2.2 mmap_regionにデータを設定する
@@ -431,14 +440,14 @@ select_addr:
     // 3. p->regionsに作成したmmap_regionを追加する
 
     // 3.1 これがプロセスの最初のmmap_regionの場合はp->regionsに追加する
-    if (p->nregions == 0) {
-        p->regions = region;
+    if (p->mm->nregions == 0) {
+        p->mm->regions = region;
         goto load_pages;
     }
 
     // 3.2 そうでない場合は適切な位置に追加して、p->regionsを更新する
-    struct mmap_region *node = p->regions;
-    struct mmap_region *prev = p->regions;
+    struct mmap_region *node = p->mm->regions;
+    struct mmap_region *prev = p->mm->regions;
     while (node) {
         //cprintf("addr=0x%p, node->addr=0x%p\n", addr, node->addr);
         if (addr < node->addr) {
@@ -456,15 +465,15 @@ select_addr:
         }
         node = node->next;
     }
-    p->regions = prev;
+    p->mm->regions = prev;
 
 load_pages:
     // 4. ページにマッピングする
     if ((error = mmap_load_pages(addr, length, prot, flags, f, offset)) < 0)
         goto out;
-    //uvm_switch(p->pgdir);
+    //uvm_switch(p->mm->pgdir);
 
-    p->nregions++;
+    p->mm->nregions++;
     region->addr = addr;
     // ファイルオフセットを正しく処理するためにlengthはここで切り上げる
     region->length = ROUNDUP(length, PGSIZE);
@@ -474,7 +483,7 @@ load_pages:
 
 out:
     if (f) fileclose(f);
-    kmfree(region);
+    kmem_cache_free(region_cachep, region);
     return error;
 }
 
@@ -511,12 +520,12 @@ munmap(void *addr, size_t length)
         if (region->f) {
             fileclose(region->f);
         }
-        delete_mmap_node(p, region);
-        p->nregions -= 1;
+        delete_mmap_node(p->mm, region);
+        p->mm->nregions -= 1;
     } else {
         //int free = (region->flags & MAP_SHARED) ? 0 : 1;
         //if (length / PGSIZE) {
-            uvm_unmap(p->pgdir, (uint64_t)addr, length / PGSIZE);
+            uvm_unmap(p->mm->pgdir, (uint64_t)addr, length / PGSIZE);
         //}
         region->addr += length;
         region->length -= length;
@@ -547,7 +556,7 @@ mremap(void *old_addr, size_t old_length, size_t new_length, int flags, void *ne
         } else {
             if ((error = scale_mmap_region(region, new_length)) < 0)
                 return (void *)error;
-            //uvm_switch(thisproc()->pgdir);
+            //uvm_switch(thisproc()->mm->pgdir);
             return region->addr;
         }
     }
@@ -570,7 +579,7 @@ mremap(void *old_addr, size_t old_length, size_t new_length, int flags, void *ne
 
     if ((error = munmap(region->addr, region->length)) < 0)
         return (void *)error;
-    //uvm_switch(thisproc()->pgdir);
+    //uvm_switch(thisproc()->mm->pgdir);
     //print_mmap_list(thisproc(), "mremap");
     return mapped_addr;
 }
@@ -593,7 +602,7 @@ msync(void *addr, size_t length, int flags)
     // addrはページ境界になければならない。
     if (NOT_PAGEALIGN((uint64_t)addr)) return error;
 
-    struct mmap_region *region = p->regions;
+    struct mmap_region *region = p->mm->regions;
     while (region) {
         if (region->addr == addr) {
             if ((region->flags & MAP_SHARED) && (region->prot & PROT_WRITE) && region->f) {
@@ -619,10 +628,10 @@ msync(void *addr, size_t length, int flags)
 void
 print_mmap_list(struct proc *p, const char *title)
 {
-    cprintf("== PRINT mmap_region[%d] (%s): regions=0x%p, nregions=%d ==\n", p->pid, title, p->regions, p->nregions);
-    if (p->nregions == 0) return;
+    cprintf("== PRINT mmap_region[%d] (%s): regions=0x%p, nregions=%d ==\n", p->pid, title, p->mm->regions, p->mm->nregions);
+    if (p->mm->nregions == 0) return;
 
-    struct mmap_region *region = p->regions;
+    struct mmap_region *region = p->mm->regions;
     int i=0;
     while (region) {
         cprintf(" - region[%d]: addr=0x%p, length=0x%llx, prot=0x%x, flags=0x%x, f=%d, offset=0x%llx\n",
@@ -632,25 +641,25 @@ print_mmap_list(struct proc *p, const char *title)
 }
 
 
-// 親プロセスから子プロセスにmmap_regionをコピー(parent->nregions > 0はチェック済み)
+// 親のアドレス空間から子のアドレス空間にmmap_regionをコピー(src->nregions > 0はチェック済み)
 long
-copy_mmap_list(struct proc *parent, struct proc *child)
+copy_mmap_list(struct mm_struct *src, struct mm_struct *dst)
 {
     //uint64_t *ptep, *ptec;
 
-    struct mmap_region *node = parent->regions;
+    struct mmap_region *node = src->regions;
     struct mmap_region *cnode = 0, *tail = 0;
 
     while (node) {
-        struct mmap_region *region = (struct mmap_region *)kmalloc(sizeof(struct mmap_region));
+        struct mmap_region *region = (struct mmap_region *)kmem_cache_alloc(region_cachep);
         if (region == (struct mmap_region *)0)
             return -ENOMEM;
         copy_mmap_region(region, node);
     /*
         if (node->flags & MAP_SHARED) {
-            ptep = pgdir_walk(parent->pgdir, node->addr, 0);
+            ptep = pgdir_walk(src->pgdir, node->addr, 0);
             if (!ptep) panic("parent pgdir not pte: va=0x%p\n", region->addr);
-            ptec = pgdir_walk(child->pgdir, region->addr, 0);
+            ptec = pgdir_walk(dst->pgdir, region->addr, 0);
             if (!ptec) panic("child  pgdir not pte: va=0x%p\n", region->addr);
             uint64_t pa = PTE_ADDR(*ptec);
             kfree(P2V(pa));
@@ -669,13 +678,9 @@ copy_mmap_list(struct proc *parent, struct proc *child)
         node = node->next;
     }
 
-    child->regions = cnode;
-    child->nregions = parent->nregions;
-    debug("child nregions=%d, regions=0x%p\n", child->nregions, child->regions);
-    //print_mmap_list(parent, parent->name);
-    //print_mmap_list(child, "child");
-    uvm_switch(child->pgdir);
-    uvm_switch(parent->pgdir);
+    dst->regions = cnode;
+    dst->nregions = src->nregions;
+    debug("child nregions=%d, regions=0x%p\n", dst->nregions, dst->regions);
     return 0;
 }
 
@@ -687,13 +692,15 @@ copy_mmap_pages(void *addr, size_t length, uint64_t perm)
     debug("copy_mmap_pages: addr=%p, length=0x%llx, perm=0x%llx\n", addr, length, perm);
     void *start  = addr;
     for (; start < addr + length; start += PGSIZE) {
-        pte = pgdir_walk(thisproc()->pgdir, start, 0);
+        pte = pgdir_walk(thisproc()->mm->pgdir, start, 0);
         if (pte == 0) { warn("copy_mmap_pages: pte = 0\n"); return -EINVAL; }
         uint64_t pa = PTE_ADDR(*pte);
         char *page = kalloc();
         if (!page) { warn("copy_mmap_pages: no page available\n"); return -ENOMEM; }
         memmove(page, P2V(pa), PGSIZE);
         *pte = V2P(page) | perm;
+        if (dec_kmem_ref(pa) == 0)
+            kfree(P2V(pa));
         debug("- start=%p, pte=%p, *pte=0x%llx\n", start, pte, *pte);
     }
     return 0;
@@ -705,7 +712,7 @@ copy_mmap_pages(void *addr, size_t length, uint64_t perm)
 struct mmap_region *
 find_available_region(void *start)
 {
-    struct mmap_region *region = thisproc()->regions;
+    struct mmap_region *region = thisproc()->mm->regions;
 
     while (region) {
         if (region->addr + region->length < start && (start < region->next->addr || region->next == 0))
@@ -720,7 +727,7 @@ find_available_region(void *start)
 struct mmap_region *
 find_mmap_region(void *start)
 {
-    struct mmap_region *region = thisproc()->regions;
+    struct mmap_region *region = thisproc()->mm->regions;
 
     while (region) {
         if (region->addr <= start && start < (region->addr + region->length))
@@ -10,87 +10,437 @@
 #include "types.h"
 #include "vfs.h"
 #include "proc.h"
+#include "linux/time.h"
 
-struct {
-    struct cached_page pages[NPAGECACHE];
-    int total_count;
+/*
+ * Page cache.
+ *
+ * Cached pages are found through a hash table keyed by (dev, inum,
+ * offset) whose buckets have their own locks, so that lookups of
+ * different pages do not contend.  A bucket lock protects its chain
+ * and the hashed and ref_count fields of the pages on it.
+ *
+ * pagecache.lock protects the LRU lists, the free list and the list
+ * of pages of each inode (ip->i_pages).  Pages are reclaimed from the
+ * tail of the inactive list; a page referenced twice while inactive
+ * is moved to the active list and the active list is aged into the
+ * inactive one when it grows larger (second chance).
+ *
+ * Lock order: bucket lock -> pagecache.lock.
+ * Page frames are allocated on demand up to NPAGECACHE.
+ *
+ * Writes to file systems with iops->writepages (delayed allocation)
+ * only copy the data into cached pages and mark them dirty.  Dirty
+ * pages are not evicted and hold a reference to their inode.  The
+ * flusher thread writes them back DIRTY_INTERVAL after the first one
+ * got dirty, when there are more than DIRTY_BACKGROUND of them, or
+ * on fsync(): runs of contiguous dirty pages are handed to writepages
+ * which allocates their blocks at once.  Writers wait while there
+ * are more than DIRTY_LIMIT dirty pages.
+ */
+
+#define DIRTY_INTERVAL      (5 * NSEC_PER_SEC)  /* Max age of dirty data */
+#define DIRTY_BACKGROUND    (NPAGECACHE / 8)    /* Start writeback */
+#define DIRTY_LIMIT         (NPAGECACHE / 4)    /* Throttle writers */
+
+struct page_bucket {
     struct spinlock lock;
+    struct list_head chain;
+};
+
+static struct {
+    struct spinlock lock;
+    struct list_head active, inactive, free;
+    int nactive, ninactive;
+    int ndirty;                         /* Dirty pages */
+    int flush;                          /* Writeback is requested */
+    int flusher;                        /* The flusher thread is created */
+    int timer_armed;
+    struct hrtimer timer;               /* Request writeback after DIRTY_INTERVAL */
+    struct cached_page pages[NPAGECACHE];
+    struct page_bucket hash[NPAGEHASH];
 } pagecache;
 
 void pagecache_init(void)
 {
     initlock(&pagecache.lock, "pagecache");
-
-    acquire(&pagecache.lock);
+    list_init(&pagecache.active);
+    list_init(&pagecache.inactive);
+    list_init(&pagecache.free);
+    for (int i = 0; i < NPAGEHASH; i++) {
+        initlock(&pagecache.hash[i].lock, "pagecache bucket");
+        list_init(&pagecache.hash[i].chain);
+    }
     for (int i = 0; i < NPAGECACHE; i++) {
-        pagecache.pages[i].page = kalloc();
-        if (!pagecache.pages[i].page) {
-            cprintf("pagecache_init: momory exhausted: i=%d\n", i);
-            return;
-        }
         initsleeplock(&pagecache.pages[i].lock, "pagecache page");
-        //memset(pagecache.pages[i].page, 0, PGSIZE);   // get_page時に初期化
+        list_push_back(&pagecache.free, &pagecache.pages[i].lru);
     }
-    pagecache.total_count = 0;
-    release(&pagecache.lock);
     cprintf("pagecache_init ok\n");
 }
 
-static struct cached_page *find_page(uint32_t inum, off_t offset, uint32_t dev)
+static struct page_bucket *
+page_hash(uint32_t dev, uint32_t inum, off_t offset)
 {
+    uint64_t h = ((uint64_t)dev << 24) ^ ((uint64_t)inum << 8) ^ (offset >> PGSHIFT);
+    h ^= h >> 10;
+    return &pagecache.hash[h & (NPAGEHASH - 1)];
+}
+
+/* hb->lock must be held. */
+static struct cached_page *
+find_page(struct page_bucket *hb, uint32_t inum, off_t offset, uint32_t dev)
+{
+    struct cached_page *cp;
+
     trace("inum: %d, offset: %lld, dev: %d", inum, offset, dev);
-    if (!pagecache.lock.locked)
-        panic("not locked");
-    for (int i = 0; i < NPAGECACHE; i++) {
-        if (pagecache.pages[i].inum == inum &&
-            pagecache.pages[i].offset == offset &&
-            pagecache.pages[i].dev == dev) {
-            debug("found page [%d]", i);
-            return &pagecache.pages[i];
-        }
+    LIST_FOREACH_ENTRY(cp, &hb->chain, hash) {
+        if (cp->inum == inum && cp->offset == offset && cp->dev == dev)
+            return cp;
     }
     return 0;
 }
 
-static struct cached_page *get_page(struct inode *ip, off_t offset)
+/* Take cp off the LRU list.  pagecache.lock must be held. */
+static void
+lru_del(struct cached_page *cp)
+{
+    if (!(cp->flags & PG_LRU))
+        return;
+    list_drop(&cp->lru);
+    if (cp->flags & PG_ACTIVE)
+        pagecache.nactive--;
+    else
+        pagecache.ninactive--;
+    cp->flags &= ~(PG_LRU | PG_ACTIVE);
+}
+
+/* pagecache.lock must be held. */
+static void
+lru_add(struct cached_page *cp, int active)
+{
+    if (active) {
+        list_push_front(&pagecache.active, &cp->lru);
+        pagecache.nactive++;
+        cp->flags |= PG_LRU | PG_ACTIVE;
+    } else {
+        list_push_front(&pagecache.inactive, &cp->lru);
+        pagecache.ninactive++;
+        cp->flags |= PG_LRU;
+    }
+}
+
+/*
+ * inactive,unreferenced -> inactive,referenced
+ * inactive,referenced   -> active,unreferenced
+ * active,unreferenced   -> active,referenced
+ */
+static void
+mark_page_accessed(struct cached_page *cp)
+{
+    acquire(&pagecache.lock);
+    if ((cp->flags & (PG_LRU | PG_ACTIVE | PG_REFERENCED)) == (PG_LRU | PG_REFERENCED)) {
+        lru_del(cp);
+        lru_add(cp, 1);
+        cp->flags &= ~PG_REFERENCED;
+    } else {
+        cp->flags |= PG_REFERENCED;
+    }
+    release(&pagecache.lock);
+}
+
+/*
+ * Age the active list: move pages from its tail to the inactive
+ * list, giving referenced ones another round on the active list.
+ * pagecache.lock must be held.
+ */
+static void
+shrink_active_list()
+{
+    struct cached_page *cp;
+    int n = pagecache.nactive;
+
+    while (n-- > 0 && pagecache.ninactive < pagecache.nactive) {
+        cp = container_of(list_back(&pagecache.active), struct cached_page, lru);
+        lru_del(cp);
+        if (cp->flags & PG_REFERENCED) {
+            cp->flags &= ~PG_REFERENCED;
+            lru_add(cp, 1);
+        } else {
+            lru_add(cp, 0);
+        }
+    }
+}
+
+/* Remove cp from the cache.  Both locks must be held. */
+static void
+page_remove(struct page_bucket *hb, struct cached_page *cp)
+{
+    list_drop(&cp->hash);
+    cp->hashed = 0;
+    lru_del(cp);
+    list_drop(&cp->ilist);
+    cp->ip = 0;
+    cp->flags = 0;
+}
+
+/* Give an unused descriptor back to the free list. */
+static void
+free_page_desc(struct cached_page *cp)
 {
-    offset -= offset % PGSIZE;
     acquire(&pagecache.lock);
-    struct cached_page *res = find_page(ip->inum, offset, ip->dev);
-    if (res) {
+    list_push_front(&pagecache.free, &cp->lru);
+    release(&pagecache.lock);
+}
+
+/*
+ * Reclaim the least recently used page which nobody is using.
+ * Returns 0 if there is none.
+ */
+static struct cached_page *
+evict_page()
+{
+    struct cached_page *cp;
+    struct page_bucket *hb;
+
+    for (int tries = 0; tries < NPAGECACHE; tries++) {
+        acquire(&pagecache.lock);
+        if (pagecache.ninactive < pagecache.nactive || pagecache.ninactive == 0)
+            shrink_active_list();
+        if (pagecache.ninactive == 0) {
+            release(&pagecache.lock);
+            return 0;
+        }
+        cp = container_of(list_back(&pagecache.inactive), struct cached_page, lru);
+        if (cp->flags & PG_REFERENCED) {
+            /* Recently used: rotate it. */
+            cp->flags &= ~PG_REFERENCED;
+            lru_del(cp);
+            lru_add(cp, 0);
+            release(&pagecache.lock);
+            continue;
+        }
+        hb = page_hash(cp->dev, cp->inum, cp->offset);
         release(&pagecache.lock);
-        acquiresleep(&res->lock);
-        return res;
+
+        /* Retake the locks in order and make sure cp is still the victim. */
+        acquire(&hb->lock);
+        acquire(&pagecache.lock);
+        if (cp->hashed && cp->ref_count == 0
+         && (cp->flags & (PG_LRU | PG_ACTIVE | PG_REFERENCED | PG_DIRTY)) == PG_LRU
+         && page_hash(cp->dev, cp->inum, cp->offset) == hb) {
+            page_remove(hb, cp);
+            release(&pagecache.lock);
+            release(&hb->lock);
+            return cp;
+        }
+        /* In use: let it age on the active list. */
+        if ((cp->flags & PG_LRU) && !(cp->flags & PG_ACTIVE)) {
+            lru_del(cp);
+            lru_add(cp, 1);
+        }
+        release(&pagecache.lock);
+        release(&hb->lock);
+    }
+    return 0;
+}
+
+/* Get an unused descriptor with a page frame. */
+static struct cached_page *
+alloc_page_desc()
+{
+    struct cached_page *cp = 0;
+
+    acquire(&pagecache.lock);
+    if (!list_empty(&pagecache.free)) {
+        cp = container_of(list_front(&pagecache.free), struct cached_page, lru);
+        list_drop(&cp->lru);
+    }
+    release(&pagecache.lock);
+
+    if (cp && (cp->page || (cp->page = kalloc())))
+        return cp;
+    if (cp)
+        free_page_desc(cp);
+    return evict_page();
+}
+
+/* Drop a reference to cp taken by get_page(). */
+static void
+put_page(struct cached_page *cp)
+{
+    struct page_bucket *hb = page_hash(cp->dev, cp->inum, cp->offset);
+    int dead;
+
+    acquire(&hb->lock);
+    dead = (--cp->ref_count == 0 && !cp->hashed);
+    release(&hb->lock);
+    if (dead)
+        free_page_desc(cp);
+}
+
+/* Flags of get_page() */
+#define GP_INOP     0x1     /* The caller is in a transaction */
+#define GP_NOREAD   0x2     /* The caller overwrites the page */
+
+/*
+ * Return the locked cached page of ip at offset,
+ * reading it from the file if it is not cached.
+ */
+static struct cached_page *get_page(struct inode *ip, off_t offset, int flags)
+{
+    struct page_bucket *hb;
+    struct cached_page *cp, *ncp;
+
+    offset -= offset % PGSIZE;
+    hb = page_hash(ip->dev, ip->inum, offset);
+    acquire(&hb->lock);
+    if ((cp = find_page(hb, ip->inum, offset, ip->dev)) != 0)
+        goto found;
+    release(&hb->lock);
+
+    if ((ncp = alloc_page_desc()) == 0) {
+        warn("get_page: no page available");
+        return (struct cached_page *)-1;
     }
 
-    struct cached_page *cached_page = &pagecache.pages[pagecache.total_count++];
+    acquire(&hb->lock);
+    if ((cp = find_page(hb, ip->inum, offset, ip->dev)) != 0) {
+        /* Somebody else has cached it meanwhile. */
+        free_page_desc(ncp);
+        goto found;
+    }
+    cp = ncp;
+    cp->dev = ip->dev;
+    cp->inum = ip->inum;
+    cp->offset = offset;
+    cp->ref_count = 1;
+    cp->hashed = 1;
+    cp->valid = 0;
+    list_push_front(&hb->chain, &cp->hash);
+    /* Not contended: readers wait for the page to be read. */
+    acquiresleep(&cp->lock);
+    acquire(&pagecache.lock);
+    cp->ip = ip;
+    list_push_back(&ip->i_pages, &cp->ilist);
+    lru_add(cp, 0);
     release(&pagecache.lock);
-    acquiresleep(&cached_page->lock);
-    if (pagecache.total_count == NPAGECACHE) {
-        pagecache.total_count = 0;
+    release(&hb->lock);
+
+    memset(cp->page, 0, PGSIZE);
+    int n = 0;
+    if (!(flags & GP_NOREAD) && offset < ip->size) {
+        if (!(flags & GP_INOP))
+            begin_op();
+        n = ip->iops->readi(ip, cp->page, offset, PGSIZE);
+        if (!(flags & GP_INOP))
+            end_op();
     }
-    memset(cached_page->page, 0, PGSIZE);
-    begin_op();
-    int n = ip->iops->readi(ip, cached_page->page, offset, PGSIZE);
     if (n < 0) {
         warn("get_page readi failed: n=%d, offset=%ld, size=%d",
             n, offset, PGSIZE);
-        end_op();
+        acquire(&hb->lock);
+        acquire(&pagecache.lock);
+        if (cp->hashed)
+            page_remove(hb, cp);
+        release(&pagecache.lock);
+        release(&hb->lock);
+        releasesleep(&cp->lock);
+        put_page(cp);
+        return (struct cached_page *)-1;
+    }
+    cp->valid = 1;
+    debug("alloc new cached page: ip=%d, offset=0x%llx", cp->inum, cp->offset);
+    return cp;
+
+found:
+    cp->ref_count++;
+    release(&hb->lock);
+    mark_page_accessed(cp);
+    acquiresleep(&cp->lock);
+    if (!cp->valid) {
+        /* Reading it failed. */
+        releasesleep(&cp->lock);
+        put_page(cp);
         return (struct cached_page *)-1;
     }
-    end_op();
-    cached_page->dev = ip->dev;
-    cached_page->inum = ip->inum;
-    cached_page->offset = offset;
-    debug("alloc new cached page[%d]: ip=%d, offset=0x%llx", pagecache.total_count - 1, cached_page->inum, cached_page->offset);
-    return cached_page;
+    return cp;
+}
+
+/*
+ * Remove the cached pages of ip in [start, end), and the dirty
+ * ones too if dirty is set.  Pages in use are freed by their last
+ * user.
+ */
+static void
+pagecache_remove(struct inode *ip, off_t start, off_t end, int dirty)
+{
+    struct cached_page *cp;
+    struct page_bucket *hb;
+    int found, dead;
+
+    for (;;) {
+        found = 0;
+        acquire(&pagecache.lock);
+        LIST_FOREACH_ENTRY(cp, &ip->i_pages, ilist) {
+            if (cp->offset >= start && cp->offset < end
+             && (dirty || !(cp->flags & PG_DIRTY))) {
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            release(&pagecache.lock);
+            return;
+        }
+        hb = page_hash(cp->dev, cp->inum, cp->offset);
+        release(&pagecache.lock);
+
+        acquire(&hb->lock);
+        acquire(&pagecache.lock);
+        dead = 0;
+        if (cp->ip == ip && cp->hashed
+         && page_hash(cp->dev, cp->inum, cp->offset) == hb) {
+            if (cp->flags & PG_DIRTY) {
+                ip->i_ndirty--;
+                pagecache.ndirty--;
+            }
+            page_remove(hb, cp);
+            /* A user still holding it frees it in put_page(). */
+            dead = (cp->ref_count == 0);
+        }
+        release(&pagecache.lock);
+        release(&hb->lock);
+        if (dead)
+            free_page_desc(cp);
+    }
+}
+
+/*
+ * Drop the clean cached pages of ip in [start, end): for
+ * POSIX_FADV_DONTNEED.
+ */
+void
+pagecache_invalidate(struct inode *ip, off_t start, off_t end)
+{
+    pagecache_remove(ip, start, end, 0);
+}
+
+/*
+ * Drop all cached pages of ip including dirty ones: called when
+ * ip is unlinked and truncated, or when its inode cache entry is
+ * recycled.
+ */
+void
+pagecache_drop(struct inode *ip)
+{
+    pagecache_remove(ip, 0, (off_t)1 << 62, 1);
 }
 
 long copy_page(struct inode *ip, off_t offset, char *dest, size_t size, off_t dest_offset)
 {
     trace("inum=%d, offset=0x%llx, dest=0x%p, size=0x%x, dest_offset=0x%llx",
             ip->inum, offset, dest, size, dest_offset);
-    struct cached_page *page = get_page(ip, offset);
+    struct cached_page *page = get_page(ip, offset, 0);
     if (page == (struct cached_page *)-1) {
         warn("get_page failed");
         return -ENOMEM;
@@ -101,6 +451,7 @@ long copy_page(struct inode *ip, off_t offset, char *dest, size_t size, off_t de
         page->page + dest_offset, dest, size);
     memmove(dest, page->page + dest_offset, size);
     releasesleep(&page->lock);
+    put_page(page);
     return 0;
 }
 
@@ -130,19 +481,354 @@ copy_pages(struct inode *ip, char *dest, size_t size, off_t offset)
 void update_page(off_t offset, uint32_t inum, uint32_t dev, char *addr, size_t size)
 {
     debug("addr=0x%p, size=0x%x, offset=0x%x", addr, size, offset);
-    acquire(&pagecache.lock);
     off_t alligned_offset = offset - (offset % PGSIZE);
     off_t start_addr = offset % PGSIZE;
+    struct page_bucket *hb = page_hash(dev, inum, alligned_offset);
     debug("  - aligned_offset=0x%d", alligned_offset);
-    struct cached_page *res = find_page(inum, alligned_offset, dev);
-    release(&pagecache.lock);
+    acquire(&hb->lock);
+    struct cached_page *res = find_page(hb, inum, alligned_offset, dev);
+    if (res)
+        res->ref_count++;
+    release(&hb->lock);
 
     if (!res) return;   // 該当ページなし
 
     acquiresleep(&res->lock);
-    char *page = res->page;
-    debug("    - addr=0x%p, page_offset=0x%x, size=0x%x", addr, start_addr, size);
-    debug("update_page: memove from 0x%p to 0x%p with 0x%x bytes", addr, page + start_addr, size);
-    memmove(page + start_addr, addr, size);
+    if (res->valid) {
+        char *page = res->page;
+        debug("    - addr=0x%p, page_offset=0x%x, size=0x%x", addr, start_addr, size);
+        debug("update_page: memove from 0x%p to 0x%p with 0x%x bytes", addr, page + start_addr, size);
+        memmove(page + start_addr, addr, size);
+    }
     releasesleep(&res->lock);
+    put_page(res);
+}
+
+/* DIRTY_INTERVAL has passed.  Called in interrupt context. */
+static int
+dirty_timer_fn(struct hrtimer *t)
+{
+    acquire(&pagecache.lock);
+    pagecache.timer_armed = 0;
+    if (pagecache.ndirty > 0) {
+        pagecache.flush = 1;
+        wakeup(&pagecache.flush);
+    }
+    release(&pagecache.lock);
+    return HRTIMER_NORESTART;
+}
+
+/* pagecache.lock must be held. */
+static void
+arm_dirty_timer()
+{
+    if (!pagecache.timer_armed) {
+        pagecache.timer_armed = 1;
+        hrtimer_init(&pagecache.timer, dirty_timer_fn);
+        hrtimer_start(&pagecache.timer, ktime_get() + DIRTY_INTERVAL);
+    }
+}
+
+/*
+ * The flusher thread: write back dirty pages when requested
+ * by the timer or by writers.
+ */
+static void
+pagecache_flusher(void *arg)
+{
+    acquire(&pagecache.lock);
+    for (;;) {
+        while (!pagecache.flush)
+            sleep(&pagecache.flush, &pagecache.lock);
+        pagecache.flush = 0;
+        release(&pagecache.lock);
+
+        pagecache_sync(-1);
+
+        acquire(&pagecache.lock);
+        // Pages dirtied meanwhile are written in the next round.
+        if (pagecache.ndirty > 0)
+            arm_dirty_timer();
+    }
+}
+
+/*
+ * Mark cp of ip dirty.  The first dirty page of ip takes
+ * a reference to ip, which the writeback drops.
+ */
+static void
+set_page_dirty(struct inode *ip, struct cached_page *cp)
+{
+    int first = 0, create = 0;
+
+    acquire(&pagecache.lock);
+    if (!(cp->flags & PG_DIRTY)) {
+        cp->flags |= PG_DIRTY;
+        first = (ip->i_ndirty++ == 0);
+        pagecache.ndirty++;
+        arm_dirty_timer();
+        if (pagecache.ndirty > DIRTY_BACKGROUND && !pagecache.flush) {
+            pagecache.flush = 1;
+            wakeup(&pagecache.flush);
+        }
+        if (!pagecache.flusher)
+            create = pagecache.flusher = 1;
+    }
+    release(&pagecache.lock);
+    if (first)
+        idup(ip);
+    if (create)
+        assert(kthread_create(pagecache_flusher, 0, "flush"));
+}
+
+/*
+ * Write n bytes at off of ip into its cached pages and mark them
+ * dirty: blocks are allocated and written when the pages are
+ * written back.  ip must be locked in a transaction.
+ * Returns the number of bytes written or an error.
+ */
+long
+pagecache_write(struct inode *ip, char *src, off_t off, size_t n)
+{
+    struct cached_page *cp;
+    size_t tot, m;
+    off_t poff;
+    long r;
+
+    if (off > ip->size || off + n < off)
+        return -1;
+    // 書き戻せない書き込みはページを汚す前に断る
+    if (ip->iops->prepare_write && (r = ip->iops->prepare_write(ip, off, n)) < 0)
+        return r;
+
+    for (tot = 0; tot < n; tot += m, off += m, src += m) {
+        poff = off % PGSIZE;
+        m = min(n - tot, PGSIZE - poff);
+        cp = get_page(ip, off, GP_INOP
+            | ((off - poff >= ip->size || m == PGSIZE) ? GP_NOREAD : 0));
+        if (cp == (struct cached_page *)-1)
+            break;
+        memmove(cp->page + poff, src, m);
+        set_page_dirty(ip, cp);
+        releasesleep(&cp->lock);
+        put_page(cp);
+        if (off + m > ip->size)
+            ip->size = off + m;
+    }
+    return tot > 0 ? (long)tot : (n > 0 ? -ENOMEM : 0);
+}
+
+/*
+ * Copy n bytes at off of ip from its cached page if the page is
+ * dirty, i.e. newer than the disk.  Returns 1 if copied, 0 if not.
+ * The range must be within one page.  Called by readi().
+ */
+int
+pagecache_read(struct inode *ip, char *dst, off_t off, size_t n)
+{
+    struct page_bucket *hb;
+    struct cached_page *cp;
+    off_t poff = off % PGSIZE;
+    int dirty = 0;
+
+    if (ip->i_ndirty == 0)
+        return 0;
+
+    hb = page_hash(ip->dev, ip->inum, off - poff);
+    acquire(&hb->lock);
+    if ((cp = find_page(hb, ip->inum, off - poff, ip->dev)) != 0) {
+        acquire(&pagecache.lock);
+        dirty = cp->flags & PG_DIRTY;
+        release(&pagecache.lock);
+        if (dirty)
+            cp->ref_count++;
+    }
+    release(&hb->lock);
+    if (!dirty)
+        return 0;
+
+    acquiresleep(&cp->lock);
+    memmove(dst, cp->page + poff, n);
+    releasesleep(&cp->lock);
+    put_page(cp);
+    return 1;
+}
+
+/*
+ * Lock the run of contiguous dirty pages of ip starting with the
+ * first one at or after start, up to WB_MAXPAGES pages.  Returns
+ * the number of pages.  ip must be locked.
+ */
+static int
+lock_dirty_run(struct inode *ip, off_t start, struct cached_page **pages)
+{
+    struct page_bucket *hb;
+    struct cached_page *cp, *first = 0;
+    off_t off;
+    int n, dirty;
+
+    acquire(&pagecache.lock);
+    LIST_FOREACH_ENTRY(cp, &ip->i_pages, ilist) {
+        if ((cp->flags & PG_DIRTY) && cp->offset >= start
+         && (first == 0 || cp->offset < first->offset))
+            first = cp;
+    }
+    release(&pagecache.lock);
+    if (first == 0)
+        return 0;
+
+    // Dirty pages are neither evicted nor cleaned while ip is locked.
+    off = first->offset;
+    for (n = 0; n < WB_MAXPAGES; n++, off += PGSIZE) {
+        hb = page_hash(ip->dev, ip->inum, off);
+        acquire(&hb->lock);
+        dirty = 0;
+        if ((cp = find_page(hb, ip->inum, off, ip->dev)) != 0) {
+            acquire(&pagecache.lock);
+            dirty = cp->flags & PG_DIRTY;
+            release(&pagecache.lock);
+        }
+        if (!dirty) {
+            release(&hb->lock);
+            break;
+        }
+        cp->ref_count++;
+        release(&hb->lock);
+        acquiresleep(&cp->lock);
+        pages[n] = cp;
+    }
+    return n;
+}
+
+/*
+ * Write back the dirty pages of ip in runs of up to WB_MAXPAGES,
+ * a transaction each.  writepages may write only the head of a run
+ * so as not to exceed the transaction; the rest stays dirty for the
+ * next one.  The pages of an unlinked inode are just discarded.  Pages which failed to be written are removed from
+ * the cache, so that they do not look written, and the error is
+ * kept in ip for pagecache_error().  Called outside of transactions.
+ * Returns 0 or an error.
+ */
+long
+pagecache_writeback(struct inode *ip)
+{
+    struct cached_page *pages[WB_MAXPAGES];
+    char *data[WB_MAXPAGES];
+    struct page_bucket *hb;
+    off_t start = 0;
+    long error = 0;
+    int n, m, r, clean;
+
+    if (ip->iops->writepages == 0)
+        return 0;
+
+    for (;;) {
+        begin_op();
+        ip->iops->ilock(ip);
+        if ((n = lock_dirty_run(ip, start, pages)) == 0) {
+            ip->iops->iunlock(ip);
+            end_op();
+            break;
+        }
+        for (int i = 0; i < n; i++)
+            data[i] = pages[i]->page;
+        r = n;
+        if (ip->nlink > 0
+         && (r = ip->iops->writepages(ip, pages[0]->offset, data, n)) < 0) {
+            warn("writeback failed: inum=%d, offset=0x%llx, error=%d",
+                ip->inum, pages[0]->offset, r);
+            error = r;
+        }
+        // 書けなかったページも取り除くのでダーティではなくなる
+        m = (r < 0) ? n : r;
+        start = pages[m - 1]->offset + PGSIZE;
+
+        acquire(&pagecache.lock);
+        for (int i = 0; i < m; i++)
+            pages[i]->flags &= ~PG_DIRTY;
+        ip->i_ndirty -= m;
+        pagecache.ndirty -= m;
+        clean = (ip->i_ndirty == 0);
+        if (r < 0)
+            ip->i_wb_error = r;
+        wakeup(&pagecache.ndirty);
+        release(&pagecache.lock);
+
+        for (int i = 0; i < n; i++) {
+            if (r < 0) {
+                // Freed by put_page() below
+                hb = page_hash(ip->dev, ip->inum, pages[i]->offset);
+                acquire(&hb->lock);
+                acquire(&pagecache.lock);
+                if (pages[i]->hashed)
+                    page_remove(hb, pages[i]);
+                release(&pagecache.lock);
+                release(&hb->lock);
+            }
+            releasesleep(&pages[i]->lock);
+            put_page(pages[i]);
+        }
+        ip->iops->iunlock(ip);
+        // Drop the reference taken by set_page_dirty().
+        if (clean)
+            iput(ip);
+        end_op();
+        if (clean)
+            break;
+    }
+    return error;
+}
+
+/*
+ * Return the error of a writeback of ip since the last call, which
+ * may have been done by the flusher, and clear it.  For fsync().
+ */
+long
+pagecache_error(struct inode *ip)
+{
+    long error;
+
+    acquire(&pagecache.lock);
+    error = ip->i_wb_error;
+    ip->i_wb_error = 0;
+    release(&pagecache.lock);
+    return error;
+}
+
+/* Write back the dirty pages of all inodes on dev, or of all if dev < 0. */
+void
+pagecache_sync(int dev)
+{
+    struct inode *ip;
+
+    for (ip = icache.inode; ip < &icache.inode[NINODE]; ip++) {
+        acquire(&pagecache.lock);
+        // Dirty pages hold a reference to their inode.
+        if (ip->i_ndirty == 0 || (dev >= 0 && ip->dev != dev)) {
+            release(&pagecache.lock);
+            continue;
+        }
+        idup(ip);
+        release(&pagecache.lock);
+        pagecache_writeback(ip);
+        begin_op();
+        iput(ip);
+        end_op();
+    }
+}
+
+/*
+ * Wait while there are too many dirty pages.  Called by writers
+ * before they begin a transaction.
+ */
+void
+balance_dirty_pages()
+{
+    acquire(&pagecache.lock);
+    while (pagecache.ndirty >= DIRTY_LIMIT) {
+        pagecache.flush = 1;
+        wakeup(&pagecache.flush);
+        sleep(&pagecache.ndirty, &pagecache.lock);
+    }
+    release(&pagecache.lock);
 }
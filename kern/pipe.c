@@ -6,6 +6,19 @@
 #include "file.h"
 #include "mm.h"
 #include "console.h"
+#include "kmalloc.h"
+#include "mmu.h"
+#include "string.h"
+#include "linux/errno.h"
+
+static struct kmem_cache *pipe_cachep;
+
+void
+pipeinit()
+{
+    pipe_cachep = kmem_cache_create("pipe", sizeof(struct pipe));
+    assert(pipe_cachep);
+}
 
 int
 pipealloc(struct file **f0, struct file **f1, int flags)
@@ -16,12 +29,21 @@ pipealloc(struct file **f0, struct file **f1, int flags)
     *f0 = *f1 = 0;
     if ((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
         goto bad;
-    if ((pi = (struct pipe *)kalloc()) == 0)
+    if ((pi = (struct pipe *)kmem_cache_alloc(pipe_cachep)) == 0)
         goto bad;
+    if ((pi->bufs = kmalloc(sizeof(char *) * PIPE_DEF_BUFFERS)) == 0) {
+        kmem_cache_free(pipe_cachep, pi);
+        pi = 0;
+        goto bad;
+    }
+    pi->nbufs = PIPE_DEF_BUFFERS;
+    pi->size = PIPE_DEF_BUFFERS * PGSIZE;
     pi->readopen = 1;
     pi->writeopen = 1;
     pi->nwrite = 0;
     pi->nread = 0;
+    pi->nrwait = 0;
+    pi->nwwait = 0;
     initlock(&pi->lock, "pipe");
     (*f0)->type = FD_PIPE;
     (*f0)->readable = 1;
@@ -40,7 +62,7 @@ pipealloc(struct file **f0, struct file **f1, int flags)
 
   bad:
     if (pi)
-        kfree((char *)pi);
+        kmem_cache_free(pipe_cachep, pi);
     if (*f0)
         fileclose(*f0);
     if (*f1)
@@ -48,6 +70,17 @@ pipealloc(struct file **f0, struct file **f1, int flags)
     return -1;
 }
 
+static void
+pipe_free(struct pipe *pi)
+{
+    for (uint32_t i = 0; i < pi->nbufs; i++) {
+        if (pi->bufs[i])
+            kfree(pi->bufs[i]);
+    }
+    kmfree(pi->bufs);
+    kmem_cache_free(pipe_cachep, pi);
+}
+
 void
 pipeclose(struct pipe *pi, int writable)
 {
@@ -61,32 +94,65 @@ pipeclose(struct pipe *pi, int writable)
     }
     if (pi->readopen == 0 && pi->writeopen == 0) {
         release(&pi->lock);
-        kfree((char *)pi);
+        pipe_free(pi);
     } else {
         release(&pi->lock);
     }
 }
 
+/* The page holding byte n of the stream */
+static inline char **
+pipe_buf(struct pipe *pi, uint32_t n)
+{
+    return &pi->bufs[(n / PGSIZE) % pi->nbufs];
+}
+
+/*
+ * Copy as much as fits in the ring, one contiguous run of a page at
+ * a time.  The reader is woken up only when the ring is full or all
+ * is written, and only if it is sleeping.
+ */
 ssize_t
 pipewrite(struct pipe *pi, char *addr, ssize_t n)
 {
-    ssize_t i/* = 0 */;
+    ssize_t i, m;
+    char **buf;
     struct proc *p = thisproc();
 
     trace("[%d]: nread=%d, nwrite=%d, n=%lld, addr='%c'", p->pid, pi->nread, pi->nwrite, n, addr[0]);
     acquire(&pi->lock);
-    for (i = 0; i < n; i++) {
-        while (pi->nwrite == pi->nread + PIPESIZE) {
+    for (i = 0; i < n; i += m) {
+        // Writes of up to PIPE_BUF bytes are not interleaved with others
+        while (pi->nwrite - pi->nread == pi->size
+            || (i == 0 && n <= PIPE_BUF && pi->size - (pi->nwrite - pi->nread) < n)) {
             if (pi->readopen == 0 || p->killed) {
                 release(&pi->lock);
                 return -1;
             }
-            wakeup(&pi->nread);
+            if (pi->nrwait)
+                wakeup(&pi->nread);
+            pi->nwwait++;
             sleep(&pi->nwrite, &pi->lock);
+            pi->nwwait--;
+        }
+        if (pi->readopen == 0) {
+            release(&pi->lock);
+            return -1;
+        }
+        buf = pipe_buf(pi, pi->nwrite);
+        if (*buf == 0 && (*buf = kalloc()) == 0) {
+            if (pi->nrwait)
+                wakeup(&pi->nread);
+            release(&pi->lock);
+            return i > 0 ? i : -ENOMEM;
         }
-        pi->data[pi->nwrite++ % PIPESIZE] = addr[i];
+        m = MIN(n - i, (ssize_t)(pi->size - (pi->nwrite - pi->nread)));
+        m = MIN(m, (ssize_t)(PGSIZE - pi->nwrite % PGSIZE));
+        memmove(*buf + pi->nwrite % PGSIZE, addr + i, m);
+        pi->nwrite += m;
     }
-    wakeup(&pi->nread);
+    if (pi->nrwait)
+        wakeup(&pi->nread);
     release(&pi->lock);
     return i;
 }
@@ -94,7 +160,7 @@ pipewrite(struct pipe *pi, char *addr, ssize_t n)
 ssize_t
 piperead(struct pipe *pi, char *addr, ssize_t n)
 {
-    ssize_t i;
+    ssize_t i, m;
     struct proc *p = thisproc();
     trace("[%d] nread=%d, nwrite=%d, n=%lld", p->pid, pi->nread, pi->nwrite, n);
     acquire(&pi->lock);
@@ -103,14 +169,81 @@ piperead(struct pipe *pi, char *addr, ssize_t n)
             release(&pi->lock);
             return -1;
         }
+        pi->nrwait++;
         sleep(&pi->nread, &pi->lock);
+        pi->nrwait--;
     }
-    for (i = 0; i < n; i++) {
-        if (pi->nread == pi->nwrite)
-            break;
-        addr[i] = pi->data[pi->nread++ % PIPESIZE];
+    for (i = 0; i < n && pi->nread != pi->nwrite; i += m) {
+        m = MIN(n - i, (ssize_t)(pi->nwrite - pi->nread));
+        m = MIN(m, (ssize_t)(PGSIZE - pi->nread % PGSIZE));
+        memmove(addr + i, *pipe_buf(pi, pi->nread) + pi->nread % PGSIZE, m);
+        pi->nread += m;
     }
-    wakeup(&pi->nwrite);
+    if (pi->nwwait)
+        wakeup(&pi->nwrite);
     release(&pi->lock);
     return i;
 }
+
+/*
+ * F_SETPIPE_SZ: resize the ring of pi to size bytes rounded up to
+ * a power of 2 pages.  The pages holding data are moved to their
+ * places in the new ring.  Returns the new size, or -EBUSY if the
+ * data does not fit.
+ */
+long
+pipe_setsize(struct pipe *pi, long size)
+{
+    uint32_t nbufs = 1, first, span;
+    char **bufs, **old;
+
+    if (size <= 0 || size > PIPE_MAX_SIZE)
+        return -EINVAL;
+    while (nbufs * PGSIZE < size)
+        nbufs <<= 1;
+    if ((bufs = kmalloc(sizeof(char *) * nbufs)) == 0)
+        return -ENOMEM;
+
+    acquire(&pi->lock);
+    first = pi->nread / PGSIZE;
+    span = (pi->nread % PGSIZE + (pi->nwrite - pi->nread) + PGSIZE - 1) / PGSIZE;
+    if (span > nbufs) {
+        release(&pi->lock);
+        kmfree(bufs);
+        return -EBUSY;
+    }
+    /*
+     * A full ring whose data starts in the middle of a page has its
+     * last bytes at the head of the same page, which need a page of
+     * their own in the larger ring.
+     */
+    if (span > pi->nbufs) {
+        if ((bufs[(first + span - 1) % nbufs] = kalloc()) == 0) {
+            release(&pi->lock);
+            kmfree(bufs);
+            return -ENOMEM;
+        }
+        memmove(bufs[(first + span - 1) % nbufs], *pipe_buf(pi, pi->nwrite),
+            pi->nwrite % PGSIZE);
+        span--;
+    }
+    for (uint32_t i = 0; i < span; i++) {
+        bufs[(first + i) % nbufs] = pi->bufs[(first + i) % pi->nbufs];
+        pi->bufs[(first + i) % pi->nbufs] = 0;
+    }
+    // The other pages are allocated again when written
+    for (uint32_t i = 0; i < pi->nbufs; i++) {
+        if (pi->bufs[i])
+            kfree(pi->bufs[i]);
+    }
+    old = pi->bufs;
+    pi->bufs = bufs;
+    pi->nbufs = nbufs;
+    pi->size = nbufs * PGSIZE;
+    // Writers may have more room now
+    if (pi->nwwait)
+        wakeup(&pi->nwrite);
+    release(&pi->lock);
+    kmfree(old);
+    return nbufs * PGSIZE;
+}
@@ -7,6 +7,7 @@
 #include "list.h"
 #include "console.h"
 #include "mm.h"
+#include "kmalloc.h"
 #include "mmu.h"
 #include "vm.h"
 #include "spinlock.h"
@@ -20,6 +21,9 @@
 #include "linux/ppoll.h"
 #include "linux/resources.h"
 #include "linux/wait.h"
+#include "linux/sched.h"
+#include "timer.h"
+#include "futex.h"
 
 extern void trapret();
 extern void swtch(struct context **old, struct context *new);
@@ -30,12 +34,40 @@ static void idle_init();
 #define SQSIZE  0x100           /* Must be power of 2. */
 #define HASH(x) ((((uint64_t)(x)) >> 5) & (SQSIZE - 1))
 
+/*
+ * Fair scheduling (CFS-like).
+ * Each process accumulates vruntime, its run time scaled by
+ * NICE_0_LOAD / weight(nice).  Run queues are sorted by vruntime
+ * and the process with the smallest vruntime runs next.
+ */
+#define NICE_0_LOAD     1024
+#define SCHED_LATENCY   20000000UL      /* 20ms: max credit for a sleeper */
+#define SCHED_GRAN      4000000UL       /* 4ms: lead needed to preempt */
+
+/* Same weights as Linux: each nice step is ~10% of cpu. */
+static const int prio_to_weight[40] = {
+    /* -20 */ 88761, 71755, 56483, 46273, 36291,
+    /* -15 */ 29154, 23254, 18705, 14949, 11916,
+    /* -10 */  9548,  7620,  6100,  4904,  3906,
+    /*  -5 */  3121,  2501,  1991,  1586,  1277,
+    /*   0 */  1024,   820,   655,   526,   423,
+    /*   5 */   335,   272,   215,   172,   137,
+    /*  10 */   110,    87,    70,    56,    45,
+    /*  15 */    36,    29,    23,    18,    15,
+};
+
 struct cpu cpu[NCPU];
 
+/*
+ * ptable.lock protects the process table and the sleep queues.
+ * Runnable processes live on per-CPU run queues (cpu[i].runq)
+ * protected by cpu[i].lock.  Lock order: ptable.lock -> cpu[i].lock.
+ * The run queue lock of the current CPU is held across swtch() and
+ * released by the process (or scheduler) that is switched to.
+ */
 struct {
     struct proc proc[NPROC];
     struct list_head slpque[SQSIZE];
-    struct list_head sched_que;
     struct spinlock lock;
 } ptable;
 
@@ -47,13 +79,176 @@ struct _q {
 struct proc *initproc;
 static pid_t pid = 0;
 
+static struct kmem_cache *mm_cachep, *files_cachep, *fs_cachep, *group_cachep;
+
+static struct thread_group *group_alloc();
+static void group_put(struct thread_group *group);
+
 void
 proc_init()
 {
+    mm_cachep = kmem_cache_create("mm_struct", sizeof(struct mm_struct));
+    files_cachep = kmem_cache_create("files_struct", sizeof(struct files_struct));
+    fs_cachep = kmem_cache_create("fs_struct", sizeof(struct fs_struct));
+    group_cachep = kmem_cache_create("thread_group", sizeof(struct thread_group));
+    assert(mm_cachep && files_cachep && fs_cachep && group_cachep);
+
     initlock(&ptable.lock, "ptable");
-    list_init(&ptable.sched_que);
     for (int i = 0; i < SQSIZE; i++)
         list_init(&ptable.slpque[i]);
+    for (int i = 0; i < NCPU; i++) {
+        initlock(&cpu[i].lock, "runq");
+        list_init(&cpu[i].runq);
+        cpu[i].nrunnable = 0;
+        cpu[i].nsteal = cpu[i].nmigrate = 0;
+    }
+}
+
+/*
+ * Put p at the tail of the run queue of c.
+ * c->lock must be held.
+ */
+static void
+runq_push(struct cpu *c, struct proc *p)
+{
+    struct proc *q;
+
+    /* Keep the queue sorted by vruntime, FIFO among equals. */
+    LIST_FOREACH_ENTRY(q, &c->runq, link) {
+        if (q->vruntime > p->vruntime)
+            break;
+    }
+    list_push_back(&q->link, &p->link);
+    c->nrunnable++;
+    p->cpu = c - cpu;
+    p->state = RUNNABLE;
+}
+
+/*
+ * Take the process at the head of the run queue of c.
+ * c->lock must be held.
+ */
+static struct proc *
+runq_pop(struct cpu *c)
+{
+    struct proc *p;
+
+    if (list_empty(&c->runq))
+        return 0;
+    p = container_of(list_front(&c->runq), struct proc, link);
+    list_pop_front(&c->runq);
+    c->nrunnable--;
+    if (p->vruntime > c->min_vruntime)
+        c->min_vruntime = p->vruntime;
+    return p;
+}
+
+/* May p run on c (sched_setaffinity())? */
+static int
+cpu_allowed(struct proc *p, struct cpu *c)
+{
+    return (p->cpus_allowed >> (c - cpu)) & 1;
+}
+
+static struct cpu *select_cpu(struct proc *p);
+
+/* Charge the time p has run since the last update to its vruntime. */
+static void
+update_curr(struct proc *p)
+{
+    uint64_t now = ktime_get();
+
+    if (p != thiscpu()->idle)
+        p->vruntime += (now - p->exec_start) * NICE_0_LOAD
+                     / prio_to_weight[p->nice - PRIO_MIN];
+    p->exec_start = now;
+}
+
+/*
+ * Make p runnable on the run queue of the cpu it last ran on, or of
+ * another one if p may no longer run there.
+ * The caller must not hold any run queue lock.
+ */
+static void
+make_runnable(struct proc *p)
+{
+    struct cpu *c = &cpu[p->cpu];
+
+    if (!cpu_allowed(p, c))
+        c = select_cpu(p);
+    acquire(&c->lock);
+    /* A sleeper gets at most half a latency period of credit. */
+    if (c->min_vruntime > p->vruntime + SCHED_LATENCY / 2)
+        p->vruntime = c->min_vruntime - SCHED_LATENCY / 2;
+    runq_push(c, p);
+    release(&c->lock);
+}
+
+/*
+ * Steal a process from the tail of the busiest other run queue.
+ * The tail is the process that waited least, i.e. the one whose
+ * cache footprint is the coldest on its cpu.  Processes which may
+ * not run on c are skipped.
+ * Returns 0 if there is nothing to steal.
+ */
+static struct proc *
+runq_steal(struct cpu *c)
+{
+    struct cpu *v, *victim = 0;
+    struct proc *p = 0, *q;
+    int64_t lag = 0;
+
+    for (v = cpu; v < cpu + NCPU; v++) {
+        if (v == c || v->nrunnable == 0)
+            continue;
+        if (victim == 0 || v->nrunnable > victim->nrunnable)
+            victim = v;
+    }
+    if (victim == 0)
+        return 0;
+
+    acquire(&victim->lock);
+    LIST_FOREACH_ENTRY_REVERSE(q, &victim->runq, link) {
+        if (cpu_allowed(q, c)) {
+            p = q;
+            break;
+        }
+    }
+    if (p) {
+        list_drop(&p->link);
+        victim->nrunnable--;
+        lag = p->vruntime - victim->min_vruntime;
+    }
+    release(&victim->lock);
+
+    if (p) {
+        /* Keep its lag relative to the new queue's min_vruntime. */
+        acquire(&c->lock);
+        if (lag < 0 && (uint64_t)-lag > c->min_vruntime)
+            p->vruntime = 0;
+        else
+            p->vruntime = c->min_vruntime + lag;
+        release(&c->lock);
+    }
+    return p;
+}
+
+/*
+ * Choose the least loaded cpu p may run on for a new or moving
+ * process, preferring this one.
+ */
+static struct cpu *
+select_cpu(struct proc *p)
+{
+    struct cpu *c, *best = thiscpu();
+
+    if (!cpu_allowed(p, best))
+        for (best = cpu; !cpu_allowed(p, best); best++)
+            ;
+    for (c = cpu; c < cpu + NCPU; c++)
+        if (cpu_allowed(p, c) && c->nrunnable < best->nrunnable)
+            best = c;
+    return best;
 }
 
 // TODO: use kmalloc
@@ -83,7 +278,8 @@ proc_alloc()
         return 0;
     }
 
-    p->pid = ++pid;
+    p->pid = p->tgid = ++pid;
+    p->cpus_allowed = (1UL << NCPU) - 1;
     p->state = EMBRYO;
     release(&ptable.lock);
 
@@ -116,10 +312,18 @@ proc_initx(char *name, char *code, size_t len)
     void *va = kalloc();
     assert(p && va);
 
-    p->pgdir = vm_init();
-    assert(p->pgdir);
-
-    int ret = uvm_map(p->pgdir, 0, PGSIZE, V2P(va));
+    p->mm = mm_alloc();
+    p->files = kmem_cache_alloc(files_cachep);
+    p->fs = kmem_cache_alloc(fs_cachep);
+    p->group = group_alloc();
+    assert(p->mm && p->files && p->fs && p->group);
+    memset(p->files, 0, sizeof(*p->files));
+    p->files->ref = 1;
+    initlock(&p->files->lock, "files");
+    p->fs->ref = 1;
+    p->fs->cwd = 0;
+
+    int ret = uvm_map(p->mm->pgdir, 0, PGSIZE, V2P(va));
     assert(ret == 0);
 
     memmove(va, code, len);
@@ -128,28 +332,59 @@ proc_initx(char *name, char *code, size_t len)
     // Flush dcache to memory so that icache can retrieve the correct one.
     dccivac(va, len);
 
-    p->stksz = 0;
-    p->sz = PGSIZE;
-    p->base = 0;
+    p->mm->stksz = 0;
+    p->mm->sz = PGSIZE;
+    p->mm->base = 0;
 
     p->pgid = p->sid = p->pid;
-    p->fdflag = 0;
     p->umask = 0002;
     p->uid = p->euid = p->suid = p->fsuid = 0;
     p->gid = p->egid = p->sgid = p->fsgid = 0;
     p->ngroups = 0;
     memset(p->groups, 0, sizeof(gid_t)*NGROUPS);
 
-    p->nregions = 0;
-    p->regions = 0;
-    initlock(p->regions_lock, "mapregion");
-
     p->tf->elr = 0;
 
     safestrcpy(p->name, name, sizeof(p->name));
     return p;
 }
 
+/* First code of a kernel thread: called by swtch() like forkret(). */
+static void
+kthread_start()
+{
+    struct proc *p = thisproc();
+
+    release(&thiscpu()->lock);
+    p->kfn(p->karg);
+    panic("kthread '%s' returned", p->name);
+}
+
+/*
+ * Create a kernel thread running fn(arg).  It has no address space,
+ * files nor directory and runs in the kernel until the system stops.
+ */
+struct proc *
+kthread_create(void (*fn)(void *), void *arg, char *name)
+{
+    struct proc *p = proc_alloc();
+
+    if (p == 0)
+        return 0;
+    p->kfn = fn;
+    p->karg = arg;
+    p->context->lr0 = (uint64_t) kthread_start;
+    p->pgid = p->sid = p->pid;
+    safestrcpy(p->name, name, sizeof(p->name));
+
+    struct cpu *c = select_cpu(p);
+    acquire(&c->lock);
+    p->vruntime = c->min_vruntime;
+    runq_push(c, p);
+    release(&c->lock);
+    return p;
+}
+
 /* Initialize per-cpu idle process. */
 static void
 idle_init()
@@ -165,12 +400,11 @@ user_init()
     extern char icode[], eicode[];
     struct proc *p = proc_initx("icode", icode, (size_t)(eicode - icode));
     p->cap_effective = p->cap_inheritable = p->cap_permitted = CAP_INIT_EFF_SET;
-    p->cwd = namei("/");
-    assert(p->cwd);
+    p->fs->cwd = namei("/");
+    assert(p->fs->cwd);
 
-    acquire(&ptable.lock);
-    list_push_back(&ptable.sched_que, &p->link);
-    release(&ptable.lock);
+    p->cpu = cpuid();
+    make_runnable(p);
 }
 
 /*
@@ -181,24 +415,55 @@ user_init()
  * - swtch to start running that process
  * - eventually that process transfers control
  *   via swtch back to the scheduler.
+ * The process is taken from this cpu's run queue.  When it is empty,
+ * one is stolen from the busiest other cpu before falling back to idle.
  */
 void
 scheduler()
 {
+    struct cpu *c = thiscpu();
+    struct proc *p;
+
     idle_init();
-    for (struct proc * p;;) {
-        acquire(&ptable.lock);
-        struct list_head *head = &ptable.sched_que;
-        if (list_empty(head)) {
-            p = thiscpu()->idle;
-        } else {
-            p = container_of(list_front(head), struct proc, link);
-            list_pop_front(head);
+    c->idle->cpu = cpuid();
+    for (;;) {
+        acquire(&c->lock);
+        if ((p = runq_pop(c)) != 0 && !cpu_allowed(p, c)) {
+            // sched_setaffinity() でこのCPUでは走れなくなった
+            release(&c->lock);
+            make_runnable(p);
+            continue;
+        }
+        if (p == 0) {
+            release(&c->lock);
+            p = runq_steal(c);
+            acquire(&c->lock);
+            if (p) {
+                c->nsteal++;
+                c->nmigrate++;
+            } else {
+                p = c->idle;
+            }
+        }
+        p->cpu = cpuid();
+        p->state = RUNNING;
+        p->exec_start = ktime_get();
+        timer_set_tick(p != c->idle);
+        // An exiting process may have dropped its address space.
+        uvm_switch(p->mm ? p->mm->pgdir : c->idle->mm->pgdir);
+        c->proc = p;
+        swtch(&c->scheduler, p->context);
+        release(&c->lock);
+
+        /* Nobody waits for a thread: reap it now that it is off this cpu. */
+        if (p->state == ZOMBIE && p->detached) {
+            acquire(&ptable.lock);
+            group_put(p->group);
+            p->group = 0;
+            kfree(p->kstack);
+            p->state = UNUSED;
+            release(&ptable.lock);
         }
-        uvm_switch(p->pgdir);
-        thiscpu()->proc = p;
-        swtch(&thiscpu()->scheduler, p->context);
-        release(&ptable.lock);
     }
 }
 
@@ -213,13 +478,13 @@ forkret()
     static int first = 1;
     if (first && thisproc() != thiscpu()->idle) {
         first = 0;
-        release(&ptable.lock);
+        release(&thiscpu()->lock);
 
         dev_init();
         iinit(ROOTDEV);
         initlog(ROOTDEV);
     } else {
-        release(&ptable.lock);
+        release(&thiscpu()->lock);
     }
     trace("proc '%s'(%d)", thisproc()->name, thisproc()->pid);
 }
@@ -229,13 +494,44 @@ void
 yield()
 {
     struct proc *p = thisproc();
-    acquire(&ptable.lock);
-    if (p != thiscpu()->idle)
-        list_push_back(&ptable.sched_que, &p->link);
-    p->state = RUNNABLE;
-    swtch(&p->context, thiscpu()->scheduler);
-    p->state = RUNNING;
-    release(&ptable.lock);
+    struct cpu *c = thiscpu();
+
+    update_curr(p);
+    acquire(&c->lock);
+    if (p != c->idle)
+        runq_push(c, p);
+    else
+        p->state = RUNNABLE;
+    swtch(&p->context, c->scheduler);
+    release(&thiscpu()->lock);
+}
+
+/*
+ * Called from timer_intr() on every tick of this cpu.
+ * Charges the tick to the current process and returns 1
+ * if it has run long enough ahead of the next runnable one
+ * that it should give up the cpu.
+ */
+int
+sched_tick()
+{
+    struct proc *p = thisproc(), *q;
+    struct cpu *c = thiscpu();
+    int resched = 0;
+
+    /* Timer interrupts are only taken from user mode. */
+    p->utime += 1000000000UL / HZ;
+    if (p == c->idle)
+        return 1;
+
+    update_curr(p);
+    acquire(&c->lock);
+    if (!list_empty(&c->runq)) {
+        q = container_of(list_front(&c->runq), struct proc, link);
+        resched = p->vruntime > q->vruntime + SCHED_GRAN;
+    }
+    release(&c->lock);
+    return resched;
 }
 
 /*
@@ -257,17 +553,19 @@ sleep(void *chan, struct spinlock *lk)
 
     p->chan = chan;
     list_push_back(&ptable.slpque[i], &p->link);
+    update_curr(p);
 
     p->state = SLEEPING;
     trace("'%s'(%d) sleep lk=0x%p", p->name, p->pid, lk);
+    /* Hold the run queue lock across swtch so that no other cpu
+       can pick up p before it has left this one. */
+    acquire(&thiscpu()->lock);
+    release(&ptable.lock);
     swtch(&thisproc()->context, thiscpu()->scheduler);
+    release(&thiscpu()->lock);
     trace("'%s'(%d) wakeup lk=0x%p", p->name, p->pid, lk);
-    p->state = RUNNING;
 
-    if (lk != &ptable.lock) {
-        release(&ptable.lock);
-        acquire(lk);
-    }
+    acquire(lk);
 }
 
 /*
@@ -283,8 +581,7 @@ wakeup1(void *chan)
     LIST_FOREACH_ENTRY_SAFE(p, np, q, link) {
         if (p->chan == chan) {
             list_drop(&p->link);
-            list_push_back(&ptable.sched_que, &p->link);
-            p->state = RUNNABLE;
+            make_runnable(p);
         }
     }
 }
@@ -298,65 +595,251 @@ wakeup(void *chan)
     release(&ptable.lock);
 }
 
+/* Address space, open files and cwd shared or copied by clone(). */
+
+struct mm_struct *
+mm_alloc()
+{
+    struct mm_struct *mm;
+
+    if ((mm = kmem_cache_alloc(mm_cachep)) == 0)
+        return 0;
+    memset(mm, 0, sizeof(*mm));
+    if ((mm->pgdir = vm_init()) == 0) {
+        kmem_cache_free(mm_cachep, mm);
+        return 0;
+    }
+    mm->ref = 1;
+    initlock(&mm->lock, "mm");
+    return mm;
+}
+
+/* Copy the address space for fork.  Pages are shared copy on write. */
+static struct mm_struct *
+mm_copy(struct mm_struct *old)
+{
+    struct mm_struct *mm;
+
+    if ((mm = kmem_cache_alloc(mm_cachep)) == 0)
+        return 0;
+    memset(mm, 0, sizeof(*mm));
+    mm->ref = 1;
+    initlock(&mm->lock, "mm");
+    // 他のスレッドのCopy on Writeと排他してページテーブルを写す
+    acquire(&old->lock);
+    if ((mm->pgdir = uvm_copy(old->pgdir)) == 0) {
+        release(&old->lock);
+        debug("uvm_copy returns null");
+        kmem_cache_free(mm_cachep, mm);
+        return 0;
+    }
+    if (old->nregions != 0 && copy_mmap_list(old, mm) < 0) {
+        release(&old->lock);
+        debug("failed copy_mmap_list");
+        mm_put(mm);
+        return 0;
+    }
+    release(&old->lock);
+    mm->base = old->base;
+    mm->sz = old->sz;
+    mm->stksz = old->stksz;
+    return mm;
+}
+
+static struct mm_struct *
+mm_get(struct mm_struct *mm)
+{
+    __atomic_add_fetch(&mm->ref, 1, __ATOMIC_RELAXED);
+    return mm;
+}
+
+/* Drop a reference to mm and free it with the last one. */
+void
+mm_put(struct mm_struct *mm)
+{
+    if (__atomic_sub_fetch(&mm->ref, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    free_mmap_list(mm);
+    vm_free(mm->pgdir);
+    kmem_cache_free(mm_cachep, mm);
+}
+
+static struct files_struct *
+files_copy(struct files_struct *old)
+{
+    struct files_struct *files;
+
+    if ((files = kmem_cache_alloc(files_cachep)) == 0)
+        return 0;
+    memset(files, 0, sizeof(*files));
+    files->ref = 1;
+    initlock(&files->lock, "files");
+    acquire(&old->lock);
+    for (int i = 0; i < NOFILE; i++)
+        if (old->ofile[i])
+            files->ofile[i] = filedup(old->ofile[i]);
+    files->fdflag = old->fdflag;
+    release(&old->lock);
+    return files;
+}
+
+static struct files_struct *
+files_get(struct files_struct *files)
+{
+    __atomic_add_fetch(&files->ref, 1, __ATOMIC_RELAXED);
+    return files;
+}
+
+/* Drop a reference to files and close them all with the last one. */
+static void
+files_put(struct files_struct *files)
+{
+    if (__atomic_sub_fetch(&files->ref, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    for (int fd = 0; fd < NOFILE; fd++) {
+        if (files->ofile[fd]) {
+            fileclose(files->ofile[fd]);
+            files->ofile[fd] = 0;
+        }
+    }
+    kmem_cache_free(files_cachep, files);
+}
+
+static struct fs_struct *
+fs_copy(struct fs_struct *old)
+{
+    struct fs_struct *fs;
+
+    if ((fs = kmem_cache_alloc(fs_cachep)) == 0)
+        return 0;
+    fs->ref = 1;
+    fs->cwd = idup(old->cwd);
+    return fs;
+}
+
+static struct fs_struct *
+fs_get(struct fs_struct *fs)
+{
+    __atomic_add_fetch(&fs->ref, 1, __ATOMIC_RELAXED);
+    return fs;
+}
+
+static void
+fs_put(struct fs_struct *fs)
+{
+    if (__atomic_sub_fetch(&fs->ref, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    begin_op();
+    iput(fs->cwd);
+    end_op();
+    kmem_cache_free(fs_cachep, fs);
+}
+
+static struct thread_group *
+group_alloc()
+{
+    struct thread_group *group;
+
+    if ((group = kmem_cache_alloc(group_cachep)) == 0)
+        return 0;
+    group->ref = 1;
+    group->nr_threads = 1;
+    group->exiting = 0;
+    group->exit_code = 0;
+    return group;
+}
+
+static struct thread_group *
+group_get(struct thread_group *group)
+{
+    __atomic_add_fetch(&group->ref, 1, __ATOMIC_RELAXED);
+    return group;
+}
+
+static void
+group_put(struct thread_group *group)
+{
+    if (__atomic_sub_fetch(&group->ref, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    kmem_cache_free(group_cachep, group);
+}
+
+int
+fork()
+{
+    return clone(SIGCHLD, 0, 0, 0, 0);
+}
+
 /*
  * Create a new process copying p as the parent.
  * Sets up stack to return as if from system call.
- * Caller must set state of returned proc to RUNNABLE.
+ *
+ * CLONE_VM, CLONE_FILES and CLONE_FS share the address space,
+ * open files and cwd with the parent instead of copying them.
+ * The child returns on stack if it is not 0.
+ * CLONE_VFORK: the parent sleeps until the child calls execve()
+ * or exit().
+ * CLONE_THREAD: the child joins the thread group of the parent.
+ * It is not a child of the parent and is reaped on exit.
+ * CLONE_SETTLS, CLONE_PARENT_SETTID, CLONE_CHILD_SETTID and
+ * CLONE_CHILD_CLEARTID are handled as pthread_create() needs;
+ * -EFAULT if the tid cannot be stored.
  */
 int
-fork()
+clone(uint64_t flags, void *stack, int *ptid, uint64_t tls, int *ctid)
 {
     struct proc *cp = thisproc();
-    struct proc *np = proc_alloc();
-    long error;
+    struct proc *np;
+    int error = -ENOMEM;
 
-    if (np == 0) {
-        debug("proc_alloc returns null");
-        return -ENOMEM;
-    }
+    if ((flags & CLONE_THREAD) && !(flags & CLONE_SIGHAND))
+        return -EINVAL;
+    if ((flags & CLONE_SIGHAND) && !(flags & CLONE_VM))
+        return -EINVAL;
 
-    //if ((np->pgdir = uvm_copy2(cp)) == 0) {
-    if ((np->pgdir = uvm_copy(cp->pgdir)) == 0) {
-        kfree(np->kstack);
-
-        acquire(&ptable.lock);
-        np->state = UNUSED;
-        release(&ptable.lock);
-
-        debug("uvm_copy returns null");
+    if ((np = proc_alloc()) == 0) {
+        debug("proc_alloc returns null");
         return -ENOMEM;
     }
 
-    if (cp->nregions != 0) {
-        if ((error = copy_mmap_list(cp, np)) < 0) {
-            vm_free(np->pgdir);
-            kfree(np->kstack);
-            acquire(&ptable.lock);
-            np->state = UNUSED;
-            release(&ptable.lock);
-            debug("failed copy_mmap_list");
-            return error;
-        }
+    np->mm = (flags & CLONE_VM) ? mm_get(cp->mm) : mm_copy(cp->mm);
+    np->files = (flags & CLONE_FILES) ? files_get(cp->files) : files_copy(cp->files);
+    np->fs = (flags & CLONE_FS) ? fs_get(cp->fs) : fs_copy(cp->fs);
+    np->group = (flags & CLONE_THREAD) ? group_get(cp->group) : group_alloc();
+    if (np->mm == 0 || np->files == 0 || np->fs == 0 || np->group == 0)
+        goto bad;
+
+    if (flags & CLONE_THREAD) {
+        np->tgid = cp->tgid;
+        np->parent = cp->parent;
+        np->detached = 1;
+        safestrcpy(np->name, cp->name, sizeof(np->name));
+    } else {
+        np->parent = cp;
     }
 
-    np->parent = cp;
-
-    np->base = cp->base;
-    np->sz = cp->sz;
-    np->stksz = cp->stksz;
-
     memmove(np->tf, cp->tf, sizeof(*np->tf));
 
     // Fork returns 0 in the child.
     np->tf->x[0] = 0;
+    if (stack)
+        np->tf->sp = (uint64_t)stack;
+    if (flags & CLONE_SETTLS)
+        np->tf->tpidr = tls;
+
+    if (((flags & CLONE_PARENT_SETTID)
+      && copyout(cp->mm, ptid, &np->pid, sizeof(np->pid)) < 0)
+     || ((flags & CLONE_CHILD_SETTID)
+      && copyout(np->mm, ctid, &np->pid, sizeof(np->pid)) < 0)) {
+        error = -EFAULT;
+        goto bad;
+    }
+    if (flags & CLONE_CHILD_CLEARTID)
+        np->clear_child_tid = ctid;
 
-    for (int i = 0; i < NOFILE; i++)
-        if (cp->ofile[i])
-            np->ofile[i] = filedup(cp->ofile[i]);
-    np->cwd = idup(cp->cwd);
     np->pgid = cp->pgid;
     np->sid = cp->sid;
-    np->fdflag = cp->fdflag;
+    np->umask = cp->umask;
     np->uid = cp->uid;
     np->euid = cp->euid;
     np->suid = cp->suid;
@@ -373,29 +856,85 @@ fork()
 
     memmove(&np->signal, &cp->signal, sizeof(struct signal));
 
-    np->stime = np->utime = 0;
+    np->utime = 0;
     np->it_real_value = np->it_prof_value = np->it_virt_value = 0;
     np->it_real_incr = np->it_prof_incr = np->it_virt_incr = 0;
-    init_timer(&np->real_timer);
-    np->real_timer.data = (unsigned long) np;
-    np->real_timer.function = it_real_fn;
+    hrtimer_init(&np->real_timer, it_real_fn);
 
     int pid = np->pid;
 
     acquire(&ptable.lock);
-    list_push_back(&cp->child, &np->clink);
-    list_push_back(&ptable.sched_que, &np->link);
-    np->state = RUNNABLE;
+    if (flags & CLONE_THREAD)
+        np->group->nr_threads++;
+    else
+        list_push_back(&cp->child, &np->clink);
     release(&ptable.lock);
 
+    np->nice = cp->nice;
+    np->cpus_allowed = cp->cpus_allowed;
+    np->vfork = (flags & CLONE_VFORK) != 0;
+
+    /* Balance at fork: place the child on the least loaded cpu. */
+    struct cpu *c = select_cpu(np);
+    acquire(&c->lock);
+    if (c != thiscpu())
+        c->nmigrate++;
+    /* Start a little behind so that forking cannot starve others. */
+    np->vruntime = c->min_vruntime + SCHED_GRAN;
+    runq_push(c, np);
+    release(&c->lock);
+
     trace("'%s'(%d) fork '%s'(%d)", cp->name, cp->pid, np->name, np->pid);
 
+    // Only this process reaps np, so np stays valid while waiting.
+    if (flags & CLONE_VFORK) {
+        acquire(&ptable.lock);
+        while (np->vfork)
+            sleep(&np->vfork, &ptable.lock);
+        release(&ptable.lock);
+    }
+
     return pid;
+
+bad:
+    if (np->mm) mm_put(np->mm);
+    if (np->files) files_put(np->files);
+    if (np->fs) fs_put(np->fs);
+    if (np->group) group_put(np->group);
+    kfree(np->kstack);
+
+    acquire(&ptable.lock);
+    np->state = UNUSED;
+    release(&ptable.lock);
+    return error;
+}
+
+/*
+ * The vfork child p is done with the address space of its parent
+ * (execve() succeeded or p is exiting).  Wake up the parent.
+ * ptable.lock must be held.
+ */
+static void
+vfork_release1(struct proc *p)
+{
+    if (p->vfork) {
+        p->vfork = 0;
+        wakeup1(&p->vfork);
+    }
+}
+
+void
+vfork_release(struct proc *p)
+{
+    acquire(&ptable.lock);
+    vfork_release1(p);
+    release(&ptable.lock);
 }
 
 
 /*
  * Wait for a child process to exit and return its pid.
+ * A thread group leader is waited for after all its threads exit.
  * Return -1 if this process has no children.
  */
 int
@@ -419,6 +958,9 @@ wait4(pid_t pid, int *status, int options, struct rusage *ru)
                 if (p->pgid != -pid)
                     continue;
             }
+            // スレッドが残っているリーダーはまだ回収しない
+            if (p->state == ZOMBIE && p->group->nr_threads > 0)
+                continue;
             if (p->state == ZOMBIE
              || (options & WUNTRACED && p->state == SLEEPING)
              || (options & WNOHANG)) {
@@ -429,8 +971,13 @@ wait4(pid_t pid, int *status, int options, struct rusage *ru)
 
                 list_drop(&p->clink);
 
+                /* Wait until the zombie has switched off its cpu. */
+                acquire(&cpu[p->cpu].lock);
+                release(&cpu[p->cpu].lock);
+
+                group_put(p->group);
+                p->group = 0;
                 kfree(p->kstack);
-                vm_free(p->pgdir);
                 p->state = UNUSED;
 
                 int pid = p->pid;
@@ -461,23 +1008,39 @@ exit(int err)
         debug("exit: %s [%d]: err %d", cp->name, cp->pid, err);
     }
 
-    // Close all open files.
-    for (int fd = 0; fd < NOFILE; fd++) {
-        if (cp->ofile[fd]) {
-            fileclose(cp->ofile[fd]);
-            cp->ofile[fd] = 0;
-        }
+    hrtimer_cancel(&cp->real_timer);
+
+    // Close all open files and cwd unless other threads use them.
+    files_put(cp->files);
+    cp->files = 0;
+    fs_put(cp->fs);
+    cp->fs = 0;
+
+    // pthread_join() waits for the tid to be cleared.
+    if (cp->clear_child_tid) {
+        int zero = 0;
+        if (copyout(cp->mm, cp->clear_child_tid, &zero, sizeof(zero)) == 0)
+            futex_wake((uint32_t *)cp->clear_child_tid, 1);
     }
 
-    begin_op();
-    iput(cp->cwd);
-    end_op();
-    cp->cwd = 0;
+    // Drop the address space after switching off it; scheduler()
+    // runs this process on the idle address space from now on.
+    struct mm_struct *mm = cp->mm;
+    uvm_switch(thiscpu()->idle->mm->pgdir);
+    cp->mm = 0;
+    mm_put(mm);
 
     acquire(&ptable.lock);
 
-    // Parent might be sleeping in wait().
+    // The group is kept until this process is reaped: wait4() looks
+    // at nr_threads of a zombie leader.  de_thread() waits for the
+    // other threads to exit.
+    if (--cp->group->nr_threads == 1)
+        wakeup1(cp->group);
+
+    // Parent might be sleeping in wait() or vfork.
     wakeup1(cp->parent);
+    vfork_release1(cp);
 
     // Pass abandoned children to init.
     struct list_head *q = &cp->child;
@@ -492,11 +1055,16 @@ exit(int err)
             wakeup1(initproc);
     }
     assert(list_empty(q));
+    for (p = ptable.proc; p < ptable.proc + NPROC; p++)
+        if (p->detached && p->parent == cp)
+            p->parent = initproc;
 
     // Jump into the scheduler, never to return.
     cp->xstate = err & 0x7f;
     cp->state = ZOMBIE;
 
+    acquire(&thiscpu()->lock);
+    release(&ptable.lock);
     swtch(&cp->context, thiscpu()->scheduler);
     panic("zombie exit");
 }
@@ -530,6 +1098,9 @@ procdump()
             cprintf("%d %s %s\n", p->pid, states[p->state], p->name);
     }
     // release(&ptable.lock);
+    for (int i = 0; i < NCPU; i++)
+        cprintf("cpu%d: runq %d steal %lld migrate %lld\n", i,
+                cpu[i].nrunnable, cpu[i].nsteal, cpu[i].nmigrate);
 }
 
 
@@ -561,6 +1132,107 @@ send_signal(struct proc *p, int sig)
     }
 }
 
+/*
+ * pと同じスレッドグループの他のスレッドを終了させる
+ * (exit_group()とexecve()から呼び出される)
+ */
+void
+zap_other_threads(struct proc *p)
+{
+    struct proc *q;
+
+    acquire(&ptable.lock);
+    for (q = ptable.proc; q < ptable.proc + NPROC; q++) {
+        if (q == p || q->tgid != p->tgid || q->state == UNUSED || q->state == ZOMBIE)
+            continue;
+        send_signal(q, SIGKILL);
+        // 眠っているスレッドは起こしてkilledに気づかせる
+        if (q->state == SLEEPING) {
+            list_drop(&q->link);
+            make_runnable(q);
+        }
+    }
+    release(&ptable.lock);
+}
+
+/*
+ * Exit all threads of the current thread group.  The other threads
+ * exit with the same code (check_pending_signal()).
+ */
+void
+exit_group(int err)
+{
+    struct proc *p = thisproc();
+
+    acquire(&ptable.lock);
+    // 先に exit_group() したスレッドの終了コードを使う
+    if (p->group->exiting) {
+        err = p->group->exit_code;
+    } else {
+        p->group->exiting = 1;
+        p->group->exit_code = err;
+    }
+    release(&ptable.lock);
+    zap_other_threads(p);
+    exit(err);
+}
+
+/*
+ * execve() by the thread p: zap the other threads and wait for them
+ * to exit.  If p is not the leader of its group, take over the pid,
+ * the parent and the children of the leader, which is reaped, as
+ * de_thread() of Linux does.  Returns without waiting if p itself
+ * was killed by another thread meanwhile.
+ */
+void
+de_thread(struct proc *p)
+{
+    struct proc *leader = 0, *q, *nq;
+
+    zap_other_threads(p);
+
+    acquire(&ptable.lock);
+    while (p->group->nr_threads > 1 && !p->killed)
+        sleep(p->group, &ptable.lock);
+    if (p->killed || p->pid == p->tgid) {
+        release(&ptable.lock);
+        return;
+    }
+
+    // リーダーは終了してゾンビになっている
+    for (q = ptable.proc; q < ptable.proc + NPROC; q++) {
+        if (q->pid == p->tgid && q->state != UNUSED) {
+            leader = q;
+            break;
+        }
+    }
+
+    p->pid = p->tgid;
+    p->detached = 0;
+    if (leader)
+        p->parent = leader->parent;
+    list_push_back(&p->parent->child, &p->clink);
+    if (leader) {
+        list_drop(&leader->clink);
+        LIST_FOREACH_ENTRY_SAFE(q, nq, &leader->child, clink) {
+            q->parent = p;
+            list_drop(&q->clink);
+            list_push_back(&p->child, &q->clink);
+        }
+        for (q = ptable.proc; q < ptable.proc + NPROC; q++)
+            if (q->detached && q->parent == leader)
+                q->parent = p;
+        assert(leader->state == ZOMBIE);
+        acquire(&cpu[leader->cpu].lock);
+        release(&cpu[leader->cpu].lock);
+        group_put(leader->group);
+        leader->group = 0;
+        kfree(leader->kstack);
+        leader->state = UNUSED;
+    }
+    release(&ptable.lock);
+}
+
 /*
  * sys_killの実装
  */
@@ -805,6 +1477,14 @@ check_pending_signal(void)
 {
     struct proc *p = thisproc();
 
+    // SIGKILLやexit_group()により終了させられた
+    if (p->killed) {
+        acquire(&ptable.lock);
+        int err = p->group->exiting ? p->group->exit_code : SIGKILL;
+        release(&ptable.lock);
+        exit(err);
+    }
+
     for (int sig = 0; sig < NSIG; sig++) {
         if (sigismember(&p->signal.pending, sig) == 1) {
             trace("pid=%d, sig=%d", p->pid, sig);
@@ -1004,6 +1684,138 @@ getpgid(pid_t pid)
     }
 }
 
+/* Does p match (which, who) of setpriority/getpriority? */
+static int
+prio_match(struct proc *p, int which, int who)
+{
+    struct proc *cp = thisproc();
+
+    if (p->state == UNUSED || p->state == ZOMBIE)
+        return 0;
+    switch (which) {
+    case PRIO_PROCESS:
+        return p->pid == (who ? who : cp->pid);
+    case PRIO_PGRP:
+        return p->pgid == (who ? who : cp->pgid);
+    case PRIO_USER:
+        return p->uid == (who ? who : cp->uid);
+    }
+    return 0;
+}
+
+/*
+ * sys_setpriorityの実装
+ */
+long
+setpriority(int which, int who, int niceval)
+{
+    struct proc *cp = thisproc(), *p;
+    long error = -ESRCH;
+
+    if (which < PRIO_PROCESS || which > PRIO_USER)
+        return -EINVAL;
+    if (niceval < PRIO_MIN)
+        niceval = PRIO_MIN;
+    if (niceval > PRIO_MAX - 1)
+        niceval = PRIO_MAX - 1;
+
+    acquire(&ptable.lock);
+    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+        if (!prio_match(p, which, who))
+            continue;
+        if (p->uid != cp->euid && p->euid != cp->euid
+         && !capable(CAP_SYS_NICE)) {
+            error = -EPERM;
+            continue;
+        }
+        if (niceval < p->nice && !capable(CAP_SYS_NICE)) {
+            error = -EACCES;
+            continue;
+        }
+        if (error == -ESRCH)
+            error = 0;
+        p->nice = niceval;
+    }
+    release(&ptable.lock);
+    return error;
+}
+
+/*
+ * sys_getpriorityの実装
+ *   Linuxと同じく 20 - nice (1..40) を返す
+ */
+long
+getpriority(int which, int who)
+{
+    struct proc *p;
+    long retval = -ESRCH;
+
+    if (which < PRIO_PROCESS || which > PRIO_USER)
+        return -EINVAL;
+
+    acquire(&ptable.lock);
+    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+        if (prio_match(p, which, who) && 20 - p->nice > retval)
+            retval = 20 - p->nice;
+    }
+    release(&ptable.lock);
+    return retval;
+}
+
+/*
+ * sys_sched_setaffinityの実装: pid (0は自分) が走るCPUをmaskの
+ * ものに限る。今のCPUで走れなくなったら移る
+ */
+long
+sched_setaffinity(pid_t pid, uint64_t mask)
+{
+    struct proc *cp = thisproc(), *p;
+    long error = -ESRCH;
+
+    if ((mask &= (1UL << NCPU) - 1) == 0)
+        return -EINVAL;
+
+    acquire(&ptable.lock);
+    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+        if (p->state == UNUSED || p->state == ZOMBIE
+         || p->pid != (pid ? pid : cp->pid))
+            continue;
+        if (p->uid != cp->euid && p->euid != cp->euid
+         && !capable(CAP_SYS_NICE)) {
+            error = -EPERM;
+            break;
+        }
+        p->cpus_allowed = mask;
+        error = 0;
+        break;
+    }
+    release(&ptable.lock);
+
+    if (!cpu_allowed(cp, thiscpu()))
+        yield();
+    return error;
+}
+
+/* sys_sched_getaffinityの実装 */
+long
+sched_getaffinity(pid_t pid, uint64_t *mask)
+{
+    struct proc *cp = thisproc(), *p;
+    long error = -ESRCH;
+
+    acquire(&ptable.lock);
+    for (p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+        if (p->state != UNUSED && p->state != ZOMBIE
+         && p->pid == (pid ? pid : cp->pid)) {
+            *mask = p->cpus_allowed;
+            error = 0;
+            break;
+        }
+    }
+    release(&ptable.lock);
+    return error;
+}
+
 uint16_t
 get_procs(void)
 {
@@ -10,6 +10,7 @@
 #include "debug.h"
 #include "string.h"
 #include "clock.h"
+#include "timer.h"
 #include "mm.h"
 #include "random.h"
 #include "mmap.h"
@@ -27,15 +28,15 @@ in_user(void *s, size_t n)
     struct proc *p = thisproc();
 
     // p + n は code+data 内にある
-    if (p->base <= (uint64_t) s && (uint64_t) s + n <= p->sz)
+    if (p->mm->base <= (uint64_t) s && (uint64_t) s + n <= p->mm->sz)
         return 1;
 
     // p + n は stack 内にある
-    if (USERTOP - p->stksz <= (uint64_t) s && (uint64_t) s + n <= USERTOP)
+    if (USERTOP - p->mm->stksz <= (uint64_t) s && (uint64_t) s + n <= USERTOP)
         return 1;
 
     // p + n は mmap_region 内にある
-    struct mmap_region *region = p->regions;
+    struct mmap_region *region = p->mm->regions;
     while (region) {
         if ((uint64_t)region->addr <= (uint64_t)s
         && ((uint64_t)s + n) <= ((uint64_t)region->addr + region->length)) {
@@ -60,11 +61,11 @@ fetchstr(uint64_t addr, char **pp)
     char *s;
 
     *pp = s = (char *)addr;
-    if (p->base <= addr && addr < p->sz) {
-        for (; (uint64_t) s < p->sz; s++)
+    if (p->mm->base <= addr && addr < p->mm->sz) {
+        for (; (uint64_t) s < p->mm->sz; s++)
             if (*s == 0)
                 return s - *pp;
-    } else if (USERTOP - p->stksz <= addr && addr < USERTOP) {
+    } else if (USERTOP - p->mm->stksz <= addr && addr < USERTOP) {
         for (; (uint64_t) s < USERTOP; s++)
             if (*s == 0)
                 return s - *pp;
@@ -161,7 +162,6 @@ long
 sys_nanosleep()
 {
     struct timespec *req, *rem, t;
-    uint64_t expire;
 
     if (argptr(0, (char **)&req, sizeof(struct timespec)) < 0
      || argptr(1, (char **)&rem, sizeof(struct timespec)) < 0)
@@ -172,16 +172,8 @@ sys_nanosleep()
     if (t.tv_nsec >= 1000000000L || t.tv_nsec < 0 || t.tv_sec < 0)
         return -EINVAL;
 
-    expire = t.tv_sec * 1000000 + (t.tv_nsec + 999) / 1000;
-    debug("sec: %d, nsec: %d, expire: %d", t.tv_sec, t.tv_nsec, expire);
-    delayus(expire);
-
-    if (rem) {
-        rem->tv_sec = 0;
-        rem->tv_nsec = 0;
-    }
-
-    return 0;
+    debug("sec: %d, nsec: %d", t.tv_sec, t.tv_nsec);
+    return hrtimer_nanosleep(&t, rem);
 }
 
 long
@@ -243,11 +235,38 @@ sys_setitimer()
 }
 
 
+long
+sys_sched_setaffinity()
+{
+    pid_t pid;
+    size_t len;
+    uint64_t *mask;
+
+    if (argint(0, &pid) < 0 || argu64(1, &len) < 0
+     || len < sizeof(uint64_t)
+     || argptr(2, (char **)&mask, sizeof(uint64_t)) < 0)
+        return -EINVAL;
+
+    return sched_setaffinity(pid, *mask);
+}
+
+/* Linuxと同じくコピーしたバイト数を返す */
 long
 sys_sched_getaffinity()
 {
-    // TODO
-    return 0;
+    pid_t pid;
+    size_t len;
+    uint64_t *mask;
+    long error;
+
+    if (argint(0, &pid) < 0 || argu64(1, &len) < 0
+     || len < sizeof(uint64_t)
+     || argptr(2, (char **)&mask, sizeof(uint64_t)) < 0)
+        return -EINVAL;
+
+    if ((error = sched_getaffinity(pid, mask)) < 0)
+        return error;
+    return sizeof(uint64_t);
 }
 
 long
@@ -384,14 +403,15 @@ static func syscalls[] = {
     [SYS_fdatasync] = sys_fdatasync,            // 83
     [SYS_utimensat] = sys_utimensat,            // 88
     [SYS_exit] = sys_exit,                      // 93
-    // FIXME: exit_group should kill every thread in the current thread group.
     [SYS_exit_group] = sys_exit_group,          // 94
     [SYS_set_tid_address] = sys_set_tid_address,  // 96
+    [SYS_futex] = sys_futex,                    // 98
     [SYS_nanosleep] = sys_nanosleep,            // 101
     [SYS_getitimer] = sys_getitimer,            // 102
     [SYS_setitimer] = sys_setitimer,            // 103
     [SYS_clock_settime] = sys_clock_settime,    // 112
     [SYS_clock_gettime] = sys_clock_gettime,    // 113
+    [SYS_sched_setaffinity] = sys_sched_setaffinity, // 122
     [SYS_sched_getaffinity] = sys_sched_getaffinity, // 123
     [SYS_sched_yield] = sys_yield,              // 124
     [SYS_kill] = sys_kill,                      // 129
@@ -401,6 +421,8 @@ static func syscalls[] = {
     [SYS_rt_sigprocmask] = sys_rt_sigprocmask,  // 135
     [SYS_rt_sigpending] = sys_rt_sigpending,    // 136
     [SYS_rt_sigreturn] = sys_rt_sigreturn,      // 139
+    [SYS_setpriority] = sys_setpriority,        // 140
+    [SYS_getpriority] = sys_getpriority,        // 141
     [SYS_setregid] = sys_setregid,              // 143
     [SYS_setgid] = sys_setgid,                  // 144
     [SYS_setreuid] = sys_setreuid,              // 145
@@ -480,13 +502,15 @@ __attribute__((unused)) static char *syscall_names[] = {
     [SYS_fdatasync] = "sys_fdatasync",            // 83
     [SYS_utimensat] = "sys_utimensat",            // 88
     [SYS_exit] = "sys_exit",                      // 93
-    [SYS_exit_group] = "sys_exit",                // 94
-    [SYS_set_tid_address] = "sys_gettid",         // 96
+    [SYS_exit_group] = "sys_exit_group",          // 94
+    [SYS_set_tid_address] = "sys_set_tid_address",  // 96
+    [SYS_futex] = "sys_futex",                    // 98
     [SYS_nanosleep] = "sys_nanosleep",            // 101
     [SYS_getitimer] = "sys_getitimer",            // 102
     [SYS_setitimer] = "sys_setitimer",            // 103
     [SYS_clock_settime] = "sys_clock_settime",    // 112
     [SYS_clock_gettime] = "sys_clock_gettime",    // 113
+    [SYS_sched_setaffinity] = "sys_sched_setaffinity", // 122
     [SYS_sched_getaffinity] = "sys_sched_getaffinity", // 123
     [SYS_sched_yield] = "sys_yield",              // 124
     [SYS_kill] = "sys_kill",                      // 129
@@ -496,6 +520,8 @@ __attribute__((unused)) static char *syscall_names[] = {
     [SYS_rt_sigprocmask] = "sys_rt_sigprocmask",  // 135
     [SYS_rt_sigpending] = "sys_rt_sigpending",    // 136
     [SYS_rt_sigreturn] = "sys_rt_sigreturn",      // 139
+    [SYS_setpriority] = "sys_setpriority",        // 140
+    [SYS_getpriority] = "sys_getpriority",        // 141
     [SYS_setregid] = "sys_setregid",              // 143
     [SYS_setgid] = "sys_setgid",                  // 144
     [SYS_setreuid] = "sys_setreuid",              // 145
@@ -42,7 +42,7 @@ argfd(int n, int *pfd, struct file **pf)
 
     if (argint(n, &fd) < 0)
         return -1;
-    if (fd < 0 || fd >= NOFILE || (f = thisproc()->ofile[fd]) == 0)
+    if (fd < 0 || fd >= NOFILE || (f = thisproc()->files->ofile[fd]) == 0)
         return -1;
     if (pfd)
         *pfd = fd;
@@ -54,7 +54,7 @@ argfd(int n, int *pfd, struct file **pf)
 static long
 dupfd(int fd, int from)
 {
-    struct file *f = thisproc()->ofile[fd];
+    struct file *f = thisproc()->files->ofile[fd];
     if (!f) return -EBADF;
     filedup(f);
     return fdalloc(f, from);
@@ -87,13 +87,13 @@ sys_dup3()
     if (fd1 < 0 || fd1 >= NOFILE) return -EBADF;
     if (fd2 < 0 || fd2 >= NOFILE) return -EBADF;
 
-    f = p->ofile[fd1];
-    if (p->ofile[fd2])
-        fileclose(p->ofile[fd2]);
+    f = p->files->ofile[fd1];
+    if (p->files->ofile[fd2])
+        fileclose(p->files->ofile[fd2]);
     filedup(f);
     if (flags & O_CLOEXEC)
-        bit_add(p->fdflag, fd2);
-    p->ofile[fd2] = f;
+        bit_add(p->files->fdflag, fd2);
+    p->files->ofile[fd2] = f;
     return fd2;
 }
 
@@ -125,7 +125,7 @@ sys_pipe2()
     fd0 = -1;
     if ((fd0 = fdalloc(rf, 0)) < 0 || (fd1 = fdalloc(wf, 0)) < 0) {
         if (fd0 >= 0)
-            p->ofile[fd0] = 0;
+            p->files->ofile[fd0] = 0;
         fileclose(rf);
         fileclose(wf);
         warn("fdalloc failed");
@@ -136,8 +136,8 @@ sys_pipe2()
     memmove((void *)pipefd+sizeof(int), &fd1, sizeof(int));
 
     if (flags & O_CLOEXEC) {
-        bit_add(p->fdflag, fd0);
-        bit_add(p->fdflag, fd1);
+        bit_add(p->files->fdflag, fd0);
+        bit_add(p->files->fdflag, fd1);
     }
     debug("pipefd[%d, %d]", fd0, fd1);
     return 0;
@@ -159,13 +159,13 @@ sys_fcntl()
             return dupfd(fd, args);
 
         case F_GETFD:
-            return bit_test(p->fdflag, fd) ? FD_CLOEXEC : 0;
+            return bit_test(p->files->fdflag, fd) ? FD_CLOEXEC : 0;
 
         case F_SETFD:
             if (args & FD_CLOEXEC)
-                bit_add(p->fdflag, fd);
+                bit_add(p->files->fdflag, fd);
             else
-                bit_remove(p->fdflag, fd);
+                bit_remove(p->files->fdflag, fd);
             return 0;
 
         case F_GETFL:
@@ -174,6 +174,16 @@ sys_fcntl()
         case F_SETFL:
             f->flags = ((args & FILE_STATUS_FLAGS) | (f->flags & O_ACCMODE));
             return 0;
+
+        case F_SETPIPE_SZ:
+            if (f->type != FD_PIPE)
+                return -EBADF;
+            return pipe_setsize(f->pipe, args);
+
+        case F_GETPIPE_SZ:
+            if (f->type != FD_PIPE)
+                return -EBADF;
+            return f->pipe->size;
     }
 
     return -EINVAL;
@@ -194,6 +204,29 @@ sys_ioctl()
 
     trace("fd=%d, req=0x%llx, type=%d", fd, req, f->type);
 
+    // 通常ファイル: ブロックマップを返す（filefragで断片化を調べる）
+    if (f->type == FD_INODE && f->ip->type == T_FILE) {
+        int *blk;
+        if (req != FIBMAP && req != FIGETBSZ)
+            return -ENOTTY;
+        if (argptr(2, (char **)&blk, sizeof(int)) < 0 || blk == NULL)
+            return -EINVAL;
+        if (req == FIGETBSZ) {
+            *blk = sb[f->ip->dev].blocksize;
+            return 0;
+        }
+        // ファイル外と未割り当て（遅延割り当て中を含む）のブロックは0
+        if (*blk < 0)
+            return -EINVAL;
+        f->ip->iops->ilock(f->ip);
+        if ((uint64_t)*blk * sb[f->ip->dev].blocksize < f->ip->size)
+            *blk = f->ip->iops->bmap_noalloc(f->ip, *blk);
+        else
+            *blk = 0;
+        f->ip->iops->iunlock(f->ip);
+        return 0;
+    }
+
     if (f->type != FD_INODE || f->ip->type != T_DEV) {
         debug("bad type: %d, %d", f->type, f->ip->type);
         return -ENOTTY;
@@ -375,9 +408,9 @@ sys_close()
         return -1;
     trace("[%d] fd=%d, f: inum=%d", thisproc()->pid, fd, f->type == FD_INODE ? f->ip->inum : -1);
 
-    thisproc()->ofile[fd] = 0;
+    thisproc()->files->ofile[fd] = 0;
     fileclose(f);
-    bit_remove(thisproc()->fdflag, fd);
+    bit_remove(thisproc()->files->fdflag, fd);
 
     return 0;
 }
@@ -590,7 +623,7 @@ sys_mkdirat()
 
 
     begin_op();
-    if ((long)(ip = create(path, T_DIR, 0, 0, mode | S_IFDIR)) == 0) {
+    if ((long)(ip = create(path, T_DIR, 0, 0, mode | S_IFDIR)) < 0) {
         end_op();
         return (long)ip;
     }
@@ -668,9 +701,9 @@ sys_chdir()
         return -ENOTDIR;
     }
     ip->iops->iunlock(ip);
-    iput(curproc->cwd);
+    iput(curproc->fs->cwd);
     end_op();
-    curproc->cwd = ip;
+    curproc->fs->cwd = ip;
     return 0;
 }
 
@@ -693,17 +726,20 @@ sys_fadvise64()
     off_t offset;
     off_t len;
     int advice;
+    struct file *f;
 
-    if (argfd(0, &fd, 0) < 0 || argu64(1, (uint64_t *)&offset) < 0
+    if (argfd(0, &fd, &f) < 0)
+        return -EBADF;
+    if (argu64(1, (uint64_t *)&offset) < 0
      || argu64(2, (uint64_t *)&len) < 0 || argint(3, &advice) < 0)
         return -EINVAL;
 
-    if (advice < POSIX_FADV_NORMAL && advice > POSIX_FADV_NOREUSE)
+    if (advice < POSIX_FADV_NORMAL || advice > POSIX_FADV_NOREUSE)
         return -EINVAL;
 
     trace("fd=%d, offset=%d, len=%d, advice=0x%x", fd, offset, len, advice);
 
-    return 0;
+    return fileadvise(f, offset, len, advice);
 }
 
 long
@@ -726,24 +762,24 @@ long
 sys_fsync()
 {
     int fd;
+    struct file *f;
 
-    if (argfd(0, &fd, 0) < 0)
+    if (argfd(0, &fd, &f) < 0)
         return -EINVAL;
 
-    // xv6 file systemは常にflushされているので何もしない
-    return 0;
+    return fsync(f, 0);
 }
 
 long
 sys_fdatasync()
 {
     int fd;
+    struct file *f;
 
-    if (argfd(0, &fd, 0) < 0)
+    if (argfd(0, &fd, &f) < 0)
         return -EINVAL;
 
-    // xv6 file systemは常にflushされているので何もしない
-    return 0;
+    return fsync(f, 1);
 }
 
 
@@ -842,7 +878,7 @@ sys_getcwd()
         return (void *)-EINVAL;
 
     begin_op();
-    cwd = idup(p->cwd);
+    cwd = idup(p->fs->cwd);
     if (cwd->inum == ROOTINO) goto root;
     while (1) {
         dp = cwd->iops->dirlookup(cwd, "..", 0);
@@ -11,6 +11,9 @@
 #include "linux/ppoll.h"
 #include "linux/capability.h"
 #include "linux/resources.h"
+#include "linux/sched.h"
+#include "linux/futex.h"
+#include "futex.h"
 
 long
 sys_yield()
@@ -49,7 +52,7 @@ size_t
 sys_brk()
 {
     struct proc *p = thisproc();
-    size_t sz, newsz, oldsz = p->sz;
+    size_t sz, newsz, oldsz = p->mm->sz;
 
     //panic("sys_brk: unimplemented. ");
 
@@ -62,16 +65,16 @@ sys_brk()
         return oldsz;
 
     if (newsz < oldsz) {
-        p->sz = uvm_dealloc(p->pgdir, p->base, oldsz, newsz);
+        p->mm->sz = uvm_dealloc(p->mm->pgdir, p->mm->base, oldsz, newsz);
     } else {
-        sz = uvm_alloc(p->pgdir, p->base, p->stksz, oldsz, newsz);
+        sz = uvm_alloc(p->mm->pgdir, p->mm->base, p->mm->stksz, oldsz, newsz);
         if (sz == 0) {
             warn("uvm_alloc failed");
             return oldsz;
         }
-        p->sz = sz;
+        p->mm->sz = sz;
     }
-    return p->sz;
+    return p->mm->sz;
 }
 
 long
@@ -95,7 +98,7 @@ sys_mmap()
         f = NULL;
     } else {
         if (fd < 0 || fd >= NOFILE) return -EBADF;
-        if ((f = thisproc()->ofile[fd]) == 0) return -EBADF;
+        if ((f = thisproc()->files->ofile[fd]) == 0) return -EBADF;
     }
 
     if ((flags & (MAP_PRIVATE | MAP_SHARED)) == 0) {
@@ -166,17 +169,28 @@ long
 sys_clone()
 {
     void *childstk;
-    uint64_t flag;
-    if (argu64(0, &flag) < 0 || argu64(1, (uint64_t *) & childstk) < 0)
+    uint64_t flag, tls;
+    int *ptid, *ctid;
+    // aarch64: clone(flags, stack, parent_tid, tls, child_tid)
+    if (argu64(0, &flag) < 0 || argu64(1, (uint64_t *) & childstk) < 0
+     || argu64(2, (uint64_t *)&ptid) < 0 || argu64(3, &tls) < 0
+     || argu64(4, (uint64_t *)&ctid) < 0)
         return -1;
     trace("flags 0x%llx, child stack 0x%p", flag, childstk);
-    // FIXME: vforkの実装
-    // flags = 0x4011の例あり(CLONE_VFORK | SIGCHLD)
-    if (flag != 17) {
-        warn("flags other than SIGCHLD are not supported");
-        return -1;
+    // fork: SIGCHLD, vfork: CLONE_VM | CLONE_VFORK | SIGCHLD (0x4111)
+    // posix_spawn: CLONE_VFORK | SIGCHLD (0x4011)
+    // pthread_create: CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+    //   CLONE_THREAD | CLONE_SYSVSEM | CLONE_SETTLS | CLONE_PARENT_SETTID |
+    //   CLONE_CHILD_CLEARTID | CLONE_DETACHED (0x7d0f00)
+    // CLONE_DETACHED (0x400000) は無視される
+    if (flag & ~(CSIGNAL | CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND
+               | CLONE_VFORK | CLONE_THREAD | CLONE_SYSVSEM | CLONE_SETTLS
+               | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID
+               | CLONE_DETACHED | CLONE_CHILD_SETTID)) {
+        warn("flags 0x%llx not supported", flag);
+        return -EINVAL;
     }
-    return fork();
+    return clone(flag, childstk, ptid, tls, ctid);
 }
 
 
@@ -213,7 +227,14 @@ sys_kill()
 long
 sys_tkill()
 {
-    return 0;
+    pid_t tid;
+    int sig;
+
+    if (argint(0, &tid) < 0 || argint(1, &sig) < 0)
+        return -EINVAL;
+    if (tid <= 0)
+        return -EINVAL;
+    return kill(tid, sig);
 }
 
 long
@@ -702,12 +723,17 @@ sys_setgroups()
 
 // FIXME: use pid instead of tid since we don't have threads :)
 long sys_set_tid_address() {
+    int *tidptr;
+
+    if (argu64(0, (uint64_t *)&tidptr) < 0)
+        return -EINVAL;
     trace("set_tid_address: name '%s'", thisproc()->name);
+    thisproc()->clear_child_tid = tidptr;
     return thisproc()->pid;
 }
 
 long sys_getpid() {
-    return thisproc()->pid;
+    return thisproc()->tgid;
 }
 
 long sys_gettid() {
@@ -721,10 +747,9 @@ sys_getppid()
     return thisproc()->parent->pid;
 }
 
-// FIXME: exit_group should kill every thread in the current thread group.
 long sys_exit_group() {
     trace("sys_exit_group: '%s' exit with code %d", thisproc()->name, thisproc()->tf->x[0]);
-    exit(thisproc()->tf->x[0]);
+    exit_group(thisproc()->tf->x[0]);
     return 0;
 }
 
@@ -755,3 +780,47 @@ sys_setpgid()
 
     return setpgid(pid, pgid);
 }
+
+long
+sys_setpriority()
+{
+    int which, who, niceval;
+
+    if (argint(0, &which) < 0 || argint(1, &who) < 0
+     || argint(2, &niceval) < 0)
+        return -EINVAL;
+
+    return setpriority(which, who, niceval);
+}
+
+long
+sys_getpriority()
+{
+    int which, who;
+
+    if (argint(0, &which) < 0 || argint(1, &who) < 0)
+        return -EINVAL;
+
+    return getpriority(which, who);
+}
+
+long
+sys_futex()
+{
+    uint32_t *uaddr, *uaddr2;
+    int op;
+    uint32_t val, val3;
+    struct timespec *timeout;
+
+    if (argu64(0, (uint64_t *)&uaddr) < 0 || argint(1, &op) < 0
+     || argint(2, (int *)&val) < 0 || argu64(3, (uint64_t *)&timeout) < 0
+     || argu64(4, (uint64_t *)&uaddr2) < 0 || argint(5, (int *)&val3) < 0)
+        return -EINVAL;
+
+    // FUTEX_WAITのtimeoutだけがポインタ。REQUEUEでは数値
+    if ((op & FUTEX_CMD_MASK) == FUTEX_WAIT && timeout
+     && !in_user(timeout, sizeof(struct timespec)))
+        return -EFAULT;
+
+    return futex(uaddr, op, val, timeout, uaddr2, val3);
+}
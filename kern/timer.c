@@ -2,25 +2,84 @@
 #include "linux/time.h"
 #include "arm.h"
 #include "base.h"
+#include "clock.h"
 #include "irq.h"
 #include "console.h"
 #include "proc.h"
 #include "list.h"
 #include "spinlock.h"
+#include "linux/errno.h"
 
 /* Core Timer */
 #define CORE_TIMER_CTRL(i)      (LOCAL_BASE + 0x40 + 4*(i))
 #define CORE_TIMER_ENABLE       (1 << 1)        /* CNTPNSIRQ */
 
-static uint64_t dt;
+#define TICK_NSEC       (NSEC_PER_SEC / HZ)
+
+/*
+ * High resolution timers.
+ * Each cpu keeps its pending hrtimers sorted by expiry and programs
+ * cntp_cval_el0 for the earliest of them and its next scheduler tick.
+ * The tick is stopped while the idle process runs (dynamic tick), so
+ * an idle cpu is only interrupted when one of its timers expires.
+ */
+struct hrtimer_base {
+    struct spinlock lock;
+    struct list_head head;      /* Pending timers sorted by expires. */
+    struct hrtimer *running;    /* Timer whose callback is running. */
+    uint64_t next_tick;         /* Time of next tick, 0 if stopped. */
+};
+
+static struct hrtimer_base hrbase[NCPU];
 static uint64_t cnt;
 
+/* Monotonic time in ns since boot. */
+uint64_t
+ktime_get()
+{
+    uint64_t t = timestamp(), f = timerfreq();
+    return t / f * NSEC_PER_SEC + t % f * NSEC_PER_SEC / f;
+}
+
+static uint64_t
+ns_to_cnt(uint64_t ns)
+{
+    uint64_t f = timerfreq();
+    return ns / NSEC_PER_SEC * f + ns % NSEC_PER_SEC * f / NSEC_PER_SEC;
+}
+
+/*
+ * Program the timer of this cpu for its next event.
+ * base must be this cpu's and base->lock must be held.
+ */
+static void
+timer_program(struct hrtimer_base *base)
+{
+    uint64_t next = base->next_tick;
+
+    if (!list_empty(&base->head)) {
+        struct hrtimer *t = container_of(list_front(&base->head), struct hrtimer, list);
+        if (next == 0 || t->expires < next)
+            next = t->expires;
+    }
+    if (next == 0) {
+        asm volatile ("msr cntp_ctl_el0, %[x]"::[x] "r"(0));    // Timer disable
+        return;
+    }
+    asm volatile ("msr cntp_cval_el0, %[x]"::[x] "r"(ns_to_cnt(next)));
+    asm volatile ("msr cntp_ctl_el0, %[x]"::[x] "r"(1));        // Timer enable
+}
+
 void
 timer_init()
 {
-    dt = timerfreq() / HZ;       // 10 ms
-    asm volatile ("msr cntp_ctl_el0, %[x]"::[x] "r"(1));    // Timer enable
-    asm volatile ("msr cntp_tval_el0, %[x]"::[x] "r"(dt));  // Set counter
+    struct hrtimer_base *base = &hrbase[cpuid()];
+
+    initlock(&base->lock, "hrtimer");
+    list_init(&base->head);
+    base->running = 0;
+    base->next_tick = 0;
+    asm volatile ("msr cntp_ctl_el0, %[x]"::[x] "r"(0));    // Started by timer_set_tick()
     put32(CORE_TIMER_CTRL(cpuid()), CORE_TIMER_ENABLE);     // core timer enable
 #ifdef USE_GIC
     irq_enable(IRQ_LOCAL_CNTPNS);
@@ -28,10 +87,105 @@ timer_init()
 #endif
 }
 
+/*
+ * Start or stop the scheduler tick of this cpu.
+ * The tick is only needed while a process other than idle runs.
+ */
+void
+timer_set_tick(int on)
+{
+    struct hrtimer_base *base = &hrbase[cpuid()];
+
+    acquire(&base->lock);
+    if (on && base->next_tick == 0) {
+        base->next_tick = ktime_get() + TICK_NSEC;
+        timer_program(base);
+    } else if (!on && base->next_tick) {
+        base->next_tick = 0;
+        timer_program(base);
+    }
+    release(&base->lock);
+}
+
+/* Insert t to base in expiry order.  base->lock must be held. */
+static void
+enqueue_hrtimer(struct hrtimer_base *base, struct hrtimer *t)
+{
+    struct hrtimer *pos;
+
+    LIST_FOREACH_ENTRY(pos, &base->head, list) {
+        if (pos->expires > t->expires)
+            break;
+    }
+    list_push_back(&pos->list, &t->list);
+}
+
+/*
+ * Arm t to expire at expires (ktime_get() ns) on this cpu.
+ * t must not be pending.
+ */
+void
+hrtimer_start(struct hrtimer *t, uint64_t expires)
+{
+    struct hrtimer_base *base = &hrbase[cpuid()];
+
+    acquire(&base->lock);
+    t->expires = expires;
+    t->base = base;
+    enqueue_hrtimer(base, t);
+    timer_program(base);
+    release(&base->lock);
+}
+
+/*
+ * Deactivate t, waiting for its callback to finish if it is running.
+ * Returns 1 if t was pending.
+ */
+int
+hrtimer_cancel(struct hrtimer *t)
+{
+    struct hrtimer_base *base;
+    int ret = 0;
+
+    for (;;) {
+        if ((base = t->base) == 0)
+            return 0;
+        acquire(&base->lock);
+        if (t->base == base && base->running != t)
+            break;
+        release(&base->lock);
+    }
+    if (hrtimer_pending(t)) {
+        list_drop(&t->list);
+        t->list.next = t->list.prev = NULL;
+        ret = 1;
+    }
+    release(&base->lock);
+    return ret;
+}
+
+/* Run the expired timers of base.  Callbacks run without base->lock. */
 static void
-timer_reset()
+hrtimer_run(struct hrtimer_base *base, uint64_t now)
 {
-    asm volatile ("msr cntp_tval_el0, %[x]"::[x] "r"(dt));
+    struct hrtimer *t;
+
+    acquire(&base->lock);
+    while (!list_empty(&base->head)) {
+        t = container_of(list_front(&base->head), struct hrtimer, list);
+        if (t->expires > now)
+            break;
+        list_drop(&t->list);
+        t->list.next = t->list.prev = NULL;
+        base->running = t;
+        release(&base->lock);
+        int restart = t->function(t);
+        acquire(&base->lock);
+        base->running = 0;
+        if (restart == HRTIMER_RESTART)
+            enqueue_hrtimer(base, t);
+    }
+    release(&base->lock);
 }
 
 /*
@@ -41,9 +195,70 @@ timer_reset()
 void
 timer_intr()
 {
+    struct hrtimer_base *base = &hrbase[cpuid()];
+    uint64_t now = ktime_get();
+    int tick = 0;
+
     trace("t: %d", ++cnt);
-    timer_reset();
-    yield();
+    update_times();
+    hrtimer_run(base, now);
+
+    acquire(&base->lock);
+    if (base->next_tick && base->next_tick <= now) {
+        base->next_tick = now + TICK_NSEC;
+        tick = 1;
+    }
+    timer_program(base);
+    release(&base->lock);
+
+    if (tick && sched_tick())
+        yield();
+}
+
+static int
+hrtimer_wakeup(struct hrtimer *t)
+{
+    wakeup(t);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Sleep for req with ns resolution.
+ * If woken up early, the time left is stored to rem.
+ */
+long
+hrtimer_nanosleep(struct timespec *req, struct timespec *rem)
+{
+    struct proc *p = thisproc();
+    struct hrtimer t;
+    struct hrtimer_base *base;
+    uint64_t now, expires;
+
+    expires = ktime_get() + req->tv_sec * NSEC_PER_SEC + req->tv_nsec;
+    hrtimer_init(&t, hrtimer_wakeup);
+    hrtimer_start(&t, expires);
+
+    base = t.base;
+    acquire(&base->lock);
+    while (hrtimer_pending(&t) && !p->killed)
+        sleep(&t, &base->lock);
+    release(&base->lock);
+    /* t is on our stack: wait for its callback before returning. */
+    hrtimer_cancel(&t);
+
+    now = ktime_get();
+    if (now < expires) {
+        if (rem) {
+            rem->tv_sec = (expires - now) / NSEC_PER_SEC;
+            rem->tv_nsec = (expires - now) % NSEC_PER_SEC;
+        }
+        return -EINTR;
+    }
+    if (rem) {
+        rem->tv_sec = 0;
+        rem->tv_nsec = 0;
+    }
+    return 0;
 }
 
 
@@ -51,6 +266,10 @@ struct spinlock timerlock;
 
 /*
  * Event timer code
+ *
+ * The wheel is advanced by wheel_timer, an hrtimer which fires every
+ * tick only while timers are pending on the wheel.  An empty wheel is
+ * moved to jiffies at once when a timer is added (wheel_resync()).
  */
 #define TVN_BITS 6
 #define TVR_BITS 8
@@ -81,6 +300,13 @@ static struct timer_vec * const tvecs[] = {
 
 #define NOOF_TVECS (sizeof(tvecs) / sizeof(tvecs[0]))
 
+static uint64_t timer_jiffies;
+static int wheel_pending;           /* Timers on the wheel (timerlock) */
+static int wheel_armed;             /* wheel_timer is armed (timerlock) */
+static struct hrtimer wheel_timer;
+
+static int wheel_timer_fn(struct hrtimer *t);
+
 void
 init_timervecs(void)
 {
@@ -96,9 +322,38 @@ init_timervecs(void)
         list_init(tv1.vec + i);
 
     initlock(&timerlock, "timerlock");
+    hrtimer_init(&wheel_timer, wheel_timer_fn);
 }
 
-static uint64_t timer_jiffies;
+/*
+ * Move the empty wheel to jiffies without walking the ticks between:
+ * set the indexes run_timer_list() would have left.
+ * timerlock must be held.
+ */
+static void
+wheel_resync(void)
+{
+    if ((int64_t)(jiffies - timer_jiffies) <= 0)
+        return;
+    timer_jiffies = jiffies;
+    tv1.index = timer_jiffies & TVR_MASK;
+    for (int n = 1; n < NOOF_TVECS; n++)
+        tvecs[n]->index = (((timer_jiffies - 1) >> (TVR_BITS + (n - 1) * TVN_BITS)) + 1) & TVN_MASK;
+}
+
+/*
+ * Count a timer added to the wheel and start ticking the wheel if it
+ * was idle.  timerlock must be held.
+ */
+static void
+wheel_get(void)
+{
+    wheel_pending++;
+    if (!wheel_armed) {
+        wheel_armed = 1;
+        hrtimer_start(&wheel_timer, (ktime_get() / TICK_NSEC + 1) * TICK_NSEC);
+    }
+}
 
 static inline void
 internal_add_timer(struct timer_list *timer)
@@ -147,7 +402,10 @@ add_timer(struct timer_list *timer)
     acquire(&timerlock);
     if (timer_pending(timer))
         goto bug;
+    if (wheel_pending == 0)
+        wheel_resync();
     internal_add_timer(timer);
+    wheel_get();
     release(&timerlock);
     return;
 bug:
@@ -162,6 +420,7 @@ detach_timer(struct timer_list *timer)
     if (!timer_pending(timer))
         return 0;
     list_drop(&timer->list);
+    wheel_pending--;
     return 1;
 }
 
@@ -173,7 +432,10 @@ mod_timer(struct timer_list *timer, uint64_t expires)
     acquire(&timerlock);
     timer->expires = expires;
     ret = detach_timer(timer);
+    if (wheel_pending == 0)
+        wheel_resync();
     internal_add_timer(timer);
+    wheel_get();
     release(&timerlock);
     return ret;
 }
@@ -218,6 +480,7 @@ cascade_timers(struct timer_vec *tv)
 void
 run_timer_list(void)
 {
+    update_times();
     acquire(&timerlock);
     while ((int64_t)(jiffies - timer_jiffies) >= 0) {
         struct list_head *head, *curr;
@@ -252,3 +515,19 @@ repeat:
     }
     release(&timerlock);
 }
+
+/* Tick the wheel while it has timers: at every jiffy boundary. */
+static int
+wheel_timer_fn(struct hrtimer *t)
+{
+    int restart;
+
+    run_timer_list();
+    acquire(&timerlock);
+    if ((restart = wheel_pending > 0))
+        t->expires = (ktime_get() / TICK_NSEC + 1) * TICK_NSEC;
+    else
+        wheel_armed = 0;
+    release(&timerlock);
+    return restart ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
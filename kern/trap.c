@@ -65,12 +65,16 @@ trap(struct trapframe *tf)
     case EC_DABORT:     // 0x24 = 36: ユーザモードで発生したデータ例外
     case EC_DABORT2:    // 0x25 = 37: カーネルモードで発生したデータ例外
         if (dfs >= 4 && dfs <= 15) {
-            if ((tf->x[0] = pf_handler(dfs, far)) < 0) {
+            // x0は割り込まれたコードのものなので書き換えない
+            if (pf_handler(dfs, far) < 0) {
                 thisproc()->killed = 1;
                 info("inst/dataabort: dfs=%d, far=0x%llx", dfs, far);
                 exit(1);
             }
-            check_pending_signal();
+            // カーネルモードでのフォルト（ユーザメモリへのCOW書き込みなど）
+            // ではシグナルを処理しない
+            if (ec == EC_DABORT || ec == EC_IABORT)
+                check_pending_signal();
         } else {
             info("unknown ec: %d, dfs: %d", ec, dfs);
             trap_error(4);
@@ -93,7 +97,7 @@ static long
 pf_handler(int dfs, uint64_t far)
 {
     struct proc *p = thisproc();
-    //uint64_t *pte;
+    uint64_t *pte;
     struct mmap_region *region;
 
     far = ROUNDDOWN(far, PGSIZE);
@@ -102,8 +106,8 @@ pf_handler(int dfs, uint64_t far)
         // 現在のところロジック上ありえない。何らかのバグなのでエラーとする
         return -1;
     /*
-        lttbr0((uint64_t)p->pgdir);
-        if ((pte = pgdir_walk(p->pgdir, (void *)far, 1)) == 0) {
+        lttbr0((uint64_t)p->mm->pgdir);
+        if ((pte = pgdir_walk(p->mm->pgdir, (void *)far, 1)) == 0) {
             warn("[%d] recoveary failed: dfs=%d, far=0x%llx", p->pid, dfs, far);
             return -1;
         } else {
@@ -112,21 +116,36 @@ pf_handler(int dfs, uint64_t far)
         }
     */
     } else if (dfs <= 11) {     // Access fault: 遅延読み込み
-        region = p->regions;
+        region = p->mm->regions;
         while (region) {
             if (region->addr == (void *)far) {
                 if (mmap_load_pages(region->addr, region->length, region->prot, region->flags, region->f, region->offset) < 0) {
                     warn("load_pages failed: dfs=%d, far=0x%llx, region=0x%p", dfs, far, region->addr);
                     return -1;
                 }
-                lttbr0((uint64_t)p->pgdir);
+                lttbr0((uint64_t)p->mm->pgdir);
                 return 0;
             }
             region = region->next;
         }
         return -1;
     } else {                    // Permission fault: Copy on Write
-        region = p->regions;
+        // 同じページに書き込んだ他のスレッドと排他する
+        acquire(&p->mm->lock);
+        pte = pgdir_walk(p->mm->pgdir, (void *)far, 0);
+        if (pte && (*pte & PTE_VALID) && (*pte & PTE_COW)) {
+            long error = uvm_cow(pte);
+            release(&p->mm->lock);
+            return error;
+        }
+        // 他のスレッドがすでにコピーしていた
+        if (pte && (*pte & PTE_VALID) && (*pte & PTE_USER) && !(*pte & (PTE_RO | PTE_UXN))) {
+            release(&p->mm->lock);
+            return 0;
+        }
+        release(&p->mm->lock);
+
+        region = p->mm->regions;
         while (region) {
             if ((uint64_t)region->addr <= far
              && far < (uint64_t)region->addr + region->length
@@ -138,7 +157,7 @@ pf_handler(int dfs, uint64_t far)
                         warn("copy_mmap_pages failed: dfs=%d, far=0x%llx, region=0x%p, perm=0x%llx", dfs, far, region->addr, perm);
                         return -1;
                     }
-                    lttbr0((uint64_t)p->pgdir);
+                    lttbr0((uint64_t)p->mm->pgdir);
                     return 0;
                 }
             }
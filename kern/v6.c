@@ -28,6 +28,8 @@
 #include "linux/errno.h"
 #include "linux/time.h"
 
+static struct inode *v6_iget(uint32_t dev, uint32_t inum, uint16_t type);
+
 // There should be one superblock per disk device,
 // but we run with only one device.
 
@@ -47,7 +49,8 @@ struct vfs_operations v6_ops = {
     .namecmp    = &v6_namecmp,
     .direntlookup = &v6_direntlookup,
     .getrootino = &v6_getrootino,
-    .getdents   = &v6_getdents
+    .getdents   = &v6_getdents,
+    .iget       = &v6_iget
 };
 
 struct inode_operations v6_iops = {
@@ -56,6 +59,7 @@ struct inode_operations v6_iops = {
     .itrunc     = &v6_itrunc,
     .cleanup    = &v6_cleanup,
     .bmap       = &v6_bmap,
+    .bmap_noalloc = &v6_bmap_noalloc,
     .ilock      = &v6_ilock,
     .iunlock    = &generic_iunlock,
     .stati      = &generic_stati,
@@ -346,8 +350,7 @@ v6_dirlookup(struct inode *dp, char *name, size_t *poff)
     if (dp->type == T_MOUNT) {
         struct inode *rinode = mtablertinode(dp);
         if (rinode == 0) panic("v6_dirlookup: Invalid inode on mount table\n");
-        rinode->ref++;
-        return rinode;
+        return idup(rinode);
     }
 
     if (dp->type != T_DIR)
@@ -540,6 +543,47 @@ v6_bmap(struct inode *ip, uint32_t bn)
     return 0;
 }
 
+/*
+ * Return the disk block address of the nth block in inode ip,
+ * or 0 if it is not allocated.  Used by readahead.
+ */
+uint32_t
+v6_bmap_noalloc(struct inode *ip, uint32_t bn)
+{
+    uint32_t addr;
+    struct buf *bp;
+    struct v6_inode *v6ip = (struct v6_inode *)ip->i_private;
+
+    if (bn < NDIRECT)
+        return v6ip->addrs[bn];
+    bn -= NDIRECT;
+
+    if (bn < NINDIRECT) {
+        if ((addr = v6ip->addrs[NDIRECT]) == 0)
+            return 0;
+        bp = v6_ops.bread(ip->dev, addr);
+        addr = ((uint32_t *)bp->data)[bn];
+        v6_ops.brelse(bp);
+        return addr;
+    }
+    bn -= NINDIRECT;
+
+    if (bn < NINDIRECT * NINDIRECT) {
+        if ((addr = v6ip->addrs[NDIRECT+1]) == 0)
+            return 0;
+        bp = v6_ops.bread(ip->dev, addr);
+        addr = ((uint32_t *)bp->data)[bn / NINDIRECT];
+        v6_ops.brelse(bp);
+        if (addr == 0)
+            return 0;
+        bp = v6_ops.bread(ip->dev, addr);
+        addr = ((uint32_t *)bp->data)[bn % NINDIRECT];
+        v6_ops.brelse(bp);
+        return addr;
+    }
+    return 0;
+}
+
 /*
  * Lock the given inode.
  * Reads the inode from disk if necessary.
@@ -16,12 +16,14 @@
 #include "buf.h"
 #include "clock.h"
 #include "console.h"
+#include "dcache.h"
 #include "dev.h"
 #include "file.h"
 #include "kmalloc.h"
 #include "list.h"
 #include "log.h"
 #include "mmu.h"
+#include "pagecache.h"
 #include "proc.h"
 #include "rtc.h"
 #include "spinlock.h"
@@ -247,6 +249,7 @@ generic_readi(struct inode *ip, char *dst, size_t off, size_t n)
 {
     trace("readi: ip=0x%llx, off=%d, n=%d", ip, off, n);
     size_t tot, m;
+    uint32_t addr;
     struct buf *bp;
     size_t blksize = sb[ip->dev].blocksize;
 
@@ -262,14 +265,50 @@ generic_readi(struct inode *ip, char *dst, size_t off, size_t n)
         n = ip->size - off;
 
     for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-        bp = ip->fs_t->ops->bread(ip->dev, ip->iops->bmap(ip, off / blksize));
         m = min(n - tot, blksize - (off % blksize));
+        // Data not written back yet is only in the page cache
+        if (pagecache_read(ip, dst, off, m))
+            continue;
+        // ホールは割り当てずに0として読む
+        if ((addr = ip->iops->bmap_noalloc(ip, off / blksize)) == 0) {
+            memset(dst, 0, m);
+            continue;
+        }
+        bp = ip->fs_t->ops->bread(ip->dev, addr);
         memmove(dst, bp->data + (off % blksize), m);
         ip->fs_t->ops->brelse(bp);
     }
     return n;
 }
 
+/*
+ * Start reading blocks [bn, bn + n) of ip into the buffer cache
+ * without waiting.  Blocks beyond the end of file or not allocated
+ * are skipped.  Caller must hold ip->lock.
+ */
+void
+generic_readahead(struct inode *ip, uint32_t bn, uint32_t n)
+{
+    struct blk_plug plug;
+    size_t blksize = sb[ip->dev].blocksize;
+    uint32_t nblocks = (ip->size + blksize - 1) / blksize;
+    uint32_t addr;
+
+    if (ip->type != T_FILE && ip->type != T_DIR)
+        return;
+    if (bn >= nblocks)
+        return;
+    if (n > nblocks - bn)
+        n = nblocks - bn;
+
+    blk_start_plug(&plug);
+    for (uint32_t i = 0; i < n; i++) {
+        if ((addr = ip->iops->bmap_noalloc(ip, bn + i)) != 0)
+            breadahead(ip->dev, addr);
+    }
+    blk_finish_plug(&plug);
+}
+
 int
 generic_permission(struct inode *ip, int mask)
 {
@@ -318,12 +357,13 @@ generic_permission(struct inode *ip, int mask)
  *   is non-zero. ialloc() allocates, and iput() frees if
  *   the reference and link counts have fallen to zero.
  *
- * * Referencing in cache: an entry in the inode cache
- *   is free if ip->ref is zero. Otherwise ip->ref tracks
- *   the number of in-memory pointers to the entry (open
- *   files and current directories). iget() finds or
- *   creates a cache entry and increments its ref; iput()
- *   decrements ref.
+ * * Referencing in cache: ip->ref tracks the number of
+ *   in-memory pointers to the entry (open files, current
+ *   directories and dirty pages). iget() finds or creates
+ *   a cache entry and increments its ref; iput() decrements
+ *   ref. An entry whose ref has fallen to zero stays cached
+ *   on the LRU list, so that iget() can find it again
+ *   without reading the disk, until it is recycled.
  *
  * * Valid: the information (type, size, &c) in an inode
  *   cache entry is only correct when ip->valid is 1.
@@ -353,10 +393,15 @@ generic_permission(struct inode *ip, int mask)
  * have locked the inodes involved; this lets callers create
  * multi-step atomic operations.
  *
- * The icache.lock spin-lock protects the allocation of icache
- * entries. Since ip->ref indicates whether an entry is free,
- * and ip->dev and ip->inum indicate which i-node an entry
- * holds, one must hold icache.lock while using any of those fields.
+ * Cached entries are on the hash chains by (dev, inum). A bucket
+ * lock protects its chain, and ip->dev and ip->inum of the entries
+ * on it. ip->ref is updated atomically: iget() increments it with
+ * the bucket lock held, so that an entry is recycled only if its
+ * ref is zero under the bucket lock; idup() and iput() take no
+ * lock. The icache.lock spin-lock protects the LRU list of
+ * unreferenced entries, which iget() recycles from its back.
+ * Entries revived by iget() are taken off the list lazily.
+ * Lock order: icache.lock -> bucket lock.
  *
  * An ip->lock sleep-lock protects all ip-> fields other than ref,
  * dev, and inum.  One must hold ip->lock in order to
@@ -367,8 +412,16 @@ void
 iinit(int dev)
 {
     initlock(&icache.lock, "icache");
+    list_init(&icache.lru);
+    for (int i = 0; i < NIHASH; i++) {
+        initlock(&icache.hash[i].lock, "icache bucket");
+        list_init(&icache.hash[i].chain);
+    }
     for (int i = 0; i < NINODE; i++) {
         initsleeplock(&icache.inode[i].lock, "inode");
+        list_init(&icache.inode[i].i_pages);
+        list_push_back(&icache.lru, &icache.inode[i].i_lru);
+        icache.inode[i].i_onlru = 1;
     }
     rootfs->fs_t->ops->readsb(dev, &sb[dev]);
     struct v6_superblock *v6sb = (struct v6_superblock *)sb[dev].fs_info;
@@ -376,56 +429,198 @@ iinit(int dev)
             v6sb->size, v6sb->nblocks, v6sb->ninodes, v6sb->nlog, v6sb->logstart, v6sb->inodestart, v6sb->bmapstart);
 }
 
+static struct inode_bucket *
+ihash(uint32_t dev, uint32_t inum)
+{
+    uint32_t h = (dev << 24) ^ inum;
+
+    h ^= h >> 8;
+    return &icache.hash[h & (NIHASH - 1)];
+}
+
 /*
- * Find the inode with number inum on device dev
- * and return the in-memory copy. Does not lock
- * the inode and does not read it from disk.
+ * Find the entry of (dev, inum) on bucket hb and take a reference.
+ * hb->lock must be held.  A mount point is replaced with the root
+ * of the file system mounted on it.
  */
-struct inode *
-iget(uint32_t dev, uint32_t inum, uint16_t type, int (*fill_inode)(struct inode *))
+static struct inode *
+ifind(struct inode_bucket *hb, uint32_t dev, uint32_t inum)
 {
-    struct inode *ip, *nip = 0;
-    struct filesystem_type *fs_t;
+    struct inode *ip;
 
-    acquire(&icache.lock);
-    for (ip = icache.inode; ip < &icache.inode[NINODE]; ip++) {
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
+    LIST_FOREACH_ENTRY(ip, &hb->chain, i_hash) {
+        if (ip->dev == dev && ip->inum == inum) {
             // If the current inode is an mount point
             if (ip->type == T_MOUNT) {
                 struct inode *rinode = mtablertinode(ip);
                 if (rinode == 0) panic("Invalid inode on mount table");
-
-                rinode->ref++;
-                release(&icache.lock);
-                return rinode;
+                ip = rinode;
             }
+            __atomic_add_fetch(&ip->ref, 1, __ATOMIC_ACQUIRE);
+            return ip;
+        }
+    }
+    return 0;
+}
+
+/* Put an unreferenced entry at the front of the LRU list. */
+static void
+ilru_add(struct inode *ip)
+{
+    acquire(&icache.lock);
+    if (__atomic_load_n(&ip->ref, __ATOMIC_ACQUIRE) == 0) {
+        if (ip->i_onlru)
+            list_drop(&ip->i_lru);
+        list_push_front(&icache.lru, &ip->i_lru);
+        ip->i_onlru = 1;
+    }
+    release(&icache.lock);
+}
+
+/*
+ * Take the least recently used unreferenced entry out of the cache.
+ * Returns it with ref 1, still holding the data of its last inode.
+ */
+static struct inode *
+irecycle()
+{
+    struct inode *ip;
+    struct inode_bucket *hb;
 
-            ip->ref++;
+    acquire(&icache.lock);
+    while (!list_empty(&icache.lru)) {
+        ip = container_of(list_back(&icache.lru), struct inode, i_lru);
+        list_drop(&ip->i_lru);
+        ip->i_onlru = 0;
+        if (!ip->i_hashed) {
+            ip->ref = 1;
             release(&icache.lock);
             return ip;
         }
-        if (nip == 0 && ip->ref == 0)
-            nip = ip;
+        hb = ihash(ip->dev, ip->inum);
+        acquire(&hb->lock);
+        // Revived by iget(): iput() puts it back on the list.
+        if (__atomic_load_n(&ip->ref, __ATOMIC_ACQUIRE) > 0) {
+            release(&hb->lock);
+            continue;
+        }
+        list_drop(&ip->i_hash);
+        ip->i_hashed = 0;
+        ip->ref = 1;
+        release(&hb->lock);
+        release(&icache.lock);
+        return ip;
     }
+    release(&icache.lock);
+    panic("iget: no inodes\n");
+    return 0;
+}
+
+/* Forget the data of the last inode of an entry taken out of the cache. */
+static void
+iforget(struct inode *ip)
+{
+    // 再利用するエントリのキャッシュページは捨てる
+    pagecache_drop(ip);
+    if (ip->i_private) {
+        ip->iops->cleanup(ip);
+        ip->i_private = 0;
+    }
+    ip->valid = 0;
+}
+
+/*
+ * Find the inode with number inum on device dev
+ * and return the in-memory copy. Does not lock
+ * the inode and does not read it from disk.
+ */
+struct inode *
+iget(uint32_t dev, uint32_t inum, uint16_t type, int (*fill_inode)(struct inode *))
+{
+    struct inode_bucket *hb = ihash(dev, inum);
+    struct inode *ip, *nip;
+    struct filesystem_type *fs_t;
 
-    if (nip == 0) panic("iget: no inodes\n");
+    acquire(&hb->lock);
+    ip = ifind(hb, dev, inum);
+    release(&hb->lock);
+    if (ip)
+        return ip;
+
+    nip = irecycle();
+    iforget(nip);
 
     fs_t = getvfsentry(SDMAJOR, dev)->fs_t;
 
     nip->dev = dev;
     nip->inum = inum;
     nip->type = type;
-    nip->ref = 1;
-    nip->valid = 0;
     nip->fs_t = fs_t;
     nip->iops = fs_t->iops;
-    release(&icache.lock);
+    // 以前このエントリにあったディレクトリのdentryを無効にする
+    nip->i_dversion = dcache_newversion();
+    nip->i_wb_error = 0;
 
+    // ハッシュに入れる前に埋めて、埋め終わっていないinodeを見せない
     if (!fill_inode(nip)) panic("iget: fill inode");
 
+    acquire(&hb->lock);
+    if ((ip = ifind(hb, dev, inum)) == 0) {
+        list_push_front(&hb->chain, &nip->i_hash);
+        nip->i_hashed = 1;
+    }
+    release(&hb->lock);
+
+    if (ip) {
+        // 他のプロセスが先に入れた
+        iforget(nip);
+        __atomic_store_n(&nip->ref, 0, __ATOMIC_RELEASE);
+        ilru_add(nip);
+        return ip;
+    }
     return nip;
 }
 
+/*
+ * Drop the unreferenced inodes of dev from the cache: called
+ * when dev is unmounted.
+ */
+void
+ievict(uint32_t dev)
+{
+    struct inode *ip;
+    struct inode_bucket *hb;
+
+    acquire(&icache.lock);
+restart:
+    LIST_FOREACH_ENTRY(ip, &icache.lru, i_lru) {
+        if (!ip->i_hashed || ip->dev != dev)
+            continue;
+        hb = ihash(ip->dev, ip->inum);
+        acquire(&hb->lock);
+        if (__atomic_load_n(&ip->ref, __ATOMIC_ACQUIRE) > 0) {
+            release(&hb->lock);
+            continue;
+        }
+        list_drop(&ip->i_hash);
+        ip->i_hashed = 0;
+        release(&hb->lock);
+        // Keep it away from irecycle() while forgetting it.
+        list_drop(&ip->i_lru);
+        ip->i_onlru = 0;
+        release(&icache.lock);
+
+        iforget(ip);
+
+        acquire(&icache.lock);
+        list_push_back(&icache.lru, &ip->i_lru);
+        ip->i_onlru = 1;
+        // Rescan: the list may have changed.
+        goto restart;
+    }
+    release(&icache.lock);
+}
+
 /*
  * Increment reference count for ip.
  * Returns ip to enable ip = idup(ip1) idiom.
@@ -433,16 +628,14 @@ iget(uint32_t dev, uint32_t inum, uint16_t type, int (*fill_inode)(struct inode
 struct inode*
 idup(struct inode *ip)
 {
-    acquire(&icache.lock);
-    ip->ref++;
-    release(&icache.lock);
+    __atomic_add_fetch(&ip->ref, 1, __ATOMIC_RELAXED);
     return ip;
 }
 
 /* Drop a reference to an in-memory inode.
  *
- * If that was the last reference, the inode cache entry can
- * be recycled.
+ * If that was the last reference, the inode cache entry
+ * goes on the LRU list to be recycled.
  * If that was the last reference and the inode has no links
  * to it, free the inode (and its content) on disk.
  * All calls to iput() must be inside a transaction in
@@ -452,26 +645,22 @@ void
 iput(struct inode *ip)
 {
     acquiresleep(&ip->lock);
-    if (ip->valid && ip->nlink == 0) {
-        acquire(&icache.lock);
-        int r = ip->ref;
-        release(&icache.lock);
-        if (r==1) {
+    if (__atomic_load_n(&ip->ref, __ATOMIC_ACQUIRE) == 1) {
+        if (ip->valid && ip->nlink == 0) {
             // inode has no link and no other ref: truncate and free
+            pagecache_drop(ip);
             ip->iops->itrunc(ip);
             ip->type = 0;
             ip->iops->iupdate(ip);
             ip->valid = 0;
         }
+        if (ip->iops->release)
+            ip->iops->release(ip);
     }
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
-    ip->ref--;
-    if (ip->ref == 0) {
-        ip->iops->cleanup(ip);
-    }
-    release(&icache.lock);
+    if (__atomic_sub_fetch(&ip->ref, 1, __ATOMIC_ACQ_REL) == 0)
+        ilru_add(ip);
 }
 
 
@@ -516,6 +705,32 @@ skipelem(char *path, char *name)
     return path;
 }
 
+/*
+ * Look for name in directory dp, which must be locked, through
+ * the dentry cache.  Returns the inode with a reference or 0.
+ */
+static struct inode *
+lookup(struct inode *dp, char *name)
+{
+    struct inode *ip;
+    uint32_t inum;
+    uint16_t type;
+
+    switch (dcache_lookup(dp, name, &inum, &type)) {
+    case DC_POSITIVE:
+        return dp->fs_t->ops->iget(dp->dev, inum, type);
+    case DC_NEGATIVE:
+        return 0;
+    }
+
+    ip = dp->iops->dirlookup(dp, name, 0);
+    if (ip == 0)
+        dcache_enter(dp, name, 0, 0);
+    else if (ip->dev == dp->dev)    // マウントポイントを越えるものはキャッシュしない
+        dcache_enter(dp, name, ip->inum, ip->type);
+    return ip;
+}
+
 /* Look up and return the inode for a path name.
  *
  * If parent != 0, return the inode for the parent and copy the final
@@ -530,7 +745,7 @@ namex(char *path, int nameiparent, char *name)
     if (*path == '/')
         ip = rootfs->fs_t->ops->getroot(SDMAJOR, ROOTDEV);
     else
-        ip = idup(thisproc()->cwd);
+        ip = idup(thisproc()->fs->cwd);
 
     while ((path = skipelem(path, name)) != 0) {
         debug("path: '%s'", path);
@@ -547,7 +762,7 @@ namex(char *path, int nameiparent, char *name)
         }
 
 component_search:
-        if ((next = ip->iops->dirlookup(ip, name, 0)) == 0) {
+        if ((next = lookup(ip, name)) == 0) {
             iunlockput(ip);
             debug("ip '%d', name: '%s' is not found", ip->inum, name);
             return 0;
@@ -558,7 +773,7 @@ component_search:
             iunlockput(ip);
             ip = mntinode;
             ip->iops->ilock(ip);
-            ip->ref++;
+            idup(ip);
             goto component_search;
         }
 
@@ -654,8 +869,20 @@ create(char *path, uint16_t type, uint16_t major, uint16_t minor, mode_t mode)
             panic("create: cant dots\n");
     }
 
-    if (dp->iops->dirlink(dp, name, ip->inum, ip->type) < 0)
-        panic("create: dirlink\n");
+    if ((ret = dp->iops->dirlink(dp, name, ip->inum, ip->type)) < 0) {
+        // 作成したi-nodeを解放する
+        if (type == T_DIR) {
+            dp->nlink--;
+            dp->iops->iupdate(dp);
+        }
+        ip->nlink = 0;
+        ip->iops->iupdate(ip);
+        iunlockput(ip);
+        iunlockput(dp);
+        return (void *)ret;
+    }
+    d_invalidate(dp);
+    d_invalidate(ip);
     iunlockput(dp);
     return ip;
 }
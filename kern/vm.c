@@ -90,37 +90,58 @@ uvm_copy(uint64_t * pgdir)
                                                 | (uint64_t) i1 << (L1SHIFT)
                                                 | (uint64_t) i2 << (L2SHIFT)
                                                 | (uint64_t) i3 << L3SHIFT;
-                                    // mmapされたアドレスでMAP_SHAREDの場合は親のpaをそのまま使用。
-                                    // それ以外は新規paに親のpaをコピーして使用
+                                    // ページはコピーせずに親子で共有する。
+                                    // mmapされたアドレスでMAP_SHAREDの場合はそのまま共有。
+                                    // それ以外の書き込み可能なページは親子とも読み込み専用にして
+                                    // 最初の書き込み時にコピーする（Copy on Write）
                                     struct mmap_region *region = find_mmap_region((void *)va);
-                                    void *np;
-                                    if (region && region->flags & MAP_SHARED) {
-                                        np = P2V(pa);
-                                        inc_kmem_ref(pa);
-                                    } else {
-                                        np = kalloc();
-                                        if (np == 0) {
-                                            vm_free(newpgdir);
-                                            warn("kalloc failed");
-                                            return 0;
-                                        }
-                                        memmove(np, P2V(pa), PGSIZE);
-                                    }
-                                    if (uvm_map
-                                        (newpgdir, (void *)va, PGSIZE,
-                                         V2P((uint64_t) np)) < 0) {
+                                    uint64_t *pte;
+                                    if (!(region && region->flags & MAP_SHARED)
+                                     && !(pgt3[i3] & PTE_RO))
+                                        pgt3[i3] |= PTE_RO | PTE_COW;
+                                    if ((pte = pgdir_walk(newpgdir, (void *)va, 1)) == 0) {
+                                        tlbi1();
                                         vm_free(newpgdir);
-                                        kfree(np);
-                                        warn("uvm_map failed");
+                                        warn("pgdir_walk failed");
                                         return 0;
                                     }
+                                    *pte = pgt3[i3];
+                                    inc_kmem_ref(pa);
                                 }
                         }
                 }
         }
+    // 親のPTEを読み込み専用にしたのでTLBをフラッシュする
+    tlbi1();
     return newpgdir;
 }
 
+/*
+ * Copy on Write: 書き込みフォルトが起きたpteのページを
+ * 現在のプロセス専用にして書き込み可能にする。
+ * 他に共有者がいなければコピーせずにそのまま使う。
+ */
+int
+uvm_cow(uint64_t *pte)
+{
+    uint64_t pa = PTE_ADDR(*pte);
+    uint64_t flags = PTE_FLAGS(*pte) & ~(PTE_RO | PTE_COW);
+    void *np;
+
+    if (get_kmem_ref(pa) == 1) {
+        *pte = pa | flags;
+    } else {
+        if ((np = kalloc()) == 0)
+            return -ENOMEM;
+        memmove(np, P2V(pa), PGSIZE);
+        *pte = V2P(np) | flags;
+        if (dec_kmem_ref(pa) == 0)
+            kfree(P2V(pa));
+    }
+    tlbi1();
+    return 0;
+}
+
 /* Free a user page table and all the physical memory pages. */
 void
 vm_free(uint64_t * pgdir)
@@ -139,15 +160,9 @@ vm_free(uint64_t * pgdir)
                             uint64_t *pgt3 = P2V(PTE_ADDR(pgt2[i2]));
                             for (int i3 = 0; i3 < 512; i3++)
                                 if (pgt3[i3] & PTE_VALID) {
-                                    uint64_t va = (uint64_t) i << L0SHIFT
-                                                | (uint64_t) i1 << L1SHIFT
-                                                | (uint64_t) i2 << L2SHIFT
-                                                | (uint64_t) i3 << L3SHIFT;
+                                    // 共有ページ (MAP_SHAREDとCOW) は最後の参照で解放する
                                     uint64_t pa = PTE_ADDR(pgt3[i3]);
-                                    struct mmap_region *region = find_mmap_region((void *)va);
-                                    if (region && (region->flags & MAP_SHARED))
-                                        dec_kmem_ref((uint64_t)pa);
-                                    if (get_kmem_ref(pa) == 0) {
+                                    if (dec_kmem_ref(pa) == 0) {
                                         uint64_t *p = P2V(pa);
                                         debug("free pte =0x%p", p);
                                         kfree(p);
@@ -242,9 +257,8 @@ uvm_dealloc(uint64_t * pgdir, size_t base, size_t oldsz, size_t newsz)
         if (pte && (*pte & PTE_VALID)) {
             uint64_t pa = PTE_ADDR(*pte);
             assert(pa);
-            dec_kmem_ref(pa);
-            if (get_kmem_ref(pa) == 0)
-                kfree((void *)pa);
+            if (dec_kmem_ref(pa) == 0)
+                kfree(P2V(pa));
             *pte = 0;
         } else {
             warn("attempt to free unallocated page");
@@ -261,12 +275,14 @@ uvm_switch(uint64_t * pgdir)
 }
 
 /*
- * Copy len bytes from p to user address va in page table pgdir.
+ * Copy len bytes from p to user address va of address space mm.
  * Allocate physical pages if required.
- * Most useful when pgdir is not the current page table.
+ * Most useful when mm is not the current address space.
+ * mm->lock is held for each page, so that other threads of mm
+ * (copy on write faults) and fork cannot share it meanwhile.
  */
 int
-copyout(uint64_t * pgdir, void *va, void *p, size_t len)
+copyout(struct mm_struct *mm, void *va, void *p, size_t len)
 {
     void *page;
     size_t n, pgoff;
@@ -275,13 +291,16 @@ copyout(uint64_t * pgdir, void *va, void *p, size_t len)
         return -1;
     for (; len; len -= n, va += n) {
         pgoff = va - ROUNDDOWN(va, PGSIZE);
-        if ((pte = pgdir_walk(pgdir, va, 1)) == 0)
-            return -1;
+        acquire(&mm->lock);
+        if ((pte = pgdir_walk(mm->pgdir, va, 1)) == 0)
+            goto bad;
         if (*pte & PTE_VALID) {
+            if ((*pte & PTE_COW) && uvm_cow(pte) < 0)
+                goto bad;
             page = P2V(PTE_ADDR(*pte));
         } else {
             if ((page = kalloc()) == 0)
-                return -1;
+                goto bad;
             *pte = V2P(page) | PTE_UDATA;
         }
         n = MIN(PGSIZE - pgoff, len);
@@ -290,12 +309,17 @@ copyout(uint64_t * pgdir, void *va, void *p, size_t len)
             p += n;
         } else
             memset(page + pgoff, 0, n);
+        release(&mm->lock);
         // disb();
         // Flush to memory to sync with icache.
         // dccivac(page + pgoff, n);
         // disb();
     }
     return 0;
+
+bad:
+    release(&mm->lock);
+    return -1;
 }
 
 void
@@ -407,8 +431,7 @@ uvm_unmap(uint64_t *pgdir, uint64_t va, uint64_t npages)
             panic("not a leaf\n");
         uint64_t pa = PTE_ADDR(*pte);
         debug("pa=0x%llx, ref=%d, *pte=0x%llx",pa, get_kmem_ref(pa), *pte);
-        dec_kmem_ref(pa);
-        if (get_kmem_ref(pa) == 0)
+        if (dec_kmem_ref(pa) == 0)
             kfree((char *)P2V(pa));
         *pte = PTE_ADDR(0UL);  // PTEを削除
         debug("- a=0x%llx, *p=0x%llx\n", a, *pte);
@@ -19,6 +19,7 @@
 #define NLOG        1                   // Max number of active logs
 #define LOGENABLED  1
 #define LOGSIZE     (NLOG*MAXOPBLOCKS*3)    // maximu number of data blocks in on-disk log
+#define LOGBLOCKS   2048                // size of circular on-disk log in blocks (8MB)
 
 // Belows are used by both
 #define ROOTDEV     1                   // Device number of file system root disk
@@ -0,0 +1,88 @@
+/*
+ * filefrag: ファイルの断片化を調べる
+ *   fsyncで遅延割り当て中のブロックを割り当てさせてから、FIBMAPで
+ *   各ブロックのディスク上の位置を調べ、連続するブロックを1つの
+ *   エクステントとして数える。-vで各エクステントを表示する
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#ifndef FIBMAP
+#define FIBMAP      1
+#endif
+#ifndef FIGETBSZ
+#define FIGETBSZ    2
+#endif
+
+static int
+filefrag(char *path, int verbose)
+{
+    struct stat st;
+    int fd, bsize, blk;
+    long nblocks, extents = 0, start = 0;
+    long first = 0, last = -1;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        printf("filefrag: cannot open %s\n", path);
+        return 1;
+    }
+    if (fstat(fd, &st) < 0 || ioctl(fd, FIGETBSZ, &bsize) < 0) {
+        printf("filefrag: cannot get the block size of %s\n", path);
+        close(fd);
+        return 1;
+    }
+    fsync(fd);
+
+    nblocks = (st.st_size + bsize - 1) / bsize;
+    if (verbose && nblocks > 0)
+        printf(" ext  logical  physical   length\n");
+    for (long i = 0; i <= nblocks; i++) {
+        blk = (int)i;
+        if (i == nblocks)
+            blk = 0;
+        else if (ioctl(fd, FIBMAP, &blk) < 0) {
+            printf("filefrag: FIBMAP failed on %s\n", path);
+            close(fd);
+            return 1;
+        }
+        // 連続していればエクステントを延ばす
+        if (blk != 0 && last >= 0 && blk == last + 1) {
+            last = blk;
+            continue;
+        }
+        if (last >= 0) {
+            if (verbose)
+                printf("%4ld %8ld %9ld %8ld\n", extents, start, first, last - first + 1);
+            extents++;
+        }
+        start = i;
+        first = last = blk ? blk : -1;
+    }
+    printf("%s: %ld extent%s found (%ld blocks of %d bytes)\n",
+           path, extents, extents == 1 ? "" : "s", nblocks, bsize);
+    close(fd);
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int verbose = 0, i = 1, ret = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        verbose = 1;
+        i++;
+    }
+    if (i >= argc) {
+        printf("usage: filefrag [-v] file...\n");
+        exit(1);
+    }
+    for (; i < argc; i++)
+        ret |= filefrag(argv[i], verbose);
+    exit(ret);
+}
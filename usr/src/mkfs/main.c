@@ -28,13 +28,13 @@ typedef uint64_t ulong;
 extern int clock_gettime (clockid_t, struct timespec *);
 
 // Disk layout:
-// [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-// [          1 |        1 | 126 |           33 |            4 |      799455 ]
+// [ boot block | sb block |  log | inode blocks | free bit map | data blocks ]
+// [          1 |        1 | 2048 |          33 |            4 |       97913 ]
 int nbitmap = FSSIZE / (BSIZE * 8) + 1; // 4 = 100000 / (4096 * 8) + 1
 int ninodeblocks = NINODE / IPB + 1;    // 33 = 1024 / 32 + 1
-int nlog = LOGSIZE;                     // 126
-int nmeta;                      // 165 = メタブロック数 (boot, sb, nlog, inode, bitmap)
-int nblocks;                    // 99835 = データブロック数
+int nlog = LOGBLOCKS;                   // 2048
+int nmeta;                      // 2087 = メタブロック数 (boot, sb, nlog, inode, bitmap)
+int nblocks;                    // 97913 = データブロック数
 
 int fsfd;
 struct superblock sb;
@@ -0,0 +1,75 @@
+/*
+ * nicetest: nice値によるCPU配分を確認する
+ *   nice 0 と nice 10 のCPUバウンドな子プロセスを同じCPUで同時に
+ *   走らせ、一定時間内のループ回数を比較する
+ */
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#define SECS    3
+
+static void
+spin(int nice, int fd)
+{
+    volatile unsigned long count = 0;
+    time_t end;
+
+    if (setpriority(PRIO_PROCESS, 0, nice) < 0) {
+        printf("setpriority(%d) failed: errno=%d\n", nice, errno);
+        exit(1);
+    }
+    printf("child %d: nice %d\n", getpid(), getpriority(PRIO_PROCESS, 0));
+
+    end = time(NULL) + SECS;
+    while (time(NULL) < end)
+        count++;
+    write(fd, (void *)&count, sizeof(count));
+    exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int nices[2] = { 0, 10 };
+    int fds[2][2];
+    unsigned long count[2];
+    cpu_set_t set;
+
+    // 別々のCPUで走ると競合しないので、子が継承するCPU 0 に固定する
+    CPU_ZERO(&set);
+    CPU_SET(0, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        printf("sched_setaffinity failed: errno=%d\n", errno);
+        exit(1);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (pipe(fds[i]) < 0) {
+            printf("pipe failed\n");
+            exit(1);
+        }
+        if (fork() == 0)
+            spin(nices[i], fds[i][1]);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        read(fds[i][0], &count[i], sizeof(count[i]));
+        printf("nice %2d: %lu loops\n", nices[i], count[i]);
+    }
+    while (wait(NULL) > 0)
+        ;
+
+    if (count[0] > count[1])
+        printf("nicetest ok\n");
+    else
+        printf("nicetest NG\n");
+    return 0;
+}
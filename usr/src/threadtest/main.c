@@ -0,0 +1,61 @@
+/*
+ * threadtest: スレッドがアドレス空間とファイルを共有することを確認する
+ *   NTHREADのスレッドで共有配列を分担して加算し、pthread_joinで
+ *   待ってから結果を検証する
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#define NTHREAD 4
+#define N       (1 << 20)
+
+static unsigned long data[N];
+static unsigned long sums[NTHREAD];
+
+static void *
+worker(void *arg)
+{
+    long id = (long)arg;
+    unsigned long sum = 0;
+
+    for (long i = id; i < N; i += NTHREAD)
+        sum += data[i];
+    sums[id] = sum;
+    printf("thread %ld: pid %d, tid %ld, sum %lu\n", id, getpid(),
+           syscall(SYS_gettid), sum);
+    return (void *)id;
+}
+
+int
+main(int argc, char *argv[])
+{
+    pthread_t th[NTHREAD];
+    unsigned long total = 0, expect = 0;
+    void *ret;
+
+    for (long i = 0; i < N; i++) {
+        data[i] = i;
+        expect += i;
+    }
+
+    for (long i = 0; i < NTHREAD; i++) {
+        if (pthread_create(&th[i], NULL, worker, (void *)i) != 0) {
+            printf("pthread_create %ld failed\n", i);
+            exit(1);
+        }
+    }
+    for (long i = 0; i < NTHREAD; i++) {
+        if (pthread_join(th[i], &ret) != 0 || (long)ret != i) {
+            printf("pthread_join %ld failed\n", i);
+            exit(1);
+        }
+        total += sums[i];
+    }
+
+    printf("total %lu, expect %lu: %s\n", total, expect,
+           total == expect ? "OK" : "NG");
+    return total == expect ? 0 : 1;
+}